@@ -65,6 +65,7 @@ class Opal_G711_uLaw_PCM : public Opal_G711_PCM {
   public:
     Opal_G711_uLaw_PCM();
     virtual int ConvertOne(int sample) const;
+    virtual bool ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const;
     static int ConvertSample(int sample);
 };
 
@@ -75,6 +76,7 @@ class Opal_PCM_G711_uLaw : public OpalStreamedTranscoder {
   public:
     Opal_PCM_G711_uLaw();
     virtual int ConvertOne(int sample) const;
+    virtual bool ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const;
     static int ConvertSample(int sample);
 };
 
@@ -85,6 +87,7 @@ class Opal_G711_ALaw_PCM : public Opal_G711_PCM {
   public:
     Opal_G711_ALaw_PCM();
     virtual int ConvertOne(int sample) const;
+    virtual bool ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const;
     static int ConvertSample(int sample);
 };
 
@@ -95,17 +98,46 @@ class Opal_PCM_G711_ALaw : public OpalStreamedTranscoder {
   public:
     Opal_PCM_G711_ALaw();
     virtual int ConvertOne(int sample) const;
+    virtual bool ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const;
     static int ConvertSample(int sample);
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+/**Direct A-law to u-law conversion, a byte for byte translation that
+   avoids going through PCM-16 with two transcoders.
+  */
+class Opal_G711_ALaw_uLaw : public OpalStreamedTranscoder {
+  public:
+    Opal_G711_ALaw_uLaw();
+    virtual int ConvertOne(int sample) const;
+    virtual bool ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+/**Direct u-law to A-law conversion, a byte for byte translation that
+   avoids going through PCM-16 with two transcoders.
+  */
+class Opal_G711_uLaw_ALaw : public OpalStreamedTranscoder {
+  public:
+    Opal_G711_uLaw_ALaw();
+    virtual int ConvertOne(int sample) const;
+    virtual bool ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const;
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #define OPAL_REGISTER_G711() \
 OPAL_REGISTER_TRANSCODER(Opal_G711_uLaw_PCM, OpalG711_ULAW_64K, OpalPCM16); \
 OPAL_REGISTER_TRANSCODER(Opal_PCM_G711_uLaw, OpalPCM16,         OpalG711_ULAW_64K); \
 OPAL_REGISTER_TRANSCODER(Opal_G711_ALaw_PCM, OpalG711_ALAW_64K, OpalPCM16); \
-OPAL_REGISTER_TRANSCODER(Opal_PCM_G711_ALaw, OpalPCM16,         OpalG711_ALAW_64K)
+OPAL_REGISTER_TRANSCODER(Opal_PCM_G711_ALaw, OpalPCM16,         OpalG711_ALAW_64K); \
+OPAL_REGISTER_TRANSCODER(Opal_G711_ALaw_uLaw, OpalG711_ALAW_64K, OpalG711_ULAW_64K); \
+OPAL_REGISTER_TRANSCODER(Opal_G711_uLaw_ALaw, OpalG711_ULAW_64K, OpalG711_ALAW_64K)
 
 #endif // OPAL_CODEC_G711CODEC_H
 
@@ -0,0 +1,193 @@
+/*
+ * pcmresample.h
+ *
+ * Sample rate conversion between the PCM-16 media formats
+ *
+ * Open Phone Abstraction Library (OPAL)
+ *
+ * Copyright (c) 2001 Equivalence Pty. Ltd.
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.0 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code is Open Phone Abstraction Library.
+ *
+ * The Initial Developer of the Original Code is Equivalence Pty. Ltd.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * $Revision$
+ * $Author$
+ * $Date$
+ */
+
+#ifndef OPAL_CODEC_PCMRESAMPLE_H
+#define OPAL_CODEC_PCMRESAMPLE_H
+
+#ifdef P_USE_PRAGMA
+#pragma interface
+#endif
+
+#include <opal/buildopts.h>
+
+#include <opal/transcoders.h>
+
+#include <vector>
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+/**This class converts between two PCM-16 sample rates.
+   A polyphase FIR filter interpolates by L and decimates by M in one step,
+   where L/M is the ratio of the output to input rates reduced to lowest
+   terms. Only the phases that produce an output sample are calculated.
+
+   The transcoder keeps the tail of each packet as filter history, so an
+   instance must only be used for one stream.
+  */
+class OpalPCM16Resampler : public OpalTranscoder
+{
+    PCLASSINFO(OpalPCM16Resampler, OpalTranscoder);
+  public:
+    enum Qualities {
+      eLowLatency,  ///< Short filter, delay of half a millisecond at 8kHz
+      eHighQuality, ///< Long filter with a sharp cut off, delay of two milliseconds at 8kHz
+      NumQualities
+    };
+
+  /**@name Construction */
+  //@{
+    /** Create a new resampler between two PCM-16 formats.
+      */
+    OpalPCM16Resampler(
+      const OpalMediaFormat & inputMediaFormat,  ///<  Input media format
+      const OpalMediaFormat & outputMediaFormat  ///<  Output media format
+    );
+  //@}
+
+  /**@name Operations */
+  //@{
+    /**Get the optimal size for data frames to be converted.
+       This function returns the size of frames that will be most efficient
+       in conversion. A RTP_DataFrame will attempt to provide or use data in
+       multiples of this size. Note that it may not do so, so the transcoder
+       must be able to handle any sized packets.
+      */
+    virtual PINDEX GetOptimalDataFrameSize(
+      PBoolean input      ///<  Flag for input or output data size
+    ) const;
+
+    /**Convert the data from one format to another.
+       This function takes the input data as a RTP_DataFrame and converts it
+       to its output format, placing it into the RTP_DataFrame provided.
+
+       Returns PFalse if the conversion fails.
+      */
+    virtual PBoolean Convert(
+      const RTP_DataFrame & input,  ///<  Input data
+      RTP_DataFrame & output        ///<  Output data
+    );
+
+    /**Convert a block of samples.
+       Returns the number of samples written to output, which must have room
+       for GetMaxOutputSamples(count).
+      */
+    PINDEX Resample(
+      const short * input,  ///<  Input samples
+      PINDEX count,         ///<  Number of input samples
+      short * output        ///<  Output samples
+    );
+
+    /**Get the most samples Resample() can produce from count input samples.
+      */
+    PINDEX GetMaxOutputSamples(
+      PINDEX count          ///<  Number of input samples
+    ) const { return (count*m_interpolate + m_decimate - 1)/m_decimate + 1; }
+
+    /**Set the filter quality.
+       This resets the filter history, so is best done before any media.
+      */
+    void SetQuality(
+      Qualities quality     ///< New filter quality
+    );
+
+    /**Get the filter quality.
+      */
+    Qualities GetQuality() const { return m_quality; }
+
+    /**Set the filter quality for new resamplers.
+      */
+    static void SetDefaultQuality(
+      Qualities quality     ///< New default filter quality
+    );
+
+    /**Get the filter quality for new resamplers.
+      */
+    static Qualities GetDefaultQuality();
+
+    /**Calculate a dot product of samples and Q14 filter coefficients.
+       The result is rounded and saturated to a sample.
+      */
+    static short FilterSample(
+      const short * samples,      ///<  Input samples
+      const short * coefficients, ///<  Filter coefficients
+      unsigned count              ///<  Number of each, a multiple of 8
+    );
+  //@}
+
+  protected:
+    Qualities          m_quality;
+    unsigned           m_interpolate;   // L
+    unsigned           m_decimate;      // M
+    unsigned           m_tapsPerPhase;
+    std::vector<short> m_coefficients;  // m_tapsPerPhase for each of L phases
+    std::vector<short> m_history;
+    unsigned           m_position;      // In interpolated samples from start of m_history
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define OPAL_DECLARE_PCM16_RESAMPLER(cls, src, dst) \
+  class cls : public OpalPCM16Resampler { \
+    public: cls() : OpalPCM16Resampler(src, dst) { } \
+  }
+
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_8K_16K,  OpalPCM16,       OpalPCM16_16KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_8K_32K,  OpalPCM16,       OpalPCM16_32KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_8K_48K,  OpalPCM16,       OpalPCM16_48KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_16K_8K,  OpalPCM16_16KHZ, OpalPCM16);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_16K_32K, OpalPCM16_16KHZ, OpalPCM16_32KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_16K_48K, OpalPCM16_16KHZ, OpalPCM16_48KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_32K_8K,  OpalPCM16_32KHZ, OpalPCM16);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_32K_16K, OpalPCM16_32KHZ, OpalPCM16_16KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_32K_48K, OpalPCM16_32KHZ, OpalPCM16_48KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_48K_8K,  OpalPCM16_48KHZ, OpalPCM16);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_48K_16K, OpalPCM16_48KHZ, OpalPCM16_16KHZ);
+OPAL_DECLARE_PCM16_RESAMPLER(Opal_PCM16_48K_32K, OpalPCM16_48KHZ, OpalPCM16_32KHZ);
+
+#define OPAL_REGISTER_PCM16_RESAMPLERS() \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_8K_16K,  OpalPCM16,       OpalPCM16_16KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_8K_32K,  OpalPCM16,       OpalPCM16_32KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_8K_48K,  OpalPCM16,       OpalPCM16_48KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_16K_8K,  OpalPCM16_16KHZ, OpalPCM16); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_16K_32K, OpalPCM16_16KHZ, OpalPCM16_32KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_16K_48K, OpalPCM16_16KHZ, OpalPCM16_48KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_32K_8K,  OpalPCM16_32KHZ, OpalPCM16); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_32K_16K, OpalPCM16_32KHZ, OpalPCM16_16KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_32K_48K, OpalPCM16_32KHZ, OpalPCM16_48KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_48K_8K,  OpalPCM16_48KHZ, OpalPCM16); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_48K_16K, OpalPCM16_48KHZ, OpalPCM16_16KHZ); \
+OPAL_REGISTER_TRANSCODER(Opal_PCM16_48K_32K, OpalPCM16_48KHZ, OpalPCM16_32KHZ)
+
+#endif // OPAL_CODEC_PCMRESAMPLE_H
+
+
+/////////////////////////////////////////////////////////////////////////////
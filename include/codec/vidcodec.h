@@ -61,6 +61,71 @@ extern const OpalVideoFormat & GetOpalYUV420P();
 #define OpalYUV420P GetOpalYUV420P()
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+/**This class merges picture update requests made of one video encoder.
+   When an encoder is shared by many receivers, every one of them that loses
+   a packet asks for an I-Frame, which can produce a burst of I-Frames well
+   beyond the bit rate budget.
+
+   Requests arriving within the merge window of an I-Frame being forced are
+   answered by that I-Frame. Requests arriving before the minimum interval
+   since the last I-Frame are deferred, and answered by the next natural
+   I-Frame, or by a single forced one when the interval expires.
+
+   A minimum interval of zero, the default, disables this and every request
+   forces an I-Frame. It is enabled by the mixer, where an encoder is shared.
+ */
+class OpalVideoUpdateCoalescer
+{
+  public:
+    OpalVideoUpdateCoalescer(
+      const PTimeInterval & minInterval = 0,    ///< Minimum time between forced I-Frames
+      const PTimeInterval & window = 200        ///< Time requests are merged into a forced I-Frame
+    );
+
+    /**Handle a request for an I-Frame.
+       Returns true if the encoder should force an I-Frame now.
+      */
+    bool OnRequest();
+
+    /**Check for a deferred request whose minimum interval has expired.
+       Returns true if the encoder should force an I-Frame now.
+      */
+    bool CheckDeferred();
+
+    /**Indicate the encoder has sent an I-Frame.
+      */
+    void OnIFrame(
+      bool forced   ///< I-Frame was forced, rather than natural
+    );
+
+    void SetMinInterval(const PTimeInterval & interval) { m_minInterval = interval; }
+    const PTimeInterval & GetMinInterval() const { return m_minInterval; }
+    void SetWindow(const PTimeInterval & window) { m_window = window; }
+    const PTimeInterval & GetWindow() const { return m_window; }
+
+    unsigned GetRequestCount() const   { return m_requestCount; }   ///< Requests received
+    unsigned GetCoalescedCount() const { return m_coalescedCount; } ///< Requests merged into another
+    unsigned GetDeferredCount() const  { return m_deferredCount; }  ///< Requests held for the minimum interval
+    unsigned GetForcedCount() const    { return m_forcedCount; }    ///< I-Frames forced
+    unsigned GetNaturalCount() const   { return m_naturalCount; }   ///< Deferred requests answered by a natural I-Frame
+
+  protected:
+    PTimeInterval m_minInterval;
+    PTimeInterval m_window;
+    PTimeInterval m_lastForced;
+    PTimeInterval m_lastIFrame;
+    bool          m_deferred;
+    unsigned      m_requestCount;
+    unsigned      m_coalescedCount;
+    unsigned      m_deferredCount;
+    unsigned      m_forcedCount;
+    unsigned      m_naturalCount;
+    PMutex        m_mutex;
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 /**This class defines a transcoder implementation class that will
@@ -120,7 +185,8 @@ class OpalVideoTranscoder : public OpalTranscoder
        to a video transcoder.
 
        The default behaviour checks for a OpalVideoUpdatePicture and sets the
-       updatePicture member variable if that is the command.
+       forceIFrame member variable if that is the command, subject to the
+       limits of the update coalescer.
       */
     virtual PBoolean ExecuteCommand(
       const OpalMediaCommand & command    ///<  Command to execute.
@@ -146,7 +212,13 @@ class OpalVideoTranscoder : public OpalTranscoder
 #endif
 
     bool WasLastFrameIFrame() const { return lastFrameWasIFrame; }
-    void ForceIFrame()              { forceIFrame = true; }
+
+    /**Force the next frame to be an I-Frame, subject to the limits of the
+       update coalescer.
+      */
+    void ForceIFrame();
+
+    OpalVideoUpdateCoalescer & GetUpdateCoalescer() { return m_updateCoalescer; }
 
     PINDEX GetMaxEncoderOutputSize() const { return videoEncoderMaxOutputSize; }
 
@@ -158,6 +230,7 @@ class OpalVideoTranscoder : public OpalTranscoder
     PINDEX videoEncoderMaxOutputSize;
     bool   forceIFrame;
     bool   lastFrameWasIFrame;
+    OpalVideoUpdateCoalescer m_updateCoalescer;
 
 #if OPAL_STATISTICS
     DWORD m_totalFrames;
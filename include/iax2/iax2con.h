@@ -449,6 +449,10 @@ class IAX2Connection : public OpalConnection
      that packets arrive in schedule at the far end. */
   OpalJitterBuffer jitterBuffer;
 
+  /**Sequence number placed on the RTP_DataFrame packets given to the jitter
+     buffer, which orders packets by sequence number. */
+  WORD jitterSequenceNumber;
+
   /**The payload type, which we put on all RTP_DataFrame packets. This
      variable is placed on all RTP_DataFrame instances, prior to placing these
      frames into the jitter buffer.
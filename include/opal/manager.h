@@ -52,6 +52,8 @@
 
 class OpalEndPoint;
 class OpalMediaPatch;
+class RTP_Reactor;
+class OpalMediaPatchScheduler;
 
 
 /**This class is the central manager for OPAL.
@@ -1108,6 +1110,122 @@ class OpalManager : public PObject
       unsigned maxDelay    ///<  New maximum jitter buffer delay in milliseconds
     );
 
+    /**Get flag for RTP jitter buffers operating without a thread of their own.
+     */
+    bool GetJitterBufferThreadless() const { return m_jitterBufferThreadless; }
+
+    /**Set flag for RTP jitter buffers operating without a thread of their own.
+       See RTP_Session::SetJitterBufferThreadless() for details. This applies
+       to RTP sessions created after the call.
+     */
+    void SetJitterBufferThreadless(
+      bool threadless    ///<  Flag to not use jitter buffer threads
+    ) { m_jitterBufferThreadless = threadless; }
+
+    /**Get the number of threads in the shared RTP reactor.
+       Defaults to zero, the reactor is not used.
+     */
+    unsigned GetRTPReactorThreads() const { return m_rtpReactorThreads; }
+
+    /**Set the number of threads in the shared RTP reactor.
+
+       If threads is zero (the default) every RTP session reads its sockets
+       with a thread of its own blocked in PSocket::Select(). If non-zero, a
+       pool of that many threads services the sockets of all RTP sessions,
+       which greatly reduces the thread count for large numbers of calls.
+
+       This must be set before any RTP sessions are created, returns false
+       if the reactor has already been started.
+     */
+    bool SetRTPReactorThreads(
+      unsigned threads    ///<  Number of reactor threads
+    );
+
+    /**Get the shared RTP reactor, starting it if necessary.
+       Returns NULL if the reactor is disabled or unavailable on the platform.
+     */
+    RTP_Reactor * GetRTPReactor();
+
+    /**Get the maximum number of RTP data packets read or written per
+       system call. Defaults to one, batching is not used.
+     */
+    unsigned GetRTPBatchSize() const { return m_rtpBatchSize; }
+
+    /**Get the maximum time an RTP data packet waits for the transmit batch
+       to fill before it is sent.
+     */
+    const PTimeInterval & GetRTPBatchLatency() const { return m_rtpBatchLatency; }
+
+    /**Set the batching of RTP data packets.
+
+       If packets is greater than one, RTP sessions read up to that many
+       data packets with a single system call (recvmmsg). When the shared
+       RTP reactor is in use, data packets written are also queued and sent
+       by the reactor threads with a single system call (sendmmsg) per
+       socket, when the queue is full or the oldest packet has waited for
+       latency. This is only available on Linux.
+
+       This applies to RTP sessions created after the call.
+     */
+    void SetRTPBatching(
+      unsigned packets,                ///<  Maximum packets per system call
+      const PTimeInterval & latency    ///<  Maximum delay of a transmitted packet
+    );
+
+    /**Get flag for relaying RTP between sessions with the same media format.
+     */
+    bool GetRTPRelay() const { return m_rtpRelay; }
+
+    /**Set flag for relaying RTP between sessions with the same media format.
+
+       If set, a media patch from one RTP session to another, with no
+       transcoding and no filters on the source format, does not read frames
+       through the jitter buffer and media patch. Instead, data frames are
+       handed from the receiving session to the sending session as they
+       arrive, with SSRC, sequence number and timestamp rewritten. See
+       RTP_UDP::SetRelaySession() for details. This is most effective with
+       the shared RTP reactor, as then no thread is used for the patch.
+
+       This is useful for gateways when media bypass is not possible, e.g.
+       due to NAT, but both sides use the same codec. It applies to media
+       patches started after the call. Adding another sink or a filter to
+       a relaying patch reverts it to normal operation.
+     */
+    void SetRTPRelay(
+      bool relay    ///<  Flag to relay RTP between sessions
+    ) { m_rtpRelay = relay; }
+
+    /**Get the number of threads in the media patch scheduler.
+       Defaults to zero, every media patch has a thread of its own.
+     */
+    unsigned GetMediaPatchWorkers() const { return m_mediaPatchWorkers; }
+
+    /**Set the number of threads in the media patch scheduler.
+
+       If workers is zero (the default) every media patch has a thread of
+       its own. If non-zero, media patches whose source stream can indicate
+       when data is ready (e.g. RTP sessions serviced by the RTP reactor)
+       and which have no synchronous streams, are serviced by a pool of that
+       many threads. See OpalMediaPatchScheduler for details.
+
+       This must be set before any media patches are started, returns false
+       if the scheduler has already been started.
+     */
+    bool SetMediaPatchWorkers(
+      unsigned workers    ///<  Number of scheduler threads
+    );
+
+    /**Get the media patch scheduler, starting it if necessary.
+       Returns NULL if the scheduler is disabled.
+     */
+    OpalMediaPatchScheduler * GetMediaPatchScheduler();
+
+    /**Get the number of processors available. This is used as the default
+       number of threads by the media patch scheduler, the RTP reactor, the
+       mixer scheduler and the SIP work queue.
+     */
+    static unsigned GetProcessorCount();
+
     /**Get the default media format order.
      */
     const PStringArray & GetMediaFormatOrder() const { return mediaFormatOrder; }
@@ -1315,6 +1433,16 @@ class OpalManager : public PObject
     PINDEX        rtpPayloadSizeMax;
     unsigned      minAudioJitterDelay;
     unsigned      maxAudioJitterDelay;
+    bool          m_jitterBufferThreadless;
+    unsigned      m_rtpReactorThreads;
+    RTP_Reactor * m_rtpReactor;
+    PMutex        m_rtpReactorMutex;
+    unsigned      m_mediaPatchWorkers;
+    OpalMediaPatchScheduler * m_mediaPatchScheduler;
+    PMutex        m_mediaPatchSchedulerMutex;
+    unsigned      m_rtpBatchSize;
+    PTimeInterval m_rtpBatchLatency;
+    bool          m_rtpRelay;
     PStringArray  mediaFormatOrder;
     PStringArray  mediaFormatMask;
     PBoolean          disableDetectInBandDTMF;
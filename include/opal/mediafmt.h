@@ -1133,6 +1133,13 @@ class OpalAudioFormat : public OpalMediaFormat
     static const PString & TxFramesPerPacketOption();
     static const PString & MaxFramesPerPacketOption();
     static const PString & ChannelsOption();
+
+    /**Get the PCM-16 media format for the clock rate.
+       Returns an invalid format if there is none at that rate.
+      */
+    static OpalMediaFormat GetPCM16(
+      unsigned clockRate    ///<  Clock rate in Hz
+    );
 };
 
 #if OPAL_VIDEO
@@ -263,6 +263,41 @@ class OpalMediaStream : public PSafeObject
        The default behaviour does nothing.
       */
     virtual void EnableJitterBuffer() const;
+
+    /**Set a notifier to be called when ReadPacket() can be called without
+       blocking. This allows a media patch scheduler to service many
+       patches from a small pool of threads. The notifier may be called
+       from any thread.
+
+       The default behaviour returns false, indicating the stream cannot
+       tell when data is available, and requires a patch thread.
+      */
+    virtual bool SetDataReadyNotifier(
+      const PNotifier & notifier  ///<  Notifier to call, NULL to clear
+    );
+
+    /**Indicate ReadPacket() can be called without blocking.
+
+       The default behaviour returns true.
+      */
+    virtual bool IsDataReady();
+
+    /**Get the interval at which ReadPacket() should be called, if data is
+       read against a clock (e.g. jitter buffer play out) rather than when
+       it arrives. If zero, SetDataReadyNotifier() indicates when to read.
+
+       The default behaviour returns zero.
+      */
+    virtual PTimeInterval GetDataReadyInterval() const;
+
+    /**Indicate if WritePacket() only ever changes the fixed RTP header
+       fields of the packet it is given, and never the payload data or the
+       buffer itself. If so, a media patch with several sinks can give this
+       stream the same packet buffer as the other sinks, instead of a copy.
+
+       The default behaviour returns false.
+      */
+    virtual bool CanShareWrittenPacket() const;
   //@}
 
   /**@name Member variable access */
@@ -447,6 +482,11 @@ class OpalNullMediaStream : public OpalMediaStream, public OpalMediaStreamPacing
        Returns false.
       */
     virtual PBoolean IsSynchronous() const;
+
+    /**Indicate if WritePacket() only changes the RTP header.
+       Returns true.
+      */
+    virtual bool CanShareWrittenPacket() const;
   //@}
 
   protected:
@@ -526,6 +566,29 @@ class OpalRTPMediaStream : public OpalMediaStream
       */
     virtual void EnableJitterBuffer() const;
 
+    /**Set a notifier to be called when ReadPacket() can be called without
+       blocking. This requires the RTP session to be serviced by the shared
+       RTP reactor.
+      */
+    virtual bool SetDataReadyNotifier(
+      const PNotifier & notifier  ///<  Notifier to call, NULL to clear
+    );
+
+    /**Indicate ReadPacket() can be called without blocking.
+      */
+    virtual bool IsDataReady();
+
+    /**Get the interval at which ReadPacket() should be called. If the
+       session has a jitter buffer, this is the frame time of the media.
+      */
+    virtual PTimeInterval GetDataReadyInterval() const;
+
+    /**Indicate if WritePacket() only changes the RTP header.
+       Returns true unless the session encrypts or otherwise encodes the
+       payload, e.g. SRTP.
+      */
+    virtual bool CanShareWrittenPacket() const;
+
     /** Return current RTP session
       */
     virtual RTP_Session & GetRtpSession() const
@@ -609,6 +672,11 @@ class OpalRawMediaStream : public OpalMediaStream
     /**Get average signal level in last frame.
       */
     virtual unsigned GetAverageSignalLevel();
+
+    /**Indicate if WritePacket() only changes the RTP header.
+       Returns true.
+      */
+    virtual bool CanShareWrittenPacket() const;
   //@}
 
   protected:
@@ -41,6 +41,8 @@
 #include <opal/buildopts.h>
 
 #include <queue>
+#include <deque>
+#include <set>
 
 #include <opal/localep.h>
 #include <codec/vidcodec.h>
@@ -48,6 +50,7 @@
 
 class RTP_DataFrame;
 class OpalJitterBuffer;
+class OpalMixerScheduler;
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -137,6 +140,24 @@ class OpalBaseMixer
       */
     void StopPushThread(bool lock = true);
 
+    /**Set the scheduler used to push data out.
+       If non-NULL, the mixer is ticked by the shared scheduler rather than
+       by a push thread of its own. This must be set before any streams are
+       added, and the scheduler must outlive the push, i.e. until
+       StopPushThread() or RemoveAllStreams() is called.
+      */
+    void SetScheduler(
+      OpalMixerScheduler * scheduler  ///< Scheduler to use, NULL for own thread
+    ) { m_scheduler = scheduler; }
+
+    /**Get the scheduler used to push data out, NULL if own thread.
+      */
+    OpalMixerScheduler * GetScheduler() const { return m_scheduler; }
+
+    /**Get the period for mixing in milliseconds.
+      */
+    unsigned GetPeriodMS() const { return m_periodMS; }
+
     /**Get the period for mixing in RTP timestamp units.
       */
     unsigned GetPeriodTS() const { return m_periodTS; }
@@ -166,6 +187,142 @@ class OpalBaseMixer
     PThread *       m_workerThread;     // reader thread handle
     bool            m_threadRunning;    // used to stop reader thread
     PMutex          m_mutex;            // mutex for list of streams and thread handle
+
+    OpalMixerScheduler * m_scheduler;   // shared scheduler, instead of m_workerThread
+    bool                 m_scheduled;   // added to m_scheduler
+
+    enum ScheduleStates {
+      ScheduleIdle,
+      ScheduleQueued,
+      ScheduleRunning,
+      ScheduleStopped
+    } m_scheduleState;                  // protected by scheduler mutex
+
+  friend class OpalMixerScheduler;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+/**Mixer scheduler.
+   Ticks many OpalBaseMixer instances from a small set of threads, rather
+   than a push thread per mixer. There is a timer thread for each distinct
+   mixing period, keeping to an absolute clock so errors in the sleep do not
+   accumulate. On each tick every mixer with that period is queued to a pool
+   of worker threads, so mixing is spread across processors.
+
+   A tick that is more than a quarter period late is counted, and if the
+   timer falls too far behind it skips the missed ticks rather than bursting.
+   A mixer still busy with the previous tick when the next one arrives misses
+   that tick, which is counted as an overrun.
+  */
+class OpalMixerScheduler : public PObject
+{
+    PCLASSINFO(OpalMixerScheduler, PObject);
+  public:
+  /**@name Construction */
+  //@{
+    /**Create the scheduler and start its worker threads.
+      */
+    OpalMixerScheduler(
+      unsigned workers = 0   ///<  Number of worker threads, zero is one per processor
+    );
+
+    /**Stop all threads.
+       All mixers must have been removed.
+      */
+    ~OpalMixerScheduler();
+  //@}
+
+  /**@name Operations */
+  //@{
+    /**Add a mixer to be ticked at its mixing period.
+      */
+    void Add(
+      OpalBaseMixer & mixer   ///<  Mixer to add
+    );
+
+    /**Remove a mixer, waiting for any mixing in progress to complete.
+      */
+    void Remove(
+      OpalBaseMixer & mixer   ///<  Mixer to remove
+    );
+
+    /**Get the number of worker threads.
+      */
+    PINDEX GetWorkerCount() const { return m_workers.size(); }
+
+    /**Get the number of mixers being ticked.
+      */
+    PINDEX GetMixerCount() const { return m_mixerCount; }
+
+    /**Get the total number of ticks by all timers.
+      */
+    PUInt64 GetTicks() const { return m_ticks; }
+
+    /**Get the number of ticks dispatched late, or skipped entirely.
+      */
+    PUInt64 GetLateTicks() const { return m_lateTicks; }
+
+    /**Get the number of times a mixer was still busy at its next tick.
+      */
+    PUInt64 GetOverruns() const { return m_overruns; }
+
+    /**Work to be split across the worker threads by RunParallel().
+      */
+    class ParallelTask
+    {
+      public:
+        virtual ~ParallelTask() { }
+
+        /**Execute one item of the task, may be called from any thread.
+          */
+        virtual void Execute(
+          PINDEX index    ///< Index of item, 0 to count-1
+        ) = 0;
+    };
+
+    /**Execute items 0 to count-1 of the task, spread across any idle worker
+       threads. The calling thread executes items too, so this never waits
+       for workers busy with other mixers, and returns once all items are
+       complete.
+      */
+    void RunParallel(
+      ParallelTask & task,  ///< Task to execute
+      PINDEX count          ///< Number of items in task
+    );
+  //@}
+
+  protected:
+    class Timer;
+    class Worker;
+    void TimerMain(Timer & timer);
+    void WorkerMain(Worker & worker);
+    void Dispatch(Timer & timer);
+    void RemoveFromTimer(OpalBaseMixer & mixer);
+    void SignalStateWaiters();
+
+    struct ParallelJob {
+      ParallelTask * m_task;
+      PINDEX         m_count;
+      PINDEX         m_next;
+      PINDEX         m_done;
+      PSyncPoint     m_finished;
+    };
+    void ExecuteParallelItem(ParallelJob & job);
+    std::deque<ParallelJob *>    m_parallelJobs;
+
+    std::map<unsigned, Timer *>  m_timers;
+    std::vector<Worker *>        m_workers;
+    std::deque<OpalBaseMixer *>  m_runQueue;
+    PINDEX                       m_mixerCount;
+    PUInt64                      m_ticks;
+    PUInt64                      m_lateTicks;
+    PUInt64                      m_overruns;
+    PMutex                       m_mutex;
+    PSyncPoint                   m_wakeUp;
+    std::vector<PSyncPoint *>    m_stateWaiters;  // In Remove(), for a worker to finish with a mixer
+    bool                         m_shutdown;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -230,6 +387,48 @@ class OpalAudioMixer : public OpalBaseMixer
       unsigned maxJitterDelay  ///<  Maximum jitter buffer delay in RTP timestamp units
     );
 
+    /**Get the maximum number of streams mixed at any one time.
+       A value of zero indicates all streams are mixed.
+      */
+    unsigned GetMaxSpeakers() const { return m_maxSpeakers; }
+
+    /**Set the maximum number of streams mixed at any one time.
+       When non-zero, the input streams are ranked by a smoothed audio level
+       and only the loudest are added to the mix. A stream that is already
+       being mixed is favoured over a new one, so the speaker set does not
+       flap between participants of similar volume.
+
+       A value of zero indicates all streams are mixed.
+      */
+    void SetMaxSpeakers(
+      unsigned count    ///< Maximum number of mixed streams
+    );
+
+    /**Indicate if the stream is one of those included in the last mix.
+      */
+    bool IsSpeaking(
+      const Key_T & key   ///< key for mixer stream
+    );
+
+    /**Add a period of PCM-16 audio into the mixing accumulator.
+       Uses SSE2/AVX2 when the compiler targets them.
+      */
+    static void MixAccumulate(
+      int * mixed,          ///< Accumulator for mixed samples
+      const short * audio,  ///< Audio samples to add
+      unsigned count        ///< Number of samples
+    );
+
+    /**Convert the mixing accumulator to PCM-16, optionally subtracting one
+       stream (e.g. a participants own audio) and clamping to a safe range.
+      */
+    static void MixSaturate(
+      short * output,               ///< Output PCM-16 samples
+      const int * mixed,            ///< Accumulator for mixed samples
+      const short * audioToSubtract,///< Audio to remove from mix, may be NULL
+      unsigned count                ///< Number of samples
+    );
+
   protected:
     struct AudioStream : public Stream
     {
@@ -244,6 +443,9 @@ class OpalAudioMixer : public OpalBaseMixer
       unsigned           m_nextTimestamp;
       PShortArray        m_cacheSamples;
       size_t             m_samplesUsed;
+      unsigned           m_level;     // Smoothed mean absolute amplitude
+      unsigned           m_rank;      // Level biased towards current speakers
+      bool               m_speaking;  // Included in last mix
     };
 
     virtual Stream * CreateStream();
@@ -251,16 +453,20 @@ class OpalAudioMixer : public OpalBaseMixer
     virtual size_t GetOutputSize() const;
 
     void PreMixStreams();
+    void SelectSpeakers();
+    static bool CompareSpeakerRank(const AudioStream * first, const AudioStream * second);
     void MixStereo(RTP_DataFrame & frame);
     void MixAdditive(RTP_DataFrame & frame, const short * audioToSubtract);
 
-  protected:
     bool     m_stereo;
     unsigned m_sampleRate;
 
     AudioStream    * m_left;
     AudioStream    * m_right;
     std::vector<int> m_mixedAudio;
+
+    unsigned                   m_maxSpeakers;
+    std::vector<AudioStream *> m_rankedStreams;
 };
 
 
@@ -294,10 +500,23 @@ class OpalVideoMixer : public OpalBaseMixer
                                  of output frame. It is expected that the output frame be
                                  double the height of the input data to maintain aspect
                                  ratio. e.g. for CIF inputs, output would be 352x576. */
-      eGrid,                /**< Standard 2x2, 3x3, 4x4 grid pattern. Size of grid is
-                                 dependent on the number of video streams. */
+      eGrid,                /**< Standard 2x2, 3x3, 4x4, 5x5 etc grid pattern. Size of
+                                 grid is dependent on the number of video streams. */
+      eActiveSpeaker,       /**< The active speaker in a large image, with the other
+                                 streams in a filmstrip along the bottom. */
+      ePictureInPicture,    /**< The active speaker full frame, with up to three other
+                                 streams in small images in the bottom right corner. */
+      eCustom               /**< Tile positions as provided by SetLayout(). */
     };
 
+    /**Position and size of a tile in the output frame.
+      */
+    struct LayoutRect {
+      unsigned m_x, m_y;
+      unsigned m_width, m_height;
+    };
+    typedef std::vector<LayoutRect> Layout;
+
     OpalVideoMixer(
       Styles style,           ///< Style for mixing video
       unsigned width,         ///< Width of output frame
@@ -335,14 +554,61 @@ class OpalVideoMixer : public OpalBaseMixer
       unsigned height   ///< new height
     );
 
+    /**Get the layout style for output frame.
+      */
+    Styles GetStyle() const { return m_style; }
+
+    /**Set the layout style for output frame.
+       May be dynamically changed at any time.
+      */
+    void SetStyle(
+      Styles style    ///< New style
+    );
+
+    /**Set an arbitrary layout for the output frame, selecting eCustom style.
+       Input streams are placed in the tiles in order, the active speaker, if
+       set, first. A tile that overlaps an earlier one is drawn on top of it.
+       Positions and sizes are rounded down to even values.
+      */
+    void SetLayout(
+      const Layout & layout   ///< Tile positions
+    );
+
+    /**Set the stream that is placed in the first tile of the layout. This is
+       the large image for eActiveSpeaker and ePictureInPicture styles.
+      */
+    void SetActiveSpeaker(
+      const Key_T & key   ///< key for mixer stream
+    );
+
+    /**Information on the tile in the output frame for an input stream.
+      */
+    struct TileInfo {
+      unsigned m_x, m_y;            ///< Position in output frame
+      unsigned m_width, m_height;   ///< Size in output frame
+      unsigned m_renderCount;       ///< Number of times tile has been rendered
+      PUInt64  m_lastRenderTime;    ///< Microseconds to render the tile last time
+      PUInt64  m_totalRenderTime;   ///< Microseconds spent rendering the tile in total
+    };
+
+    /**Get information on the tile for an input stream.
+       Returns false if the stream does not exist.
+      */
+    bool GetTileInfo(
+      const Key_T & key,  ///< key for mixer stream
+      TileInfo & info     ///< Tile information
+    );
+
   protected:
     struct VideoStream : public Stream
     {
       VideoStream(OpalVideoMixer & mixer);
       virtual void QueuePacket(const RTP_DataFrame & rtp);
-      void InsertVideoFrame(unsigned x, unsigned y, unsigned w, unsigned h);
+      bool InsertVideoFrame(const LayoutRect & rect, bool redraw);
 
       OpalVideoMixer     & m_mixer;
+      RTP_DataFrame        m_lastFrame;  // Last input rendered, for redrawing on layout change
+      TileInfo             m_tile;
     };
 
     friend struct VideoStream;
@@ -351,11 +617,41 @@ class OpalVideoMixer : public OpalBaseMixer
     virtual bool MixStreams(RTP_DataFrame & frame);
     virtual size_t GetOutputSize() const;
 
+    /**Calculate the tile positions for the number of input streams.
+       The default uses the style to select the layout.
+      */
+    virtual void CalculateLayout(
+      size_t count,     ///< Number of input streams
+      Layout & layout   ///< Tile positions to fill in
+    ) const;
+
+    struct RenderItem {
+      VideoStream * m_stream;
+      bool          m_redraw;
+      bool          m_drawn;
+    };
+    class RenderTask;
+    friend class RenderTask;
+
   protected:
     Styles     m_style;
     unsigned   m_width, m_height;
 
-    PBYTEArray m_frameStore;
+    Layout                            m_customLayout;
+    Key_T                             m_activeSpeaker;
+    Layout                            m_layout;         // Current tile positions
+    std::vector<unsigned>             m_layoutPass;     // Tile drawing order, overlaps drawn later
+    std::vector< std::vector<size_t> > m_layoutOverlaps; // Earlier tiles each tile is on top of
+    unsigned                          m_layoutPasses;
+    std::vector<RenderItem>           m_renderItems;
+    std::vector<size_t>               m_renderPass;
+
+    /* Composed output, PluginCodec_Video_FrameHeader and YUV420P, in an RTP
+       payload so it can be handed out by reference. Only tiles with a new
+       input frame are rendered into it each period. */
+    RTP_DataFrame m_mixedFrame;
+    size_t        m_lastStreamCount;
+    bool          m_layoutChanged;
 };
 
 #endif // OPAL_VIDEO
@@ -372,12 +668,15 @@ struct OpalMixerNodeInfo
   OpalMixerNodeInfo()
     : m_listenOnly(false)
     , m_sampleRate(OpalMediaFormat::AudioClockRate)
+    , m_maxSpeakers(0)
 #if OPAL_VIDEO
     , m_audioOnly(false)
     , m_style(OpalVideoMixer::eGrid)
     , m_width(PVideoFrameInfo::CIFWidth)
     , m_height(PVideoFrameInfo::CIFHeight)
     , m_rate(15)
+    , m_maxEncodeClasses(0)
+    , m_minIFrameInterval(1000)
 #endif
   { }
 
@@ -388,12 +687,15 @@ struct OpalMixerNodeInfo
   PString  m_name;
   bool     m_listenOnly;
   unsigned m_sampleRate;
+  unsigned m_maxSpeakers; ///< Loudest participants mixed, zero for all
 #if OPAL_VIDEO
   bool     m_audioOnly;
   OpalVideoMixer::Styles m_style;
   unsigned m_width;
   unsigned m_height;
   unsigned m_rate;
+  unsigned m_maxEncodeClasses; ///< Distinct video encoders per node, zero for no limit
+  unsigned m_minIFrameInterval; ///< Minimum milliseconds between forced I-Frames from an encoder
 #endif
 };
 
@@ -574,11 +876,33 @@ class OpalMixerEndPoint : public OpalLocalEndPoint
        Default bahaviour returns member variable m_adHocNodeInfo.
       */
     OpalMixerNodeInfo * GetAdHocNodeInfo() { return m_adHocNodeInfo; }
+
+    /**Set the number of threads in the mixer scheduler.
+
+       If workers is zero (the default) every node mixer has a push thread
+       of its own. If non-zero, all node mixers are ticked by a shared
+       OpalMixerScheduler with this many worker threads.
+
+       This must be set before any nodes are created, returns false if the
+       scheduler has already been started.
+      */
+    bool SetMixerWorkers(
+      unsigned workers    ///<  Number of scheduler threads
+    );
+
+    /**Get the shared mixer scheduler, creating it if required.
+       Returns NULL if node mixers are to use their own threads.
+      */
+    OpalMixerScheduler * GetMixerScheduler();
   //@}
 
   protected:
     OpalMixerNodeInfo * m_adHocNodeInfo;
 
+    unsigned             m_mixerWorkers;
+    OpalMixerScheduler * m_mixerScheduler;
+    PMutex               m_mixerSchedulerMutex;
+
     PSafeDictionary<PGloballyUniqueID, OpalMixerNode> m_nodesByUID;
     PDictionary<PString, OpalMixerNode>               m_nodesByName;
 
@@ -743,6 +1067,19 @@ class OpalMixerMediaStream : public OpalMediaStream
     virtual PBoolean RequiresPatchThread(
       OpalMediaStream * sinkStream  ///< Sink stream for this source
     ) const;
+
+    /**Execute the command specified to the transcoder.
+       A picture update for a video stream encoded by the mixer is passed to
+       the encoder the stream shares with others, which merges it with the
+       requests from those other streams.
+      */
+    virtual PBoolean ExecuteCommand(
+      const OpalMediaCommand & command    ///<  Command to execute.
+    );
+
+#if OPAL_STATISTICS
+    virtual void GetStatistics(OpalMediaStatistics & statistics, bool fromPatch = false) const;
+#endif
   //@}
 
   /**@name Member variable access */
@@ -838,6 +1175,22 @@ class OpalMixerNode : public PSafeObject
       const OpalBaseMixer::Key_T & key, ///< key for mixer stream
       const RTP_DataFrame & input       ///< Input RTP data for media
     ) { return m_videoMixer.WriteStream(key, input); }
+
+    /**Request an I-Frame be sent to an output stream.
+       Returns false if the stream is not encoded by the mixer.
+      */
+    bool UpdateVideoPicture(
+      OpalMixerMediaStream & stream     ///< Output stream wanting the I-Frame
+    );
+
+#if OPAL_STATISTICS
+    /**Get the statistics of the encoder used for an output stream.
+      */
+    void GetVideoStatistics(
+      OpalMixerMediaStream & stream,    ///< Output stream
+      OpalMediaStatistics & statistics  ///< Statistics to fill in
+    );
+#endif
 #endif // OPAL_VIDEO
   //@}
 
@@ -934,6 +1287,47 @@ class OpalMixerNode : public PSafeObject
       ~VideoMixer();
 
       virtual bool OnMixed(RTP_DataFrame * & output);
+
+      /* Output streams with the same codec, resolution and bit rate tier
+         share one encoder. When there are already m_maxEncodeClasses, a
+         new stream is given the nearest existing class for its codec. */
+      struct EncodeClass {
+        EncodeClass(const OpalMediaFormat & mediaFormat, unsigned width, unsigned height, unsigned bitRate);
+        ~EncodeClass();
+
+        OpalMediaFormat   m_mediaFormat;
+        unsigned          m_width;
+        unsigned          m_height;
+        unsigned          m_bitRate;
+        OpalTranscoder  * m_encoder;
+        RTP_DataFrame     m_scaled;
+        RTP_DataFrameList m_encoded;
+        enum { Pending, Encoded, Failed } m_state;
+        unsigned          m_streamCount;
+      };
+      typedef std::map<PString, EncodeClass *> EncodeClassMap;
+
+      struct StreamClass {
+        PString m_wanted;   // Key for the class that exactly fits the stream
+        PString m_actual;   // Key for the class being used
+      };
+      typedef std::map<PString, StreamClass> StreamClassMap;
+
+      EncodeClass * GetEncodeClass(
+        const PString & streamID,
+        const OpalMediaFormat & mediaFormat,
+        StreamClassMap & streamClasses
+      );
+
+      unsigned       m_maxEncodeClasses;
+      unsigned       m_minIFrameInterval;
+      EncodeClassMap m_encodeClasses;
+      StreamClassMap m_streamClasses;
+      PMutex         m_encodeMutex;
+
+      // Picture updates requested by stream ID, passed to encoders on next mix
+      std::set<PString> m_updatePictures;
+      PMutex            m_updatePictureMutex;
     };
     VideoMixer m_videoMixer;
 #endif // OPAL_VIDEO
@@ -43,8 +43,12 @@
 #include <codec/ratectl.h>
 
 #include <list>
+#include <deque>
+#include <map>
+#include <vector>
 
 class OpalTranscoder;
+class OpalMediaPatchScheduler;
 
 /**Media stream "patch cord".
    This class is the thread of control that transfers data from one
@@ -90,6 +94,10 @@ class OpalMediaPatch : public PObject
   //@{
     /**Start the patch. The default implementation simply starts the
        patch thread, which in turn calls Main()
+
+       If the manager has a media patch scheduler, the source stream can
+       indicate when data is ready, and neither source nor sinks are
+       synchronous, the patch is instead serviced by the scheduler threads.
       */
     virtual void Start();
 
@@ -208,13 +216,44 @@ class OpalMediaPatch : public PObject
 #if OPAL_STATISTICS
     virtual void GetStatistics(OpalMediaStatistics & statistics, bool fromSink) const;
 #endif
+
+    /**Get the number of media frame buffers the patch has had to allocate,
+       rather than reuse from a previous frame. Once the patch has reached a
+       steady state this should no longer increase.
+      */
+    unsigned GetFrameAllocations() const { return m_frameAllocations; }
+
+    /**Get the total CPU cost of the transcoders used by the patch sinks.
+       This is in microseconds per second of media, as for
+       OpalTranscoder::GetTranscoderCost(), and is zero if no transcoding
+       is being done.
+      */
+    unsigned GetTranscoderCost() const;
   //@}
 
   protected:
                 
     /**Called from the associated patch thread */
     virtual void Main();
+    bool ReadSourceFrame();
     bool DispatchFrame(RTP_DataFrame & frame);
+
+    /**Called from a scheduler thread when the source has data ready, or
+       its clock interval has expired. Returns false if the patch is to
+       stop. Sets more to true if there may be more data to read.
+      */
+    virtual bool Service(bool & more);
+
+    /**Determine if neither the source nor any sink is synchronous, so the
+       patch does not need to pace itself, and may be serviced by a
+       OpalMediaPatchScheduler.
+      */
+    bool IsAsynchronous() const;
+    void StopScheduled();
+    void StartRelay();
+    void StopRelay(bool restart);
+    PDECLARE_NOTIFIER(PObject, OpalMediaPatch, OnSourceDataReady);
+    friend class OpalMediaPatchScheduler;
         
     OpalMediaStream & source;
 
@@ -226,7 +265,8 @@ class OpalMediaPatch : public PObject
         bool UpdateMediaFormat(const OpalMediaFormat & mediaFormat);
         bool ExecuteCommand(const OpalMediaCommand & command);
         void SetCommandNotifier(const PNotifier & notifier);
-        bool WriteFrame(RTP_DataFrame & sourceFrame);
+        bool WriteFrame(RTP_DataFrame & sourceFrame, bool shared);
+        bool WriteSourcePacket(RTP_DataFrame & sourceFrame, bool shared);
 #if OPAL_STATISTICS
         void GetStatistics(OpalMediaStatistics & statistics, bool fromSource) const;
 #endif
@@ -235,6 +275,7 @@ class OpalMediaPatch : public PObject
         OpalMediaStreamPtr stream;
         OpalTranscoder  * primaryCodec;
         OpalTranscoder  * secondaryCodec;
+        unsigned          transcoderCost;
         RTP_DataFrameList intermediateFrames;
         RTP_DataFrameList finalFrames;
         bool              writeSuccessful;
@@ -267,6 +308,27 @@ class OpalMediaPatch : public PObject
     Thread * patchThread;
     PMutex patchThreadMutex;
     mutable PReadWriteMutex inUse;
+
+    enum ScheduleStates {
+      ScheduleIdle,
+      ScheduleQueued,
+      ScheduleTimed,
+      ScheduleRunning,
+      ScheduleRunningNotified,
+      ScheduleStopping,
+      ScheduleFinished
+    };
+    OpalMediaPatchScheduler * m_scheduler;
+    ScheduleStates            m_scheduleState;
+    PTimeInterval             m_scheduleInterval;
+    PTimeInterval             m_scheduleDeadline;
+
+    RTP_DataFrame m_sourceFrame;
+    unsigned      m_frameAllocations;
+
+    RTP_UDP * m_relaySession;
+    bool      m_relayByReactor;
+    bool      m_relayDisabled;
 };
 
 /**Passive Media Patch
@@ -290,6 +352,82 @@ class OpalPassiveMediaPatch : public OpalMediaPatch
 };
 
 
+/**Media patch scheduler.
+   Services many OpalMediaPatch instances from a fixed pool of threads,
+   rather than a thread per patch. A patch is only serviced when its source
+   stream indicates a read will not block, or at the interval the source is
+   clocked at, e.g. for jitter buffer play out. Patches with synchronous
+   streams still get a thread of their own.
+  */
+class OpalMediaPatchScheduler : public PObject
+{
+    PCLASSINFO(OpalMediaPatchScheduler, PObject);
+  public:
+  /**@name Construction */
+  //@{
+    /**Create the scheduler and start its worker threads.
+      */
+    OpalMediaPatchScheduler(
+      unsigned workers = 0   ///<  Number of worker threads, zero is one per processor
+    );
+
+    /**Stop the worker threads.
+       All patches must have been removed.
+      */
+    ~OpalMediaPatchScheduler();
+  //@}
+
+  /**@name Operations */
+  //@{
+    /**Add a patch to be serviced. It is serviced immediately, then as
+       indicated by the source stream.
+      */
+    void Add(
+      OpalMediaPatch & patch   ///<  Patch to add
+    );
+
+    /**Remove a patch, waiting for any servicing in progress to complete.
+       The source stream OnPatchStop() is called if the patch had not
+       already stopped.
+      */
+    void Remove(
+      OpalMediaPatch & patch   ///<  Patch to remove
+    );
+
+    /**Indicate the source of a patch has data ready to be read.
+      */
+    void Schedule(
+      OpalMediaPatch & patch   ///<  Patch to service
+    );
+
+    /**Get the number of worker threads.
+      */
+    PINDEX GetWorkerCount() const { return m_workers.size(); }
+
+    /**Get the number of patches being serviced.
+      */
+    PINDEX GetPatchCount() const { return m_patchCount; }
+  //@}
+
+  protected:
+    class Worker;
+    void WorkerMain(Worker & worker);
+    void Stopped(OpalMediaPatch & patch);
+    void SignalStateWaiters();
+
+    typedef std::multimap<PTimeInterval, OpalMediaPatch *> TimedPatches;
+
+    std::vector<Worker *>        m_workers;
+    std::deque<OpalMediaPatch *> m_runQueue;
+    TimedPatches                 m_timedPatches;
+    PINDEX                       m_patchCount;
+    PMutex                       m_mutex;
+    PSyncPoint                   m_wakeUp;
+    std::vector<PSyncPoint *>    m_stateWaiters;  // In Remove(), for a worker to finish with a patch
+    bool                         m_shutdown;
+};
+
+
 #endif // OPAL_OPAL_PATCH_H
 
 
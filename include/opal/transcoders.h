@@ -230,8 +230,12 @@ class OpalTranscoder : public OpalMediaFormatPair
        allow two transcoders to be used to get data from the source format to
        the destination format.
 
-       There could be many possible matches between the two lists, so
-       preference is given to the order of the destination formats.
+       There could be many possible matches between the two lists. A match
+       without transcoders is always used first, then one with a single
+       transcoder, and only as a last resort one with two. Among matches with
+       the same number of transcoders, the one with the lowest total
+       GetTranscoderCost() is used, with preference given to the order of the
+       destination formats when the costs are the same.
 
        At least one of the two selected medai formats (source or destination)
        must also be of the specified media type ("audio", "video" etc).
@@ -257,13 +261,19 @@ class OpalTranscoder : public OpalMediaFormatPair
        the destination format then the function returns true but the
        intermediateFormat parmaeter will be an invlid format.
 
+       A direct transcoder is always used if there is one. Otherwise the pair
+       with the lowest total GetTranscoderCost() is used. That search is
+       cached for each pair of formats until the costs or the registered
+       transcoders change.
+
        Returns false if there is no registered media transcoder that can be used
        between the two named formats.
       */
     static bool FindIntermediateFormat(
       const OpalMediaFormat & srcFormat,    ///<  Selected destination format to be used
       const OpalMediaFormat & dstFormat,    ///<  Selected destination format to be used
-      OpalMediaFormat & intermediateFormat  ///<  Intermediate format that can be used
+      OpalMediaFormat & intermediateFormat, ///<  Intermediate format that can be used
+      unsigned * pathCost = NULL            ///<  Total cost of the transcoders, if not NULL
     );
 
     /**Get a list of possible destination media formats for the destination.
@@ -283,6 +293,66 @@ class OpalTranscoder : public OpalMediaFormatPair
     static OpalMediaFormatList GetPossibleFormats(
       const OpalMediaFormatList & formats    ///<  Destination format list
     );
+
+    enum {
+      UnknownTranscoderCost = 10000 ///< Cost used for transcoders not measured or loaded
+    };
+
+    /**Get the CPU cost of a transcoder.
+       This is the microseconds of CPU time taken to convert one second of
+       media, as measured by CalibrateTranscoderCosts() or loaded by
+       LoadTranscoderCosts(). UnknownTranscoderCost is returned for
+       transcoders that have not been, so without a table paths are chosen
+       purely on the number of transcoders and the order of the formats.
+      */
+    static unsigned GetTranscoderCost(
+      const OpalMediaFormat & srcFormat,  ///<  Source format
+      const OpalMediaFormat & dstFormat   ///<  Destination format
+    );
+
+    /**Set the CPU cost of a transcoder.
+      */
+    static void SetTranscoderCost(
+      const OpalMediaFormat & srcFormat,  ///<  Source format
+      const OpalMediaFormat & dstFormat,  ///<  Destination format
+      unsigned cost                       ///<  Microseconds per second of media
+    );
+
+    /**Load the table of transcoder costs from a file.
+       Each line is the source format name, destination format name and cost
+       separated by tabs, as written by SaveTranscoderCosts().
+      */
+    static bool LoadTranscoderCosts(
+      const PFilePath & filename          ///<  File to load
+    );
+
+    /**Save the table of transcoder costs to a file.
+      */
+    static bool SaveTranscoderCosts(
+      const PFilePath & filename          ///<  File to save
+    );
+
+    /**Measure the CPU cost of a transcoder.
+       Synthetic audio is converted for the duration given, split into
+       several runs of which the fastest is used. Decoders are fed the output
+       of an encoder from PCM-16 at the same clock rate.
+
+       Returns zero if the transcoder could not be measured, e.g. for video.
+      */
+    static unsigned MeasureTranscoderCost(
+      const OpalMediaFormat & srcFormat,  ///<  Source format
+      const OpalMediaFormat & dstFormat,  ///<  Destination format
+      const PTimeInterval & duration = 200 ///<  Wall clock time to spend measuring
+    );
+
+    /**Measure and set the cost of every registered audio transcoder.
+       As this takes the duration for each of them, it is intended to be run
+       once at start up, after the plug ins are loaded, or by a utility that
+       then saves the table for LoadTranscoderCosts().
+      */
+    static void CalibrateTranscoderCosts(
+      const PTimeInterval & duration = 200 ///<  Wall clock time to spend on each transcoder
+    );
   //@}
 
   /**@name Operations */
@@ -484,6 +554,20 @@ class OpalStreamedTranscoder : public OpalTranscoder
        Returns converted value.
       */
     virtual int ConvertOne(int sample) const = 0;
+
+    /**Convert a block of samples from one format to another.
+       This allows a transcoder to convert a whole frame in one tight loop,
+       e.g. using lookup tables, rather than with a virtual call to
+       ConvertOne() for every sample.
+
+       The default behaviour returns false, indicating Convert() is to use
+       ConvertOne() for each sample.
+      */
+    virtual bool ConvertSamples(
+      const BYTE * input,   ///<  Input samples, packed at inputBitsPerSample
+      BYTE * output,        ///<  Output samples, packed at outputBitsPerSample
+      PINDEX samples        ///<  Number of samples to convert
+    ) const;
   //@}
 
   protected:
@@ -125,6 +125,11 @@ class OpalJitterBuffer : public PSafeObject
       */
     DWORD GetBufferOverruns() const { return bufferOverruns; }
 
+    /**Get total number of packets that had not arrived when it was time for
+       them to be played out.
+      */
+    DWORD GetPacketsLost() const { return packetsLost; }
+
     /**Get maximum consecutive marker bits before buffer starts to ignore them.
       */
     DWORD GetMaxConsecutiveMarkerBits() const { return maxConsecutiveMarkerBits; }
@@ -143,6 +148,8 @@ class OpalJitterBuffer : public PSafeObject
     };
     OpalJitterBuffer::Entry * GetAvailableEntry();
     void InternalWriteData(OpalJitterBuffer::Entry * availableEntry);
+    void InsertEntry(OpalJitterBuffer::Entry * availableEntry);
+    void FlushEntries();
 
     DWORD         minJitterTime;
     DWORD         maxJitterTime;
@@ -153,6 +160,7 @@ class OpalJitterBuffer : public PSafeObject
     DWORD         currentJitterTime;
     DWORD         packetsTooLate;
     unsigned      bufferOverruns;
+    DWORD         packetsLost;
     unsigned      consecutiveBufferOverruns;
     DWORD         consecutiveMarkerBits;
     bool          markerWarning;
@@ -182,9 +190,48 @@ class OpalJitterBuffer : public PSafeObject
     };
 
     FrameQueue freeFrames;
-    FrameQueue jitterBuffer;
-    inline Entry * GetNewest(bool pop) { Entry * e = jitterBuffer.back(); if (pop) jitterBuffer.pop_back(); return e; }
-    inline Entry * GetOldest(bool pop) { Entry * e = jitterBuffer.front(); if (pop) jitterBuffer.pop_front(); return e; }
+
+    /* The frames waiting for play out are held in a ring indexed by RTP
+       sequence number modulo its size, so insertion and removal are O(1).
+       The size is a power of two, at least twice bufferSize, so gaps from
+       lost packets do not cause collisions.
+     */
+    std::vector<Entry *> m_ring;
+    WORD                 m_ringMask;
+    PINDEX               m_ringCount;
+    WORD                 m_oldestSequence;
+    WORD                 m_newestSequence;
+    WORD                 m_playedSequence;  // Last sequence number removed from ring
+    bool                 m_playedSequenceValid;
+
+    inline PINDEX GetBufferCount() const { return m_ringCount; }
+    inline Entry * GetNewest(bool pop)
+    {
+      Entry * e = m_ring[m_newestSequence & m_ringMask];
+      if (pop) {
+        m_ring[m_newestSequence & m_ringMask] = NULL;
+        if (--m_ringCount > 0) {
+          while (m_ring[--m_newestSequence & m_ringMask] == NULL)
+            ;
+        }
+      }
+      return e;
+    }
+    inline Entry * GetOldest(bool pop)
+    {
+      Entry * e = m_ring[m_oldestSequence & m_ringMask];
+      if (pop) {
+        m_ring[m_oldestSequence & m_ringMask] = NULL;
+        m_playedSequence = m_oldestSequence;
+        m_playedSequenceValid = true;
+        if (--m_ringCount > 0) {
+          // Anything skipped over never arrived in time
+          while (m_ring[++m_oldestSequence & m_ringMask] == NULL)
+            packetsLost++;
+        }
+      }
+      return e;
+    }
 
     Entry * currentFrame;    // storage of current frame
 
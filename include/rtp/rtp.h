@@ -43,8 +43,12 @@
 #include <ptlib/sockets.h>
 #include <ptlib/safecoll.h>
 
+#include <deque>
+#include <vector>
+
 
 class RTP_JitterBuffer;
+class RTP_Reactor;
 class PNatMethod;
 class OpalSecurityMode;
 
@@ -310,6 +314,10 @@ class OpalMediaStatistics : public PObject
     // Video
     unsigned m_totalFrames;
     unsigned m_keyFrames;
+    unsigned m_updateRequests;   // Picture updates asked of the encoder
+    unsigned m_updatesCoalesced; // Merged into an I-Frame already on its way
+    unsigned m_updatesDeferred;  // Held back by the minimum I-Frame interval
+    unsigned m_forcedKeyFrames;
 
     // Fax
 #if OPAL_FAX
@@ -463,6 +471,38 @@ class RTP_Session : public PObject
      */
     unsigned GetJitterTimeUnits() const;
 
+    /**Set the jitter buffer to operate without a thread of its own.
+       When set, received data frames are written directly into the jitter
+       buffer by the receive path (e.g. the shared RTP reactor), or are
+       collected without blocking on each call to ReadBufferedData(). This
+       saves a thread and a hand off per packet for each session.
+
+       As ReadBufferedData() never blocks in this mode, it may be called
+       from a shared timer servicing many asynchronous sinks.
+
+       This must be set before SetJitterBufferSize() creates the jitter
+       buffer, and is only supported by RTP_UDP.
+      */
+    void SetJitterBufferThreadless(
+      bool threadless   ///<  Flag to not use a jitter buffer thread
+    ) { m_jitterBufferThreadless = threadless; }
+
+    /**Indicate the jitter buffer operates without a thread of its own.
+      */
+    bool IsJitterBufferThreadless() const { return m_jitterBufferThreadless; }
+
+    /**Write a data frame received on another session, when relaying media
+       between two sessions without decoding it. The SSRC and timestamp are
+       rewritten as for WriteData(), but the sequence number is offset
+       rather than renumbered, so packets lost before the relay are still
+       seen as lost in the far end's receiver reports. A change of SSRC on
+       the incoming frames restarts the offsets, so the outgoing sequence
+       and timestamps stay continuous.
+      */
+    virtual PBoolean RelayData(
+      RTP_DataFrame & frame   ///<  Frame received on the other session
+    );
+
     /**Modifies the QOS specifications for this RTP session*/
     virtual PBoolean ModifyQOS(RTP_QOS * )
     { return PFalse; }
@@ -863,6 +903,7 @@ class RTP_Session : public PObject
 
     typedef PSafePtr<RTP_JitterBuffer, PSafePtrMultiThreaded> JitterBufferPtr;
     JitterBufferPtr m_jitterBuffer;
+    bool            m_jitterBufferThreadless;
 
     PBoolean      ignoreOutOfOrderPackets;
     DWORD         syncSourceOut;
@@ -888,6 +929,12 @@ class RTP_Session : public PObject
     DWORD         oobTimeStampOutBase;         // base timestamp value for oob data
     PTimeInterval oobTimeStampBase;            // base time for oob timestamp
 
+    bool          m_relayStarted;
+    DWORD         m_relaySyncSourceIn;
+    WORD          m_relaySequenceOffset;
+    DWORD         m_relayLastTimestamp;
+    DWORD         m_relayTimestampStep;        // Frame duration of the relayed media, in timestamp units
+
     // Statistics
     DWORD packetsSent;
     DWORD rtcpPacketsSent;
@@ -968,6 +1015,13 @@ class RTP_UDP : public RTP_Session
     virtual PBoolean ReadData(RTP_DataFrame & frame, PBoolean loop);
     virtual PBoolean Internal_ReadData(RTP_DataFrame & frame, PBoolean loop);
 
+    /**Read a data frame from the RTP channel.
+       If the jitter buffer is threadless, any data frames waiting on the
+       socket are collected into it first, unless the reactor is already
+       doing so. This never blocks.
+      */
+    virtual PBoolean ReadBufferedData(RTP_DataFrame & frame);
+
     /** Write a data frame to the RTP channel.
       */
     virtual PBoolean WriteData(RTP_DataFrame & frame);
@@ -1077,7 +1131,70 @@ class RTP_UDP : public RTP_Session
     virtual int GetControlSocketHandle() const
     { return controlSocket != NULL ? controlSocket->GetHandle() : -1; }
 
+  /**@name Reactor support */
+  //@{
+    /**Set the shared reactor used to service the sockets of this session.
+       When a reactor is set, no thread blocks in WaitForPDU() for this
+       session. A reactor thread reads the data and control sockets, and
+       received data frames are queued for ReadData(), which keeps its
+       usual blocking semantics.
+
+       If the reactor cannot accept the session, or NULL is passed, the
+       session reverts to reading the sockets directly.
+      */
+    void SetReactor(
+      RTP_Reactor * reactor    ///<  Reactor to use, NULL to disable
+    );
+
+    /**Get the shared reactor servicing this session, if any.
+      */
+    RTP_Reactor * GetReactor() const { return m_reactor; }
+
+    /**Called from the reactor thread when a socket of this session has
+       data available. Data frames are processed by OnReceiveData() and
+       queued for ReadData(), control frames are processed immediately.
+      */
+    virtual void OnReactorReadable(
+      bool fromDataChannel   ///<  Data socket is readable, else control socket
+    );
+
+    /**Set a notifier called from the reactor thread whenever a data frame
+       is queued for ReadData(), or reading has stopped. This allows a
+       caller to only call ReadData() when it will not block.
+
+       Returns false if the session is not serviced by a reactor, as there
+       is then no way to indicate data is ready.
+      */
+    bool SetDataReadyNotifier(
+      const PNotifier & notifier   ///<  Notifier to call, NULL to clear
+    );
+
+    /**Indicate that ReadData() will return without blocking, that is a
+       data frame is queued, or reading has stopped.
+      */
+    bool IsDataReady();
+
+    /**Set the session that data frames received on this session are
+       relayed to, via RTP_Session::RelayData(), with the payload type
+       changed to the one given. Receiver statistics and RTCP reports are
+       still maintained by both sessions.
+
+       If the session is serviced by a reactor, frames are relayed by the
+       reactor thread as they arrive. Otherwise they are relayed from within
+       ReadData(), which does not return them. Setting a NULL session stops
+       the relay, waiting for any frame in the process of being relayed.
+
+       Returns true if the reactor relays the frames, so nothing need call
+       ReadData() while the relay is active.
+      */
+    bool SetRelaySession(
+      RTP_Session * session,                     ///<  Session to relay to, NULL to stop
+      RTP_DataFrame::PayloadTypes payloadType = RTP_DataFrame::IllegalPayloadType  ///<  Payload type for relayed frames
+    );
+  //@}
+
     friend class RTP_Encoding;
+    friend class RTP_Reactor;
 
     virtual int WaitForPDU(PUDPSocket & dataSocket, PUDPSocket & controlSocket, const PTimeInterval & timer);
     virtual int Internal_WaitForPDU(PUDPSocket & dataSocket, PUDPSocket & controlSocket, const PTimeInterval & timer);
@@ -1102,6 +1219,34 @@ class RTP_UDP : public RTP_Session
       bool toDataChannel
     );
 
+    /**Get the size of the last PDU read by ReadDataOrControlPDU().
+      */
+    PINDEX GetLastReadCount(
+      bool fromDataChannel    ///<  Data or control channel
+    ) const { return fromDataChannel ? m_lastDataReadCount : m_lastControlReadCount; }
+
+    /**Set the maximum number of datagrams read from the data socket with a
+       single system call (recvmmsg). The extra datagrams are buffered and
+       returned by subsequent calls to ReadDataOrControlPDU().
+
+       A value of one (the default) reads one datagram per system call.
+       Batching is only available on platforms supporting recvmmsg (Linux).
+       This should be set before the session starts reading.
+      */
+    void SetReceiveBatchSize(
+      unsigned packets    ///<  Maximum datagrams per system call
+    );
+
+    /**Get the maximum number of datagrams read from the data socket with a
+       single system call.
+      */
+    unsigned GetReceiveBatchSize() const;
+
+    /**Indicate there are datagrams already read from the data socket and
+       not yet returned by ReadDataOrControlPDU().
+      */
+    bool HasBatchedDataPDU() const;
+
 
   protected:
     PIPSocket::Address localAddress;
@@ -1125,6 +1270,139 @@ class RTP_UDP : public RTP_Session
     bool first;
     int  badTransmitCounter;
     PTime badTransmitStart;
+
+    PBoolean ReactorReadData(RTP_DataFrame & frame, PBoolean loop);
+    void SignalReactorData();
+    RTP_DataFrame GetReactorFrame();
+    void RecycleReactorFrame(const RTP_DataFrame & frame);
+    bool RelayReceivedData(RTP_DataFrame & frame);
+    bool PollReceivedData(RTP_JitterBuffer & jitter);
+
+    class ReceiveBatch;
+    ReceiveBatch * m_receiveBatch;
+    PINDEX         m_lastDataReadCount;
+    PINDEX         m_lastControlReadCount;
+
+    RTP_Reactor             * m_reactor;
+    PINDEX                    m_reactorIndex;
+    std::deque<RTP_DataFrame> m_reactorFrames;
+    std::vector<RTP_DataFrame> m_reactorFreeFrames;
+    PMutex                    m_reactorMutex;
+    PSyncPoint                m_reactorFramesAvailable;
+    bool                      m_reactorAborted;
+    PNotifier                 m_dataReadyNotifier;
+    PMutex                    m_dataReadyMutex;
+
+    RTP_Session                * m_relaySession;
+    RTP_DataFrame::PayloadTypes  m_relayPayloadType;
+    PMutex                       m_relayMutex;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+
+/**This class is a small, fixed pool of threads servicing the sockets of many
+   RTP_UDP sessions. Rather than every session parking a thread in
+   PSocket::Select(), each session is assigned to one reactor thread which
+   waits on all of its sessions at once using the operating system event
+   notification mechanism. Received packets are passed to
+   RTP_Session::OnReceiveData() and RTP_Session::OnReceiveControl() on the
+   reactor thread.
+
+   A session is always serviced by the same reactor thread, so packets for a
+   session are never processed concurrently or out of order.
+
+   This is only available where epoll is supported (Linux). Elsewhere
+   AddSession() fails and sessions use their own blocking read.
+  */
+class RTP_Reactor : public PObject
+{
+  PCLASSINFO(RTP_Reactor, PObject);
+
+  public:
+  /**@name Construction */
+  //@{
+    /**Create the reactor and start its threads.
+      */
+    RTP_Reactor(
+      unsigned threadCount = 0  ///<  Number of threads, zero is one per processor
+    );
+
+    /**Stop all the reactor threads.
+       All sessions should have been removed before this is called.
+      */
+    ~RTP_Reactor();
+  //@}
+
+  /**@name Operations */
+  //@{
+    /**Indicate the reactor is supported on this platform.
+      */
+    static bool IsAvailable();
+
+    /**Add the sockets of the session to the least loaded reactor thread.
+       The session sockets are set to non-blocking reads.
+      */
+    bool AddSession(
+      RTP_UDP & session   ///<  Session to service
+    );
+
+    /**Remove the session from the reactor. On return the session is
+       guaranteed not to be in use by a reactor thread, unless this is
+       called from that reactor thread itself.
+      */
+    void RemoveSession(
+      RTP_UDP & session   ///<  Session to remove
+    );
+
+    /**Get the number of reactor threads.
+      */
+    PINDEX GetThreadCount() const { return m_threads.size(); }
+
+    /**Get the total number of sessions being serviced.
+      */
+    PINDEX GetSessionCount() const;
+
+    /**Set transmit batching.
+       When maxPackets is greater than one, data PDUs written by sessions
+       serviced by the reactor are queued and sent by the reactor thread
+       using a single system call (sendmmsg) per socket. The queue is
+       flushed when it holds maxPackets datagrams, or when the oldest
+       datagram has waited maxLatency, whichever is first.
+
+       As sendmmsg operates on one socket, the queue of a reactor thread is
+       flushed with one call per socket that has datagrams pending, in a
+       single pass over all the sockets owned by that thread.
+      */
+    void SetTransmitBatching(
+      unsigned maxPackets,                ///<  Maximum datagrams queued
+      const PTimeInterval & maxLatency    ///<  Maximum time a datagram is queued
+    );
+
+    /**Indicate transmit batching is enabled.
+      */
+    bool IsTransmitBatching() const { return m_transmitBatchSize > 1; }
+
+    /**Queue a datagram for sending by the reactor thread servicing the
+       session. Returns false if it could not be queued, in which case the
+       caller should send it directly.
+      */
+    bool QueueTransmit(
+      RTP_UDP & session,                  ///<  Session sending datagram
+      PUDPSocket & socket,                ///<  Socket to send on
+      const BYTE * framePtr,              ///<  Datagram to send
+      PINDEX frameSize,                   ///<  Size of datagram
+      const PIPSocket::Address & address, ///<  Remote address
+      WORD port                           ///<  Remote port
+    );
+  //@}
+
+  protected:
+    class WorkerThread;
+    std::vector<WorkerThread *> m_threads;
+    PMutex                      m_threadsMutex;
+    unsigned                    m_transmitBatchSize;
+    PTimeInterval               m_transmitLatency;
 };
 
 /////////////////////////////////////////////////////////////////////////////
@@ -48,6 +48,62 @@
 #include <opal/connection.h>
 #include <sip/sippdu.h>
 
+#include <string>
+#include <vector>
+
+
+class SIPHandler;
+
+
+/** Hash table of handlers by a string key, used by SIPHandlersList.
+    Several handlers may have the same key. Each entry is kept by the
+    handler, so it can be removed without searching. This does no locking
+    of its own.
+  */
+class SIPHandlerIndex
+{
+  public:
+    struct Entry {
+      std::string  m_key;
+      unsigned     m_hash;
+      SIPHandler * m_handler;
+      Entry      * m_prev;
+      Entry      * m_next;
+    };
+
+    SIPHandlerIndex();
+    ~SIPHandlerIndex();
+
+    /**Add a handler with the key, returning its entry.
+      */
+    Entry * Insert(const std::string & key, SIPHandler * handler);
+
+    /**Remove an entry returned by Insert().
+      */
+    void Erase(Entry * entry);
+
+    /**Find the first entry with the key, NULL if none.
+      */
+    Entry * Find(const std::string & key) const;
+
+    /**Find the next entry with the same key as the one given, NULL if none.
+      */
+    Entry * FindNext(const Entry * entry) const;
+
+    size_t GetSize() const { return m_count; }
+
+  protected:
+    static unsigned Hash(const std::string & key);
+    void Rehash(size_t buckets);
+
+    std::vector<Entry *> m_buckets;
+    size_t               m_count;
+
+  private:
+    SIPHandlerIndex(const SIPHandlerIndex &) { }
+    void operator=(const SIPHandlerIndex &) { }
+};
+
 
 /* Class to handle SIP REGISTER, SUBSCRIBE, MESSAGE, and renew
  * the 'bindings' before they expire.
@@ -165,9 +221,13 @@ protected:
   OpalProductInfo             m_productInfo;
 
 public:
-  std::string                 m_userNameAndRealmKey;
-  std::string                 m_urlKey;
-  std::string                 m_urlAndPackageKey;
+  // Positions in the SIPHandlersList indexes, maintained by the list
+  SIPHandlerIndex::Entry    * m_byCallIdEntry;
+  SIPHandlerIndex::Entry    * m_byUserNameAndRealmEntry;
+  SIPHandlerIndex::Entry    * m_byRealmEntry;
+  SIPHandlerIndex::Entry    * m_byUrlEntry;
+  SIPHandlerIndex::Entry    * m_byUrlAndPackageEntry;
+  SIPHandlerIndex::Entry    * m_byDomainEntry;
   SIPMIMEInfo                 m_mime;
 };
 
@@ -338,9 +398,10 @@ public:
 };
 
 
-/** This dictionary is used both to contain the active and successful
- * registrations, and subscriptions. 
- */
+/** List of active handlers, with indexes for finding them.
+    The indexes are hash tables, read under a shared lock, so lookups run
+    concurrently and are constant time on average.
+  */
 class SIPHandlersList
 {
   public:
@@ -348,6 +409,11 @@ class SIPHandlersList
       */
     void Append(SIPHandler * handler);
 
+    /** Update the indexes after the user name or realm of a handler in the
+        list has changed.
+      */
+    void Update(SIPHandler * handler);
+
     /** Remove a handler from the list.
         Handler is not immediately deleted but marked for deletion later by
         DeleteObjectsToBeRemoved() when all references are done with the handler.
@@ -403,13 +469,18 @@ class SIPHandlersList
     PSafePtr <SIPHandler> FindSIPHandlerByDomain(const PString & name, SIP_PDU::Methods meth, PSafetyMode m);
 
   protected:
-    PMutex m_extraMutex;
+    void InsertAuthentication(SIPHandler * handler);
+    void EraseAuthentication(SIPHandler * handler);
+    PSafePtr<SIPHandler> FindFirst(const SIPHandlerIndex & index, const std::string & key, bool skipUnsubscribed = false);
+
+    PReadWriteMutex       m_indexMutex;
     PSafeList<SIPHandler> m_handlersList;
-    typedef std::map<std::string, PSafePtr<SIPHandler> > StringToHandlerMap;
-    StringToHandlerMap m_handlersByCallId;
-    StringToHandlerMap m_handlersByUserNameAndRealm;
-    StringToHandlerMap m_handlersByUrl;
-    StringToHandlerMap m_handlersByUrlAndPackage;
+    SIPHandlerIndex       m_handlersByCallId;
+    SIPHandlerIndex       m_handlersByUserNameAndRealm;
+    SIPHandlerIndex       m_handlersByRealm;
+    SIPHandlerIndex       m_handlersByUrl;
+    SIPHandlerIndex       m_handlersByUrlAndPackage;
+    SIPHandlerIndex       m_handlersByDomain;
 };
 
 
@@ -464,8 +464,8 @@ class SIPConnection : public OpalRTPConnection
     PString GetLocalPartyURL() const;
 
   protected:
-    PDECLARE_NOTIFIER(PTimer, SIPConnection, OnInviteResponseRetry);
-    PDECLARE_NOTIFIER(PTimer, SIPConnection, OnAckTimeout);
+    PDECLARE_NOTIFIER(SIPTimer, SIPConnection, OnInviteResponseRetry);
+    PDECLARE_NOTIFIER(SIPTimer, SIPConnection, OnAckTimeout);
 
     virtual RTP_UDP *OnUseRTPSession(
       const unsigned rtpSessionId,
@@ -543,8 +543,8 @@ class SIPConnection : public OpalRTPConnection
 
     std::map<SIP_PDU::Methods, unsigned> m_lastRxCSeq;
 
-    PTimer                    ackTimer;
-    PTimer                    ackRetry;
+    SIPTimer                  ackTimer;
+    SIPTimer                  ackRetry;
     SIP_PDU                   ackPacket;
     bool                      ackReceived;
     PSafePtr<SIPTransaction>  referTransaction;
@@ -44,11 +44,11 @@
 
 #if OPAL_SIP
 
-#include <ptclib/threadpool.h>
 #include <opal/rtpep.h>
 #include <sip/sipcon.h>
 #include <sip/sippdu.h>
 #include <sip/handlers.h> 
+#include <sip/siptimer.h>
 
 #if OPAL_HAS_SIPIM
 #include <im/sipim.h>
@@ -683,6 +683,20 @@ class SIPEndPoint : public OpalRTPEndPoint
 
     PSafePtr<SIPTransaction> GetTransaction(const PString & transactionID, PSafetyMode mode = PSafeReadWrite)
     { return transactions.FindWithLock(transactionID, mode); }
+
+    /**Get the timer wheel that runs the transaction timers.
+       The statistics from this give the number of timers and how late
+       they are being processed.
+     */
+    SIPTimerWheel & GetTimerWheel() { return m_timerWheel; }
+
+    /**Get the index of connection dialogs by Call-ID and tags.
+     */
+    SIPDialogIndex & GetDialogIndex() { return m_dialogIndex; }
+
+    /**Get the list of active registration, subscription etc handlers.
+     */
+    SIPHandlersList & GetHandlersList() { return activeSIPHandlers; }
     
     /**Return the next CSEQ for the next transaction.
      */
@@ -824,6 +838,8 @@ class SIPEndPoint : public OpalRTPEndPoint
     SIPHandlersList   activeSIPHandlers;
     PStringToString   m_receivedConnectionTokens;
 
+    SIPTimerWheel     m_timerWheel;   // Must be destroyed after transactions
+    SIPDialogIndex    m_dialogIndex;
     PSafeDictionary<PString, SIPTransaction> transactions;
 
     PTimer                  natBindingTimer;
@@ -832,8 +848,40 @@ class SIPEndPoint : public OpalRTPEndPoint
     int                     m_defaultAppearanceCode;
 
   public:
+    /**Queue of work with any number of producers and one consumer, which
+       does not use a mutex. Any thread may add work, only one thread at a
+       time may remove it, either the owner or one that has Claim()ed it.
+      */
+    class SIP_WorkQueue
+    {
+      public:
+        struct Node {
+          Node() : m_nextWork(NULL) { }
+          Node * volatile m_nextWork;
+        };
+
+        SIP_WorkQueue();
+
+        void Push(Node * node);
+        Node * Pop();
+
+        bool Claim();
+        void Release();
+
+        unsigned GetDepth() const { return m_depth > 0 ? (unsigned)(long)m_depth : 0; }
+
+      protected:
+        void Link(Node * node);
+
+        Node * volatile m_head;   // Most recently pushed
+        Node          * m_tail;   // Next to be popped
+        Node            m_stub;
+        PAtomicInteger  m_depth;
+        volatile long   m_claimed;
+    };
+
     class WorkThreadPool;
-    class SIP_Work
+    class SIP_Work : public SIP_WorkQueue::Node
     {
       public:
         SIP_Work(SIPEndPoint & ep, SIP_PDU * pdu);
@@ -850,10 +898,11 @@ class SIPEndPoint : public OpalRTPEndPoint
     class SIP_PDU_Work : public SIP_Work
     {
       public:
-        SIP_PDU_Work(SIPEndPoint & ep, const PString & token, SIP_PDU * pdu);
+        SIP_PDU_Work(SIPEndPoint & ep, const PString & token, SIP_PDU * pdu, bool inDialog = true);
         void Add(SIPEndPoint::WorkThreadPool & pool);
         virtual void Process();
         PString       m_token;
+        bool          m_inDialog;
     };
 
     class SIPResponseWork : public SIP_Work
@@ -865,32 +914,106 @@ class SIPEndPoint : public OpalRTPEndPoint
         PString m_transactionID;
     };
 
-    class WorkThreadPool : public PThreadPool<SIP_Work>
+    class SIP_Timer_Work : public SIP_Work
+    {
+      public:
+        SIP_Timer_Work(SIPEndPoint & ep, SIPTimerWheel::ExpiredList & expired);
+        void Add(SIPEndPoint::WorkThreadPool & pool);
+        void Process();
+        SIPTimerWheel::ExpiredList m_expired;
+    };
+
+  protected:
+    class SIP_Work_Thread;
+
+  public:
+    /**Pool of threads processing received PDUs and timers.
+       Each thread has its own queues. Work for a dialog is always given to
+       the thread selected by a hash of its Call-ID, so it is processed in
+       the order received. Other work, such as responses for REGISTER and
+       OPTIONS, goes to the least busy of two threads, and may be taken by
+       any thread that runs out of work of its own.
+      */
+    class WorkThreadPool
     {
       public:
-        virtual WorkerThreadBase * CreateWorkerThread();
+        WorkThreadPool(
+          unsigned threads = 0  ///< Number of threads, zero is one per processor
+        );
+        ~WorkThreadPool();
+
+        /**Add work that must be done in order with all other work for the key.
+          */
+        void AddWork(
+          SIP_Work * work,      ///< Work to do
+          const PString & key   ///< Call-ID of dialog
+        );
+
+        /**Add work that may be done on any thread.
+          */
+        void AddWork(
+          SIP_Work * work       ///< Work to do
+        );
+
+        /**Stop all threads, any work still queued is discarded.
+          */
+        void Shutdown();
+
+        struct ShardStatistics {
+          unsigned m_dialogDepth;   ///< Dialog work waiting
+          unsigned m_otherDepth;    ///< Work for any thread waiting
+          unsigned m_processed;     ///< Total work done by thread
+          unsigned m_stolen;        ///< Total work thread took from others
+        };
+
+        /**Get the queue depths and counts for each thread.
+          */
+        void GetStatistics(
+          std::vector<ShardStatistics> & statistics
+        ) const;
+
+        /**Get the number of threads, and so queues, work is spread over.
+          */
+        unsigned GetShardCount() const { return (unsigned)m_workers.size(); }
+
+      protected:
+        void AddOtherWork(SIP_Work * work);
+        SIP_Work * Steal(SIP_Work_Thread & thief);
+        void WakeIdle(SIP_Work_Thread & busy);
+
+        std::vector<SIP_Work_Thread *> m_workers;
+        PAtomicInteger                 m_nextChoice;
+        PAtomicInteger                 m_adding;    // Calls to AddWork() in progress
+        volatile bool                  m_shutdown;
+
+      friend class SIP_Work_Thread;
     } threadPool;
 
     virtual void AddWork(SIP_Work * work);
 
   protected:
-    typedef std::queue<SIP_Work *> SIP_WorkQueue;
-
-    class SIP_Work_Thread : public WorkThreadPool::WorkerThread
+    class SIP_Work_Thread : public PThread
     {
+        PCLASSINFO(SIP_Work_Thread, PThread);
       public:
-        SIP_Work_Thread(WorkThreadPool & pool_);
+        SIP_Work_Thread(WorkThreadPool & pool, unsigned index);
 
-        void AddWork(SIP_Work * work);
-        void RemoveWork(SIP_Work * work);
-        unsigned GetWorkSize() const;
+        void AddWork(SIP_Work * work, bool inDialog);
+        SIP_Work * TakeOther();
 
         void Main();
         void Shutdown();
 
-      protected:
-        PSyncPoint m_sync;
-        SIP_WorkQueue m_pduQueue;
+        WorkThreadPool & m_pool;
+        unsigned         m_index;
+        SIP_WorkQueue    m_dialogQueue;   // Only processed by this thread
+        SIP_WorkQueue    m_otherQueue;    // Processed by any thread
+        PAtomicInteger   m_pending;
+        PAtomicInteger   m_processed;
+        PAtomicInteger   m_stolen;
+        PSyncPoint       m_sync;
+        volatile bool    m_idle;          // Waiting on m_sync, a hint for giving out work to steal
+        bool             m_shutdown;
     };
 
     enum {
@@ -43,6 +43,7 @@
 #include <ptclib/mime.h>
 #include <ptclib/url.h>
 #include <sip/sdp.h>
+#include <sip/siptimer.h>
 #include <opal/rtpconn.h>
 
  
@@ -218,6 +219,7 @@ class SIPURL : public PURL
    PMIMEInfo::ReadFrom supports multi-line values if the next line starts
    with a space - it just appends the next line to the existing string
    with the separating space.
+   Parse() does the same directly from a received buffer.
    There is no checking of header names or values.
    compactForm decides whether 'Set' methods store full or compact headers.
    'Set' methods replace values, there is no method for appending except
@@ -246,6 +248,19 @@ class SIPMIMEInfo : public PMIMEInfo
     virtual void PrintOn(ostream & strm) const;
     virtual void ReadFrom(istream & strm);
 
+    /**Parse header fields directly from a buffer.
+       The fields are scanned in place up to and including the blank line
+       that ends them, with compact forms expanded as they are found. On
+       return data is after the blank line, or at the end of the buffer if
+       the fields run to it without one, as there is then no body.
+
+       Returns false if a field is malformed.
+      */
+    bool Parse(
+      const char * & data,  ///< Start of fields, updated to start of body
+      const char * end      ///< End of buffer
+    );
+
     void SetCompactForm(bool form) { compactForm = form; }
 
     PCaselessString GetContentType() const;
@@ -416,6 +431,8 @@ class SIPMIMEInfo : public PMIMEInfo
 	 */
     void SetRouteList(const char * name, const PStringList & v);
 
+    void AddField(const PCaselessString & name, const PString & value);
+
     /// Encode using compact form
     bool compactForm;
 };
@@ -701,6 +718,17 @@ class SIP_PDU : public PSafeObject
       OpalTransport & transport
     );
 
+    /**Parse a complete PDU from a buffer, e.g. a received datagram.
+       The start line and header fields are scanned in a single pass over
+       the buffer, without intermediate copies of the message.
+
+       Returns false if the PDU is malformed.
+      */
+    bool Parse(
+      const char * data,    ///< Start of PDU
+      PINDEX length         ///< Length of PDU in bytes
+    );
+
     /**Write the PDU to the transport.
       */
     PBoolean Write(
@@ -769,6 +797,66 @@ ostream & operator<<(ostream & strm, SIP_PDU::Methods method);
 #endif
 
 
+/////////////////////////////////////////////////////////////////////////
+// SIPDialogIndex
+
+/** Index of dialogs by Call-ID and tags.
+    This gives the token, usually of a SIPConnection, that owns a dialog
+    without having to search all of them. Entries are kept up to date by
+    SIPDialogContext instances bound to the index with SetIndex().
+  */
+class SIPDialogIndex : public PObject
+{
+    PCLASSINFO(SIPDialogIndex, PObject);
+  public:
+    SIPDialogIndex();
+
+    /**Add or change the dialog for a token.
+      */
+    void SetAt(
+      const PString & token,      ///< Token of dialog owner
+      const PString & callId,     ///< Call-ID of dialog
+      const PString & localTag,   ///< Local tag of dialog
+      const PString & remoteTag   ///< Remote tag of dialog
+    );
+
+    /**Remove the dialog for a token.
+      */
+    void RemoveAt(
+      const PString & token       ///< Token of dialog owner
+    );
+
+    /**Find the owner of the dialog with exactly the Call-ID and tags.
+       Returns empty string if there is none.
+      */
+    PString Find(
+      const PString & callId,     ///< Call-ID of dialog
+      const PString & localTag,   ///< Local tag of dialog
+      const PString & remoteTag   ///< Remote tag of dialog
+    ) const;
+
+    /**Find the owners of all dialogs with the Call-ID.
+      */
+    PStringList FindByCallID(
+      const PString & callId      ///< Call-ID of dialogs
+    ) const;
+
+    /**Get the number of dialogs indexed.
+      */
+    PINDEX GetSize() const;
+
+  protected:
+    void InternalRemove(const PString & token);
+
+    PDICTIONARY(TokensByCallID, PString, PStringList);
+
+    PStringToString m_dialogByToken;  // Token to Call-ID/tags key
+    PStringToString m_tokenByDialog;  // Call-ID/tags key to token
+    TokensByCallID  m_tokensByCallID;
+    PMutex          m_mutex;
+};
+
+
 /////////////////////////////////////////////////////////////////////////
 // SIPDialogContext
 
@@ -779,22 +867,26 @@ class SIPDialogContext
   public:
     SIPDialogContext();
 
+    /**Remove the dialog from the index it is bound to, if any.
+      */
+    ~SIPDialogContext();
+
     const PString & GetCallID() const { return m_callId; }
-    void SetCallID(const PString & id) { m_callId = id; }
+    void SetCallID(const PString & id) { m_callId = id; UpdateIndex(); }
 
     const SIPURL & GetRequestURI() const { return m_requestURI; }
     void SetRequestURI(const SIPURL & url) { m_requestURI = url; }
     bool SetRequestURI(const PString & uri) { return m_requestURI.Parse(uri); }
 
     const PString & GetLocalTag() const { return m_localTag; }
-    void SetLocalTag(const PString & tag) { m_localTag = tag; }
+    void SetLocalTag(const PString & tag) { m_localTag = tag; UpdateIndex(); }
 
     const SIPURL & GetLocalURI() const { return m_localURI; }
     void SetLocalURI(const SIPURL & url);
     bool SetLocalURI(const PString & uri);
 
     const PString & GetRemoteTag() const { return m_remoteTag; }
-    void SetRemoteTag(const PString & tag) { m_remoteTag = tag; }
+    void SetRemoteTag(const PString & tag) { m_remoteTag = tag; UpdateIndex(); }
 
     const SIPURL & GetRemoteURI() const { return m_remoteURI; }
     void SetRemoteURI(const SIPURL & url);
@@ -811,7 +903,18 @@ class SIPDialogContext
 
     bool IsEstablished() const { return !m_remoteTag.IsEmpty(); }
 
+    /**Keep an index up to date with the Call-ID and tags of this dialog.
+       A NULL index removes the entry for the token. A copy of a dialog
+       context is not bound to the index.
+      */
+    void SetIndex(
+      SIPDialogIndex * index,                     ///< Index to keep up to date
+      const PString & token = PString::Empty()    ///< Token of dialog owner
+    );
+
   protected:
+    void UpdateIndex();
+
     PString     m_callId;
     SIPURL      m_requestURI;
     SIPURL      m_localURI;
@@ -821,6 +924,18 @@ class SIPDialogContext
     PStringList m_routeSet;
     unsigned    m_lastSentCSeq;
     unsigned    m_lastReceivedCSeq;
+
+    struct IndexBinding {
+      IndexBinding() : m_index(NULL) { }
+      IndexBinding(const IndexBinding &) : m_index(NULL) { }
+      IndexBinding & operator=(const IndexBinding &) { return *this; }
+
+      SIPDialogIndex * m_index;
+      PString          m_token;
+      PString          m_callId;      // As last put in index
+      PString          m_localTag;
+      PString          m_remoteTag;
+    } m_indexBinding;
 };
 
 
@@ -891,8 +1006,8 @@ class SIPTransaction : public SIP_PDU
     bool SendPDU(SIP_PDU & pdu);
     bool ResendCANCEL();
 
-    PDECLARE_NOTIFIER(PTimer, SIPTransaction, OnRetry);
-    PDECLARE_NOTIFIER(PTimer, SIPTransaction, OnTimeout);
+    PDECLARE_NOTIFIER(SIPTimer, SIPTransaction, OnRetry);
+    PDECLARE_NOTIFIER(SIPTimer, SIPTransaction, OnTimeout);
 
     enum States {
       NotStarted,
@@ -918,8 +1033,8 @@ class SIPTransaction : public SIP_PDU
 
     States     state;
     unsigned   retry;
-    PTimer     retryTimer;
-    PTimer     completionTimer;
+    SIPTimer   retryTimer;
+    SIPTimer   completionTimer;
     PSyncPoint completed;
     PString              m_localInterface;
     OpalTransportAddress m_remoteAddress;
@@ -0,0 +1,255 @@
+/*
+ * siptimer.h
+ *
+ * Session Initiation Protocol transaction timers.
+ *
+ * Open Phone Abstraction Library (OPAL)
+ *
+ * Copyright (c) 2000 Equivalence Pty. Ltd.
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.0 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code is Open Phone Abstraction Library.
+ *
+ * The Initial Developer of the Original Code is Equivalence Pty. Ltd.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * $Revision$
+ * $Author$
+ * $Date$
+ */
+
+#ifndef OPAL_SIP_SIPTIMER_H
+#define OPAL_SIP_SIPTIMER_H
+
+#ifdef P_USE_PRAGMA
+#pragma interface
+#endif
+
+#include <opal/buildopts.h>
+
+#if OPAL_SIP
+
+#include <ptlib/safecoll.h>
+
+#include <vector>
+
+
+class SIPEndPoint;
+class SIPTimerWheel;
+
+
+/////////////////////////////////////////////////////////////////////////
+
+/**A timer for SIP transactions and connections, driven by a SIPTimerWheel.
+   This has the parts of the PTimer interface used by transactions, but
+   starting and stopping it is O(1) and does not involve the global PTLib
+   timer list. The notifier is called on one of the SIPEndPoint work
+   threads, while holding a reference to the owner object, so the owner
+   cannot be deleted while it runs.
+  */
+class SIPTimer : public PObject
+{
+    PCLASSINFO(SIPTimer, PObject);
+  public:
+    /**Create a timer for the owner object.
+      */
+    SIPTimer(
+      SIPTimerWheel & wheel,  ///< Wheel to run timer on
+      PSafeObject & owner     ///< Object notifier is called for
+    );
+
+    /**Destroy timer, stopping it.
+      */
+    ~SIPTimer();
+
+    /**Print the time the timer was last started with.
+      */
+    virtual void PrintOn(ostream & strm) const;
+
+    /**Start the timer as a one shot.
+      */
+    SIPTimer & operator=(
+      const PTimeInterval & interval  ///< Time until notifier is called
+    );
+
+    /**Start the timer as a one shot.
+      */
+    void SetInterval(
+      PInt64 milliseconds = 0,  ///< Number of milliseconds for interval.
+      long seconds = 0,         ///< Number of seconds for interval.
+      long minutes = 0,         ///< Number of minutes for interval.
+      long hours = 0,           ///< Number of hours for interval.
+      int days = 0              ///< Number of days for interval.
+    );
+
+    /**Stop the timer.
+       A notifier already queued to a work thread is not called, unless it
+       has started. The wait flag is for compatibility with PTimer, a
+       notifier that has started is never waited for.
+      */
+    void Stop(
+      bool wait = true
+    );
+
+    /**Get the time the timer was last started with.
+      */
+    const PTimeInterval & GetResetTime() const { return m_resetTime; }
+
+    /**Determine if the timer is waiting to expire.
+      */
+    bool IsRunning() const;
+
+    /**Set the function called when the timer expires.
+      */
+    void SetNotifier(
+      const PNotifier & notifier  ///< Function to call
+    ) { m_notifier = notifier; }
+
+  protected:
+    SIPTimerWheel & m_wheel;
+    PSafeObject   & m_owner;
+    PNotifier       m_notifier;
+    PTimeInterval   m_resetTime;
+
+    // Maintained by SIPTimerWheel under its mutex
+    SIPTimer     ** m_head;         // Slot of the wheel, NULL if not running
+    SIPTimer      * m_prev;
+    SIPTimer      * m_next;
+    PUInt64         m_expiry;       // In wheel ticks
+    PInt64          m_expiryTime;   // In milliseconds since wheel was created
+    unsigned        m_generation;   // Changed on every start and stop
+
+  friend class SIPTimerWheel;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+
+/**Hierarchical timing wheel for the SIP transaction timers.
+   The retry (A/E) and completion (B/F) timers of every client transaction,
+   and the 2xx retransmit and ACK wait timers of every INVITE answered by a
+   SIPConnection, are kept in this rather than the PTLib timer list, so
+   arming and cancelling them is constant time however many transactions
+   are in progress. The first level has a slot for each tick, and each
+   higher level covers a whole turn of the level below, its entries moving
+   down as their time approaches.
+
+   A thread advances the wheel each tick and passes the expired timers in
+   batches to the SIPEndPoint work threads, where the notifiers are called.
+  */
+class SIPTimerWheel : public PObject
+{
+    PCLASSINFO(SIPTimerWheel, PObject);
+  public:
+    enum {
+      DefaultTickMilliseconds = 10
+    };
+
+    /**Create a timer wheel for the endpoint.
+      */
+    SIPTimerWheel(
+      SIPEndPoint & endpoint,                          ///< Endpoint to do work on
+      unsigned tickMilliseconds = DefaultTickMilliseconds ///< Resolution of timers
+    );
+
+    /**Destroy the wheel, stopping its thread.
+      */
+    ~SIPTimerWheel();
+
+    /**Stop the thread advancing the wheel, no more timers will fire.
+      */
+    void ShutDown();
+
+    struct Statistics {
+      Statistics();
+
+      unsigned      m_active;         ///< Timers waiting to expire
+      PUInt64       m_started;        ///< Total times a timer was started
+      PUInt64       m_stopped;        ///< Total times a running timer was stopped
+      PUInt64       m_fired;          ///< Total notifiers called
+      PUInt64       m_stale;          ///< Expired timers restarted or stopped before their notifier was called
+      PUInt64       m_batches;        ///< Total batches passed to work threads
+      PTimeInterval m_totalLateness;  ///< Sum of time notifiers were called after expiry
+      PTimeInterval m_maxLateness;    ///< Longest time a notifier was called after expiry
+    };
+
+    /**Get the timer counts and lateness statistics.
+      */
+    void GetStatistics(
+      Statistics & statistics
+    ) const;
+
+    /**Get the timer resolution.
+      */
+    unsigned GetTickMilliseconds() const { return m_tickMilliseconds; }
+
+    struct Expired {
+      PSafePtr<PSafeObject> m_owner;
+      SIPTimer            * m_timer;
+      unsigned              m_generation;
+      PInt64                m_expiryTime;
+    };
+    typedef std::vector<Expired> ExpiredList;
+
+    /**Call the notifiers for expired timers.
+       This is called on a SIPEndPoint work thread.
+      */
+    void Fire(
+      ExpiredList & expired
+    );
+
+  protected:
+    void Start(SIPTimer & timer, const PTimeInterval & interval);
+    void Stop(SIPTimer & timer);
+    bool IsRunning(const SIPTimer & timer) const;
+
+    void Insert(SIPTimer & timer);
+    void Unlink(SIPTimer & timer);
+    unsigned Cascade(unsigned level);
+    void Advance(ExpiredList & expired);
+    void Dispatch(ExpiredList & expired);
+    PUInt64 GetElapsedTicks(PInt64 & elapsed) const;
+
+    PDECLARE_NOTIFIER(PThread, SIPTimerWheel, TickMain);
+
+    enum {
+      FirstLevelBits = 8,
+      LevelBits = 6,
+      NumLevels = 4,
+      FirstLevelSlots = 1 << FirstLevelBits,
+      LevelSlots = 1 << LevelBits,
+      BatchSize = 64
+    };
+
+    SIPEndPoint  & m_endpoint;
+    unsigned       m_tickMilliseconds;
+    PTimeInterval  m_baseTime;
+    PUInt64        m_currentTick;  // Next tick to be processed
+
+    SIPTimer     * m_firstLevel[FirstLevelSlots];
+    SIPTimer     * m_levels[NumLevels-1][LevelSlots];
+
+    PMutex         m_mutex;
+    Statistics     m_statistics;
+
+    PThread      * m_thread;
+    PSyncPoint     m_shutdownSync;
+    bool           m_shuttingDown;
+
+  friend class SIPTimer;
+};
+
+
+#endif // OPAL_SIP
+
+#endif // OPAL_SIP_SIPTIMER_H
@@ -0,0 +1,549 @@
+/*
+ * benchmark.cxx
+ *
+ * OPAL application source file for testing codecs
+ *
+ * Headless throughput benchmark of all registered transcoders.
+ *
+ * Copyright (c) 2007 Equivalence Pty. Ltd.
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.0 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code is Portable Windows Library.
+ *
+ * The Initial Developer of the Original Code is Equivalence Pty. Ltd.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * $Revision$
+ * $Author$
+ * $Date$
+ */
+
+#include "precompile.h"
+#include "main.h"
+
+#include <codec/opalwavfile.h>
+
+#include <math.h>
+
+#if defined(_WIN32) || defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+
+static const unsigned AudioPacketTime = 20;   // Milliseconds of audio in each input frame
+static const unsigned InstanceCount = 4;      // Transcoders created to measure memory use
+
+
+// Bytes allocated from the C run time heap, or -1 if it cannot be determined
+static PInt64 GetHeapInUse()
+{
+#if defined(_WIN32)
+  PInt64 total = 0;
+  _HEAPINFO info;
+  info._pentry = NULL;
+  while (_heapwalk(&info) == _HEAPOK) {
+    if (info._useflag == _USEDENTRY)
+      total += info._size;
+  }
+  return total;
+#elif defined(__GLIBC__)
+  struct mallinfo info = mallinfo();
+  return (PInt64)(unsigned)info.uordblks + (unsigned)info.hblkhd;
+#else
+  return -1;
+#endif
+}
+
+
+static PString JSONString(const PString & str)
+{
+  PString escaped = '"';
+  for (PINDEX i = 0; i < str.GetLength(); ++i) {
+    if (str[i] == '"' || str[i] == '\\')
+      escaped += '\\';
+    escaped += str[i];
+  }
+  return escaped + '"';
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+BenchmarkThread::BenchmarkThread(OpalTranscoder * transcoder, const BenchmarkInput & input, const PTimeInterval & duration)
+  : PThread(65536, NoAutoDeleteThread, NormalPriority, "Benchmark")
+  , m_transcoder(transcoder)
+  , m_duration(duration)
+  , m_frames(0)
+  , m_failures(0)
+{
+  /* Each thread gets its own copy of the data, so there is no contention on
+     the reference counts of shared buffers while measuring. */
+  for (BenchmarkInput::const_iterator unit = input.begin(); unit != input.end(); ++unit) {
+    RTP_DataFrameList * frames = new RTP_DataFrameList;
+    for (RTP_DataFrameList::const_iterator frame = unit->begin(); frame != unit->end(); ++frame)
+      frames->Append(new RTP_DataFrame((const BYTE *)*frame, frame->GetHeaderSize()+frame->GetPayloadSize()));
+    m_input.Append(frames);
+  }
+}
+
+
+BenchmarkThread::~BenchmarkThread()
+{
+  delete m_transcoder;
+}
+
+
+void BenchmarkThread::Main()
+{
+  RTP_DataFrameList output;
+  PTimeInterval start = PTimer::Tick();
+
+  do {
+    for (BenchmarkInput::iterator unit = m_input.begin(); unit != m_input.end(); ++unit) {
+      for (RTP_DataFrameList::iterator frame = unit->begin(); frame != unit->end(); ++frame) {
+        if (!m_transcoder->ConvertFrames(*frame, output))
+          ++m_failures;
+      }
+      ++m_frames;
+    }
+    m_elapsed = PTimer::Tick() - start;
+  } while (m_elapsed < m_duration);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+CodecBenchmark::CodecBenchmark()
+  : m_maxThreads(1)
+  , m_duration(0, 2)
+  , m_wavRate(0)
+  , m_width(PVideoFrameInfo::CIFWidth)
+  , m_height(PVideoFrameInfo::CIFHeight)
+  , m_frameRate(25)
+  , m_json(false)
+  , m_output(&cout)
+  , m_results(0)
+{
+}
+
+
+bool CodecBenchmark::Initialise(PArgList & args)
+{
+  for (PINDEX i = 0; i < args.GetCount(); i++) {
+    OpalMediaFormat mediaFormat = args[i];
+    if (mediaFormat.IsEmpty()) {
+      cerr << "Unknown media format name \"" << args[i] << '"' << endl;
+      return false;
+    }
+    m_formats.AppendString(mediaFormat.GetName());
+  }
+
+  if (args.HasOption('S'))
+    m_maxThreads = std::max(1U, args.GetOptionString('S').AsUnsigned());
+
+  if (args.HasOption("bench-time")) {
+    unsigned seconds = args.GetOptionString("bench-time").AsUnsigned();
+    if (seconds == 0) {
+      cerr << "Illegal benchmark time \"" << args.GetOptionString("bench-time") << '"' << endl;
+      return false;
+    }
+    m_duration.SetInterval(0, seconds);
+  }
+
+  if (args.HasOption("frame-size")) {
+    PString sizeString = args.GetOptionString("frame-size");
+    if (!PVideoFrameInfo::ParseSize(sizeString, m_width, m_height)) {
+      cerr << "Illegal video frame size \"" << sizeString << '"' << endl;
+      return false;
+    }
+  }
+
+  if (args.HasOption("frame-rate")) {
+    m_frameRate = args.GetOptionString("frame-rate").AsUnsigned();
+    if (m_frameRate == 0 || m_frameRate > 100) {
+      cerr << "Illegal video frame rate \"" << args.GetOptionString("frame-rate") << '"' << endl;
+      return false;
+    }
+  }
+
+  if (args.HasOption("bench-input")) {
+    PFilePath filename = args.GetOptionString("bench-input");
+    OpalWAVFile wavFile(filename, PFile::ReadOnly);
+    if (!wavFile.IsOpen()) {
+      cerr << "Could not open WAV file \"" << filename << '"' << endl;
+      return false;
+    }
+    if (wavFile.GetChannels() != 1 || wavFile.GetSampleSize() != 16) {
+      cerr << "WAV file \"" << filename << "\" must be 16 bit mono" << endl;
+      return false;
+    }
+    m_wavRate = wavFile.GetSampleRate();
+    PINDEX samples = (PINDEX)(wavFile.GetDataLength()/sizeof(short));
+    if (samples == 0 || !wavFile.Read(m_wavSamples.GetPointer(samples), samples*sizeof(short))) {
+      cerr << "Could not read WAV file \"" << filename << '"' << endl;
+      return false;
+    }
+    m_wavSamples.SetSize(wavFile.GetLastReadCount()/sizeof(short));
+  }
+
+  PCaselessString format = args.GetOptionString("bench-format", "csv");
+  if (format == "json")
+    m_json = true;
+  else if (format != "csv") {
+    cerr << "Illegal benchmark output format \"" << format << '"' << endl;
+    return false;
+  }
+
+  if (args.HasOption("bench-output")) {
+    PFilePath filename = args.GetOptionString("bench-output");
+    if (!m_file.Open(filename, PFile::WriteOnly)) {
+      cerr << "Could not create benchmark output file \"" << filename << '"' << endl;
+      return false;
+    }
+    m_output = &m_file;
+  }
+
+  // Make sure the plugin codecs are loaded and their transcoders registered
+  if (PFactory<PPluginModuleManager>::CreateInstanceAs<OpalPluginCodecManager>("OpalPluginCodecManager") == NULL) {
+    cerr << "error: Cannot get codec manager" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+void CodecBenchmark::Run()
+{
+  if (m_json)
+    *m_output << "[\n";
+  else
+    *m_output << "source,destination,threads,frames,failures,frames_per_second,"
+                 "us_per_frame,channels_per_core,bytes_per_instance\n";
+
+  OpalTranscoderList availableTranscoders = OpalTranscoderFactory::GetKeyList();
+  for (OpalTranscoderIterator it = availableTranscoders.begin(); it != availableTranscoders.end(); ++it) {
+    if (!m_formats.IsEmpty() &&
+         m_formats.GetStringsIndex(it->first) == P_MAX_INDEX &&
+         m_formats.GetStringsIndex(it->second) == P_MAX_INDEX)
+      continue;
+
+    OpalMediaFormat srcFormat = it->first;
+    OpalMediaFormat dstFormat = it->second;
+    if (srcFormat.IsValid() && dstFormat.IsValid())
+      Measure(srcFormat, dstFormat);
+  }
+
+  if (m_json)
+    *m_output << "\n]\n";
+  m_output->flush();
+
+  cerr << "Benchmark complete, " << m_results << " results." << endl;
+}
+
+
+OpalMediaFormat CodecBenchmark::AdjustFormat(const OpalMediaFormat & mediaFormat) const
+{
+  OpalMediaFormat adjustedFormat = mediaFormat;
+  if (mediaFormat.GetMediaType() == OpalMediaType::Video()) {
+    adjustedFormat.SetOptionInteger(OpalVideoFormat::FrameWidthOption(), m_width);
+    adjustedFormat.SetOptionInteger(OpalVideoFormat::FrameHeightOption(), m_height);
+    adjustedFormat.SetOptionInteger(OpalVideoFormat::FrameTimeOption(), mediaFormat.GetClockRate()/m_frameRate);
+  }
+  return adjustedFormat;
+}
+
+
+OpalTranscoder * CodecBenchmark::CreateTranscoder(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat) const
+{
+  OpalTranscoder * transcoder = OpalTranscoder::Create(srcFormat, dstFormat);
+  if (transcoder != NULL && srcFormat.GetMediaType() == OpalMediaType::Video())
+    transcoder->UpdateMediaFormats(AdjustFormat(srcFormat), AdjustFormat(dstFormat));
+  return transcoder;
+}
+
+
+bool CodecBenchmark::CreateRawAudio(unsigned clockRate, PShortArray & samples) const
+{
+  // One second of audio, looped by the benchmark threads
+  samples.SetSize(clockRate);
+
+  PShortArray wavSamples = m_wavSamples;
+  if (m_wavRate != 0 && m_wavRate != clockRate) {
+    OpalMediaFormat wavFormat = OpalAudioFormat::GetPCM16(m_wavRate);
+    OpalTranscoder * resampler = wavFormat.IsValid() ? OpalTranscoder::Create(wavFormat, OpalAudioFormat::GetPCM16(clockRate)) : NULL;
+    if (resampler == NULL) {
+      cerr << "Cannot convert WAV file from " << m_wavRate << " to " << clockRate << "Hz, using synthetic audio." << endl;
+      wavSamples.SetSize(0);
+    }
+    else {
+      RTP_DataFrame wavFrame(m_wavSamples.GetSize()*sizeof(short));
+      memcpy(wavFrame.GetPayloadPtr(), (const short *)m_wavSamples, m_wavSamples.GetSize()*sizeof(short));
+      RTP_DataFrame resampled;
+      if (resampler->Convert(wavFrame, resampled))
+        wavSamples = PShortArray((const short *)resampled.GetPayloadPtr(), resampled.GetPayloadSize()/sizeof(short));
+      else
+        wavSamples.SetSize(0);
+      delete resampler;
+    }
+  }
+
+  PINDEX i;
+  if (wavSamples.IsEmpty()) {
+    // A tone with some noise, so codecs have something to work on
+    for (i = 0; i < (PINDEX)clockRate; ++i)
+      samples[i] = (short)(8000*sin(i*2*M_PI*440/clockRate) + (rand()%2001) - 1000);
+  }
+  else {
+    for (i = 0; i < (PINDEX)clockRate; ++i)
+      samples[i] = wavSamples[i%wavSamples.GetSize()];
+  }
+
+  return true;
+}
+
+
+bool CodecBenchmark::CreateInput(const OpalMediaFormat & srcFormat, BenchmarkInput & input, double & unitTime) const
+{
+  OpalMediaFormat rawFormat;
+  RTP_DataFrameList rawFrames;
+
+  if (srcFormat.GetMediaType() == OpalMediaType::Audio()) {
+    rawFormat = OpalAudioFormat::GetPCM16(srcFormat.GetClockRate());
+    if (!rawFormat.IsValid())
+      return false;
+
+    PShortArray samples;
+    if (!CreateRawAudio(srcFormat.GetClockRate(), samples))
+      return false;
+
+    PINDEX samplesPerFrame = srcFormat.GetClockRate()*AudioPacketTime/1000;
+    for (PINDEX offset = 0; offset+samplesPerFrame <= samples.GetSize(); offset += samplesPerFrame) {
+      RTP_DataFrame * frame = new RTP_DataFrame(samplesPerFrame*sizeof(short));
+      frame->SetPayloadType(rawFormat.GetPayloadType());
+      frame->SetTimestamp(offset);
+      memcpy(frame->GetPayloadPtr(), (const short *)samples + offset, samplesPerFrame*sizeof(short));
+      rawFrames.Append(frame);
+    }
+    unitTime = AudioPacketTime*1000.0;
+  }
+  else if (srcFormat.GetMediaType() == OpalMediaType::Video()) {
+    rawFormat = OpalYUV420P;
+
+    // One second of a moving gradient with some noise
+    PINDEX planeSize = m_width*m_height;
+    for (unsigned f = 0; f < m_frameRate; ++f) {
+      RTP_DataFrame * frame = new RTP_DataFrame(sizeof(OpalVideoTranscoder::FrameHeader) + planeSize*3/2);
+      frame->SetPayloadType(rawFormat.GetPayloadType());
+      frame->SetTimestamp(f*OpalMediaFormat::VideoClockRate/m_frameRate);
+      frame->SetMarker(true);
+      OpalVideoTranscoder::FrameHeader * header = (OpalVideoTranscoder::FrameHeader *)frame->GetPayloadPtr();
+      header->x = header->y = 0;
+      header->width = m_width;
+      header->height = m_height;
+      BYTE * yuv = OPAL_VIDEO_FRAME_DATA_PTR(header);
+      for (unsigned y = 0; y < m_height; ++y) {
+        for (unsigned x = 0; x < m_width; ++x)
+          *yuv++ = (BYTE)(((x + y + f*4)&0xff)/2 + rand()%32);
+      }
+      for (PINDEX c = 0; c < planeSize/2; ++c)
+        *yuv++ = (BYTE)(128 + (c + f*2)%64 - 32);
+      rawFrames.Append(frame);
+    }
+    unitTime = 1000000.0/m_frameRate;
+  }
+  else
+    return false;
+
+  if (srcFormat == rawFormat) {
+    for (RTP_DataFrameList::iterator frame = rawFrames.begin(); frame != rawFrames.end(); ++frame) {
+      RTP_DataFrameList * unit = new RTP_DataFrameList;
+      unit->Append(new RTP_DataFrame(*frame));
+      input.Append(unit);
+    }
+    return true;
+  }
+
+  // Encode the raw media once, each input frame is what one raw frame produced
+  OpalTranscoder * encoder = CreateTranscoder(rawFormat, srcFormat);
+  if (encoder == NULL)
+    return false;
+
+  unsigned rawCount = 0;
+  for (RTP_DataFrameList::iterator frame = rawFrames.begin(); frame != rawFrames.end(); ++frame) {
+    RTP_DataFrameList * unit = new RTP_DataFrameList;
+    if (encoder->ConvertFrames(*frame, *unit) && !unit->IsEmpty())
+      input.Append(unit);
+    else
+      delete unit;
+    ++rawCount;
+  }
+  delete encoder;
+
+  if (input.IsEmpty())
+    return false;
+
+  // Some encoders buffer several raw frames into one output
+  unitTime *= (double)rawCount/input.GetSize();
+  return true;
+}
+
+
+PInt64 CodecBenchmark::MeasureInstanceMemory(const OpalMediaFormat & srcFormat,
+                                             const OpalMediaFormat & dstFormat,
+                                             const BenchmarkInput & input) const
+{
+  OpalTranscoder * transcoders[InstanceCount];
+  RTP_DataFrameList output;
+
+  // Warm up once, so one off allocations in the codec library are not counted
+  OpalTranscoder * transcoder = CreateTranscoder(srcFormat, dstFormat);
+  if (transcoder == NULL)
+    return -1;
+  transcoder->ConvertFrames(input.front().front(), output);
+  delete transcoder;
+  output.RemoveAll();
+
+  PInt64 before = GetHeapInUse();
+  if (before < 0)
+    return -1;
+
+  // Many codecs allocate their state on the first frame, so convert one each
+  unsigned i;
+  for (i = 0; i < InstanceCount; ++i) {
+    transcoders[i] = CreateTranscoder(srcFormat, dstFormat);
+    if (transcoders[i] != NULL) {
+      transcoders[i]->ConvertFrames(input.front().front(), output);
+      output.RemoveAll();
+    }
+  }
+
+  PInt64 after = GetHeapInUse();
+
+  for (i = 0; i < InstanceCount; ++i)
+    delete transcoders[i];
+
+  return after > before ? (after - before)/InstanceCount : 0;
+}
+
+
+void CodecBenchmark::Measure(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat)
+{
+  BenchmarkInput input;
+  double unitTime;
+  if (!CreateInput(srcFormat, input, unitTime)) {
+    cerr << "Skipping " << srcFormat << " to " << dstFormat << ", cannot create input media." << endl;
+    return;
+  }
+
+  PInt64 bytesPerInstance = MeasureInstanceMemory(srcFormat, dstFormat, input);
+
+  unsigned threadCount = 1;
+  for (;;) {
+    cerr << "Benchmarking " << srcFormat << " to " << dstFormat << " on " << threadCount << " thread(s)" << endl;
+
+    PList<BenchmarkThread> threads;
+    unsigned i;
+    for (i = 0; i < threadCount; ++i) {
+      OpalTranscoder * transcoder = CreateTranscoder(srcFormat, dstFormat);
+      if (transcoder == NULL) {
+        cerr << "Skipping " << srcFormat << " to " << dstFormat << ", cannot create transcoder." << endl;
+        return;
+      }
+      threads.Append(new BenchmarkThread(transcoder, input, m_duration));
+    }
+
+    for (i = 0; i < threadCount; ++i)
+      threads[i].Resume();
+
+    PUInt64 frames = 0;
+    PUInt64 failures = 0;
+    double framesPerSecond = 0;
+    double totalElapsed = 0;
+    for (i = 0; i < threadCount; ++i) {
+      threads[i].WaitForTermination();
+      double elapsed = threads[i].m_elapsed.GetMilliSeconds()/1000.0;
+      frames += threads[i].m_frames;
+      failures += threads[i].m_failures;
+      if (elapsed > 0)
+        framesPerSecond += threads[i].m_frames/elapsed;
+      totalElapsed += elapsed;
+    }
+
+    /* Real time channels is the media time each thread got through in a
+       second of work, which is per core while there are no more threads
+       than cores. A run with no input frames gets zero for both. */
+    double microsecondsPerFrame = frames > 0 ? totalElapsed*1000000/frames : 0;
+    double channelsPerCore = microsecondsPerFrame > 0 ? unitTime/microsecondsPerFrame : 0;
+
+    OutputResult(srcFormat, dstFormat, threadCount, frames, failures,
+                 framesPerSecond, microsecondsPerFrame, channelsPerCore, bytesPerInstance);
+
+    if (threadCount >= m_maxThreads)
+      break;
+    threadCount = std::min(threadCount*2, m_maxThreads);
+  }
+}
+
+
+void CodecBenchmark::OutputResult(const OpalMediaFormat & srcFormat,
+                                  const OpalMediaFormat & dstFormat,
+                                  unsigned threads,
+                                  PUInt64 frames,
+                                  PUInt64 failures,
+                                  double framesPerSecond,
+                                  double microsecondsPerFrame,
+                                  double channelsPerCore,
+                                  PInt64 bytesPerInstance)
+{
+  ostream & strm = *m_output;
+  strm << setprecision(2) << setiosflags(ios::fixed);
+
+  if (m_json) {
+    if (m_results > 0)
+      strm << ",\n";
+    strm << "  { \"source\": " << JSONString(srcFormat.GetName())
+         << ", \"destination\": " << JSONString(dstFormat.GetName())
+         << ", \"threads\": " << threads
+         << ", \"frames\": " << frames
+         << ", \"failures\": " << failures
+         << ", \"frames_per_second\": " << framesPerSecond
+         << ", \"us_per_frame\": " << microsecondsPerFrame
+         << ", \"channels_per_core\": " << channelsPerCore
+         << ", \"bytes_per_instance\": ";
+    if (bytesPerInstance < 0)
+      strm << "null";
+    else
+      strm << bytesPerInstance;
+    strm << " }";
+  }
+  else {
+    strm << srcFormat << ',' << dstFormat << ','
+         << threads << ','
+         << frames << ','
+         << failures << ','
+         << framesPerSecond << ','
+         << microsecondsPerFrame << ','
+         << channelsPerCore << ',';
+    if (bytesPerInstance >= 0)
+      strm << bytesPerInstance;
+    strm << '\n';
+  }
+
+  strm << resetiosflags(ios::fixed);
+  strm.flush();
+  ++m_results;
+}
+
+
+// End of File ///////////////////////////////////////////////////////////////
@@ -93,6 +93,11 @@ void CodecTest::Main()
              "-noprompt."
              "-snr."
              "-list."
+             "-benchmark."
+             "-bench-time:"
+             "-bench-input:"
+             "-bench-format:"
+             "-bench-output:"
 #if PTRACING
              "o-output:"             "-no-output."
              "t-trace."              "-no-trace."
@@ -142,6 +147,13 @@ void CodecTest::Main()
     return;
   }
 
+  if (args.HasOption("benchmark")) {
+    CodecBenchmark benchmark;
+    if (benchmark.Initialise(args))
+      benchmark.Run();
+    return;
+  }
+
   if (args.HasOption('h') || args.GetCount() == 0) {
     PError << "usage: " << GetFile().GetTitle() << " [ options ] fmtname [ fmtname ]\n"
               "  where fmtname is the Media Format Name for the codec(s) to test, up to two\n"
@@ -179,6 +191,15 @@ void CodecTest::Main()
               "  --snr                   : calculate signal-to-noise ratio between input and output\n"
               "  -i --info               : display per-frame info (use multiple times for more info)\n"
               "  --list                  : list all available plugin codecs\n"
+              "\n"
+              "Benchmark mode runs every transcoder, or those to or from the fmtname\n"
+              "arguments, without any devices. A frame is 20ms of audio or one video\n"
+              "frame of the -s and -r size and rate, and -S sets the most threads.\n"
+              "  --benchmark             : measure transcoder throughput\n"
+              "  --bench-time secs       : time to run each transcoder, default 2\n"
+              "  --bench-input file      : WAV file for audio input, default is a tone\n"
+              "  --bench-format fmt      : results as \"csv\" (default) or \"json\"\n"
+              "  --bench-output file     : file for results, default is stdout\n"
 #if PTRACING
               "  -o or --output file     : file name for output of log messages\n"       
               "  -t or --trace           : degree of verbosity in error log (more times for more detail)\n"     
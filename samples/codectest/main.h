@@ -184,6 +184,66 @@ class VideoThread : public TranscoderThread
 };
 
 
+PLIST(BenchmarkInput, RTP_DataFrameList);
+
+class BenchmarkThread : public PThread
+{
+  PCLASSINFO(BenchmarkThread, PThread);
+  public:
+    BenchmarkThread(OpalTranscoder * transcoder, const BenchmarkInput & input, const PTimeInterval & duration);
+    ~BenchmarkThread();
+
+    virtual void Main();
+
+    OpalTranscoder * m_transcoder;
+    BenchmarkInput   m_input;
+    PTimeInterval    m_duration;
+    PTimeInterval    m_elapsed;
+    PUInt64          m_frames;
+    PUInt64          m_failures;
+};
+
+
+class CodecBenchmark
+{
+  public:
+    CodecBenchmark();
+
+    bool Initialise(PArgList & args);
+    void Run();
+
+  protected:
+    OpalMediaFormat AdjustFormat(const OpalMediaFormat & mediaFormat) const;
+    OpalTranscoder * CreateTranscoder(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat) const;
+    bool CreateRawAudio(unsigned clockRate, PShortArray & samples) const;
+    bool CreateInput(const OpalMediaFormat & srcFormat, BenchmarkInput & input, double & unitTime) const;
+    PInt64 MeasureInstanceMemory(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat, const BenchmarkInput & input) const;
+    void Measure(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat);
+    void OutputResult(const OpalMediaFormat & srcFormat,
+                      const OpalMediaFormat & dstFormat,
+                      unsigned threads,
+                      PUInt64 frames,
+                      PUInt64 failures,
+                      double framesPerSecond,
+                      double microsecondsPerFrame,
+                      double channelsPerCore,
+                      PInt64 bytesPerInstance);
+
+    PStringList   m_formats;
+    unsigned      m_maxThreads;
+    PTimeInterval m_duration;
+    PShortArray   m_wavSamples;
+    unsigned      m_wavRate;
+    unsigned      m_width;
+    unsigned      m_height;
+    unsigned      m_frameRate;
+    bool          m_json;
+    PTextFile     m_file;
+    ostream     * m_output;
+    unsigned      m_results;
+};
+
+
 class CodecTest : public PProcess
 {
   PCLASSINFO(CodecTest, PProcess)
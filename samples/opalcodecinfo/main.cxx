@@ -29,6 +29,7 @@
 #include <ptlib.h>
 
 #include <opal/transcoders.h>
+#include <opal/opalmixer.h>
 #include <codec/opalplugin.h>
 #include <codec/opalpluginmgr.h>
 #include <codec/vidcodec.h>
@@ -499,6 +500,129 @@ void AudioTest(const PString & fmtName)
 }
 
 
+static void BenchmarkConvert(const char * name, OpalTranscoder & transcoder,
+                             const RTP_DataFrame & input, RTP_DataFrame & output, PINDEX samples)
+{
+  // Run for at least a second so the tick resolution does not matter
+  PINDEX frames = 0;
+  PTimeInterval start = PTimer::Tick();
+  PTimeInterval elapsed;
+  do {
+    for (PINDEX i = 0; i < 1000; i++) {
+      if (!transcoder.Convert(input, output)) {
+        cout << "error: " << name << " conversion failed!" << endl;
+        return;
+      }
+    }
+    frames += 1000;
+    elapsed = PTimer::Tick() - start;
+  } while (elapsed < 1000);
+
+  double ns = elapsed.GetMilliSeconds()*1000000.0;
+  cout << "   " << name << ": " << frames << " frames of " << samples << " samples in " << elapsed << "s, "
+       << ns/frames << " ns/frame, " << (double)frames*samples/ns << " samples/ns" << endl;
+}
+
+
+void AudioBenchmark(const PString & fmtName)
+{
+  OpalMediaFormat mediaFormat = fmtName;
+  if (mediaFormat.IsEmpty() || mediaFormat.GetMediaType() != OpalMediaType::Audio()) {
+    cout << "error: cannot use format name \"" << fmtName << '"' << endl;
+    return;
+  }
+
+  std::auto_ptr<OpalTranscoder> encoder(OpalTranscoder::Create(OpalPCM16, mediaFormat));
+  std::auto_ptr<OpalTranscoder> decoder(OpalTranscoder::Create(mediaFormat, OpalPCM16));
+  if (encoder.get() == NULL || decoder.get() == NULL) {
+    cout << "error: Encoder or decoder cannot be instantiated!" << endl;
+    return;
+  }
+
+  PINDEX decBlkSize = encoder->GetOptimalDataFrameSize(PTrue);
+  PINDEX samples = decBlkSize/2;
+
+  PTones tones("440:1.0");
+  RTP_DataFrame source(decBlkSize), output(decBlkSize);
+  memcpy(source.GetPayloadPtr(), &tones[0], PMIN(decBlkSize, tones.GetSize()*2));
+
+  RTP_DataFrame encoded(PMAX(encoder->GetOptimalDataFrameSize(PFalse), decoder->GetOptimalDataFrameSize(PTrue)));
+  encoded.SetPayloadType(mediaFormat.GetPayloadType());
+  if (!encoder->Convert(source, encoded)) {
+    cout << "error: Encoder conversion failed!" << endl;
+    return;
+  }
+
+  cout << "Benchmark of " << mediaFormat << ':' << endl;
+  BenchmarkConvert("Encoder", *encoder, source, encoded, samples);
+  BenchmarkConvert("Decoder", *decoder, encoded, output, samples);
+}
+
+
+class BenchmarkAudioMixer : public OpalAudioMixer
+{
+  public:
+    BenchmarkAudioMixer()
+      : OpalAudioMixer(false, OpalMediaFormat::AudioClockRate, false, 20)
+    { }
+
+    // Same work as OpalMixerNode does per tick: full mix then mix minus each participant
+    void Tick(const RTP_DataFrame & input, RTP_DataFrame & output)
+    {
+      for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end(); ++iter)
+        iter->second->QueuePacket(input);
+
+      PWaitAndSignal mutex(m_mutex);
+      PreMixStreams();
+      for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end(); ++iter) {
+        output.SetPayloadSize(0);
+        MixAdditive(output, ((AudioStream *)iter->second)->m_cacheSamples);
+      }
+    }
+};
+
+
+void MixerBenchmark(const PString & countStr)
+{
+  unsigned maxParticipants = countStr.AsUnsigned();
+  if (maxParticipants == 0) {
+    cout << "error: invalid participant count \"" << countStr << '"' << endl;
+    return;
+  }
+
+  PTones tones("440:1.0");
+  cout << "Benchmark of audio mixer, 20ms ticks at " << OpalMediaFormat::AudioClockRate << "Hz:" << endl;
+
+  for (unsigned participants = 1; participants <= maxParticipants; participants *= 2) {
+    BenchmarkAudioMixer mixer;
+    for (unsigned i = 0; i < participants; ++i)
+      mixer.AddStream(psprintf("%u", i));
+
+    PINDEX size = mixer.GetPeriodTS()*sizeof(short);
+    RTP_DataFrame input(size), output(size);
+    memcpy(input.GetPayloadPtr(), &tones[0], PMIN(size, tones.GetSize()*2));
+
+    PINDEX ticks = 0;
+    PTimeInterval start = PTimer::Tick();
+    PTimeInterval elapsed;
+    do {
+      for (PINDEX i = 0; i < 100; i++)
+        mixer.Tick(input, output);
+      ticks += 100;
+      elapsed = PTimer::Tick() - start;
+    } while (elapsed < 1000);
+
+    double ns = elapsed.GetMilliSeconds()*1000000.0;
+    cout << "   " << setw(5) << participants << " participants: "
+         << ns/ticks << " ns/tick, " << ns/ticks/participants << " ns/participant, "
+         << (ns/ticks)/200000.0 << "% of one core" << endl;
+
+    if (participants < maxParticipants && participants*2 > maxParticipants)
+      participants = maxParticipants/2;
+  }
+}
+
+
 void VideoTest(const PString & fmtName)
 {
   OpalMediaFormat mediaFormat = fmtName;
@@ -575,11 +699,13 @@ void OpalCodecInfo::Main()
   args.Parse(
              "A-audio-test:"
              "a-capabilities."
+             "B-benchmark:"
              "C-caps:"
              "f-format:"
              "h-help."
              "i-info:"
              "m-mediaformats."
+             "M-mixer-benchmark:"
              "p-pluginlist."
              "T-transcoders."
 #if PTRACING
@@ -587,6 +713,7 @@ void OpalCodecInfo::Main()
              "o-output:"
 #endif
              "V-video-test:"
+             "-calibrate:"
              , PFalse);
 
 #if PTRACING
@@ -678,6 +805,29 @@ void OpalCodecInfo::Main()
     needHelp = false;
   }
 
+  if (args.HasOption('B')) {
+    AudioBenchmark(args.GetOptionString('B'));
+    needHelp = false;
+  }
+
+  if (args.HasOption('M')) {
+    MixerBenchmark(args.GetOptionString('M'));
+    needHelp = false;
+  }
+
+  if (args.HasOption("calibrate")) {
+    cout << "Calibrating transcoders ..." << endl;
+    OpalTranscoder::CalibrateTranscoderCosts();
+    OpalTranscoderList keys = OpalTranscoderFactory::GetKeyList();
+    for (OpalTranscoderList::const_iterator transcoder = keys.begin(); transcoder != keys.end(); ++transcoder)
+      cout << "   " << transcoder->first << "->" << transcoder->second << ": "
+           << OpalTranscoder::GetTranscoderCost(transcoder->first, transcoder->second) << "us/s" << endl;
+    PFilePath filename = args.GetOptionString("calibrate");
+    if (!OpalTranscoder::SaveTranscoderCosts(filename))
+      cerr << "Could not write " << filename << endl;
+    needHelp = false;
+  }
+
   if (needHelp) {
     cout << "available options:" << endl
         << "  -m --mediaformats   display media formats\n"
@@ -690,6 +840,9 @@ void OpalCodecInfo::Main()
         << "  -T --transcoders    display available transcoders\n"
         << "  -A --audio-test fmt Test audio transcoder: PCM-16->fmt then fmt->PCM-16\n"
         << "  -V --video-test fmt Test video transcoder: YUV420P->fmt then fmt->YUV420P\n"
+        << "  -B --benchmark fmt  Time audio transcoder: PCM-16->fmt and fmt->PCM-16\n"
+        << "  -M --mixer-benchmark n  Time audio mixer for up to n participants\n"
+        << "     --calibrate file Measure transcoder CPU costs and save to file\n"
         << "  -t --trace          Increment trace level\n"
         << "  -o --output         Trace output file\n"
         << "  -h --help           display this help message\n";
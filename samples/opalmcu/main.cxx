@@ -58,6 +58,7 @@ void ConfOPAL::Main()
              "h-help."
              "H-h323:"
              "m-moderator:"
+             "M-max-speakers:"
              "n-name:"
              "N-stun:"
              "o-output:"
@@ -73,6 +74,8 @@ void ConfOPAL::Main()
              "-rtp-max:"
              "-rtp-tos:"
              "-rtp-size:"
+             "-mixer-workers:"
+             "-transcoder-costs:"
              , FALSE);
 
 #if PTRACING
@@ -89,6 +92,7 @@ void ConfOPAL::Main()
             "  -n or --name alias      : Name of default conference\n"
             "  -m or --moderator pin   : PIN to allow to become a moderator and have talk rights\n"
             "                          : if absent, all participants are moderators.\n"
+            "  -M or --max-speakers n  : Mix only the n loudest participants, default all.\n"
 #if OPAL_VIDEO
             "  -V or --no-video        : Disable video\n"
             "  -s or --size            : Set default video size\n"
@@ -110,6 +114,9 @@ void ConfOPAL::Main()
             "        --rtp-max port    : Set RTP port range maximum, default 5999.\n"
             "        --rtp-tos tos     : Set RTP Type Of Service (DiffServ code).\n"
             "        --rtp-size size   : Set RTP maximum payload size in bytes.\n"
+            "        --mixer-workers n : Mix all conferences with a pool of n threads.\n"
+            "        --transcoder-costs file : Choose transcoders using costs from\n"
+            "                          : opalcodecinfo --calibrate.\n"
 #if PTRACING
             "  -o or --output file     : file name for output of log messages\n"       
             "  -t or --trace           : degree of verbosity in error log (more times for more detail)\n"     
@@ -121,6 +128,11 @@ void ConfOPAL::Main()
 
   m_manager = new MyManager();
 
+  if (args.HasOption("transcoder-costs") && !OpalTranscoder::LoadTranscoderCosts(args.GetOptionString("transcoder-costs"))) {
+    cerr << "Could not load transcoder costs from " << args.GetOptionString("transcoder-costs") << endl;
+    return;
+  }
+
   if (args.HasOption('N')) {
     PSTUNClient::NatTypes nat = m_manager->SetSTUNServer(args.GetOptionString('N'));
     cout << "STUN server \"" << m_manager->GetSTUNClient()->GetServer() << "\" replies " << nat;
@@ -203,11 +215,13 @@ void ConfOPAL::Main()
   cli.SetCommand("conf add", PCREATE_NOTIFIER_EXT(mixer, MyMixerEndPoint, CmdConfAdd),
                  "Add a new conferance:",
 #if OPAL_VIDEO
-                 "[ -V ] [ -s size ] <name> [ <name> ... ]\n"
-                 "  -V or --no-video : Disable video\n"
-                 "  -s or --size     : Set video size"
+                 "[ -M n ] [ -V ] [ -s size ] <name> [ <name> ... ]\n"
+                 "  -M or --max-speakers : Mix only the n loudest participants\n"
+                 "  -V or --no-video     : Disable video\n"
+                 "  -s or --size         : Set video size"
 #else
-                 "conf add <name>"
+                 "[ -M n ] <name> [ <name> ... ]\n"
+                 "  -M or --max-speakers : Mix only the n loudest participants"
 #endif
                  );
   cli.SetCommand("conf list", PCREATE_NOTIFIER_EXT(mixer, MyMixerEndPoint, CmdConfList),
@@ -270,6 +284,10 @@ MyMixerEndPoint::MyMixerEndPoint(OpalManager & manager, PArgList & args)
   m_adHocNodeInfo = new OpalMixerNodeInfo;
   m_adHocNodeInfo->m_name = args.GetOptionString('n', "room101");
   m_adHocNodeInfo->m_listenOnly = !m_moderatorPIN.IsEmpty();
+  m_adHocNodeInfo->m_maxSpeakers = args.GetOptionString('M').AsUnsigned();
+
+  if (args.HasOption("mixer-workers"))
+    SetMixerWorkers(args.GetOptionString("mixer-workers").AsUnsigned());
 
 #if OPAL_VIDEO
   m_adHocNodeInfo->m_audioOnly = args.HasOption('V');
@@ -291,7 +309,7 @@ OpalMixerConnection * MyMixerEndPoint::CreateConnection(PSafePtr<OpalMixerNode>
 
 void MyMixerEndPoint::CmdConfAdd(PCLI::Arguments & args, INT)
 {
-  args.Parse("s-size:V-no-video.");
+  args.Parse("M-max-speakers:s-size:V-no-video.");
   if (args.GetCount() == 0) {
     args.WriteUsage();
     return;
@@ -306,6 +324,7 @@ void MyMixerEndPoint::CmdConfAdd(PCLI::Arguments & args, INT)
 
   OpalMixerNodeInfo * info = new OpalMixerNodeInfo();
   info->m_name = args[0];
+  info->m_maxSpeakers = args.GetOptionString('M').AsUnsigned();
   info->m_audioOnly = args.HasOption('V');
   if (args.HasOption('s'))
     PVideoFrameInfo::ParseSize(args.GetOptionString('s'), info->m_width, info->m_height);
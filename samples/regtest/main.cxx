@@ -28,6 +28,7 @@
 
 #include <opal/manager.h>
 #include <sip/sipep.h>
+#include <sip/sdp.h>
 
 class MyManager : public OpalManager
 {
@@ -51,6 +52,115 @@ class RegTest : public PProcess
 
 PCREATE_PROCESS(RegTest);
 
+
+// Messages as received from common user agents and proxies, for the parse benchmark
+static const struct {
+  const char * m_name;
+  const char * m_pdu;
+} ParseCorpus[] = {
+  { "INVITE",
+    "INVITE sip:2001@10.0.1.20 SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 10.0.1.31:5060;branch=z9hG4bK1fa2c4e3d0;rport\r\n"
+    "Via: SIP/2.0/UDP 10.0.1.7:5062;received=10.0.1.7;branch=z9hG4bK-524287-1---77f1a4b3a4d2c6f1\r\n"
+    "Record-Route: <sip:10.0.1.31;lr>\r\n"
+    "Max-Forwards: 69\r\n"
+    "Contact: <sip:1001@10.0.1.7:5062;transport=udp>\r\n"
+    "To: <sip:2001@pbx.example.com>\r\n"
+    "From: \"Alice Smith\" <sip:1001@pbx.example.com>;tag=3c2b1f40\r\n"
+    "Call-ID: ZjQ0YmI0NWZlMDg1ZDM5ZTc1ZWM4N2E0ODA1ZmQ1ZDg.\r\n"
+    "CSeq: 2 INVITE\r\n"
+    "Allow: INVITE, ACK, CANCEL, BYE, NOTIFY, REFER, MESSAGE, OPTIONS, INFO, SUBSCRIBE\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Proxy-Authorization: Digest username=\"1001\",realm=\"pbx.example.com\",nonce=\"4b3f2a1e0d\","
+      "uri=\"sip:2001@10.0.1.20\",response=\"9a7e4b6c1d2f3e4a5b6c7d8e9f0a1b2c\",algorithm=MD5\r\n"
+    "Supported: replaces, timer\r\n"
+    "User-Agent: Softphone 4.2.1 r61804\r\n"
+    "Content-Length: 325\r\n"
+    "\r\n"
+    "v=0\r\n"
+    "o=- 13079203 13079204 IN IP4 10.0.1.7\r\n"
+    "s=session\r\n"
+    "c=IN IP4 10.0.1.7\r\n"
+    "t=0 0\r\n"
+    "m=audio 54062 RTP/AVP 9 8 0 3 101\r\n"
+    "a=rtpmap:9 G722/8000\r\n"
+    "a=rtpmap:8 PCMA/8000\r\n"
+    "a=rtpmap:0 PCMU/8000\r\n"
+    "a=rtpmap:3 GSM/8000\r\n"
+    "a=rtpmap:101 telephone-event/8000\r\n"
+    "a=fmtp:101 0-15\r\n"
+    "a=ptime:20\r\n"
+    "a=sendrecv\r\n"
+    "m=video 0 RTP/AVP 34\r\n"
+    "a=rtpmap:34 H263/90000\r\n"
+  },
+  { "REGISTER",
+    "REGISTER sip:pbx.example.com SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 192.168.20.41:5060;branch=z9hG4bK7d1c84a2e;rport\r\n"
+    "From: \"2048\" <sip:2048@pbx.example.com>;tag=1406548352\r\n"
+    "To: \"2048\" <sip:2048@pbx.example.com>\r\n"
+    "Call-ID: 0_2865416204@192.168.20.41\r\n"
+    "CSeq: 3 REGISTER\r\n"
+    "Contact: <sip:2048@192.168.20.41:5060>;+sip.instance=\"<urn:uuid:00000000-0000-1000-8000-000B82A1B2C3>\"\r\n"
+    "Authorization: Digest username=\"2048\", realm=\"pbx.example.com\", nonce=\"5f8c1e2d3b4a\", "
+      "uri=\"sip:pbx.example.com\", response=\"0c3b5d2e9f8a7b6c5d4e3f2a1b0c9d8e\", algorithm=MD5\r\n"
+    "Max-Forwards: 70\r\n"
+    "User-Agent: Deskphone 1.0.5.36\r\n"
+    "Expires: 3600\r\n"
+    "Allow: INVITE, INFO, PRACK, ACK, BYE, CANCEL, OPTIONS, NOTIFY, REGISTER, SUBSCRIBE, REFER, PUBLISH, UPDATE, MESSAGE\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n"
+  },
+  { "OPTIONS",
+    "OPTIONS sip:trunk.example.net SIP/2.0\r\n"
+    "v: SIP/2.0/UDP 203.0.113.5:5060;branch=z9hG4bK4a2f1e9c;rport\r\n"
+    "Max-Forwards: 70\r\n"
+    "t: <sip:trunk.example.net>\r\n"
+    "f: <sip:ping@203.0.113.5>;tag=as6b8c2d1e\r\n"
+    "i: 51e8d3a07c2f4b1958a9e33c7d1f62a4@203.0.113.5:5060\r\n"
+    "CSeq: 102 OPTIONS\r\n"
+    "User-Agent: Gateway\r\n"
+    "Date: Tue, 14 Apr 2009 02:30:12 GMT\r\n"
+    "Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, SUBSCRIBE, NOTIFY, INFO\r\n"
+    "k: replaces, timer\r\n"
+    "l: 0\r\n"
+    "\r\n"
+  }
+};
+
+
+static void ParseBenchmark(unsigned iterations)
+{
+  cout << "Message    Iterations     us/PDU      PDU/s\n";
+
+  for (PINDEX i = 0; i < PARRAYSIZE(ParseCorpus); ++i) {
+    const char * data = ParseCorpus[i].m_pdu;
+    PINDEX length = strlen(data);
+
+    PTimeInterval start = PTimer::Tick();
+    for (unsigned count = 0; count < iterations; ++count) {
+      SIP_PDU pdu;
+      if (!pdu.Parse(data, length)) {
+        cerr << "Could not parse " << ParseCorpus[i].m_name << endl;
+        return;
+      }
+      // Includes handing the body over to the SDP decoder
+      pdu.GetSDP();
+    }
+    PTimeInterval elapsed = PTimer::Tick() - start;
+
+    double microseconds = elapsed.GetMilliSeconds()*1000.0/iterations;
+    cout << setw(10) << left << ParseCorpus[i].m_name << right
+         << setw(11) << iterations
+         << setw(11) << setprecision(2) << setiosflags(ios::fixed) << microseconds
+         << setw(11) << setprecision(0) << (microseconds > 0 ? 1000000/microseconds : 0)
+         << resetiosflags(ios::fixed) << '\n';
+  }
+
+  cout << endl;
+}
+
+
 RegTest::RegTest()
   : PProcess("OPAL RegTest", "RegTest", OPAL_MAJOR, OPAL_MINOR, ReleaseCode, OPAL_BUILD)
   , m_manager(NULL)
@@ -68,7 +178,9 @@ void RegTest::Main()
 {
   PArgList & args = GetArguments();
 
-  args.Parse(
+  args.Parse("h-help."
+             "-parse-benchmark."
+             "-iterations:"
 #if PTRACING
              "o-output:"             "-no-output."
              "t-trace."              "-no-trace."
@@ -86,6 +198,8 @@ void RegTest::Main()
             "\n"
             "Available options are:\n"
             "  --help                  : print this help message.\n"
+            "  --parse-benchmark       : time parsing of typical INVITE, REGISTER and OPTIONS\n"
+            "  --iterations n          : parses of each message in benchmark, default 100000\n"
 #if PTRACING
             "  -o or --output file     : file name for output of log messages\n"       
             "  -t or --trace           : degree of verbosity in error log (more times for more detail)\n"     
@@ -96,6 +210,12 @@ void RegTest::Main()
     return;
   }
 
+  if (args.HasOption("parse-benchmark")) {
+    unsigned iterations = args.GetOptionString("iterations", "100000").AsUnsigned();
+    ParseBenchmark(iterations > 0 ? iterations : 1);
+    return;
+  }
+
   MyManager m_manager;
   SIPEndPoint * sipEp = new SIPEndPoint(m_manager);
 
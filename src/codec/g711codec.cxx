@@ -37,6 +37,10 @@
 
 #include <codec/g711codec.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #define new PNEW
 
 extern "C" {
@@ -44,9 +48,164 @@ extern "C" {
   int linear2ulaw(int pcm_val);
   int alaw2linear(int u_val);
   int linear2alaw(int pcm_val);
+  int alaw2ulaw(int aval);
+  int ulaw2alaw(int uval);
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+/* Lookup tables built from the g711.c reference functions. The encoders use
+   every possible 16 bit sample as an index, the decoders every 8 bit code,
+   so converting a sample is a single load with no branches.
+
+   An AVX2 gather loads 32 bits at each index, so every table has a little
+   extra on the end for the gather at the last index to stay inside it. */
+enum { GatherPadding = 4 };
+
+class Opal_G711_Tables
+{
+  public:
+    Opal_G711_Tables()
+    {
+      memset(this, 0, sizeof(*this));
+
+      int i;
+      for (i = 0; i < 65536; i++) {
+        ulawEncode[i] = (BYTE)linear2ulaw((short)i);
+        alawEncode[i] = (BYTE)linear2alaw((short)i);
+      }
+      for (i = 0; i < 256; i++) {
+        ulawDecode[i] = (short)ulaw2linear(i);
+        alawDecode[i] = (short)alaw2linear(i);
+        alawToUlaw[i] = (BYTE)alaw2ulaw(i);
+        ulawToAlaw[i] = (BYTE)ulaw2alaw(i);
+      }
+    }
+
+    BYTE  ulawEncode[65536+GatherPadding];
+    BYTE  alawEncode[65536+GatherPadding];
+    short ulawDecode[256+GatherPadding];
+    short alawDecode[256+GatherPadding];
+    BYTE  alawToUlaw[256+GatherPadding];
+    BYTE  ulawToAlaw[256+GatherPadding];
+};
+
+/* Built during static initialisation, before any thread can use them. A
+   function local static is not safely constructed with concurrent first
+   callers by all the compilers we support, e.g. MSVC 2008. */
+static const Opal_G711_Tables G711Tables;
+
+
+#if defined(__AVX2__)
+
+/* Gather eight table entries at once. Each 32 bit result has the wanted
+   byte(s) at the bottom, which are then packed together. */
+static __inline __m256i GatherBytes(const BYTE * table, __m256i indexes)
+{
+  static const int PackMask = (int)0x80808080;
+  __m256i values = _mm256_i32gather_epi32((const int *)table, indexes, 1);
+  values = _mm256_shuffle_epi8(values, _mm256_setr_epi32(0x0c080400, PackMask, PackMask, PackMask,
+                                                         0x0c080400, PackMask, PackMask, PackMask));
+  return _mm256_permutevar8x32_epi32(values, _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+}
+
+
+static __inline __m256i GatherWords(const short * table, __m256i indexes)
+{
+  static const int PackMask = (int)0x80808080;
+  __m256i values = _mm256_i32gather_epi32((const int *)table, indexes, 2);
+  values = _mm256_shuffle_epi8(values, _mm256_setr_epi32(0x05040100, 0x0d0c0908, PackMask, PackMask,
+                                                         0x05040100, 0x0d0c0908, PackMask, PackMask));
+  return _mm256_permutevar8x32_epi32(values, _mm256_setr_epi32(0, 1, 4, 5, 2, 2, 2, 2));
+}
+
+#endif // __AVX2__
+
+
+/* The lookups are independent of each other, unrolling lets several be in
+   flight at once. Without a gather instruction (SSE2/NEON) this is as fast
+   as a vector version would be. */
+static void EncodeBlock(const BYTE * table, const short * input, BYTE * output, PINDEX samples)
+{
+#if defined(__AVX2__)
+  while (samples >= 8) {
+    __m256i indexes = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)input));
+    _mm_storel_epi64((__m128i *)output, _mm256_castsi256_si128(GatherBytes(table, indexes)));
+    input += 8;
+    output += 8;
+    samples -= 8;
+  }
+#endif
+
+  while (samples >= 4) {
+    output[0] = table[(unsigned short)input[0]];
+    output[1] = table[(unsigned short)input[1]];
+    output[2] = table[(unsigned short)input[2]];
+    output[3] = table[(unsigned short)input[3]];
+    input += 4;
+    output += 4;
+    samples -= 4;
+  }
+
+  while (samples-- > 0)
+    *output++ = table[(unsigned short)*input++];
+}
+
+
+static void DecodeBlock(const short * table, const BYTE * input, short * output, PINDEX samples)
+{
+#if defined(__AVX2__)
+  while (samples >= 8) {
+    __m256i indexes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)input));
+    _mm_storeu_si128((__m128i *)output, _mm256_castsi256_si128(GatherWords(table, indexes)));
+    input += 8;
+    output += 8;
+    samples -= 8;
+  }
+#endif
+
+  while (samples >= 4) {
+    output[0] = table[input[0]];
+    output[1] = table[input[1]];
+    output[2] = table[input[2]];
+    output[3] = table[input[3]];
+    input += 4;
+    output += 4;
+    samples -= 4;
+  }
+
+  while (samples-- > 0)
+    *output++ = table[*input++];
+}
+
+
+static void TranslateBlock(const BYTE * table, const BYTE * input, BYTE * output, PINDEX samples)
+{
+#if defined(__AVX2__)
+  while (samples >= 8) {
+    __m256i indexes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)input));
+    _mm_storel_epi64((__m128i *)output, _mm256_castsi256_si128(GatherBytes(table, indexes)));
+    input += 8;
+    output += 8;
+    samples -= 8;
+  }
+#endif
+
+  while (samples >= 4) {
+    output[0] = table[input[0]];
+    output[1] = table[input[1]];
+    output[2] = table[input[2]];
+    output[3] = table[input[3]];
+    input += 4;
+    output += 4;
+    samples -= 4;
+  }
+
+  while (samples-- > 0)
+    *output++ = table[*input++];
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -99,7 +258,14 @@ Opal_G711_uLaw_PCM::Opal_G711_uLaw_PCM()
 
 int Opal_G711_uLaw_PCM::ConvertOne(int sample) const
 {
-  return ulaw2linear(sample);
+  return G711Tables.ulawDecode[sample & 0xff];
+}
+
+
+bool Opal_G711_uLaw_PCM::ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const
+{
+  DecodeBlock(G711Tables.ulawDecode, input, (short *)output, samples);
+  return true;
 }
 
 
@@ -120,7 +286,14 @@ Opal_PCM_G711_uLaw::Opal_PCM_G711_uLaw()
 
 int Opal_PCM_G711_uLaw::ConvertOne(int sample) const
 {
-  return linear2ulaw(sample);
+  return G711Tables.ulawEncode[(unsigned short)sample];
+}
+
+
+bool Opal_PCM_G711_uLaw::ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const
+{
+  EncodeBlock(G711Tables.ulawEncode, (const short *)input, output, samples);
+  return true;
 }
 
 
@@ -141,7 +314,14 @@ Opal_G711_ALaw_PCM::Opal_G711_ALaw_PCM()
 
 int Opal_G711_ALaw_PCM::ConvertOne(int sample) const
 {
-  return alaw2linear(sample);
+  return G711Tables.alawDecode[sample & 0xff];
+}
+
+
+bool Opal_G711_ALaw_PCM::ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const
+{
+  DecodeBlock(G711Tables.alawDecode, input, (short *)output, samples);
+  return true;
 }
 
 
@@ -161,7 +341,14 @@ Opal_PCM_G711_ALaw::Opal_PCM_G711_ALaw()
 
 int Opal_PCM_G711_ALaw::ConvertOne(int sample) const
 {
-  return linear2alaw(sample);
+  return G711Tables.alawEncode[(unsigned short)sample];
+}
+
+
+bool Opal_PCM_G711_ALaw::ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const
+{
+  EncodeBlock(G711Tables.alawEncode, (const short *)input, output, samples);
+  return true;
 }
 
 
@@ -171,4 +358,48 @@ int Opal_PCM_G711_ALaw::ConvertSample(int sample)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+Opal_G711_ALaw_uLaw::Opal_G711_ALaw_uLaw()
+  : OpalStreamedTranscoder(OpalG711_ALAW_64K, OpalG711_ULAW_64K, 8, 8)
+{
+  PTRACE(3, "Codec\tG711-ALaw-64k to G711-uLaw-64k transcoder created");
+}
+
+
+int Opal_G711_ALaw_uLaw::ConvertOne(int sample) const
+{
+  return G711Tables.alawToUlaw[sample & 0xff];
+}
+
+
+bool Opal_G711_ALaw_uLaw::ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const
+{
+  TranslateBlock(G711Tables.alawToUlaw, input, output, samples);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+Opal_G711_uLaw_ALaw::Opal_G711_uLaw_ALaw()
+  : OpalStreamedTranscoder(OpalG711_ULAW_64K, OpalG711_ALAW_64K, 8, 8)
+{
+  PTRACE(3, "Codec\tG711-uLaw-64k to G711-ALaw-64k transcoder created");
+}
+
+
+int Opal_G711_uLaw_ALaw::ConvertOne(int sample) const
+{
+  return G711Tables.ulawToAlaw[sample & 0xff];
+}
+
+
+bool Opal_G711_uLaw_ALaw::ConvertSamples(const BYTE * input, BYTE * output, PINDEX samples) const
+{
+  TranslateBlock(G711Tables.ulawToAlaw, input, output, samples);
+  return true;
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
@@ -830,6 +830,9 @@ PBoolean OpalPluginVideoTranscoder::ConvertFrames(const RTP_DataFrame & src, RTP
   unsigned flags;
 
   if (isEncoder) {
+    if (m_updateCoalescer.CheckDeferred())
+      forceIFrame = true;
+
     do {
       PINDEX reportedBufferSize = outputDataSize;
       if (reportedBufferSize > GetMaxEncoderOutputSize())
@@ -885,8 +888,10 @@ PBoolean OpalPluginVideoTranscoder::ConvertFrames(const RTP_DataFrame & src, RTP
     }
 #endif
 
-    if (lastFrameWasIFrame)
+    if (lastFrameWasIFrame) {
+      m_updateCoalescer.OnIFrame(forceIFrame);
       forceIFrame = false;
+    }
   }
 
   else {
@@ -0,0 +1,259 @@
+/*
+ * pcmresample.cxx
+ *
+ * Sample rate conversion between the PCM-16 media formats
+ *
+ * Open Phone Abstraction Library (OPAL)
+ *
+ * Copyright (c) 2001 Equivalence Pty. Ltd.
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.0 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code is Open Phone Abstraction Library.
+ *
+ * The Initial Developer of the Original Code is Equivalence Pty. Ltd.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * $Revision$
+ * $Author$
+ * $Date$
+ */
+
+#include <ptlib.h>
+
+#ifdef __GNUC__
+#pragma implementation "pcmresample.h"
+#endif
+
+#include <opal/buildopts.h>
+
+#include <codec/pcmresample.h>
+
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define OPAL_RESAMPLE_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OPAL_RESAMPLE_SSE2 1
+#endif
+
+#define new PNEW
+
+
+#define COEFFICIENT_BITS 14
+#define TAPS_MULTIPLE    8    // So FilterSample() never has a tail
+
+static const struct {
+  unsigned m_taps;    // Per phase, when not decimating
+  double   m_cutoff;  // Fraction of the lower Nyquist frequency
+  double   m_beta;    // Kaiser window shape
+} QualityParameters[OpalPCM16Resampler::NumQualities] = {
+  {  8, 0.80, 5.0 }, // eLowLatency
+  { 32, 0.92, 8.0 }  // eHighQuality
+};
+
+static OpalPCM16Resampler::Qualities DefaultQuality = OpalPCM16Resampler::eHighQuality;
+
+
+static unsigned GreatestCommonDivisor(unsigned a, unsigned b)
+{
+  while (b != 0) {
+    unsigned t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+
+// Modified Bessel function of the first kind, order zero, for the Kaiser window
+static double BesselI0(double x)
+{
+  double sum = 1, term = 1;
+  for (int k = 1; k < 50 && term > sum*1e-12; ++k) {
+    term *= (x/(2*k))*(x/(2*k));
+    sum += term;
+  }
+  return sum;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+OpalPCM16Resampler::OpalPCM16Resampler(const OpalMediaFormat & inputMediaFormat,
+                                       const OpalMediaFormat & outputMediaFormat)
+  : OpalTranscoder(inputMediaFormat, outputMediaFormat)
+{
+  unsigned inputRate = inputMediaFormat.GetClockRate();
+  unsigned outputRate = outputMediaFormat.GetClockRate();
+  unsigned gcd = GreatestCommonDivisor(inputRate, outputRate);
+  m_interpolate = outputRate/gcd;
+  m_decimate = inputRate/gcd;
+
+  SetQuality(DefaultQuality);
+}
+
+
+void OpalPCM16Resampler::SetDefaultQuality(Qualities quality)
+{
+  DefaultQuality = quality;
+}
+
+
+OpalPCM16Resampler::Qualities OpalPCM16Resampler::GetDefaultQuality()
+{
+  return DefaultQuality;
+}
+
+
+void OpalPCM16Resampler::SetQuality(Qualities quality)
+{
+  m_quality = quality;
+
+  const unsigned L = m_interpolate;
+  const unsigned M = m_decimate;
+
+  /* When decimating the pass band is narrower in input samples, so the
+     filter needs proportionally more of them for the same roll off. */
+  m_tapsPerPhase = QualityParameters[quality].m_taps*((M+L-1)/L);
+  m_tapsPerPhase = (m_tapsPerPhase+TAPS_MULTIPLE-1)/TAPS_MULTIPLE*TAPS_MULTIPLE;
+
+  // Windowed sinc prototype at the interpolated rate
+  const unsigned length = m_tapsPerPhase*L;
+  const double cutoff = QualityParameters[quality].m_cutoff*0.5/std::max(L, M);
+  const double beta = QualityParameters[quality].m_beta;
+  const double centre = (length-1)/2.0;
+  const double windowScale = 1/BesselI0(beta);
+
+  std::vector<double> prototype(length);
+  unsigned n;
+  for (n = 0; n < length; ++n) {
+    double t = n - centre;
+    double sinc = t == 0 ? 1 : sin(2*M_PI*cutoff*t)/(2*M_PI*cutoff*t);
+    double ratio = t/(centre+1);
+    prototype[n] = 2*cutoff*sinc*BesselI0(beta*sqrt(1 - ratio*ratio))*windowScale;
+  }
+
+  /* Split into phases, reversed so FilterSample() runs forward over the
+     oldest to the newest sample. Each phase is normalised to unity gain so
+     there is no ripple at DC between phases. */
+  m_coefficients.resize(length);
+  for (unsigned phase = 0; phase < L; ++phase) {
+    double sum = 0;
+    unsigned tap;
+    for (tap = 0; tap < m_tapsPerPhase; ++tap)
+      sum += prototype[tap*L + phase];
+
+    for (tap = 0; tap < m_tapsPerPhase; ++tap) {
+      double value = prototype[(m_tapsPerPhase-1-tap)*L + phase]/sum*(1 << COEFFICIENT_BITS);
+      m_coefficients[phase*m_tapsPerPhase + tap] = (short)std::max(-32768.0, std::min(32767.0, floor(value + 0.5)));
+    }
+  }
+
+  // Silence for the filter to look back on at the start of the stream
+  m_history.assign(m_tapsPerPhase-1, 0);
+  m_position = (m_tapsPerPhase-1)*L;
+
+  PTRACE(4, "Resample\tConverting " << inputMediaFormat.GetClockRate() << " to "
+         << outputMediaFormat.GetClockRate() << " Hz, L=" << L << ", M=" << M
+         << ", " << m_tapsPerPhase << " taps per phase");
+}
+
+
+PINDEX OpalPCM16Resampler::GetOptimalDataFrameSize(PBoolean input) const
+{
+  // A PCM-16 "frame" is one millisecond worth of data
+  const OpalMediaFormat & mediaFormat = input ? inputMediaFormat : outputMediaFormat;
+  PINDEX size = mediaFormat.GetFrameSize()*outputMediaFormat.GetOptionInteger(input ? OpalAudioFormat::TxFramesPerPacketOption()
+                                                                                    : OpalAudioFormat::RxFramesPerPacketOption(), 1);
+  return size > 0 ? size : 1;
+}
+
+
+PBoolean OpalPCM16Resampler::Convert(const RTP_DataFrame & input, RTP_DataFrame & output)
+{
+  PINDEX count = input.GetPayloadSize()/sizeof(short);
+
+  output.SetPayloadSize(GetMaxOutputSamples(count)*sizeof(short));
+  PINDEX samples = Resample((const short *)input.GetPayloadPtr(), count, (short *)output.GetPayloadPtr());
+  output.SetPayloadSize(samples*sizeof(short));
+
+  return true;
+}
+
+
+PINDEX OpalPCM16Resampler::Resample(const short * input, PINDEX count, short * output)
+{
+  m_history.insert(m_history.end(), input, input+count);
+
+  const unsigned L = m_interpolate;
+  const unsigned M = m_decimate;
+  const unsigned available = m_history.size();
+
+  /* The newest sample used for an output is at m_position/L, and the
+     phase of the filter to use is m_position%L. */
+  PINDEX produced = 0;
+  unsigned position = m_position;
+  while (position/L < available) {
+    output[produced++] = FilterSample(&m_history[position/L - (m_tapsPerPhase-1)],
+                                      &m_coefficients[(position%L)*m_tapsPerPhase], m_tapsPerPhase);
+    position += M;
+  }
+
+  // Keep what the next output will look back on
+  unsigned discard = std::min(position/L - (m_tapsPerPhase-1), available);
+  m_history.erase(m_history.begin(), m_history.begin()+discard);
+  m_position = position - discard*L;
+
+  return produced;
+}
+
+
+short OpalPCM16Resampler::FilterSample(const short * samples, const short * coefficients, unsigned count)
+{
+  int sum = 1 << (COEFFICIENT_BITS-1);
+  unsigned i = 0;
+
+#if defined(__AVX2__)
+  __m256i acc256 = _mm256_setzero_si256();
+  for (; i+16 <= count; i += 16)
+    acc256 = _mm256_add_epi32(acc256, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(samples+i)),
+                                                        _mm256_loadu_si256((const __m256i *)(coefficients+i))));
+  __m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc256), _mm256_extracti128_si256(acc256, 1));
+#elif OPAL_RESAMPLE_SSE2
+  __m128i acc = _mm_setzero_si128();
+#endif
+
+#if OPAL_RESAMPLE_SSE2
+  for (; i+8 <= count; i += 8)
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(samples+i)),
+                                            _mm_loadu_si128((const __m128i *)(coefficients+i))));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  sum += _mm_cvtsi128_si32(acc);
+#endif
+
+  for (; i < count; ++i)
+    sum += samples[i]*coefficients[i];
+
+  sum >>= COEFFICIENT_BITS;
+  if (sum > 32767)
+    return 32767;
+  if (sum < -32768)
+    return -32768;
+  return (short)sum;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
@@ -149,7 +149,7 @@ PINDEX OpalVideoTranscoder::GetOptimalDataFrameSize(PBoolean input) const
 PBoolean OpalVideoTranscoder::ExecuteCommand(const OpalMediaCommand & command)
 {
   if (PIsDescendant(&command, OpalVideoUpdatePicture)) {
-    forceIFrame = true; // Reset when I-Frame is sent
+    ForceIFrame();
     return PTrue;
   }
 
@@ -157,6 +157,13 @@ PBoolean OpalVideoTranscoder::ExecuteCommand(const OpalMediaCommand & command)
 }
 
 
+void OpalVideoTranscoder::ForceIFrame()
+{
+  if (m_updateCoalescer.OnRequest())
+    forceIFrame = true; // Reset when I-Frame is sent
+}
+
+
 PBoolean OpalVideoTranscoder::Convert(const RTP_DataFrame & /*input*/,
                                   RTP_DataFrame & /*output*/)
 {
@@ -169,10 +176,103 @@ void OpalVideoTranscoder::GetStatistics(OpalMediaStatistics & statistics) const
 {
   statistics.m_totalFrames = m_totalFrames;
   statistics.m_keyFrames   = m_keyFrames;
+
+  statistics.m_updateRequests   = m_updateCoalescer.GetRequestCount();
+  statistics.m_updatesCoalesced = m_updateCoalescer.GetCoalescedCount();
+  statistics.m_updatesDeferred  = m_updateCoalescer.GetDeferredCount();
+  statistics.m_forcedKeyFrames  = m_updateCoalescer.GetForcedCount();
 }
 #endif
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+OpalVideoUpdateCoalescer::OpalVideoUpdateCoalescer(const PTimeInterval & minInterval,
+                                                   const PTimeInterval & window)
+  : m_minInterval(minInterval)
+  , m_window(window)
+  , m_deferred(false)
+  , m_requestCount(0)
+  , m_coalescedCount(0)
+  , m_deferredCount(0)
+  , m_forcedCount(0)
+  , m_naturalCount(0)
+{
+}
+
+
+bool OpalVideoUpdateCoalescer::OnRequest()
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  ++m_requestCount;
+
+  if (m_minInterval == 0) {
+    ++m_forcedCount;
+    return true;
+  }
+
+  if (m_deferred) {
+    ++m_coalescedCount;
+    PTRACE(5, "Media\tPicture update merged with deferred request");
+    return false;
+  }
+
+  PTimeInterval now = PTimer::Tick();
+
+  if (m_lastForced != 0 && now - m_lastForced < m_window) {
+    ++m_coalescedCount;
+    PTRACE(5, "Media\tPicture update merged with I-Frame forced " << (now - m_lastForced) << "ms ago");
+    return false;
+  }
+
+  PTimeInterval last = std::max(m_lastForced, m_lastIFrame);
+  if (last != 0 && now - last < m_minInterval) {
+    m_deferred = true;
+    ++m_deferredCount;
+    PTRACE(4, "Media\tPicture update deferred, last I-Frame " << (now - last) << "ms ago");
+    return false;
+  }
+
+  m_lastForced = now;
+  ++m_forcedCount;
+  return true;
+}
+
+
+bool OpalVideoUpdateCoalescer::CheckDeferred()
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  if (!m_deferred)
+    return false;
+
+  PTimeInterval now = PTimer::Tick();
+  if (now - std::max(m_lastForced, m_lastIFrame) < m_minInterval)
+    return false;
+
+  m_deferred = false;
+  m_lastForced = now;
+  ++m_forcedCount;
+  PTRACE(4, "Media\tForcing I-Frame for deferred picture update");
+  return true;
+}
+
+
+void OpalVideoUpdateCoalescer::OnIFrame(bool forced)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  m_lastIFrame = PTimer::Tick();
+
+  if (m_deferred) {
+    if (!forced)
+      ++m_naturalCount;
+    m_deferred = false;
+  }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 PString OpalVideoUpdatePicture::GetName() const
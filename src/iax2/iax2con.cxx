@@ -70,6 +70,7 @@ IAX2Connection::IAX2Connection(OpalCall & call,               /* Owner call for
   , jitterBuffer(400, 2000)
 {  
   opalPayloadType = RTP_DataFrame::IllegalPayloadType;
+  jitterSequenceNumber = 0;
 
   remotePartyAddress = "iax2:" + inRemoteParty;
   if (inRemotePartyName.IsEmpty())
@@ -505,6 +506,7 @@ void IAX2Connection::ReceivedSoundPacketFromNetwork(IAX2Frame *soundFrame)
 
     RTP_DataFrame mediaFrame(soundFrame->GetMediaDataSize());
     mediaFrame.SetTimestamp(soundFrame->GetTimeStamp() * 8);
+    mediaFrame.SetSequenceNumber(++jitterSequenceNumber);
     mediaFrame.SetMarker(PFalse);
     mediaFrame.SetPayloadType(opalPayloadType);
 
@@ -43,6 +43,7 @@
 #include <opal/patch.h>
 #include <opal/mediastrm.h>
 #include <codec/g711codec.h>
+#include <codec/pcmresample.h>
 #include <codec/vidcodec.h>
 #include <codec/rfc4175.h>
 #include <codec/opalpluginmgr.h>
@@ -80,6 +81,9 @@ static const char * const DefaultMediaFormatOrder[] = {
 // Linux it would not get loaded due to static initialisation optimisation
 OPAL_REGISTER_G711();
 
+// As are conversions between the PCM-16 sample rates
+OPAL_REGISTER_PCM16_RESAMPLERS();
+
 // Same deal for RC4175 video
 #if OPAL_RFC4175
 OPAL_REGISTER_RFC4175();
@@ -167,6 +171,14 @@ OpalManager::OpalManager()
   , rtpPayloadSizeMax(576-20-16-12) // Max safe MTU size (576 bytes as per RFC879) minus IP, UDP an RTP headers
   , minAudioJitterDelay(50)  // milliseconds
   , maxAudioJitterDelay(250) // milliseconds
+  , m_jitterBufferThreadless(false)
+  , m_rtpReactorThreads(0)
+  , m_rtpReactor(NULL)
+  , m_mediaPatchWorkers(0)
+  , m_mediaPatchScheduler(NULL)
+  , m_rtpBatchSize(1)
+  , m_rtpBatchLatency(1)    // milliseconds
+  , m_rtpRelay(false)
   , mediaFormatOrder(PARRAYSIZE(DefaultMediaFormatOrder), DefaultMediaFormatOrder)
   , disableDetectInBandDTMF(false)
   , noMediaTimeout(0, 0, 5)     // Minutes
@@ -230,6 +242,10 @@ OpalManager::~OpalManager()
 
   delete garbageCollector;
 
+  // All media patches and RTP sessions are gone now
+  delete m_mediaPatchScheduler;
+  delete m_rtpReactor;
+
   delete stun;
   delete interfaceMonitor;
 
@@ -1474,6 +1490,91 @@ void OpalManager::SetAudioJitterDelay(unsigned minDelay, unsigned maxDelay)
 }
 
 
+bool OpalManager::SetRTPReactorThreads(unsigned threads)
+{
+  PWaitAndSignal mutex(m_rtpReactorMutex);
+
+  if (m_rtpReactor != NULL) {
+    PTRACE(2, "OpalMan\tCannot change RTP reactor threads, already started");
+    return false;
+  }
+
+  m_rtpReactorThreads = threads;
+  return true;
+}
+
+
+RTP_Reactor * OpalManager::GetRTPReactor()
+{
+  PWaitAndSignal mutex(m_rtpReactorMutex);
+
+  if (m_rtpReactor == NULL && m_rtpReactorThreads > 0) {
+    if (RTP_Reactor::IsAvailable()) {
+      m_rtpReactor = new RTP_Reactor(m_rtpReactorThreads);
+      m_rtpReactor->SetTransmitBatching(m_rtpBatchSize, m_rtpBatchLatency);
+    }
+    else {
+      PTRACE(2, "OpalMan\tRTP reactor not available on this platform");
+      m_rtpReactorThreads = 0;
+    }
+  }
+
+  return m_rtpReactor;
+}
+
+
+bool OpalManager::SetMediaPatchWorkers(unsigned workers)
+{
+  PWaitAndSignal mutex(m_mediaPatchSchedulerMutex);
+
+  if (m_mediaPatchScheduler != NULL) {
+    PTRACE(2, "OpalMan\tCannot change media patch workers, already started");
+    return false;
+  }
+
+  m_mediaPatchWorkers = workers;
+  return true;
+}
+
+
+OpalMediaPatchScheduler * OpalManager::GetMediaPatchScheduler()
+{
+  PWaitAndSignal mutex(m_mediaPatchSchedulerMutex);
+
+  if (m_mediaPatchScheduler == NULL && m_mediaPatchWorkers > 0)
+    m_mediaPatchScheduler = new OpalMediaPatchScheduler(m_mediaPatchWorkers);
+
+  return m_mediaPatchScheduler;
+}
+
+
+unsigned OpalManager::GetProcessorCount()
+{
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  return processors > 0 ? (unsigned)processors : 1;
+#else
+  return 1;
+#endif
+}
+
+
+void OpalManager::SetRTPBatching(unsigned packets, const PTimeInterval & latency)
+{
+  PWaitAndSignal mutex(m_rtpReactorMutex);
+
+  m_rtpBatchSize = packets > 0 ? packets : 1;
+  m_rtpBatchLatency = latency;
+
+  if (m_rtpReactor != NULL)
+    m_rtpReactor->SetTransmitBatching(m_rtpBatchSize, m_rtpBatchLatency);
+}
+
+
 void OpalManager::SetMediaFormatOrder(const PStringArray & order)
 {
   mediaFormatOrder = order;
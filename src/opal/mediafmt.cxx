@@ -1329,6 +1329,22 @@ const PString & OpalAudioFormat::TxFramesPerPacketOption() { static PString s =
 const PString & OpalAudioFormat::MaxFramesPerPacketOption(){ static PString s = "Max Frames Per Packet"; return s; }
 const PString & OpalAudioFormat::ChannelsOption()          { static PString s = "Channels"; return s; }
 
+OpalMediaFormat OpalAudioFormat::GetPCM16(unsigned clockRate)
+{
+  switch (clockRate) {
+    case 8000 :
+      return OpalPCM16;
+    case 16000 :
+      return OpalPCM16_16KHZ;
+    case 32000 :
+      return OpalPCM16_32KHZ;
+    case 48000 :
+      return OpalPCM16_48KHZ;
+  }
+  return OpalMediaFormat();
+}
+
+
 OpalAudioFormat::OpalAudioFormat(const char * fullName,
                                  RTP_DataFrame::PayloadTypes rtpPayloadType,
                                  const char * encodingName,
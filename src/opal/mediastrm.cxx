@@ -417,6 +417,30 @@ void OpalMediaStream::EnableJitterBuffer() const
 }
 
 
+bool OpalMediaStream::SetDataReadyNotifier(const PNotifier &)
+{
+  return false;
+}
+
+
+bool OpalMediaStream::IsDataReady()
+{
+  return true;
+}
+
+
+PTimeInterval OpalMediaStream::GetDataReadyInterval() const
+{
+  return 0;
+}
+
+
+bool OpalMediaStream::CanShareWrittenPacket() const
+{
+  return false;
+}
+
+
 void OpalMediaStream::SetPaused(bool p)
 {
   PTRACE_IF(3, paused != p, "Media\t" << (p ? "Paused" : "Resumed") << " stream " << *this);
@@ -557,6 +581,12 @@ PBoolean OpalNullMediaStream::IsSynchronous() const
 }
 
 
+bool OpalNullMediaStream::CanShareWrittenPacket() const
+{
+  return true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 OpalRTPMediaStream::OpalRTPMediaStream(OpalRTPConnection & conn,
@@ -647,6 +677,15 @@ PBoolean OpalRTPMediaStream::WritePacket(RTP_DataFrame & packet)
 }
 
 
+bool OpalRTPMediaStream::CanShareWrittenPacket() const
+{
+  /* RTP_Session::WriteData() sets the sequence number, SSRC and timestamp
+     in place, which the patch restores for the next sink. Encryption, or
+     any encoding other than plain RTP, changes the payload as well. */
+  return !PIsDescendant(&rtpSession, SecureRTP_UDP) && rtpSession.GetEncoding() == "rtp/avp";
+}
+
+
 PBoolean OpalRTPMediaStream::SetDataSize(PINDEX dataSize)
 {
   if (dataSize <= 0)
@@ -672,6 +711,38 @@ void OpalRTPMediaStream::EnableJitterBuffer() const
 }
 
 
+bool OpalRTPMediaStream::SetDataReadyNotifier(const PNotifier & notifier)
+{
+  RTP_UDP * udp = dynamic_cast<RTP_UDP *>(&rtpSession);
+  return udp != NULL && udp->SetDataReadyNotifier(notifier);
+}
+
+
+bool OpalRTPMediaStream::IsDataReady()
+{
+  // Jitter buffer never blocks
+  if (rtpSession.GetJitterBufferSize() > 0)
+    return true;
+
+  RTP_UDP * udp = dynamic_cast<RTP_UDP *>(&rtpSession);
+  return udp != NULL && udp->IsDataReady();
+}
+
+
+PTimeInterval OpalRTPMediaStream::GetDataReadyInterval() const
+{
+  if (rtpSession.GetJitterBufferSize() == 0)
+    return 0;
+
+  unsigned timeUnits = mediaFormat.GetTimeUnits();
+  unsigned frameTime = mediaFormat.GetFrameTime();
+  if (timeUnits == 0 || frameTime < timeUnits)
+    return 10;
+
+  return frameTime/timeUnits;
+}
+
+
 #if OPAL_STATISTICS
 void OpalRTPMediaStream::GetStatistics(OpalMediaStatistics & statistics, bool fromPatch) const
 {
@@ -809,6 +880,12 @@ bool OpalRawMediaStream::SetChannel(PChannel * chan, bool autoDelete)
 }
 
 
+bool OpalRawMediaStream::CanShareWrittenPacket() const
+{
+  return true;
+}
+
+
 PBoolean OpalRawMediaStream::Close()
 {
   if (!isOpen)
@@ -40,6 +40,17 @@
 #include <rtp/jitter.h>
 #include <ptlib/vconvert.h>
 
+#include <algorithm>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define OPAL_MIXER_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OPAL_MIXER_SSE2 1
+#endif
+
 
 #define DETAIL_LOG_LEVEL 4
 
@@ -54,6 +65,9 @@ OpalBaseMixer::OpalBaseMixer(bool pushThread, unsigned periodMS, unsigned period
   , m_pushFrame(NULL)
   , m_workerThread(NULL)
   , m_threadRunning(false)
+  , m_scheduler(NULL)
+  , m_scheduled(false)
+  , m_scheduleState(ScheduleIdle)
 {
 }
 
@@ -168,7 +182,13 @@ void OpalBaseMixer::StartPushThread()
 {
   if (m_pushThread) {
     PWaitAndSignal mutex(m_mutex);
-    if (m_workerThread == NULL) {
+    if (m_scheduler != NULL) {
+      if (!m_scheduled) {
+        m_scheduled = true;
+        m_scheduler->Add(*this);
+      }
+    }
+    else if (m_workerThread == NULL) {
       m_threadRunning = true;
       m_workerThread = new PThreadObj<OpalBaseMixer>(*this,
                                                      &OpalBaseMixer::PushThreadMain,
@@ -186,6 +206,15 @@ void OpalBaseMixer::StopPushThread(bool lock)
     m_mutex.Wait();
 
   m_threadRunning = false;
+
+  if (m_scheduled) {
+    // Allow any tick in progress, which needs the mutex, to complete
+    m_mutex.Signal();
+    m_scheduler->Remove(*this);
+    m_mutex.Wait();
+    m_scheduled = false;
+  }
+
   if (m_workerThread != NULL) {
     m_mutex.Signal();
 
@@ -227,6 +256,460 @@ bool OpalBaseMixer::OnMixed(RTP_DataFrame * & /*mixed*/)
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+
+// Ticks further behind than this are skipped rather than caught up
+#define MAX_CATCH_UP_TICKS 5
+
+class OpalMixerScheduler::Timer : public PThread
+{
+    PCLASSINFO(Timer, PThread);
+  public:
+    Timer(OpalMixerScheduler & scheduler, unsigned periodMS)
+      : PThread(65536,  //16*4kpage size
+                NoAutoDeleteThread,
+                HighestPriority,
+                psprintf("Mixer Timer:%u", periodMS))
+      , m_scheduler(scheduler)
+      , m_periodMS(periodMS)
+    {
+    }
+
+    virtual void Main() { m_scheduler.TimerMain(*this); }
+
+    OpalMixerScheduler          & m_scheduler;
+    unsigned                      m_periodMS;
+    std::vector<OpalBaseMixer *>  m_mixers;
+    PSyncPoint                    m_stop;
+};
+
+
+class OpalMixerScheduler::Worker : public PThread
+{
+    PCLASSINFO(Worker, PThread);
+  public:
+    Worker(OpalMixerScheduler & scheduler, unsigned index)
+      : PThread(65536,  //16*4kpage size
+                NoAutoDeleteThread,
+                HighestPriority,
+                psprintf("Mixer:%u", index))
+      , m_scheduler(scheduler)
+      , m_mixer(NULL)
+      , m_mixerRemoved(false)
+    {
+    }
+
+    virtual void Main() { m_scheduler.WorkerMain(*this); }
+
+    OpalMixerScheduler & m_scheduler;
+    OpalBaseMixer      * m_mixer;
+    bool                 m_mixerRemoved;
+};
+
+
+OpalMixerScheduler::OpalMixerScheduler(unsigned workers)
+  : m_mixerCount(0)
+  , m_ticks(0)
+  , m_lateTicks(0)
+  , m_overruns(0)
+  , m_shutdown(false)
+{
+  if (workers == 0)
+    workers = OpalManager::GetProcessorCount();
+
+  for (unsigned i = 0; i < workers; ++i) {
+    Worker * worker = new Worker(*this, i);
+    m_workers.push_back(worker);
+    worker->Resume();
+  }
+
+  PTRACE(3, "Mixer\tScheduler started with " << workers << " threads");
+}
+
+
+OpalMixerScheduler::~OpalMixerScheduler()
+{
+  PTRACE_IF(1, m_mixerCount > 0, "Mixer\tScheduler stopping with " << m_mixerCount << " mixers");
+
+  m_mutex.Wait();
+  m_shutdown = true;
+  m_mutex.Signal();
+
+  for (std::map<unsigned, Timer *>::iterator it = m_timers.begin(); it != m_timers.end(); ++it) {
+    it->second->m_stop.Signal();
+    it->second->WaitForTermination();
+    delete it->second;
+  }
+
+  m_wakeUp.Signal();
+  for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it) {
+    (*it)->WaitForTermination();
+    delete *it;
+  }
+
+  PTRACE(3, "Mixer\tScheduler stopped: ticks=" << m_ticks
+         << ", late=" << m_lateTicks << ", overruns=" << m_overruns);
+}
+
+
+void OpalMixerScheduler::Add(OpalBaseMixer & mixer)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  unsigned period = mixer.GetPeriodMS();
+  Timer * & timer = m_timers[period];
+  if (timer == NULL) {
+    // Timers are kept until shut down, there are only ever a few periods in use
+    timer = new Timer(*this, period);
+    timer->Resume();
+    PTRACE(4, "Mixer\tScheduler started timer for " << period << "ms");
+  }
+
+  timer->m_mixers.push_back(&mixer);
+  mixer.m_scheduleState = OpalBaseMixer::ScheduleIdle;
+  ++m_mixerCount;
+}
+
+
+void OpalMixerScheduler::Remove(OpalBaseMixer & mixer)
+{
+  m_mutex.Wait();
+
+  for (;;) {
+    if (mixer.m_scheduleState == OpalBaseMixer::ScheduleRunning) {
+      // If we are the worker mixing it, just tell it the mixer is gone
+      std::vector<Worker *>::iterator it = m_workers.begin();
+      while (it != m_workers.end() && (*it)->m_mixer != &mixer)
+        ++it;
+      if (it == m_workers.end() || *it != PThread::Current()) {
+        // Wait for the worker to finish with it
+        PSyncPoint changed;
+        m_stateWaiters.push_back(&changed);
+        m_mutex.Signal();
+        changed.Wait();
+        m_mutex.Wait();
+        continue;
+      }
+      (*it)->m_mixerRemoved = true;
+    }
+    else if (mixer.m_scheduleState == OpalBaseMixer::ScheduleQueued)
+      m_runQueue.erase(std::find(m_runQueue.begin(), m_runQueue.end(), &mixer));
+    break;
+  }
+
+  RemoveFromTimer(mixer);
+  mixer.m_scheduleState = OpalBaseMixer::ScheduleIdle;
+
+  m_mutex.Signal();
+}
+
+
+void OpalMixerScheduler::SignalStateWaiters()
+{
+  // Must have m_mutex
+  for (std::vector<PSyncPoint *>::iterator it = m_stateWaiters.begin(); it != m_stateWaiters.end(); ++it)
+    (*it)->Signal();
+  m_stateWaiters.clear();
+}
+
+
+void OpalMixerScheduler::RemoveFromTimer(OpalBaseMixer & mixer)
+{
+  for (std::map<unsigned, Timer *>::iterator it = m_timers.begin(); it != m_timers.end(); ++it) {
+    std::vector<OpalBaseMixer *> & mixers = it->second->m_mixers;
+    std::vector<OpalBaseMixer *>::iterator pos = std::find(mixers.begin(), mixers.end(), &mixer);
+    if (pos != mixers.end()) {
+      mixers.erase(pos);
+      --m_mixerCount;
+      return;
+    }
+  }
+}
+
+
+void OpalMixerScheduler::TimerMain(Timer & timer)
+{
+  PTRACE(4, "Mixer\tScheduler timer started");
+
+  const PTimeInterval period = timer.m_periodMS;
+  PTimeInterval deadline = PTimer::Tick();
+
+  for (;;) {
+    // Keep to an absolute clock, so sleep errors do not accumulate
+    deadline += period;
+    PTimeInterval now = PTimer::Tick();
+    if (deadline > now) {
+      if (timer.m_stop.Wait(deadline - now))
+        break;
+      now = PTimer::Tick();
+    }
+
+    if (now - deadline > period*MAX_CATCH_UP_TICKS) {
+      PINDEX skipped = (PINDEX)((now - deadline).GetMilliSeconds()/timer.m_periodMS);
+      PTRACE(3, "Mixer\tScheduler timer for " << timer.m_periodMS << "ms skipping " << skipped << " ticks");
+      m_mutex.Wait();
+      m_lateTicks += skipped;
+      m_mutex.Signal();
+      deadline += period*skipped;
+    }
+
+    m_mutex.Wait();
+    if (m_shutdown) {
+      m_mutex.Signal();
+      break;
+    }
+
+    ++m_ticks;
+    if (now - deadline > period/4)
+      ++m_lateTicks;
+
+    Dispatch(timer);
+    m_mutex.Signal();
+  }
+
+  PTRACE(4, "Mixer\tScheduler timer ended");
+}
+
+
+void OpalMixerScheduler::Dispatch(Timer & timer)
+{
+  // Expected to already be mutexed
+
+  std::vector<OpalBaseMixer *> moved;
+
+  std::vector<OpalBaseMixer *>::iterator it = timer.m_mixers.begin();
+  while (it != timer.m_mixers.end()) {
+    OpalBaseMixer * mixer = *it;
+
+    // Period may be changed at any time, e.g. video frame rate
+    if (mixer->GetPeriodMS() != timer.m_periodMS) {
+      moved.push_back(mixer);
+      it = timer.m_mixers.erase(it);
+      --m_mixerCount;
+      continue;
+    }
+
+    switch (mixer->m_scheduleState) {
+      case OpalBaseMixer::ScheduleIdle :
+        mixer->m_scheduleState = OpalBaseMixer::ScheduleQueued;
+        m_runQueue.push_back(mixer);
+        break;
+
+      case OpalBaseMixer::ScheduleQueued :
+      case OpalBaseMixer::ScheduleRunning :
+        ++m_overruns;
+        PTRACE(5, "Mixer\tScheduler overrun on mixer " << mixer);
+        break;
+
+      default :
+        break;
+    }
+    ++it;
+  }
+
+  for (it = moved.begin(); it != moved.end(); ++it) {
+    OpalBaseMixer::ScheduleStates state = (*it)->m_scheduleState;
+    Add(**it);
+    (*it)->m_scheduleState = state;
+  }
+
+  if (!m_runQueue.empty())
+    m_wakeUp.Signal();
+}
+
+
+void OpalMixerScheduler::WorkerMain(Worker & worker)
+{
+  PTRACE(4, "Mixer\tScheduler thread started");
+
+  m_mutex.Wait();
+
+  while (!m_shutdown) {
+    // Help out with work split up by a mixer first, as it is holding up that mixer
+    if (!m_parallelJobs.empty()) {
+      ExecuteParallelItem(*m_parallelJobs.front());
+      continue;
+    }
+
+    if (m_runQueue.empty()) {
+      m_mutex.Signal();
+      m_wakeUp.Wait();
+      m_mutex.Wait();
+      continue;
+    }
+
+    OpalBaseMixer * mixer = m_runQueue.front();
+    m_runQueue.pop_front();
+
+    // Get another worker going on anything left
+    if (!m_runQueue.empty())
+      m_wakeUp.Signal();
+
+    mixer->m_scheduleState = OpalBaseMixer::ScheduleRunning;
+    worker.m_mixer = mixer;
+    worker.m_mixerRemoved = false;
+    m_mutex.Signal();
+
+    bool running = mixer->OnPush();
+
+    m_mutex.Wait();
+    worker.m_mixer = NULL;
+    SignalStateWaiters();
+
+    // Was removed, and possibly deleted, while we were mixing it
+    if (worker.m_mixerRemoved)
+      continue;
+
+    // Same as a push thread exiting, not ticked again until removed and re-added
+    mixer->m_scheduleState = running ? OpalBaseMixer::ScheduleIdle : OpalBaseMixer::ScheduleStopped;
+  }
+
+  m_mutex.Signal();
+
+  // Pass the shut down on to the next worker
+  m_wakeUp.Signal();
+
+  PTRACE(4, "Mixer\tScheduler thread ended");
+}
+
+
+void OpalMixerScheduler::RunParallel(ParallelTask & task, PINDEX count)
+{
+  if (count <= 1) {
+    if (count == 1)
+      task.Execute(0);
+    return;
+  }
+
+  ParallelJob job;
+  job.m_task = &task;
+  job.m_count = count;
+  job.m_next = 0;
+  job.m_done = 0;
+
+  m_mutex.Wait();
+
+  m_parallelJobs.push_back(&job);
+  m_wakeUp.Signal();
+
+  while (job.m_next < job.m_count)
+    ExecuteParallelItem(job);
+
+  bool waitForWorkers = job.m_done < job.m_count;
+
+  m_mutex.Signal();
+
+  if (waitForWorkers) {
+    job.m_finished.Wait();
+    // Signal() is done with the mutex held, make sure it has returned before job goes away
+    m_mutex.Wait();
+    m_mutex.Signal();
+  }
+}
+
+
+void OpalMixerScheduler::ExecuteParallelItem(ParallelJob & job)
+{
+  // Expected to already be mutexed
+
+  PINDEX index = job.m_next++;
+  if (job.m_next >= job.m_count)
+    m_parallelJobs.erase(std::find(m_parallelJobs.begin(), m_parallelJobs.end(), &job));
+  else
+    m_wakeUp.Signal(); // Get another worker going on the rest
+
+  m_mutex.Signal();
+  job.m_task->Execute(index);
+  m_mutex.Wait();
+
+  if (++job.m_done == job.m_count)
+    job.m_finished.Signal();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+
+// Limit used on mixed output, slightly inside the PCM-16 range
+#define MIX_SAMPLE_LIMIT 32765
+
+void OpalAudioMixer::MixAccumulate(int * mixed, const short * audio, unsigned count)
+{
+  unsigned i = 0;
+
+#if defined(__AVX2__)
+  for (; i+16 <= count; i += 16) {
+    __m256i samples = _mm256_loadu_si256((const __m256i *)(audio+i));
+    __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(samples));
+    __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(samples, 1));
+    _mm256_storeu_si256((__m256i *)(mixed+i),   _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(mixed+i)),   lo));
+    _mm256_storeu_si256((__m256i *)(mixed+i+8), _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(mixed+i+8)), hi));
+  }
+#elif OPAL_MIXER_SSE2
+  for (; i+8 <= count; i += 8) {
+    __m128i samples = _mm_loadu_si128((const __m128i *)(audio+i));
+    // Sign extend by placing each sample in the top half and arithmetic shifting down
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_si128((__m128i *)(mixed+i),   _mm_add_epi32(_mm_loadu_si128((const __m128i *)(mixed+i)),   lo));
+    _mm_storeu_si128((__m128i *)(mixed+i+4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(mixed+i+4)), hi));
+  }
+#endif
+
+  for (; i < count; ++i)
+    mixed[i] += audio[i];
+}
+
+
+void OpalAudioMixer::MixSaturate(short * output, const int * mixed, const short * audioToSubtract, unsigned count)
+{
+  unsigned i = 0;
+
+#if defined(__AVX2__)
+  const __m256i upper = _mm256_set1_epi32(MIX_SAMPLE_LIMIT);
+  const __m256i lower = _mm256_set1_epi32(-MIX_SAMPLE_LIMIT);
+  for (; i+16 <= count; i += 16) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)(mixed+i));
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(mixed+i+8));
+    if (audioToSubtract != NULL) {
+      __m256i samples = _mm256_loadu_si256((const __m256i *)(audioToSubtract+i));
+      lo = _mm256_sub_epi32(lo, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(samples)));
+      hi = _mm256_sub_epi32(hi, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(samples, 1)));
+    }
+    lo = _mm256_max_epi32(_mm256_min_epi32(lo, upper), lower);
+    hi = _mm256_max_epi32(_mm256_min_epi32(hi, upper), lower);
+    // Pack works within 128 bit lanes, so put the quad words back in order
+    _mm256_storeu_si256((__m256i *)(output+i), _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8));
+  }
+#elif OPAL_MIXER_SSE2
+  const __m128i upper = _mm_set1_epi16(MIX_SAMPLE_LIMIT);
+  const __m128i lower = _mm_set1_epi16(-MIX_SAMPLE_LIMIT);
+  for (; i+8 <= count; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(mixed+i));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(mixed+i+4));
+    if (audioToSubtract != NULL) {
+      __m128i samples = _mm_loadu_si128((const __m128i *)(audioToSubtract+i));
+      lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+      hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+    }
+    // Saturating pack to 16 bits, then pull in to the mixer limit
+    __m128i packed = _mm_packs_epi32(lo, hi);
+    _mm_storeu_si128((__m128i *)(output+i), _mm_max_epi16(_mm_min_epi16(packed, upper), lower));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    int value = mixed[i];
+    if (audioToSubtract != NULL)
+      value -= audioToSubtract[i];
+    if (value < -MIX_SAMPLE_LIMIT)
+      value = -MIX_SAMPLE_LIMIT;
+    else if (value > MIX_SAMPLE_LIMIT)
+      value = MIX_SAMPLE_LIMIT;
+    output[i] = (short)value;
+  }
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 
 OpalAudioMixer::OpalAudioMixer(bool stereo,
@@ -238,6 +721,7 @@ OpalAudioMixer::OpalAudioMixer(bool stereo,
   , m_sampleRate(sampleRate)
   , m_left(NULL)
   , m_right(NULL)
+  , m_maxSpeakers(0)
 {
   m_mixedAudio.resize(m_periodTS);
 }
@@ -329,21 +813,92 @@ bool OpalAudioMixer::SetJitterBufferSize(const Key_T & key, unsigned minJitterDe
 }
 
 
+void OpalAudioMixer::SetMaxSpeakers(unsigned count)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  if (m_maxSpeakers != count) {
+    PTRACE(3, "Mixer\tMaximum speakers set to " << count);
+    m_maxSpeakers = count;
+  }
+}
+
+
+bool OpalAudioMixer::IsSpeaking(const Key_T & key)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  StreamMap_T::iterator iter = m_inputStreams.find(key);
+  return iter != m_inputStreams.end() && ((AudioStream *)iter->second)->m_speaking;
+}
+
+
 void OpalAudioMixer::PreMixStreams()
 {
   // Expected to already be mutexed
 
-  size_t streamCount = m_inputStreams.size();
-  const short ** buffers = (const short **)alloca(streamCount*sizeof(short *));
+  /* Accumulate a whole period of each stream in turn rather than interleaving
+     across streams per sample, so each pass is a linear walk over two arrays
+     the compiler and the SIMD kernel can stream through. */
+  int * mixed = &m_mixedAudio[0];
+  memset(mixed, 0, m_periodTS*sizeof(int));
+
+  if (m_maxSpeakers > 0) {
+    SelectSpeakers();
+    for (std::vector<AudioStream *>::iterator iter = m_rankedStreams.begin(); iter != m_rankedStreams.end(); ++iter) {
+      if ((*iter)->m_speaking)
+        MixAccumulate(mixed, (*iter)->m_cacheSamples, m_periodTS);
+    }
+    return;
+  }
 
-  size_t i = 0;
-  for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end(); ++iter, ++i)
-    buffers[i] = ((AudioStream *)iter->second)->GetAudioDataPtr();
+  for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end(); ++iter) {
+    AudioStream * stream = (AudioStream *)iter->second;
+    stream->m_speaking = true;
+    MixAccumulate(mixed, stream->GetAudioDataPtr(), m_periodTS);
+  }
+}
+
+
+bool OpalAudioMixer::CompareSpeakerRank(const AudioStream * first, const AudioStream * second)
+{
+  return first->m_rank > second->m_rank;
+}
+
+
+void OpalAudioMixer::SelectSpeakers()
+{
+  // Expected to already be mutexed
+
+  m_rankedStreams.clear();
+
+  for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end(); ++iter) {
+    AudioStream * stream = (AudioStream *)iter->second;
+
+    // Every stream must be read each period, mixed or not, to keep its queue moving
+    const short * audio = stream->GetAudioDataPtr();
+    unsigned total = 0;
+    for (unsigned i = 0; i < m_periodTS; ++i)
+      total += audio[i] < 0 ? -audio[i] : audio[i];
 
-  for (unsigned samp = 0; samp < m_periodTS; ++samp) {
-    m_mixedAudio[samp] = 0;
-    for (size_t strm = 0; strm < streamCount; ++strm)
-      m_mixedAudio[samp] += *(buffers[strm])++;
+    // Smooth over a few periods so a single click does not grab the floor
+    stream->m_level = (stream->m_level*3 + total/m_periodTS)/4;
+
+    // Current speakers are only displaced by somebody twice as loud
+    stream->m_rank = stream->m_speaking ? stream->m_level*2 : stream->m_level;
+
+    m_rankedStreams.push_back(stream);
+  }
+
+  size_t speakers = std::min((size_t)m_maxSpeakers, m_rankedStreams.size());
+  std::partial_sort(m_rankedStreams.begin(), m_rankedStreams.begin()+speakers, m_rankedStreams.end(), CompareSpeakerRank);
+
+  for (size_t i = 0; i < m_rankedStreams.size(); ++i) {
+    AudioStream * stream = m_rankedStreams[i];
+    bool speaking = i < speakers && stream->m_level > 0;
+    PTRACE_IF(4, speaking != stream->m_speaking, "Mixer\tStream " << stream
+              << (speaking ? " started" : " stopped") << " speaking, level=" << stream->m_level);
+    stream->m_speaking = speaking;
   }
 }
 
@@ -399,17 +954,7 @@ void OpalAudioMixer::MixAdditive(RTP_DataFrame & frame, const short * audioToSub
   if (size == 0)
     frame.SetTimestamp(m_outputTimestamp);
 
-  short * dst = (short *)(frame.GetPayloadPtr()+size);
-  for (unsigned i = 0; i < m_periodTS; ++i) {
-    int value = m_mixedAudio[i];
-    if (audioToSubtract != NULL)
-      value -= *audioToSubtract++;
-    if (value < -32765)
-      value = -32765;
-    else if (value > 32765)
-      value = 32765;
-    *dst++ = (short)value;
-  }
+  MixSaturate((short *)(frame.GetPayloadPtr()+size), &m_mixedAudio[0], audioToSubtract, m_periodTS);
 }
 
 
@@ -425,6 +970,9 @@ OpalAudioMixer::AudioStream::AudioStream(OpalAudioMixer & mixer)
   , m_nextTimestamp(0)
   , m_cacheSamples(mixer.GetPeriodTS())
   , m_samplesUsed(0)
+  , m_level(0)
+  , m_rank(0)
+  , m_speaking(false)
 {
 }
 
@@ -492,9 +1040,176 @@ const short * OpalAudioMixer::AudioStream::GetAudioDataPtr()
 
 #if OPAL_VIDEO
 
+// Below this many tiles to draw, splitting the work across threads is not worth it
+#define MIN_PARALLEL_TILES 4
+
+// Smallest tile in a grid or filmstrip
+#define MIN_TILE_SIZE 16
+
+/* Scale one plane of an image with bilinear filtering, using 8 bit fixed
+   point weights. Exact size and 2:1 reductions, the usual cases for a grid
+   of like sized inputs, have their own faster paths. */
+static void ScalePlane(const BYTE * src, unsigned srcWidth, unsigned srcHeight, unsigned srcStride,
+                       BYTE * dst, unsigned dstWidth, unsigned dstHeight, unsigned dstStride)
+{
+  if (srcWidth == 0 || srcHeight == 0 || dstWidth == 0 || dstHeight == 0)
+    return;
+
+  if (srcWidth == dstWidth && srcHeight == dstHeight) {
+    for (unsigned y = 0; y < dstHeight; ++y)
+      memcpy(dst + y*dstStride, src + y*srcStride, dstWidth);
+    return;
+  }
+
+  if (srcWidth == dstWidth*2 && srcHeight == dstHeight*2) {
+    for (unsigned y = 0; y < dstHeight; ++y) {
+      const BYTE * row0 = src + 2*y*srcStride;
+      const BYTE * row1 = row0 + srcStride;
+      BYTE * out = dst + y*dstStride;
+      unsigned x = 0;
+#if OPAL_MIXER_SSE2
+      const __m128i lowBytes = _mm_set1_epi16(0xff);
+      for (; x+16 <= dstWidth; x += 16) {
+        __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(row0+2*x)),    _mm_loadu_si128((const __m128i *)(row1+2*x)));
+        __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(row0+2*x+16)), _mm_loadu_si128((const __m128i *)(row1+2*x+16)));
+        __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, lowBytes), _mm_srli_epi16(v0, 8));
+        __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, lowBytes), _mm_srli_epi16(v1, 8));
+        _mm_storeu_si128((__m128i *)(out+x), _mm_packus_epi16(h0, h1));
+      }
+#endif
+      for (; x < dstWidth; ++x) {
+        unsigned left  = (row0[2*x]   + row1[2*x]   + 1) >> 1;
+        unsigned right = (row0[2*x+1] + row1[2*x+1] + 1) >> 1;
+        out[x] = (BYTE)((left + right + 1) >> 1);
+      }
+    }
+    return;
+  }
+
+  // Source position of each output column, as index and 8 bit fraction
+  std::vector<unsigned> xIndex(dstWidth);
+  std::vector<unsigned> xFraction(dstWidth);
+  unsigned xStep = (srcWidth << 16)/dstWidth;
+  for (unsigned x = 0; x < dstWidth; ++x) {
+    int pos = (int)(x*xStep + xStep/2) - 0x8000;
+    if (pos < 0)
+      pos = 0;
+    xIndex[x] = pos >> 16;
+    xFraction[x] = (pos >> 8) & 0xff;
+    if (xIndex[x] >= srcWidth-1) {
+      xIndex[x] = srcWidth-1;
+      xFraction[x] = 0;
+    }
+  }
+
+  // Horizontally scaled source rows, 8.8 fixed point
+  std::vector<unsigned short> row0(dstWidth), row1(dstWidth);
+  unsigned row0Index = UINT_MAX, row1Index = UINT_MAX;
+
+  unsigned yStep = (srcHeight << 16)/dstHeight;
+  for (unsigned y = 0; y < dstHeight; ++y) {
+    int pos = (int)(y*yStep + yStep/2) - 0x8000;
+    if (pos < 0)
+      pos = 0;
+    unsigned index = pos >> 16;
+    unsigned fraction = (pos >> 8) & 0xff;
+    if (index >= srcHeight-1) {
+      index = srcHeight-1;
+      fraction = 0;
+    }
+
+    for (unsigned r = 0; r < 2; ++r) {
+      unsigned wanted = index+r < srcHeight ? index+r : index;
+      std::vector<unsigned short> & row = r == 0 ? row0 : row1;
+      unsigned & rowIndex = r == 0 ? row0Index : row1Index;
+      if (rowIndex == wanted)
+        continue;
+      if (r == 0 && row1Index == wanted) {
+        // Moving down one source row, reuse what we have
+        row0.swap(row1);
+        std::swap(row0Index, row1Index);
+        continue;
+      }
+      const BYTE * line = src + wanted*srcStride;
+      for (unsigned x = 0; x < dstWidth; ++x) {
+        unsigned i = xIndex[x];
+        unsigned f = xFraction[x];
+        row[x] = (unsigned short)(line[i]*(256-f) + (f != 0 ? line[i+1]*f : 0));
+      }
+      rowIndex = wanted;
+    }
+
+    BYTE * out = dst + y*dstStride;
+    unsigned x = 0;
+    if (fraction == 0) {
+      for (; x < dstWidth; ++x)
+        out[x] = (BYTE)(row0[x] >> 8);
+      continue;
+    }
+
+#if OPAL_MIXER_SSE2
+    const __m128i weight0 = _mm_set1_epi16((short)((256-fraction) << 8));
+    const __m128i weight1 = _mm_set1_epi16((short)(fraction << 8));
+    for (; x+16 <= dstWidth; x += 16) {
+      __m128i lo = _mm_add_epi16(_mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)&row0[x]),   weight0),
+                                 _mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)&row1[x]),   weight1));
+      __m128i hi = _mm_add_epi16(_mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)&row0[x+8]), weight0),
+                                 _mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)&row1[x+8]), weight1));
+      _mm_storeu_si128((__m128i *)(out+x), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; x < dstWidth; ++x)
+      out[x] = (BYTE)(((row0[x]*((256-fraction) << 8) >> 16) + (row1[x]*(fraction << 8) >> 16)) >> 8);
+  }
+}
+
+
+static void ScaleYUV420P(const PluginCodec_Video_FrameHeader * header,
+                         BYTE * frame, unsigned frameWidth, unsigned frameHeight,
+                         const OpalVideoMixer::LayoutRect & rect)
+{
+  unsigned srcWidth = header->width;
+  unsigned srcHeight = header->height;
+  const BYTE * srcY = OPAL_VIDEO_FRAME_DATA_PTR(header);
+  const BYTE * srcU = srcY + srcWidth*srcHeight;
+  const BYTE * srcV = srcU + (srcWidth/2)*(srcHeight/2);
+
+  BYTE * dstY = frame + rect.m_y*frameWidth + rect.m_x;
+  BYTE * dstU = frame + frameWidth*frameHeight + (rect.m_y/2)*(frameWidth/2) + rect.m_x/2;
+  BYTE * dstV = frame + frameWidth*frameHeight*5/4 + (rect.m_y/2)*(frameWidth/2) + rect.m_x/2;
+
+  ScalePlane(srcY, srcWidth,   srcHeight,   srcWidth,   dstY, rect.m_width,   rect.m_height,   frameWidth);
+  ScalePlane(srcU, srcWidth/2, srcHeight/2, srcWidth/2, dstU, rect.m_width/2, rect.m_height/2, frameWidth/2);
+  ScalePlane(srcV, srcWidth/2, srcHeight/2, srcWidth/2, dstV, rect.m_width/2, rect.m_height/2, frameWidth/2);
+}
+
+
+class OpalVideoMixer::RenderTask : public OpalMixerScheduler::ParallelTask
+{
+  public:
+    RenderTask(OpalVideoMixer & mixer)
+      : m_mixer(mixer)
+    {
+    }
+
+    virtual void Execute(PINDEX index)
+    {
+      size_t tile = m_mixer.m_renderPass[index];
+      RenderItem & item = m_mixer.m_renderItems[tile];
+      item.m_drawn = item.m_stream->InsertVideoFrame(m_mixer.m_layout[tile], item.m_redraw);
+    }
+
+  protected:
+    OpalVideoMixer & m_mixer;
+};
+
+
 OpalVideoMixer::OpalVideoMixer(Styles style, unsigned width, unsigned height, unsigned rate, bool pushThread)
   : OpalBaseMixer(pushThread, 1000/rate, OpalMediaFormat::VideoClockRate/rate)
   , m_style(style)
+  , m_layoutPasses(0)
+  , m_lastStreamCount(0)
+  , m_layoutChanged(true)
 {
   SetFrameSize(width, height);
 }
@@ -520,109 +1235,268 @@ bool OpalVideoMixer::SetFrameSize(unsigned width, unsigned height)
 
   m_width = width;
   m_height = height;
-  PColourConverter::FillYUV420P(0, 0, m_width, m_height, m_width, m_height,
-                                m_frameStore.GetPointer(m_width*m_height*3/2),
-                                0, 0, 0);
+
+  // Do not scribble on a previous output somebody is still using
+  m_mixedFrame.MakeUnique();
+  m_mixedFrame.SetPayloadSize(sizeof(PluginCodec_Video_FrameHeader) + m_width*m_height*3/2);
+  m_mixedFrame.SetPayloadType(RTP_DataFrame::MaxPayloadType);
+
+  PluginCodec_Video_FrameHeader * video = (PluginCodec_Video_FrameHeader *)m_mixedFrame.GetPayloadPtr();
+  video->x = video->y = 0;
+  video->width = m_width;
+  video->height = m_height;
+
+  m_layoutChanged = true;
 
   m_mutex.Signal();
   return true;
 }
 
 
-OpalBaseMixer::Stream * OpalVideoMixer::CreateStream()
+void OpalVideoMixer::SetStyle(Styles style)
 {
-  return new VideoStream(*this);
+  PWaitAndSignal mutex(m_mutex);
+
+  if (m_style != style) {
+    m_style = style;
+    m_layoutChanged = true;
+  }
 }
 
 
-bool OpalVideoMixer::MixStreams(RTP_DataFrame & frame)
+void OpalVideoMixer::SetLayout(const Layout & layout)
 {
-  // create output frame
-  unsigned left, x, y, w, h;
+  PWaitAndSignal mutex(m_mutex);
+
+  m_customLayout = layout;
+  m_style = eCustom;
+  m_layoutChanged = true;
+}
+
+
+void OpalVideoMixer::SetActiveSpeaker(const Key_T & key)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  if (m_activeSpeaker != key) {
+    m_activeSpeaker = key;
+    m_layoutChanged = true;
+  }
+}
+
+
+static void AddLayoutRect(OpalVideoMixer::Layout & layout, unsigned x, unsigned y, unsigned w, unsigned h)
+{
+  // Keep on chroma sample boundaries
+  OpalVideoMixer::LayoutRect rect;
+  rect.m_x = x & ~1;
+  rect.m_y = y & ~1;
+  rect.m_width = w & ~1;
+  rect.m_height = h & ~1;
+  if (rect.m_width > 0 && rect.m_height > 0)
+    layout.push_back(rect);
+}
+
+
+static unsigned GetGridSize(size_t count, unsigned maxSize)
+{
+  unsigned size = 1;
+  while (size*size < count && size < maxSize)
+    ++size;
+  return size;
+}
+
+
+void OpalVideoMixer::CalculateLayout(size_t count, Layout & layout) const
+{
+  layout.clear();
+
+  unsigned maxGrid = std::max(1U, std::min(m_width, m_height)/MIN_TILE_SIZE);
+
   switch (m_style) {
     case eSideBySideLetterbox :
-      x = left = 0;
-      y = m_height/4;
-      w = m_width/2;
-      h = m_height/2;
+      AddLayoutRect(layout, 0,         m_height/4, m_width/2, m_height/2);
+      AddLayoutRect(layout, m_width/2, m_height/4, m_width/2, m_height/2);
       break;
 
     case eSideBySideScaled :
-      x = left = 0;
-      y = 0;
-      w = m_width/2;
-      h = m_height;
+      AddLayoutRect(layout, 0,         0, m_width/2, m_height);
+      AddLayoutRect(layout, m_width/2, 0, m_width/2, m_height);
       break;
 
     case eStackedPillarbox :
-      x = left = m_width/4;
-      y = 0;
-      w = m_width/2;
-      h = m_height/2;
+      AddLayoutRect(layout, m_width/4, 0,          m_width/2, m_height/2);
+      AddLayoutRect(layout, m_width/4, m_height/2, m_width/2, m_height/2);
       break;
 
     case eStackedScaled :
-      x = left = 0;
-      y = 0;
-      w = m_width;
-      h = m_height/2;
+      AddLayoutRect(layout, 0, 0,          m_width, m_height/2);
+      AddLayoutRect(layout, 0, m_height/2, m_width, m_height/2);
       break;
 
     case eGrid :
-      x = left = 0;
-      y = 0;
-      switch (m_inputStreams.size()) {
-        case 0 :
-        case 1 :
-          w = m_width;
-          h = m_height;
-          break;
-          break;
-
-        case 2 :
-        case 3 :
-        case 4 :
-          w = m_width/2;
-          h = m_height/2;
-          break;
-
-        case 5 :
-        case 6 :
-        case 7 :
-        case 8 :
-        case 9 :
-          w = m_width/3;
-          h = m_height/3;
-          break;
-
-        default :
-          w = m_width/4;
-          h = m_height/4;
-          break;
+    {
+      unsigned size = GetGridSize(count, maxGrid);
+      unsigned w = m_width/size;
+      unsigned h = m_height/size;
+      for (unsigned i = 0; i < count && i < size*size; ++i)
+        AddLayoutRect(layout, (i%size)*w, (i/size)*h, w, h);
+      break;
+    }
+
+    case eActiveSpeaker :
+    {
+      if (count <= 1) {
+        AddLayoutRect(layout, 0, 0, m_width, m_height);
+        break;
       }
+
+      // Filmstrip has at least five slots so speaker gets most of the frame
+      unsigned others = (unsigned)count-1;
+      unsigned slots = std::min(std::max(others, 5U), maxGrid);
+      if (others > slots)
+        others = slots;
+      unsigned w = m_width/slots;
+      unsigned h = m_height/slots;
+
+      // Speaker keeps the output aspect ratio, centred above the filmstrip
+      unsigned speakerHeight = m_height - h;
+      unsigned speakerWidth = speakerHeight*m_width/m_height;
+      AddLayoutRect(layout, (m_width - speakerWidth)/2, 0, speakerWidth, speakerHeight);
+
+      unsigned left = (m_width - others*w)/2;
+      for (unsigned i = 0; i < others; ++i)
+        AddLayoutRect(layout, left + i*w, m_height - h, w, h);
       break;
+    }
 
-    default :
-      return false;
+    case ePictureInPicture :
+    {
+      AddLayoutRect(layout, 0, 0, m_width, m_height);
+
+      unsigned w = m_width/4;
+      unsigned h = m_height/4;
+      unsigned margin = m_width/32;
+      for (unsigned i = 1; i < count && i <= 3; ++i)
+        AddLayoutRect(layout, m_width - i*(w + margin), m_height - h - margin, w, h);
+      break;
+    }
+
+    case eCustom :
+      for (Layout::const_iterator it = m_customLayout.begin(); it != m_customLayout.end(); ++it) {
+        // Clip to the output frame
+        if (it->m_x < m_width && it->m_y < m_height)
+          AddLayoutRect(layout, it->m_x, it->m_y,
+                        std::min(it->m_width, m_width - it->m_x),
+                        std::min(it->m_height, m_height - it->m_y));
+      }
+      break;
   }
+}
 
-  for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end(); ++iter) {
-    ((VideoStream *)iter->second)->InsertVideoFrame(x, y, w, h);
 
-    x += w;
-    if (x+w > m_width) {
-      x = left;
-      y += h;
-      if (y+h > m_height)
-        break;
+OpalBaseMixer::Stream * OpalVideoMixer::CreateStream()
+{
+  return new VideoStream(*this);
+}
+
+
+bool OpalVideoMixer::MixStreams(RTP_DataFrame & frame)
+{
+  // Expected to already be mutexed
+
+  if (m_lastStreamCount != m_inputStreams.size()) {
+    m_lastStreamCount = m_inputStreams.size();
+    m_layoutChanged = true;
+  }
+
+  bool redraw = m_layoutChanged;
+  if (redraw) {
+    CalculateLayout(m_lastStreamCount, m_layout);
+
+    // Tiles on top of earlier ones are drawn in a later pass
+    m_layoutPasses = 1;
+    m_layoutPass.assign(m_layout.size(), 0);
+    m_layoutOverlaps.assign(m_layout.size(), std::vector<size_t>());
+    for (size_t i = 0; i < m_layout.size(); ++i) {
+      const LayoutRect & upper = m_layout[i];
+      for (size_t j = 0; j < i; ++j) {
+        const LayoutRect & lower = m_layout[j];
+        if (upper.m_x < lower.m_x + lower.m_width  && lower.m_x < upper.m_x + upper.m_width &&
+            upper.m_y < lower.m_y + lower.m_height && lower.m_y < upper.m_y + upper.m_height) {
+          m_layoutOverlaps[i].push_back(j);
+          if (m_layoutPass[i] <= m_layoutPass[j])
+            m_layoutPass[i] = m_layoutPass[j]+1;
+        }
+      }
+      if (m_layoutPasses <= m_layoutPass[i])
+        m_layoutPasses = m_layoutPass[i]+1;
     }
+
+    PTRACE(4, "Mixer\tVideo layout changed, redrawing all " << m_layout.size()
+           << " tiles for " << m_lastStreamCount << " streams in " << m_layoutPasses << " passes");
   }
 
-  frame.SetPayloadSize(GetOutputSize());
-  PluginCodec_Video_FrameHeader * video = (PluginCodec_Video_FrameHeader *)frame.GetPayloadPtr();
-  video->width = m_width;
-  video->height = m_height;
-  memcpy(OPAL_VIDEO_FRAME_DATA_PTR(video), m_frameStore, m_frameStore.GetSize());
+  /* Compose straight into the RTP payload we hand out. Drop the reference
+     the caller has from last time first, so the buffer only needs copying
+     if somebody downstream is still holding on to it. */
+  frame.SetSize(0);
+  if (!m_mixedFrame.IsUnique()) {
+    PTRACE(DETAIL_LOG_LEVEL, "Mixer\tPrevious video output still in use, copying");
+    m_mixedFrame.MakeUnique();
+  }
+
+  if (redraw) {
+    BYTE * frameStore = OPAL_VIDEO_FRAME_DATA_PTR((PluginCodec_Video_FrameHeader *)m_mixedFrame.GetPayloadPtr());
+    PColourConverter::FillYUV420P(0, 0, m_width, m_height, m_width, m_height, frameStore, 0, 0, 0);
+    m_layoutChanged = false;
+  }
+
+  // Assign streams to tiles, the active speaker, if any, gets the first
+  m_renderItems.clear();
+  RenderItem item;
+  item.m_redraw = redraw;
+  item.m_drawn = false;
+
+  StreamMap_T::iterator speaker = m_activeSpeaker.IsEmpty() ? m_inputStreams.end() : m_inputStreams.find(m_activeSpeaker);
+  if (speaker != m_inputStreams.end() && !m_layout.empty()) {
+    item.m_stream = (VideoStream *)speaker->second;
+    m_renderItems.push_back(item);
+  }
+
+  for (StreamMap_T::iterator iter = m_inputStreams.begin(); iter != m_inputStreams.end() && m_renderItems.size() < m_layout.size(); ++iter) {
+    if (iter != speaker) {
+      item.m_stream = (VideoStream *)iter->second;
+      m_renderItems.push_back(item);
+    }
+  }
+
+  RenderTask task(*this);
+  for (unsigned pass = 0; pass < m_layoutPasses; ++pass) {
+    m_renderPass.clear();
+    for (size_t tile = 0; tile < m_renderItems.size(); ++tile) {
+      if (m_layoutPass[tile] != pass)
+        continue;
+
+      // Anything underneath was drawn over, so must draw on top again
+      for (std::vector<size_t>::iterator lower = m_layoutOverlaps[tile].begin(); lower != m_layoutOverlaps[tile].end(); ++lower) {
+        if (m_renderItems[*lower].m_drawn)
+          m_renderItems[tile].m_redraw = true;
+      }
+
+      m_renderPass.push_back(tile);
+    }
+
+    if (m_scheduler != NULL && m_renderPass.size() >= MIN_PARALLEL_TILES)
+      m_scheduler->RunParallel(task, m_renderPass.size());
+    else {
+      for (size_t i = 0; i < m_renderPass.size(); ++i)
+        task.Execute(i);
+    }
+  }
+
+  m_mixedFrame.SetPayloadType(RTP_DataFrame::MaxPayloadType);
+  frame = m_mixedFrame;
 
   return true;
 }
@@ -630,13 +1504,28 @@ bool OpalVideoMixer::MixStreams(RTP_DataFrame & frame)
 
 size_t OpalVideoMixer::GetOutputSize() const
 {
-  return m_frameStore.GetSize() + sizeof(PluginCodec_Video_FrameHeader);
+  return m_mixedFrame.GetPayloadSize();
+}
+
+
+bool OpalVideoMixer::GetTileInfo(const Key_T & key, TileInfo & info)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  StreamMap_T::iterator iter = m_inputStreams.find(key);
+  if (iter == m_inputStreams.end())
+    return false;
+
+  info = ((VideoStream *)iter->second)->m_tile;
+  return true;
 }
 
 
 OpalVideoMixer::VideoStream::VideoStream(OpalVideoMixer & mixer)
   : m_mixer(mixer)
+  , m_lastFrame(0)
 {
+  memset(&m_tile, 0, sizeof(m_tile));
 }
 
 
@@ -646,23 +1535,45 @@ void OpalVideoMixer::VideoStream::QueuePacket(const RTP_DataFrame & rtp)
 }
 
 
-void OpalVideoMixer::VideoStream::InsertVideoFrame(unsigned x, unsigned y, unsigned w, unsigned h)
+bool OpalVideoMixer::VideoStream::InsertVideoFrame(const LayoutRect & rect, bool redraw)
 {
-  if (m_queue.empty())
-    return;
+  if (!m_queue.empty()) {
+    // Only the latest picture is of interest, skip any we fell behind on
+    while (m_queue.size() > 1)
+      m_queue.pop();
+    m_lastFrame = m_queue.front();
+    m_queue.pop();
+  }
+  else if (!redraw && rect.m_x == m_tile.m_x && rect.m_y == m_tile.m_y &&
+                      rect.m_width == m_tile.m_width && rect.m_height == m_tile.m_height)
+    return false; // Nothing new, tile in output is still valid
+
+  if (m_lastFrame.GetPayloadSize() < (PINDEX)sizeof(PluginCodec_Video_FrameHeader))
+    return false;
 
-  PluginCodec_Video_FrameHeader * header = (PluginCodec_Video_FrameHeader *)m_queue.front().GetPayloadPtr();
+  PluginCodec_Video_FrameHeader * header = (PluginCodec_Video_FrameHeader *)m_lastFrame.GetPayloadPtr();
+  if ((PINDEX)(sizeof(PluginCodec_Video_FrameHeader) + header->width*header->height*3/2) > m_lastFrame.GetPayloadSize()) {
+    PTRACE(2, "Mixer\tVideo frame too small for " << header->width << 'x' << header->height);
+    return false;
+  }
 
   PTRACE(DETAIL_LOG_LEVEL, "Mixer\tCopying video: " << header->width << 'x' << header->height
-         << " -> " << x << ',' << y << '/' << w << 'x' << h);
+         << " -> " << rect.m_x << ',' << rect.m_y << '/' << rect.m_width << 'x' << rect.m_height);
+
+  PTime start;
 
-  PColourConverter::CopyYUV420P(0, 0, header->width, header->height,
-                                header->width, header->height, OPAL_VIDEO_FRAME_DATA_PTR(header),
-                                x, y, w, h,
-                                m_mixer.m_width, m_mixer.m_height, m_mixer.m_frameStore.GetPointer(),
-                                PVideoFrameInfo::eScale);
+  ScaleYUV420P(header,
+               OPAL_VIDEO_FRAME_DATA_PTR((PluginCodec_Video_FrameHeader *)m_mixer.m_mixedFrame.GetPayloadPtr()),
+               m_mixer.m_width, m_mixer.m_height, rect);
 
-  m_queue.pop();
+  m_tile.m_x = rect.m_x;
+  m_tile.m_y = rect.m_y;
+  m_tile.m_width = rect.m_width;
+  m_tile.m_height = rect.m_height;
+  m_tile.m_lastRenderTime = PTime().GetTimestamp() - start.GetTimestamp();
+  m_tile.m_totalRenderTime += m_tile.m_lastRenderTime;
+  ++m_tile.m_renderCount;
+  return true;
 }
 
 
@@ -674,6 +1585,8 @@ void OpalVideoMixer::VideoStream::InsertVideoFrame(unsigned x, unsigned y, unsig
 OpalMixerEndPoint::OpalMixerEndPoint(OpalManager & manager, const char * prefix)
   : OpalLocalEndPoint(manager, prefix)
   , m_adHocNodeInfo(NULL)
+  , m_mixerWorkers(0)
+  , m_mixerScheduler(NULL)
 {
   m_nodesByName.DisallowDeleteObjects();
   PTRACE(4, "MixerEP\tConstructed");
@@ -682,6 +1595,13 @@ OpalMixerEndPoint::OpalMixerEndPoint(OpalManager & manager, const char * prefix)
 
 OpalMixerEndPoint::~OpalMixerEndPoint()
 {
+  if (m_mixerScheduler != NULL) {
+    // Nodes may outlive us, make sure none are still using the scheduler
+    for (PSafePtr<OpalMixerNode> node(m_nodesByUID, PSafeReference); node != NULL; ++node)
+      node->ShutDown();
+    delete m_mixerScheduler;
+  }
+
   PTRACE(4, "MixerEP\tDestroyed");
 }
 
@@ -775,6 +1695,31 @@ void OpalMixerEndPoint::RemoveNode(OpalMixerNode & node)
 }
 
 
+bool OpalMixerEndPoint::SetMixerWorkers(unsigned workers)
+{
+  PWaitAndSignal mutex(m_mixerSchedulerMutex);
+
+  if (m_mixerScheduler != NULL) {
+    PTRACE(2, "MixerEP\tCannot change mixer workers, already started");
+    return false;
+  }
+
+  m_mixerWorkers = workers;
+  return true;
+}
+
+
+OpalMixerScheduler * OpalMixerEndPoint::GetMixerScheduler()
+{
+  PWaitAndSignal mutex(m_mixerSchedulerMutex);
+
+  if (m_mixerScheduler == NULL && m_mixerWorkers > 0)
+    m_mixerScheduler = new OpalMixerScheduler(m_mixerWorkers);
+
+  return m_mixerScheduler;
+}
+
+
 void OpalMixerEndPoint::SetAdHocNodeInfo(const OpalMixerNodeInfo & info)
 {
   SetAdHocNodeInfo(info.Clone());
@@ -962,6 +1907,30 @@ PBoolean OpalMixerMediaStream::RequiresPatchThread(OpalMediaStream *) const
 }
 
 
+PBoolean OpalMixerMediaStream::ExecuteCommand(const OpalMediaCommand & command)
+{
+#if OPAL_VIDEO
+  if (m_video && isSource && PIsDescendant(&command, OpalVideoUpdatePicture) && m_node->UpdateVideoPicture(*this))
+    return true;
+#endif
+
+  return OpalMediaStream::ExecuteCommand(command);
+}
+
+
+#if OPAL_STATISTICS
+void OpalMixerMediaStream::GetStatistics(OpalMediaStatistics & statistics, bool fromPatch) const
+{
+#if OPAL_VIDEO
+  if (m_video && isSource)
+    m_node->GetVideoStatistics(const_cast<OpalMixerMediaStream &>(*this), statistics);
+#endif
+
+  OpalMediaStream::GetStatistics(statistics, fromPatch);
+}
+#endif
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 OpalMixerNode::OpalMixerNode(OpalMixerEndPoint & endpoint, OpalMixerNodeInfo * info)
@@ -974,6 +1943,11 @@ OpalMixerNode::OpalMixerNode(OpalMixerEndPoint & endpoint, OpalMixerNodeInfo * i
 {
   m_connections.DisallowDeleteObjects();
 
+  m_audioMixer.SetScheduler(endpoint.GetMixerScheduler());
+#if OPAL_VIDEO
+  m_videoMixer.SetScheduler(endpoint.GetMixerScheduler());
+#endif
+
   AddName(m_info->m_name);
 
   PTRACE(4, "MixerNode\tConstructed " << m_guid);
@@ -1148,6 +2122,7 @@ OpalTranscoder & OpalMixerNode::MediaMixer::GetTranscoder(const OpalMediaFormat
 OpalMixerNode::AudioMixer::AudioMixer(const OpalMixerNodeInfo & info)
   : OpalAudioMixer(false, info.m_sampleRate)
 {
+  SetMaxSpeakers(info.m_maxSpeakers);
 }
 
 
@@ -1218,12 +2193,16 @@ bool OpalMixerNode::AudioMixer::OnPush()
 
     m_mutex.Wait(); // Signal() call for this mutex is inside PushOne()
 
-    // Check for full participant, so can subtract their signal
+    // Check for full participant in the mix, so can subtract their signal
     StreamMap_T::iterator inputStream = m_inputStreams.find(stream->GetID());
-    if (inputStream != m_inputStreams.end())
+    if (inputStream != m_inputStreams.end() && ((AudioStream *)inputStream->second)->m_speaking)
       PushOne(*stream, m_cache[stream->GetID()], ((AudioStream *)inputStream->second)->m_cacheSamples);
     else {
-      // Listen only participant, can use cached encoded audio
+      // Drop any partial individual mix left from when they were speaking
+      if (inputStream != m_inputStreams.end())
+        m_cache.erase(stream->GetID());
+
+      // Listen only, or not currently speaking, participant, can use cached encoded audio
       PString encodedFrameKey = mediaFormat;
       encodedFrameKey.sprintf(":%u", stream->GetDataSize());
       PushOne(*stream, m_cache[encodedFrameKey], NULL);
@@ -1256,8 +2235,38 @@ bool OpalMixerNode::AudioMixer::OnPush()
 ///////////////////////////////////////////////////////////////////////////////
 
 #if OPAL_VIDEO
+bool OpalMixerNode::UpdateVideoPicture(OpalMixerMediaStream & stream)
+{
+  // Raw video is encoded in the streams own patch, which deals with it
+  if (stream.GetMediaFormat() == OpalYUV420P)
+    return false;
+
+  PWaitAndSignal mutex(m_videoMixer.m_updatePictureMutex);
+  m_videoMixer.m_updatePictures.insert(stream.GetID());
+  return true;
+}
+
+
+#if OPAL_STATISTICS
+void OpalMixerNode::GetVideoStatistics(OpalMixerMediaStream & stream, OpalMediaStatistics & statistics)
+{
+  PWaitAndSignal mutex(m_videoMixer.m_encodeMutex);
+
+  VideoMixer::StreamClassMap::iterator streamClass = m_videoMixer.m_streamClasses.find(stream.GetID());
+  if (streamClass == m_videoMixer.m_streamClasses.end())
+    return;
+
+  VideoMixer::EncodeClassMap::iterator encodeClass = m_videoMixer.m_encodeClasses.find(streamClass->second.m_actual);
+  if (encodeClass != m_videoMixer.m_encodeClasses.end() && encodeClass->second->m_encoder != NULL)
+    encodeClass->second->m_encoder->GetStatistics(statistics);
+}
+#endif
+
+
 OpalMixerNode::VideoMixer::VideoMixer(const OpalMixerNodeInfo & info)
   : OpalVideoMixer(info.m_style, info.m_width, info.m_height, info.m_rate)
+  , m_maxEncodeClasses(info.m_maxEncodeClasses)
+  , m_minIFrameInterval(info.m_minIFrameInterval)
 {
 }
 
@@ -1265,31 +2274,199 @@ OpalMixerNode::VideoMixer::VideoMixer(const OpalMixerNodeInfo & info)
 OpalMixerNode::VideoMixer::~VideoMixer()
 {
   StopPushThread();
+
+  for (EncodeClassMap::iterator it = m_encodeClasses.begin(); it != m_encodeClasses.end(); ++it)
+    delete it->second;
+}
+
+
+OpalMixerNode::VideoMixer::EncodeClass::EncodeClass(const OpalMediaFormat & mediaFormat,
+                                                    unsigned width,
+                                                    unsigned height,
+                                                    unsigned bitRate)
+  : m_mediaFormat(mediaFormat)
+  , m_width(width)
+  , m_height(height)
+  , m_bitRate(bitRate)
+  , m_state(Pending)
+  , m_streamCount(0)
+{
+  m_mediaFormat.SetOptionInteger(OpalVideoFormat::FrameWidthOption(), width);
+  m_mediaFormat.SetOptionInteger(OpalVideoFormat::FrameHeightOption(), height);
+  m_mediaFormat.SetOptionInteger(OpalMediaFormat::TargetBitRateOption(), bitRate);
+
+  m_encoder = OpalTranscoder::Create(OpalYUV420P, m_mediaFormat);
+  PTRACE_IF(2, m_encoder == NULL, "MixerNode\tCould not create encoder for " << m_mediaFormat);
+}
+
+
+OpalMixerNode::VideoMixer::EncodeClass::~EncodeClass()
+{
+  delete m_encoder;
+}
+
+
+static unsigned GetBitRateTier(unsigned bitRate)
+{
+  // Round down, so a class never exceeds what a stream negotiated
+  static const unsigned Tiers[] = { 64000, 128000, 256000, 384000, 512000, 768000, 1024000, 1536000, 2048000, 4096000 };
+  PINDEX i = PARRAYSIZE(Tiers)-1;
+  while (i > 0 && Tiers[i] > bitRate)
+    --i;
+  return Tiers[i];
+}
+
+
+static double EncodeClassDistance(unsigned wantedArea, unsigned wantedRate, unsigned area, unsigned rate)
+{
+  // Log ratios so 2x too big is as far as 2x too small, then penalise too big
+  double distance = fabs(log((double)area/wantedArea)) + fabs(log((double)rate/wantedRate));
+  if (area > wantedArea)
+    distance += 1;
+  if (rate > wantedRate)
+    distance += 1;
+  return distance;
+}
+
+
+OpalMixerNode::VideoMixer::EncodeClass *
+      OpalMixerNode::VideoMixer::GetEncodeClass(const PString & streamID,
+                                                const OpalMediaFormat & mediaFormat,
+                                                StreamClassMap & streamClasses)
+{
+  // Never more than the mixer produces, that would just be scaling up
+  unsigned width  = std::min((unsigned)mediaFormat.GetOptionInteger(OpalVideoFormat::FrameWidthOption(), m_width), m_width) & ~1;
+  unsigned height = std::min((unsigned)mediaFormat.GetOptionInteger(OpalVideoFormat::FrameHeightOption(), m_height), m_height) & ~1;
+  if (width == 0 || height == 0) {
+    width = m_width & ~1;
+    height = m_height & ~1;
+  }
+  unsigned bitRate = GetBitRateTier(mediaFormat.GetOptionInteger(OpalMediaFormat::TargetBitRateOption(), mediaFormat.GetBandwidth()));
+
+  PString wanted = mediaFormat.GetName() + psprintf(":%ux%u:%u", width, height, bitRate);
+
+  // Stick with the class we had, unless the stream has renegotiated
+  StreamClass & streamClass = streamClasses[streamID];
+  StreamClassMap::iterator previous = m_streamClasses.find(streamID);
+  if (previous != m_streamClasses.end() && previous->second.m_wanted == wanted) {
+    EncodeClassMap::iterator it = m_encodeClasses.find(previous->second.m_actual);
+    if (it != m_encodeClasses.end()) {
+      streamClass = previous->second;
+      return it->second;
+    }
+  }
+
+  streamClass.m_wanted = wanted;
+
+  EncodeClassMap::iterator it = m_encodeClasses.find(wanted);
+  if (it == m_encodeClasses.end() && m_maxEncodeClasses > 0 && m_encodeClasses.size() >= m_maxEncodeClasses) {
+    double bestDistance = 0;
+    for (EncodeClassMap::iterator candidate = m_encodeClasses.begin(); candidate != m_encodeClasses.end(); ++candidate) {
+      const EncodeClass & encodeClass = *candidate->second;
+      if (encodeClass.m_mediaFormat.GetName() != mediaFormat.GetName() || encodeClass.m_encoder == NULL)
+        continue;
+      double distance = EncodeClassDistance(width*height, bitRate,
+                                            encodeClass.m_width*encodeClass.m_height, encodeClass.m_bitRate);
+      if (it == m_encodeClasses.end() || distance < bestDistance) {
+        it = candidate;
+        bestDistance = distance;
+      }
+    }
+    PTRACE_IF(2, it == m_encodeClasses.end(), "MixerNode\tMaximum " << m_maxEncodeClasses
+              << " encoders exceeded, no existing encoder for " << mediaFormat);
+  }
+
+  if (it == m_encodeClasses.end()) {
+    it = m_encodeClasses.insert(EncodeClassMap::value_type(wanted, new EncodeClass(mediaFormat, width, height, bitRate))).first;
+    OpalVideoTranscoder * encoder = dynamic_cast<OpalVideoTranscoder *>(it->second->m_encoder);
+    if (encoder != NULL)
+      encoder->GetUpdateCoalescer().SetMinInterval(m_minIFrameInterval);
+    PTRACE(3, "MixerNode\tCreated video encode class " << wanted);
+  }
+
+  PTRACE(4, "MixerNode\tStream id " << streamID << " wanting " << wanted << " using encode class " << it->first);
+  streamClass.m_actual = it->first;
+  return it->second;
 }
 
 
 bool OpalMixerNode::VideoMixer::OnMixed(RTP_DataFrame * & output)
 {
-  std::map<OpalMediaFormat, RTP_DataFrameList> cachedVideo;
+  std::set<PString> updatePictures;
+  m_updatePictureMutex.Wait();
+  updatePictures.swap(m_updatePictures);
+  m_updatePictureMutex.Signal();
+
+  PWaitAndSignal mutex(m_encodeMutex);
+
+  for (EncodeClassMap::iterator it = m_encodeClasses.begin(); it != m_encodeClasses.end(); ++it) {
+    it->second->m_state = it->second->m_encoder != NULL ? EncodeClass::Pending : EncodeClass::Failed;
+    it->second->m_streamCount = 0;
+  }
+
+  StreamClassMap streamClasses;
 
   for (PSafePtr<OpalMixerMediaStream> stream(m_outputStreams, PSafeReadOnly); stream != NULL; ++stream) {
     OpalMediaFormat mediaFormat = stream->GetMediaFormat();
-    if (mediaFormat == OpalYUV420P)
+    if (mediaFormat == OpalYUV420P) {
       stream->PushPacket(*output);
-    else {
-      if (cachedVideo.find(mediaFormat) == cachedVideo.end()) {
-        OpalTranscoder & transcoder = GetTranscoder(OpalYUV420P, mediaFormat);
-        if (!transcoder.ConvertFrames(*output, cachedVideo[mediaFormat])) {
-          PTRACE(2, "MixerNode\tCould not convert video to "
-                 << mediaFormat << " for stream id " << stream->GetID());
-          stream->Close();
-          continue;
-        }
+      continue;
+    }
+
+    EncodeClass & encodeClass = *GetEncodeClass(stream->GetID(), mediaFormat, streamClasses);
+    ++encodeClass.m_streamCount;
+
+    // Every stream sharing the encoder may ask, the encoder merges them
+    if (encodeClass.m_encoder != NULL && updatePictures.find(stream->GetID()) != updatePictures.end())
+      encodeClass.m_encoder->ExecuteCommand(OpalVideoUpdatePicture());
+
+    if (encodeClass.m_state == EncodeClass::Pending) {
+      const RTP_DataFrame * input = output;
+
+      if (encodeClass.m_width != m_width || encodeClass.m_height != m_height) {
+        encodeClass.m_scaled.SetPayloadSize(sizeof(PluginCodec_Video_FrameHeader) + encodeClass.m_width*encodeClass.m_height*3/2);
+        encodeClass.m_scaled.SetTimestamp(output->GetTimestamp());
+        PluginCodec_Video_FrameHeader * video = (PluginCodec_Video_FrameHeader *)encodeClass.m_scaled.GetPayloadPtr();
+        video->x = video->y = 0;
+        video->width = encodeClass.m_width;
+        video->height = encodeClass.m_height;
+
+        LayoutRect rect;
+        rect.m_x = rect.m_y = 0;
+        rect.m_width = encodeClass.m_width;
+        rect.m_height = encodeClass.m_height;
+        ScaleYUV420P((const PluginCodec_Video_FrameHeader *)output->GetPayloadPtr(),
+                     OPAL_VIDEO_FRAME_DATA_PTR(video), encodeClass.m_width, encodeClass.m_height, rect);
+        input = &encodeClass.m_scaled;
       }
 
-      RTP_DataFrameList & list = cachedVideo[mediaFormat];
-      for (RTP_DataFrameList::iterator frame = list.begin(); frame != list.end(); ++frame)
-        stream->PushPacket(*frame);
+      encodeClass.m_encoded.RemoveAll();
+      encodeClass.m_state = encodeClass.m_encoder->ConvertFrames(*input, encodeClass.m_encoded)
+                                                ? EncodeClass::Encoded : EncodeClass::Failed;
+    }
+
+    if (encodeClass.m_state != EncodeClass::Encoded) {
+      PTRACE(2, "MixerNode\tCould not convert video to "
+             << mediaFormat << " for stream id " << stream->GetID());
+      stream->Close();
+      continue;
+    }
+
+    for (RTP_DataFrameList::iterator frame = encodeClass.m_encoded.begin(); frame != encodeClass.m_encoded.end(); ++frame)
+      stream->PushPacket(*frame);
+  }
+
+  // Forget streams that have gone, and encoders nobody is using
+  m_streamClasses.swap(streamClasses);
+
+  EncodeClassMap::iterator it = m_encodeClasses.begin();
+  while (it != m_encodeClasses.end()) {
+    if (it->second->m_streamCount > 0)
+      ++it;
+    else {
+      PTRACE(3, "MixerNode\tRemoved video encode class " << it->first);
+      delete it->second;
+      m_encodeClasses.erase(it++);
     }
   }
 
@@ -41,6 +41,10 @@
 #include <opal/patch.h>
 #include <opal/mediastrm.h>
 #include <opal/transcoders.h>
+#include <opal/endpoint.h>
+#include <opal/manager.h>
+
+#include <algorithm>
 
 #if OPAL_VIDEO
 #include <codec/vidcodec.h>
@@ -48,6 +52,8 @@
 
 #define new PNEW
 
+#define MAX_FRAMES_PER_SERVICE 10  // frames read per scheduled service, for fairness between patches
+
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -56,6 +62,12 @@ OpalMediaPatch::OpalMediaPatch(OpalMediaStream & src)
 {
   src.SetPatch(this);
   patchThread = NULL;
+  m_scheduler = NULL;
+  m_scheduleState = ScheduleIdle;
+  m_frameAllocations = 0;
+  m_relaySession = NULL;
+  m_relayByReactor = false;
+  m_relayDisabled = false;
   PTRACE(5, "Patch\tCreated media patch " << this);
 }
 
@@ -63,6 +75,10 @@ OpalMediaPatch::OpalMediaPatch(OpalMediaStream & src)
 OpalMediaPatch::~OpalMediaPatch()
 {
   PWaitAndSignal m(patchThreadMutex);
+
+  if (m_scheduler != NULL)
+    m_scheduler->Remove(*this);
+
   inUse.StartWrite();
   if (patchThread != NULL) {
     PAssert(patchThread->WaitForTermination(10000), "Media patch thread not terminated.");
@@ -100,8 +116,29 @@ void OpalMediaPatch::Start()
 {
   PWaitAndSignal m(patchThreadMutex);
 	
-  if(patchThread != NULL) 
+  if(patchThread != NULL || m_scheduler != NULL || m_relayByReactor) 
     return;
+
+  if (m_relaySession == NULL)
+    StartRelay();
+
+  if (m_relayByReactor) {
+    OnPatchStart();
+    return;
+  }
+
+  OpalMediaPatchScheduler * scheduler = source.GetConnection().GetEndPoint().GetManager().GetMediaPatchScheduler();
+  if (scheduler != NULL && IsAsynchronous()) {
+    m_scheduleInterval = source.GetDataReadyInterval();
+    if (m_scheduleInterval > 0 || source.SetDataReadyNotifier(PCREATE_NOTIFIER(OnSourceDataReady))) {
+      OnPatchStart();
+      m_scheduler = scheduler;
+      scheduler->Add(*this);
+      PTRACE(4, "Media\tScheduling " << *this << ' '
+             << (m_scheduleInterval > 0 ? "every " + m_scheduleInterval.AsString() + "s" : PString("on data ready")));
+      return;
+    }
+  }
 	
   patchThread = new Thread(*this);
   patchThread->Resume();
@@ -114,6 +151,8 @@ void OpalMediaPatch::Close()
 {
   PTRACE(3, "Patch\tClosing media patch " << *this);
 
+  StopRelay(false);
+
   inUse.StartWrite();
   filters.RemoveAll();
   source.Close();
@@ -133,6 +172,11 @@ void OpalMediaPatch::Close()
   PTRACE(4, "Patch\tWaiting for media patch thread to stop " << *this);
   {
     PWaitAndSignal m(patchThreadMutex);
+    if (m_scheduler != NULL) {
+      inUse.EndWrite();
+      m_scheduler->Remove(*this);
+      return;
+    }
     if (patchThread != NULL && !patchThread->IsSuspended()) {
       inUse.EndWrite();
       PAssert(patchThread->WaitForTermination(10000), "Media patch thread not terminated.");
@@ -146,6 +190,9 @@ void OpalMediaPatch::Close()
 
 PBoolean OpalMediaPatch::AddSink(const OpalMediaStreamPtr & sinkStream)
 {
+  // Relaying only works with one sink
+  StopRelay(true);
+
   PWriteWaitAndSignal mutex(inUse);
 
   if (PAssertNULL(sinkStream) == NULL)
@@ -177,6 +224,8 @@ PBoolean OpalMediaPatch::AddSink(const OpalMediaStreamPtr & sinkStream)
   PString id = sinkStream->GetID();
   sink->primaryCodec = OpalTranscoder::Create(sourceFormat, destinationFormat, (const BYTE *)id, id.GetLength());
   if (sink->primaryCodec != NULL) {
+    sink->transcoderCost = OpalTranscoder::GetTranscoderCost(sourceFormat, destinationFormat);
+
     PTRACE(4, "Patch\tCreated primary codec " << sourceFormat << "->" << destinationFormat << " with ID " << id);
 
     if (!sinkStream->SetDataSize(sink->primaryCodec->GetOptimalDataFrameSize(false))) {
@@ -192,13 +241,17 @@ PBoolean OpalMediaPatch::AddSink(const OpalMediaStreamPtr & sinkStream)
   else {
     OpalMediaFormat intermediateFormat;
     if (!OpalTranscoder::FindIntermediateFormat(sourceFormat, destinationFormat,
-                                                intermediateFormat)) {
+                                                intermediateFormat, &sink->transcoderCost)) {
       PTRACE(1, "Patch\tCould find compatible media format for " << *sinkStream);
       return false;
     }
 
     sink->primaryCodec = OpalTranscoder::Create(sourceFormat, intermediateFormat, (const BYTE *)id, id.GetLength());
     sink->secondaryCodec = OpalTranscoder::Create(intermediateFormat, destinationFormat, (const BYTE *)id, id.GetLength());
+    if (sink->primaryCodec == NULL || sink->secondaryCodec == NULL) {
+      PTRACE(1, "Patch\tCould not create codecs " << sourceFormat << "/" << intermediateFormat << "/" << destinationFormat << " for " << *sinkStream);
+      return false;
+    }
 
     PTRACE(4, "Patch\tCreated two stage codec " << sourceFormat << "/" << intermediateFormat << "/" << destinationFormat << " with ID " << id);
 
@@ -214,6 +267,8 @@ PBoolean OpalMediaPatch::AddSink(const OpalMediaStreamPtr & sinkStream)
            << " and " << *sink->secondaryCodec << ", data size=" << sinkStream->GetDataSize());
   }
 
+  PTRACE(4, "Patch\tTranscoding cost for " << *sinkStream << " is " << sink->transcoderCost << "us/s");
+
   source.SetDataSize(sink->primaryCodec->GetOptimalDataFrameSize(true));
   return true;
 }
@@ -226,6 +281,8 @@ void OpalMediaPatch::RemoveSink(const OpalMediaStreamPtr & stream)
 
   PTRACE(3, "Patch\tRemoving media stream sink " << *stream);
 
+  StopRelay(false);
+
   inUse.StartWrite();
 
   for (PList<Sink>::iterator s = sinks.begin(); s != sinks.end(); ++s) {
@@ -289,6 +346,17 @@ void OpalMediaPatch::UnLockSinkTranscoder() const
 }
 
 
+unsigned OpalMediaPatch::GetTranscoderCost() const
+{
+  PReadWaitAndSignal mutex(inUse);
+
+  unsigned cost = 0;
+  for (PList<Sink>::const_iterator s = sinks.begin(); s != sinks.end(); ++s)
+    cost += s->transcoderCost;
+  return cost;
+}
+
+
 #if OPAL_STATISTICS
 void OpalMediaPatch::GetStatistics(OpalMediaStatistics & statistics, bool fromSink) const
 {
@@ -323,6 +391,7 @@ OpalMediaPatch::Sink::Sink(OpalMediaPatch & p, const OpalMediaStreamPtr & s)
   , stream(s)
   , primaryCodec(NULL)
   , secondaryCodec(NULL)
+  , transcoderCost(0)
   , writeSuccessful(true)
 #if OPAL_VIDEO
   , rateController(NULL)
@@ -348,6 +417,10 @@ OpalMediaPatch::Sink::~Sink()
 
 void OpalMediaPatch::AddFilter(const PNotifier & filter, const OpalMediaFormat & stage)
 {
+  // Relayed frames are never seen by the patch, so cannot be filtered
+  if (stage.IsEmpty() || stage == source.GetMediaFormat())
+    StopRelay(true);
+
   PWriteWaitAndSignal mutex(inUse);
 
   if (source.GetMediaFormat().GetMediaType() != stage.GetMediaType())
@@ -437,22 +510,14 @@ bool OpalMediaPatch::OnPatchStart()
 {
   source.OnPatchStart();
 
-  if (source.IsSynchronous())
-    return false;
-
-  bool isAudio = source.GetMediaFormat().GetMediaType() == OpalMediaType::Audio();
+  if (IsAsynchronous())
+    return true;
 
-  PReadWaitAndSignal mutex(inUse);
+  // A synchronous sink sets the pace, so an audio source needs to buffer
+  if (!source.IsSynchronous() && source.GetMediaFormat().GetMediaType() == OpalMediaType::Audio())
+    source.EnableJitterBuffer();
 
-  for (PList<Sink>::iterator s = sinks.begin(); s != sinks.end(); ++s) {
-    if (s->stream->IsSynchronous()) {
-      if (isAudio) 
-        source.EnableJitterBuffer();
-      return false;
-    }
-  }
-	
-  return true;
+  return false;
 }
 
 
@@ -465,17 +530,13 @@ void OpalMediaPatch::Main()
 
   while (source.IsOpen()) {
 
-    RTP_DataFrame sourceFrame(source.GetDataSize());
-    sourceFrame.SetPayloadType(source.GetMediaFormat().GetPayloadType());
-    sourceFrame.SetPayloadSize(0); 
-
-    if (!source.ReadPacket(sourceFrame)) {
+    if (!ReadSourceFrame()) {
       PTRACE(4, "Patch\tThread ended because source read failed");
       break;
     }
  
     inUse.StartRead();
-    bool written = DispatchFrame(sourceFrame);
+    bool written = DispatchFrame(m_sourceFrame);
     inUse.EndRead();
 
     if (!written) {
@@ -499,7 +560,164 @@ void OpalMediaPatch::Main()
 
   source.OnPatchStop();
 
-  PTRACE(4, "Patch\tThread ended for " << *this);
+  PTRACE(4, "Patch\tThread ended for " << *this << ", frame allocations=" << m_frameAllocations);
+}
+
+
+bool OpalMediaPatch::ReadSourceFrame()
+{
+  /* Reuse the buffer from the previous frame unless it is too small, or
+     something downstream kept a reference to it, in which case writing into
+     it would corrupt their copy. */
+  PINDEX dataSize = source.GetDataSize();
+  if (!m_sourceFrame.IsUnique() || m_sourceFrame.GetSize() < RTP_DataFrame::MinHeaderSize+dataSize) {
+    m_sourceFrame = RTP_DataFrame(dataSize);
+    ++m_frameAllocations;
+  }
+  else {
+    // Reset the header to the same state as a newly constructed frame
+    BYTE * header = m_sourceFrame.GetPointer();
+    memset(header, 0, RTP_DataFrame::MinHeaderSize);
+    header[0] = '\x80';
+    header[1] = '\x7f';
+  }
+
+  m_sourceFrame.SetPayloadType(source.GetMediaFormat().GetPayloadType());
+  m_sourceFrame.SetPayloadSize(0);
+
+  const BYTE * buffer = m_sourceFrame;
+  if (!source.ReadPacket(m_sourceFrame))
+    return false;
+
+  // Stream grew the buffer, or substituted one of its own
+  if ((const BYTE *)m_sourceFrame != buffer)
+    ++m_frameAllocations;
+
+  return true;
+}
+
+
+void OpalMediaPatch::StartRelay()
+{
+  // Must have patchThreadMutex
+  if (m_relayDisabled || !source.GetConnection().GetEndPoint().GetManager().GetRTPRelay())
+    return;
+
+  PReadWaitAndSignal mutex(inUse);
+
+  // Only when the data goes straight from one RTP session to another
+  if (sinks.GetSize() != 1 || sinks.front().primaryCodec != NULL)
+    return;
+
+  for (PList<Filter>::iterator f = filters.begin(); f != filters.end(); ++f) {
+    if (f->stage.IsEmpty() || f->stage == source.GetMediaFormat())
+      return;
+  }
+
+  OpalRTPMediaStream * sourceRTP = dynamic_cast<OpalRTPMediaStream *>(&source);
+  OpalRTPMediaStream * sinkRTP = dynamic_cast<OpalRTPMediaStream *>(&*sinks.front().stream);
+  if (sourceRTP == NULL || sinkRTP == NULL)
+    return;
+
+  RTP_UDP * session = dynamic_cast<RTP_UDP *>(&sourceRTP->GetRtpSession());
+  if (session == NULL || session->GetJitterBufferSize() > 0)
+    return;
+
+  m_relayByReactor = session->SetRelaySession(&sinkRTP->GetRtpSession(), sinkRTP->GetMediaFormat().GetPayloadType());
+  m_relaySession = session;
+  PTRACE(3, "Patch\tRelaying RTP from " << (m_relayByReactor ? "reactor" : "patch thread") << " for " << *this);
+}
+
+
+void OpalMediaPatch::StopRelay(bool restart)
+{
+  {
+    PWaitAndSignal m(patchThreadMutex);
+
+    if (m_relaySession == NULL)
+      return;
+
+    m_relaySession->SetRelaySession(NULL);
+    m_relaySession = NULL;
+    m_relayDisabled = true;
+
+    // Patch thread simply carries on with the next frame read
+    if (!m_relayByReactor)
+      return;
+
+    m_relayByReactor = false;
+  }
+
+  if (restart)
+    Start();
+  else
+    source.OnPatchStop();
+}
+
+
+bool OpalMediaPatch::IsAsynchronous() const
+{
+  if (source.IsSynchronous())
+    return false;
+
+  PReadWaitAndSignal mutex(inUse);
+
+  for (PList<Sink>::const_iterator s = sinks.begin(); s != sinks.end(); ++s) {
+    if (s->stream->IsSynchronous())
+      return false;
+  }
+
+  return true;
+}
+
+
+bool OpalMediaPatch::Service(bool & more)
+{
+  // When clocked, one frame per interval, otherwise while data is waiting
+  PINDEX maxFrames = m_scheduleInterval > 0 ? 1 : MAX_FRAMES_PER_SERVICE;
+
+  for (PINDEX count = 0; count < maxFrames; ++count) {
+    if (!source.IsOpen())
+      return false;
+
+    if (!source.IsDataReady())
+      return true;
+
+    if (!ReadSourceFrame()) {
+      PTRACE(4, "Patch\tScheduling ended because source read failed");
+      return false;
+    }
+
+    inUse.StartRead();
+    bool written = DispatchFrame(m_sourceFrame);
+    inUse.EndRead();
+
+    if (!written) {
+      PTRACE(4, "Patch\tScheduling ended because all sink writes failed");
+      return false;
+    }
+  }
+
+  more = m_scheduleInterval == 0;
+  return true;
+}
+
+
+void OpalMediaPatch::StopScheduled()
+{
+  if (m_scheduleInterval == 0)
+    source.SetDataReadyNotifier(PNotifier());
+
+  source.OnPatchStop();
+
+  PTRACE(4, "Patch\tScheduling ended for " << *this << ", frame allocations=" << m_frameAllocations);
+}
+
+
+void OpalMediaPatch::OnSourceDataReady(PObject &, INT)
+{
+  if (m_scheduler != NULL)
+    m_scheduler->Schedule(*this);
 }
 
 
@@ -507,9 +725,20 @@ bool OpalMediaPatch::DispatchFrame(RTP_DataFrame & frame)
 {
   FilterFrame(frame, source.GetMediaFormat());    
 
+  if (sinks.GetSize() == 1) {
+    if (sinks.front().WriteFrame(frame, false))
+      return true;
+    PTRACE(2, "Patch\tWriteFrame failed");
+    return false;
+  }
+
+  /* Each sink gets its own reference to the one frame buffer, so the
+     payload is not copied per sink. A sink that has to change more than
+     the fixed RTP header makes its own copy, see Sink::WriteFrame(). */
   bool written = false;
   for (PList<Sink>::iterator s = sinks.begin(); s != sinks.end(); ++s) {
-    if (s->WriteFrame(frame))
+    RTP_DataFrame sinkFrame(frame);
+    if (s->WriteFrame(sinkFrame, true))
       written = true;
     else {
       PTRACE(2, "Patch\tWriteFrame failed");
@@ -634,7 +863,47 @@ bool OpalMediaPatch::Sink::RateControlExceeded(bool & forceIFrame)
 #endif
 
 
-bool OpalMediaPatch::Sink::WriteFrame(RTP_DataFrame & sourceFrame)
+/* Header overlay for a frame buffer shared between sinks. The fixed RTP
+   header, i.e. payload type, marker, sequence number, timestamp and SSRC,
+   is saved before a sink writes and restored after, so each sink can set
+   its own values in place, e.g. the RTP session rewriting sequence number,
+   timestamp and SSRC, without the next sink seeing them, and without the
+   payload being copied. */
+class OpalSinkHeaderOverlay
+{
+  public:
+    OpalSinkHeaderOverlay(RTP_DataFrame & frame, bool shared)
+      : m_buffer(shared ? frame.GetPointer() : NULL)
+    {
+      if (m_buffer != NULL)
+        memcpy(m_header, m_buffer, sizeof(m_header));
+    }
+
+    ~OpalSinkHeaderOverlay()
+    {
+      if (m_buffer != NULL)
+        memcpy(m_buffer, m_header, sizeof(m_header));
+    }
+
+  protected:
+    BYTE * m_buffer;
+    BYTE   m_header[RTP_DataFrame::MinHeaderSize];
+};
+
+
+bool OpalMediaPatch::Sink::WriteSourcePacket(RTP_DataFrame & sourceFrame, bool shared)
+{
+  // Only a stream that changes the payload, e.g. SRTP, needs its own copy
+  if (shared && !stream->CanShareWrittenPacket() && !sourceFrame.IsUnique()) {
+    sourceFrame.MakeUnique();
+    ++patch.m_frameAllocations;
+  }
+
+  return (writeSuccessful = stream->WritePacket(sourceFrame));
+}
+
+
+bool OpalMediaPatch::Sink::WriteFrame(RTP_DataFrame & sourceFrame, bool shared)
 {
   if (!writeSuccessful)
     return false;
@@ -642,6 +911,8 @@ bool OpalMediaPatch::Sink::WriteFrame(RTP_DataFrame & sourceFrame)
   if (stream->IsPaused())
     return true;
 
+  OpalSinkHeaderOverlay header(sourceFrame, shared);
+
 #if OPAL_VIDEO
   if (rateController != NULL) {
     bool forceIFrame = false;
@@ -669,15 +940,18 @@ bool OpalMediaPatch::Sink::WriteFrame(RTP_DataFrame & sourceFrame)
 #endif
 
   if (primaryCodec == NULL)
-    return (writeSuccessful = stream->WritePacket(sourceFrame));
+    return WriteSourcePacket(sourceFrame, shared);
 
   if (CannotTranscodeFrame(*primaryCodec, sourceFrame))
-    return (writeSuccessful = stream->WritePacket(sourceFrame));
+    return WriteSourcePacket(sourceFrame, shared);
 
+  PINDEX previousCount = intermediateFrames.GetSize();
   if (!primaryCodec->ConvertFrames(sourceFrame, intermediateFrames)) {
     PTRACE(1, "Patch\tMedia conversion (primary) failed");
     return false;
   }
+  if (intermediateFrames.GetSize() > previousCount)
+    patch.m_frameAllocations += intermediateFrames.GetSize() - previousCount;
 
 #if OPAL_VIDEO
   if (secondaryCodec == NULL && rateController != NULL) {
@@ -714,10 +988,13 @@ bool OpalMediaPatch::Sink::WriteFrame(RTP_DataFrame & sourceFrame)
       continue;
     }
 
+    previousCount = finalFrames.GetSize();
     if (!secondaryCodec->ConvertFrames(*interFrame, finalFrames)) {
       PTRACE(1, "Patch\tMedia conversion (secondary) failed");
       return false;
     }
+    if (finalFrames.GetSize() > previousCount)
+      patch.m_frameAllocations += finalFrames.GetSize() - previousCount;
 
     for (RTP_DataFrameList::iterator finalFrame = finalFrames.begin(); finalFrame != finalFrames.end(); ++finalFrame) {
       patch.FilterFrame(*finalFrame, secondaryCodec->GetOutputFormat());
@@ -768,3 +1045,254 @@ PBoolean OpalPassiveMediaPatch::PushFrame(RTP_DataFrame & frame)
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+
+class OpalMediaPatchScheduler::Worker : public PThread
+{
+    PCLASSINFO(Worker, PThread);
+  public:
+    Worker(OpalMediaPatchScheduler & scheduler, unsigned index)
+      : PThread(65536,  //16*4kpage size
+                NoAutoDeleteThread,
+                HighPriority,
+                psprintf("Media Patch:%u", index))
+      , m_scheduler(scheduler)
+      , m_patch(NULL)
+      , m_patchRemoved(false)
+    {
+    }
+
+    virtual void Main() { m_scheduler.WorkerMain(*this); }
+
+    OpalMediaPatchScheduler & m_scheduler;
+    OpalMediaPatch          * m_patch;
+    bool                      m_patchRemoved;
+};
+
+
+OpalMediaPatchScheduler::OpalMediaPatchScheduler(unsigned workers)
+  : m_patchCount(0)
+  , m_shutdown(false)
+{
+  if (workers == 0)
+    workers = OpalManager::GetProcessorCount();
+
+  for (unsigned i = 0; i < workers; ++i) {
+    Worker * worker = new Worker(*this, i);
+    m_workers.push_back(worker);
+    worker->Resume();
+  }
+
+  PTRACE(3, "Patch\tScheduler started with " << workers << " threads");
+}
+
+
+OpalMediaPatchScheduler::~OpalMediaPatchScheduler()
+{
+  PTRACE_IF(1, m_patchCount > 0, "Patch\tScheduler stopping with " << m_patchCount << " patches");
+
+  m_mutex.Wait();
+  m_shutdown = true;
+  m_mutex.Signal();
+  m_wakeUp.Signal();
+
+  for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); ++it) {
+    (*it)->WaitForTermination();
+    delete *it;
+  }
+
+  PTRACE(3, "Patch\tScheduler stopped");
+}
+
+
+void OpalMediaPatchScheduler::Add(OpalMediaPatch & patch)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  ++m_patchCount;
+  patch.m_scheduleDeadline = PTimer::Tick();
+  patch.m_scheduleState = OpalMediaPatch::ScheduleQueued;
+  m_runQueue.push_back(&patch);
+  m_wakeUp.Signal();
+}
+
+
+void OpalMediaPatchScheduler::Remove(OpalMediaPatch & patch)
+{
+  m_mutex.Wait();
+
+  for (;;) {
+    switch (patch.m_scheduleState) {
+      case OpalMediaPatch::ScheduleFinished :
+        m_mutex.Signal();
+        return;
+
+      case OpalMediaPatch::ScheduleQueued :
+        m_runQueue.erase(std::find(m_runQueue.begin(), m_runQueue.end(), &patch));
+        break;
+
+      case OpalMediaPatch::ScheduleTimed :
+        for (TimedPatches::iterator it = m_timedPatches.begin(); it != m_timedPatches.end(); ++it) {
+          if (it->second == &patch) {
+            m_timedPatches.erase(it);
+            break;
+          }
+        }
+        break;
+
+      case OpalMediaPatch::ScheduleRunning :
+      case OpalMediaPatch::ScheduleRunningNotified :
+      {
+        // If we are the worker servicing it, just tell it the patch is gone
+        std::vector<Worker *>::iterator it = m_workers.begin();
+        while (it != m_workers.end() && (*it)->m_patch != &patch)
+          ++it;
+        if (it != m_workers.end() && *it == PThread::Current()) {
+          (*it)->m_patchRemoved = true;
+          break;
+        }
+      }
+        // Else wait for it to finish, like the stopping case
+
+      case OpalMediaPatch::ScheduleStopping :
+      {
+        PSyncPoint changed;
+        m_stateWaiters.push_back(&changed);
+        m_mutex.Signal();
+        changed.Wait();
+        m_mutex.Wait();
+        continue;
+      }
+
+      default :
+        break;
+    }
+    break;
+  }
+
+  patch.m_scheduleState = OpalMediaPatch::ScheduleStopping;
+  m_mutex.Signal();
+
+  Stopped(patch);
+}
+
+
+void OpalMediaPatchScheduler::Stopped(OpalMediaPatch & patch)
+{
+  patch.StopScheduled();
+
+  PWaitAndSignal mutex(m_mutex);
+  patch.m_scheduleState = OpalMediaPatch::ScheduleFinished;
+  --m_patchCount;
+  SignalStateWaiters();
+}
+
+
+void OpalMediaPatchScheduler::SignalStateWaiters()
+{
+  // Must have m_mutex
+  for (std::vector<PSyncPoint *>::iterator it = m_stateWaiters.begin(); it != m_stateWaiters.end(); ++it)
+    (*it)->Signal();
+  m_stateWaiters.clear();
+}
+
+
+void OpalMediaPatchScheduler::Schedule(OpalMediaPatch & patch)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  switch (patch.m_scheduleState) {
+    case OpalMediaPatch::ScheduleIdle :
+      patch.m_scheduleState = OpalMediaPatch::ScheduleQueued;
+      m_runQueue.push_back(&patch);
+      m_wakeUp.Signal();
+      break;
+
+    case OpalMediaPatch::ScheduleRunning :
+      patch.m_scheduleState = OpalMediaPatch::ScheduleRunningNotified;
+      break;
+
+    default :
+      break;
+  }
+}
+
+
+void OpalMediaPatchScheduler::WorkerMain(Worker & worker)
+{
+  PTRACE(4, "Patch\tScheduler thread started");
+
+  m_mutex.Wait();
+
+  while (!m_shutdown) {
+    PTimeInterval now = PTimer::Tick();
+    while (!m_timedPatches.empty() && m_timedPatches.begin()->first <= now) {
+      OpalMediaPatch * patch = m_timedPatches.begin()->second;
+      m_timedPatches.erase(m_timedPatches.begin());
+      patch->m_scheduleState = OpalMediaPatch::ScheduleQueued;
+      m_runQueue.push_back(patch);
+    }
+
+    if (m_runQueue.empty()) {
+      PTimeInterval timeout = m_timedPatches.empty() ? PMaxTimeInterval : (m_timedPatches.begin()->first - now);
+      m_mutex.Signal();
+      m_wakeUp.Wait(timeout);
+      m_mutex.Wait();
+      continue;
+    }
+
+    OpalMediaPatch * patch = m_runQueue.front();
+    m_runQueue.pop_front();
+
+    // Get another worker going on anything left
+    if (!m_runQueue.empty())
+      m_wakeUp.Signal();
+
+    patch->m_scheduleState = OpalMediaPatch::ScheduleRunning;
+    worker.m_patch = patch;
+    worker.m_patchRemoved = false;
+    m_mutex.Signal();
+
+    bool more = false;
+    bool running = patch->Service(more);
+
+    m_mutex.Wait();
+    worker.m_patch = NULL;
+    SignalStateWaiters();
+
+    // Was removed, and possibly deleted, while we were servicing it
+    if (worker.m_patchRemoved)
+      continue;
+
+    if (!running) {
+      patch->m_scheduleState = OpalMediaPatch::ScheduleStopping;
+      m_mutex.Signal();
+      Stopped(*patch);
+      m_mutex.Wait();
+    }
+    else if (more || patch->m_scheduleState == OpalMediaPatch::ScheduleRunningNotified) {
+      patch->m_scheduleState = OpalMediaPatch::ScheduleQueued;
+      m_runQueue.push_back(patch);
+    }
+    else if (patch->m_scheduleInterval > 0) {
+      // Keep to the clock, but do not try to catch up after a long stall
+      patch->m_scheduleDeadline += patch->m_scheduleInterval;
+      now = PTimer::Tick();
+      if (patch->m_scheduleDeadline < now - patch->m_scheduleInterval)
+        patch->m_scheduleDeadline = now;
+      patch->m_scheduleState = OpalMediaPatch::ScheduleTimed;
+      m_timedPatches.insert(TimedPatches::value_type(patch->m_scheduleDeadline, patch));
+    }
+    else
+      patch->m_scheduleState = OpalMediaPatch::ScheduleIdle;
+  }
+
+  m_mutex.Signal();
+
+  // Pass the shut down on to the next worker
+  m_wakeUp.Signal();
+
+  PTRACE(4, "Patch\tScheduler thread ended");
+}
+
+
@@ -164,6 +164,10 @@ RTP_Session * OpalRTPConnection::CreateSession(const OpalTransport & transport,
   if (manager.TranslateIPAddress(localAddress, remoteAddress)){
     rtpSession->SetLocalAddress(localAddress);
   }
+
+  rtpSession->SetJitterBufferThreadless(manager.GetJitterBufferThreadless());
+  rtpSession->SetReceiveBatchSize(manager.GetRTPBatchSize());
+  rtpSession->SetReactor(manager.GetRTPReactor());
   
   return rtpSession;
 }
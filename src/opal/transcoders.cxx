@@ -38,6 +38,8 @@
 
 #include <opal/transcoders.h>
 
+#include <algorithm>
+#include <math.h>
 
 #define new PNEW
 
@@ -140,7 +142,7 @@ PBoolean OpalTranscoder::ConvertFrames(const RTP_DataFrame & input, RTP_DataFram
   }
 
   // set the output timestamp and marker bit
-  output.front().SetTimestamp(input.GetTimestamp()*outputMediaFormat.GetClockRate()/inputMediaFormat.GetClockRate());
+  output.front().SetTimestamp((DWORD)((PUInt64)input.GetTimestamp()*outputMediaFormat.GetClockRate()/inputMediaFormat.GetClockRate()));
   output.front().SetMarker(input.GetMarker());
 
   // set the output payload type directly from the output media format
@@ -273,6 +275,34 @@ static bool MergeFormats(const OpalMediaFormatList & masterFormats,
 }
 
 
+struct TranscoderPath {
+  unsigned m_cost;
+  OpalMediaFormatList::const_iterator m_src;
+  OpalMediaFormatList::const_iterator m_dst;
+  bool operator<(const TranscoderPath & other) const { return m_cost < other.m_cost; }
+};
+
+
+static bool SelectCheapestPath(std::vector<TranscoderPath> & paths,
+                               const OpalMediaFormatList & allFormats,
+                               OpalMediaFormat & srcFormat,
+                               OpalMediaFormat & dstFormat)
+{
+  /* The sort is stable, so where the costs are the same, as they all are
+     without a cost table, the order of the lists decides. */
+  std::stable_sort(paths.begin(), paths.end());
+
+  for (std::vector<TranscoderPath>::iterator path = paths.begin(); path != paths.end(); ++path) {
+    if (MergeFormats(allFormats, *path->m_src, *path->m_dst, srcFormat, dstFormat)) {
+      PTRACE(4, "Opal\tSelected " << *path->m_src << " to " << *path->m_dst << " with cost " << path->m_cost);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
 bool OpalTranscoder::SelectFormats(const OpalMediaType & mediaType,
                                    const OpalMediaFormatList & srcFormats,
                                    const OpalMediaFormatList & dstFormats,
@@ -293,59 +323,147 @@ bool OpalTranscoder::SelectFormats(const OpalMediaType & mediaType,
     }
   }
 
-  // Search for a single transcoder to get from a to b
+  std::vector<TranscoderPath> paths;
+  TranscoderPath path;
+
+  // Search for a single transcoder to get from a to b, cheapest first
+  OpalTranscoderList availableTranscoders = OpalTranscoderFactory::GetKeyList();
   for (d = dstFormats.begin(); d != dstFormats.end(); ++d) {
     for (s = srcFormats.begin(); s != srcFormats.end(); ++s) {
-      OpalTranscoderKey search(*s, *d);
-      OpalTranscoderList availableTranscoders = OpalTranscoderFactory::GetKeyList();
-      for (OpalTranscoderIterator i = availableTranscoders.begin(); i != availableTranscoders.end(); ++i) {
-        if (search == *i &&
-            (s->GetMediaType() == mediaType || d->GetMediaType() == mediaType) &&
-            MergeFormats(allFormats, *s, *d, srcFormat, dstFormat))
-          return true;
+      if ((s->GetMediaType() == mediaType || d->GetMediaType() == mediaType) &&
+          std::find(availableTranscoders.begin(), availableTranscoders.end(),
+                    MakeOpalTranscoderKey(*s, *d)) != availableTranscoders.end()) {
+        path.m_cost = GetTranscoderCost(*s, *d);
+        path.m_src = s;
+        path.m_dst = d;
+        paths.push_back(path);
       }
     }
   }
 
-  // Last gasp search for a double transcoder to get from a to b
+  if (SelectCheapestPath(paths, allFormats, srcFormat, dstFormat))
+    return true;
+
+  // Last gasp search for a double transcoder to get from a to b, cheapest first
+  paths.clear();
   for (d = dstFormats.begin(); d != dstFormats.end(); ++d) {
     for (s = srcFormats.begin(); s != srcFormats.end(); ++s) {
       OpalMediaFormat intermediateFormat;
-      if (FindIntermediateFormat(*s, *d, intermediateFormat) &&
-          (s->GetMediaType() == mediaType || d->GetMediaType() == mediaType) &&
-          MergeFormats(allFormats, *s, *d, srcFormat, dstFormat))
-        return true;
+      if ((s->GetMediaType() == mediaType || d->GetMediaType() == mediaType) &&
+          FindIntermediateFormat(*s, *d, intermediateFormat, &path.m_cost)) {
+        path.m_src = s;
+        path.m_dst = d;
+        paths.push_back(path);
+      }
     }
   }
 
-  return PFalse;
+  return SelectCheapestPath(paths, allFormats, srcFormat, dstFormat);
 }
 
 
+struct TranscoderPathCost {
+  PString  m_intermediate; ///< Empty if there is no two stage path
+  unsigned m_cost;
+};
+
+
+class TranscoderCostTable : public std::map<OpalTranscoderKey, unsigned>
+{
+  public:
+    TranscoderCostTable() : m_transcoderCount(0) { }
+
+    unsigned Lookup(const PString & srcFormat, const PString & dstFormat) const
+    {
+      const_iterator it = find(OpalTranscoderKey(srcFormat, dstFormat));
+      return it != end() ? it->second : (unsigned)OpalTranscoder::UnknownTranscoderCost;
+    }
+
+    // Cheapest two stage path by format pair, dropped when costs or transcoders change
+    std::map<OpalTranscoderKey, TranscoderPathCost> m_paths;
+    size_t m_transcoderCount;
+
+    PMutex m_mutex;
+};
+
+// At file scope so it exists before any media thread can look up a cost
+static TranscoderCostTable TranscoderCosts;
+
+
 bool OpalTranscoder::FindIntermediateFormat(const OpalMediaFormat & srcFormat,
                                             const OpalMediaFormat & dstFormat,
-                                            OpalMediaFormat & intermediateFormat)
+                                            OpalMediaFormat & intermediateFormat,
+                                            unsigned * pathCost)
 {
   intermediateFormat = OpalMediaFormat();
 
+  // A single transcoder is always used if there is one
+  OpalTranscoderKey key = MakeOpalTranscoderKey(srcFormat, dstFormat);
   OpalTranscoderList availableTranscoders = OpalTranscoderFactory::GetKeyList();
+  if (std::find(availableTranscoders.begin(), availableTranscoders.end(), key) != availableTranscoders.end()) {
+    if (pathCost != NULL)
+      *pathCost = GetTranscoderCost(srcFormat, dstFormat);
+    return true;
+  }
+
+  TranscoderCostTable & table = TranscoderCosts;
+  PWaitAndSignal mutex(table.m_mutex);
+
+  if (table.m_transcoderCount != availableTranscoders.size()) {
+    table.m_paths.clear();
+    table.m_transcoderCount = availableTranscoders.size();
+  }
+
+  std::map<OpalTranscoderKey, TranscoderPathCost>::iterator cached = table.m_paths.find(key);
+  if (cached != table.m_paths.end()) {
+    if (cached->second.m_intermediate.IsEmpty())
+      return false;
+
+    OpalMediaFormat probableFormat = cached->second.m_intermediate;
+    if (probableFormat.Merge(srcFormat) && probableFormat.Merge(dstFormat)) {
+      intermediateFormat = probableFormat;
+      if (pathCost != NULL)
+        *pathCost = cached->second.m_cost;
+      return true;
+    }
+
+    // Options of these particular formats do not merge, search the lot again
+  }
+
+  TranscoderPathCost best;
+  best.m_cost = 0;
+  bool anyPath = false;
+
   for (OpalTranscoderIterator find1 = availableTranscoders.begin(); find1 != availableTranscoders.end(); ++find1) {
     if (find1->first == srcFormat) {
-      if (find1->second == dstFormat)
-        return true;
       for (OpalTranscoderIterator find2 = availableTranscoders.begin(); find2 != availableTranscoders.end(); ++find2) {
         if (find2->first == find1->second && find2->second == dstFormat) {
+          anyPath = true;
+          unsigned cost = table.Lookup(find1->first, find1->second) + table.Lookup(find2->first, find2->second);
+          if (intermediateFormat.IsValid() && cost >= best.m_cost)
+            continue;
+
           OpalMediaFormat probableFormat = find1->second;
           if (probableFormat.Merge(srcFormat) && probableFormat.Merge(dstFormat)) {
             intermediateFormat = probableFormat;
-            return true;
+            best.m_intermediate = find1->second;
+            best.m_cost = cost;
           }
         }
       }
     }
   }
 
-  return PFalse;
+  // A failed merge is particular to the options of these formats, so is not cached
+  if (cached == table.m_paths.end() && (intermediateFormat.IsValid() || !anyPath))
+    table.m_paths[key] = best;
+
+  if (!intermediateFormat.IsValid())
+    return false;
+
+  if (pathCost != NULL)
+    *pathCost = best.m_cost;
+  return true;
 }
 
 
@@ -404,6 +522,165 @@ OpalMediaFormatList OpalTranscoder::GetPossibleFormats(const OpalMediaFormatList
 }
 
 
+unsigned OpalTranscoder::GetTranscoderCost(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat)
+{
+  TranscoderCostTable & table = TranscoderCosts;
+  PWaitAndSignal mutex(table.m_mutex);
+
+  return table.Lookup(srcFormat.GetName(), dstFormat.GetName());
+}
+
+
+void OpalTranscoder::SetTranscoderCost(const OpalMediaFormat & srcFormat, const OpalMediaFormat & dstFormat, unsigned cost)
+{
+  TranscoderCostTable & table = TranscoderCosts;
+  PWaitAndSignal mutex(table.m_mutex);
+
+  table[MakeOpalTranscoderKey(srcFormat, dstFormat)] = cost;
+  table.m_paths.clear();
+}
+
+
+bool OpalTranscoder::LoadTranscoderCosts(const PFilePath & filename)
+{
+  PTextFile file;
+  if (!file.Open(filename, PFile::ReadOnly)) {
+    PTRACE(2, "Opal\tCould not open transcoder cost file " << filename);
+    return false;
+  }
+
+  TranscoderCostTable & table = TranscoderCosts;
+  PWaitAndSignal mutex(table.m_mutex);
+
+  PString line;
+  while (file.ReadLine(line)) {
+    line = line.Trim();
+    if (line.IsEmpty() || line[0] == '#')
+      continue;
+
+    PStringArray fields = line.Tokenise('\t');
+    if (fields.GetSize() != 3) {
+      PTRACE(2, "Opal\tIgnoring malformed line in transcoder cost file: \"" << line << '"');
+      continue;
+    }
+
+    table[OpalTranscoderKey(fields[0], fields[1])] = fields[2].AsUnsigned();
+  }
+
+  table.m_paths.clear();
+
+  PTRACE(3, "Opal\tLoaded " << table.size() << " transcoder costs from " << filename);
+  return true;
+}
+
+
+bool OpalTranscoder::SaveTranscoderCosts(const PFilePath & filename)
+{
+  PTextFile file;
+  if (!file.Open(filename, PFile::WriteOnly)) {
+    PTRACE(2, "Opal\tCould not create transcoder cost file " << filename);
+    return false;
+  }
+
+  TranscoderCostTable & table = TranscoderCosts;
+  PWaitAndSignal mutex(table.m_mutex);
+
+  file << "# Source\tDestination\tMicroseconds CPU per second of media\n";
+  for (TranscoderCostTable::iterator it = table.begin(); it != table.end(); ++it)
+    file << it->first.first << '\t' << it->first.second << '\t' << it->second << '\n';
+
+  return file.Close();
+}
+
+
+unsigned OpalTranscoder::MeasureTranscoderCost(const OpalMediaFormat & srcFormat,
+                                               const OpalMediaFormat & dstFormat,
+                                               const PTimeInterval & duration)
+{
+  if (srcFormat.GetMediaType() != OpalMediaType::Audio())
+    return 0;
+
+  OpalMediaFormat rawFormat = OpalAudioFormat::GetPCM16(srcFormat.GetClockRate());
+  if (!rawFormat.IsValid())
+    return 0;
+
+  // Twenty milliseconds of a tone with some noise, so codecs have something to work on
+  static const unsigned PacketTime = 20;
+  unsigned samples = srcFormat.GetClockRate()*PacketTime/1000;
+  RTP_DataFrame raw(samples*sizeof(short));
+  raw.SetPayloadType(rawFormat.GetPayloadType());
+  short * audio = (short *)raw.GetPayloadPtr();
+  for (unsigned i = 0; i < samples; ++i)
+    audio[i] = (short)(8000*sin(i*2*M_PI*440/srcFormat.GetClockRate()) + (rand()%2001) - 1000);
+
+  RTP_DataFrameList input;
+  if (srcFormat == rawFormat)
+    input.Append(new RTP_DataFrame(raw));
+  else {
+    OpalTranscoder * encoder = Create(rawFormat, srcFormat);
+    if (encoder == NULL)
+      return 0;
+    bool ok = encoder->ConvertFrames(raw, input);
+    delete encoder;
+    if (!ok || input.IsEmpty())
+      return 0;
+  }
+
+  OpalTranscoder * transcoder = Create(srcFormat, dstFormat);
+  if (transcoder == NULL)
+    return 0;
+
+  /* This is timed by the wall clock, so take the best of several runs, as
+     other threads and processes only ever make a run look slower. */
+  static const unsigned MeasureRuns = 5;
+  const PTimeInterval runDuration = duration/MeasureRuns;
+  unsigned bestCost = 0;
+
+  RTP_DataFrameList output;
+  for (unsigned run = 0; run < MeasureRuns; ++run) {
+    PTimeInterval mediaTime;
+    PTimeInterval start = PTimer::Tick();
+    PTimeInterval elapsed;
+    do {
+      for (RTP_DataFrameList::iterator frame = input.begin(); frame != input.end(); ++frame) {
+        if (!transcoder->ConvertFrames(*frame, output)) {
+          delete transcoder;
+          return 0;
+        }
+      }
+      mediaTime += PacketTime;
+      elapsed = PTimer::Tick() - start;
+    } while (elapsed < runDuration);
+
+    unsigned cost = (unsigned)(elapsed.GetMilliSeconds()*1000000/mediaTime.GetMilliSeconds());
+    if (run == 0 || cost < bestCost)
+      bestCost = cost;
+  }
+
+  delete transcoder;
+
+  return bestCost > 0 ? bestCost : 1;
+}
+
+
+void OpalTranscoder::CalibrateTranscoderCosts(const PTimeInterval & duration)
+{
+  OpalTranscoderList availableTranscoders = OpalTranscoderFactory::GetKeyList();
+  for (OpalTranscoderIterator it = availableTranscoders.begin(); it != availableTranscoders.end(); ++it) {
+    OpalMediaFormat srcFormat = it->first;
+    OpalMediaFormat dstFormat = it->second;
+    unsigned cost = MeasureTranscoderCost(srcFormat, dstFormat, duration);
+    if (cost > 0) {
+      SetTranscoderCost(srcFormat, dstFormat, cost);
+      PTRACE(3, "Opal\tTranscoder " << srcFormat << " to " << dstFormat << " costs " << cost << "us/s");
+    }
+    else {
+      PTRACE(4, "Opal\tCould not measure transcoder " << srcFormat << " to " << dstFormat);
+    }
+  }
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 
 OpalFramedTranscoder::OpalFramedTranscoder(const OpalMediaFormat & inputMediaFormat,
@@ -591,6 +868,12 @@ PINDEX OpalStreamedTranscoder::GetOptimalDataFrameSize(PBoolean input) const
 }
 
 
+bool OpalStreamedTranscoder::ConvertSamples(const BYTE *, BYTE *, PINDEX) const
+{
+  return false;
+}
+
+
 PBoolean OpalStreamedTranscoder::Convert(const RTP_DataFrame & input,
                                      RTP_DataFrame & output)
 {
@@ -610,6 +893,9 @@ PBoolean OpalStreamedTranscoder::Convert(const RTP_DataFrame & input,
   BYTE * outputBytes = output.GetPayloadPtr();
   short * outputWords = (short *)outputBytes;
 
+  if (ConvertSamples(inputBytes, outputBytes, samples))
+    return PTrue;
+
   switch (inputBitsPerSample) {
     case 16 :
       switch (outputBitsPerSample) {
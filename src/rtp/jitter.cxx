@@ -46,6 +46,10 @@
   again. */
 #define MAX_BUFFER_OVERRUNS 20
 
+/* Largest size of the sequence number indexed ring, half the sequence number
+   space so ordering comparisons remain unambiguous */
+#define MAX_RING_SIZE 32768
+
 /**How much time must elapse with lower jitter before jitter
    buffer size is reduced */
 #define DECREASE_JITTER_PERIOD 5000 // milliseconds
@@ -97,6 +101,12 @@ OpalJitterBuffer::OpalJitterBuffer(unsigned minJitter,
   , jitterCalc(0)
   , jitterCalcPacketCount(0)
   , m_resetJitterBufferNow(false)
+  , m_ringMask(0)
+  , m_ringCount(0)
+  , m_oldestSequence(0)
+  , m_newestSequence(0)
+  , m_playedSequence(0)
+  , m_playedSequenceValid(false)
   , currentFrame(NULL)
   , shuttingDown(false)
 #if PTRACING && !defined(NO_ANALYSER)
@@ -116,10 +126,13 @@ OpalJitterBuffer::~OpalJitterBuffer()
 {
   shuttingDown = true;
 
-  // Free up all the memory allocated (jitterBuffer and freeFrames will self delete)
+  // Free up all the memory allocated (freeFrames will self delete)
   delete currentFrame;
   currentFrame = NULL;
 
+  for (std::vector<Entry *>::iterator it = m_ring.begin(); it != m_ring.end(); ++it)
+    delete *it;
+
 #if PTRACING && !defined(NO_ANALYSER)
   PTRACE(5, "RTP\tJitter buffer analysis: size=" << bufferSize
          << " time=" << currentJitterTime << '\n' << *analyser);
@@ -151,6 +164,7 @@ void OpalJitterBuffer::SetDelay(unsigned minJitterDelay, unsigned maxJitterDelay
 
   packetsTooLate                  = 0;
   bufferOverruns                  = 0;
+  packetsLost                     = 0;
   consecutiveBufferOverruns       = 0;
   consecutiveMarkerBits           = 0;
 
@@ -161,10 +175,8 @@ void OpalJitterBuffer::SetDelay(unsigned minJitterDelay, unsigned maxJitterDelay
     currentFrame = NULL;
   }
 
-  while (jitterBuffer.size() > 0) {
-    PAssertNULL(GetNewest(false));
-    freeFrames.push_back(GetNewest(true));
-  }
+  FlushEntries();
+  m_playedSequenceValid = false;
 
   // Calculate number of frames to allocate, we make the assumption that the
   // smallest packet we can possibly get is 5ms long.
@@ -176,6 +188,13 @@ void OpalJitterBuffer::SetDelay(unsigned minJitterDelay, unsigned maxJitterDelay
   // resize the free queue for the new buffer size
   freeFrames.resize(bufferSize);
 
+  // ring is indexed by sequence number, allow room for gaps due to loss
+  PINDEX ringSize = 1;
+  while (ringSize < bufferSize*2 && ringSize < MAX_RING_SIZE)
+    ringSize <<= 1;
+  m_ring.assign(ringSize, NULL);
+  m_ringMask = (WORD)(ringSize-1);
+
   PTRACE(3, "RTP\tJitter buffer restarted:" << *this);
 
   bufferMutex.Signal();
@@ -200,15 +219,14 @@ OpalJitterBuffer::Entry * OpalJitterBuffer::GetAvailableEntry()
   }
   else {
     // We have a full jitter buffer, need a new frame so take the oldest one
-    PAssert(jitterBuffer.size() > 0, "Cannot find free frame in jitter buffer");
+    PAssert(m_ringCount > 0, "Cannot find free frame in jitter buffer");
     availableEntry = GetOldest(true);
 
     bufferOverruns++;
     consecutiveBufferOverruns++;
     if (consecutiveBufferOverruns > MAX_BUFFER_OVERRUNS) {
       PTRACE(2, "RTP\tJitter buffer continuously full, throwing away entire buffer.");
-      while (jitterBuffer.size() > 0) 
-        freeFrames.push_front(GetOldest(true));
+      FlushEntries();
       preBuffering = true;
     }
     else {
@@ -230,7 +248,7 @@ PBoolean OpalJitterBuffer::WriteData(const RTP_DataFrame & frame)
   if (availableEntry == NULL)
     return false;
 
-  *dynamic_cast<RTP_DataFrame *>(availableEntry) = frame;
+  (RTP_DataFrame &)*availableEntry = frame;
   InternalWriteData(availableEntry);
   return true;
 }
@@ -259,33 +277,98 @@ void OpalJitterBuffer::InternalWriteData(OpalJitterBuffer::Entry * availableEntr
   }
 
 #if PTRACING && !defined(NO_ANALYSER)
-  analyser->In(availableEntry->GetTimestamp(), jitterBuffer.size(), preBuffering ? "PreBuf" : "");
+  analyser->In(availableEntry->GetTimestamp(), m_ringCount, preBuffering ? "PreBuf" : "");
 #endif
 
   // Have been reading a frame, put it into the queue now, at correct position
-  if (jitterBuffer.size() == 0) {
-    PAssertNULL(availableEntry);
-    jitterBuffer.push_front(availableEntry);
-  }
-  else {
-    DWORD time = availableEntry->GetTimestamp();
-
-    // add the entry to the jitter buffer
-    FrameQueue::iterator r;
-    bool inserted = false;
-    for (r = jitterBuffer.begin(); r != jitterBuffer.end(); ++r) {
-      if (time < (*r)->GetTimestamp() || ((time == (*r)->GetTimestamp()) && (availableEntry->GetSequenceNumber() < (*r)->GetSequenceNumber()))) {
-        PAssertNULL(availableEntry);
-        jitterBuffer.insert(r, availableEntry);
-        inserted = true;
-        break;
+  InsertEntry(availableEntry);
+}
+
+
+void OpalJitterBuffer::InsertEntry(OpalJitterBuffer::Entry * availableEntry)
+{
+  PAssertNULL(availableEntry);
+
+  WORD sequence = availableEntry->GetSequenceNumber();
+  int ringSize = m_ringMask+1;
+
+  if (m_ringCount > 0) {
+    short offset = (short)(sequence - m_oldestSequence);
+
+    if (offset <= -ringSize) {
+      // Way out of range, assume sender has restarted sequence numbers
+      PTRACE(3, "RTP\tJitter buffer sequence discontinuity, "
+             << sequence << " < " << m_oldestSequence << ", throwing away buffer");
+      FlushEntries();
+      m_playedSequenceValid = false;
+    }
+    else if (offset < 0) {
+      // Earlier than anything in buffer, but may have already played it out
+      if ((m_playedSequenceValid && (short)(sequence - m_playedSequence) <= 0) ||
+          (WORD)(m_newestSequence - sequence) > m_ringMask) {
+        PTRACE(4, "RTP\tJitter buffer packet " << sequence << " too late, throwing away");
+        packetsTooLate++;
+        freeFrames.push_back(availableEntry);
+        return;
       }
+
+      m_ring[sequence & m_ringMask] = availableEntry;
+      m_oldestSequence = sequence;
+      m_ringCount++;
+      return;
     }
-    if (!inserted) {
-      PAssertNULL(availableEntry);
-      jitterBuffer.push_back(availableEntry);
+    else {
+      Entry * existing = m_ring[sequence & m_ringMask];
+      if (existing != NULL && existing->GetSequenceNumber() == sequence) {
+        PTRACE(4, "RTP\tJitter buffer duplicate packet " << sequence << ", throwing away");
+        freeFrames.push_back(availableEntry);
+        return;
+      }
+
+      // Make room in the ring if the sequence number has moved too far ahead
+      while (m_ringCount > 0 && (WORD)(sequence - m_oldestSequence) > m_ringMask) {
+        bufferOverruns++;
+        freeFrames.push_back(GetOldest(true));
+      }
+
+      if (m_ringCount > 0) {
+        m_ring[sequence & m_ringMask] = availableEntry;
+        if ((short)(sequence - m_newestSequence) > 0)
+          m_newestSequence = sequence;
+        m_ringCount++;
+        return;
+      }
+    }
+  }
+
+  // Ring is empty, see if this is behind what has already been played out
+  if (m_playedSequenceValid) {
+    short offset = (short)(sequence - m_playedSequence);
+    if (offset <= 0 && offset > -ringSize) {
+      PTRACE(4, "RTP\tJitter buffer packet " << sequence << " too late, throwing away");
+      packetsTooLate++;
+      freeFrames.push_back(availableEntry);
+      return;
+    }
+    if (offset > 1 && offset <= ringSize)
+      packetsLost += offset-1;
+  }
+
+  m_ring[sequence & m_ringMask] = availableEntry;
+  m_oldestSequence = m_newestSequence = sequence;
+  m_ringCount = 1;
+}
+
+
+void OpalJitterBuffer::FlushEntries()
+{
+  for (std::vector<Entry *>::iterator it = m_ring.begin(); it != m_ring.end(); ++it) {
+    if (*it != NULL) {
+      freeFrames.push_back(*it);
+      *it = NULL;
     }
   }
+  m_ringCount = 0;
 }
 
 
@@ -315,7 +398,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
     special member so can unlock the mutex while the writer thread has its
     way with the buffer.
    */
-  if (jitterBuffer.size() == 0) {
+  if (m_ringCount == 0) {
     /*No data to play! We ran the buffer down to empty, restart buffer by
       setting flag that will fill it again before returning any data.
      */
@@ -323,7 +406,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
     currentJitterTime = targetJitterTime;
 
 #if PTRACING && !defined(NO_ANALYSER)
-    analyser->Out(0, jitterBuffer.size(), "Empty");
+    analyser->Out(0, m_ringCount, "Empty");
 #endif
     return true;
   }
@@ -360,7 +443,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
     // If oldest frame has not been in the buffer long enough, don't return anything yet
     if ((PTimer::Tick() - GetOldest(false)->tick).GetInterval() * timeUnits < currentJitterTime/2) {
 #if PTRACING && !defined(NO_ANALYSER)
-      analyser->Out(oldestTimestamp, jitterBuffer.size(), "PreBuf");
+      analyser->Out(oldestTimestamp, m_ringCount, "PreBuf");
 #endif
       return true;
     }
@@ -382,7 +465,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
   if (shortSilence) {
     // It is not yet time for something in the buffer
 #if PTRACING && !defined(NO_ANALYSER)
-    analyser->Out(oldestTimestamp, jitterBuffer.size(), "Wait");
+    analyser->Out(oldestTimestamp, m_ringCount, "Wait");
 #endif
     lastWriteTimestamp = 0;
     lastWriteTick = 0;
@@ -391,7 +474,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
 
   // Detach oldest packet from the list, put into parking space
 #if PTRACING && !defined(NO_ANALYSER)
-  analyser->Out(oldestTimestamp, jitterBuffer.size(), requestedTimestamp >= oldestTimestamp ? "" : "Late");
+  analyser->Out(oldestTimestamp, m_ringCount, requestedTimestamp >= oldestTimestamp ? "" : "Late");
 #endif
   currentFrame = GetOldest(true);
 
@@ -451,7 +534,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
   lastWriteTimestamp = currentFrame->GetTimestamp();
   lastWriteTick      = currentFrame->tick;
 
-  if (jitterBuffer.size() != 0) {
+  if (m_ringCount != 0) {
 
     // If exceeded current jitter buffer time delay:
     DWORD currentJitterLen = newestTimestamp - currentFrame->GetTimestamp();
@@ -492,8 +575,7 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
         // Throw away the oldest frame and move everything up
         PAssertNULL(currentFrame);
         freeFrames.push_back(currentFrame);
-        currentFrame = jitterBuffer.front();
-        jitterBuffer.pop_front();
+        currentFrame = GetOldest(true);
       }
 
       // Now change the jitter time to cope with the new size
@@ -522,8 +604,8 @@ PBoolean OpalJitterBuffer::ReadData(RTP_DataFrame & frame)
 
   /* If using immediate jitter reduction (rather than waiting for silence opportunities)
   then trash oldest frames as necessary to reduce the size of the jitter buffer */
-  if (targetJitterTime < currentJitterTime && m_resetJitterBufferNow && jitterBuffer.size() != 0) {
-    while ((GetNewest(false)->GetTimestamp() - currentFrame->GetTimestamp()) > targetJitterTime){
+  if (targetJitterTime < currentJitterTime && m_resetJitterBufferNow && m_ringCount != 0) {
+    while (m_ringCount > 0 && (GetNewest(false)->GetTimestamp() - currentFrame->GetTimestamp()) > targetJitterTime){
 
       // Throw away the newest entries
       PAssertNULL(GetNewest(false));
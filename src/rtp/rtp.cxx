@@ -45,11 +45,23 @@
 #include <ptclib/random.h>
 #include <ptclib/pstun.h>
 #include <opal/rtpconn.h>
+#include <opal/manager.h>
+
+#ifdef P_LINUX
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <map>
+#endif
 
 #define new PNEW
 
 #define BAD_TRANSMIT_TIME_MAX 10    //  maximum of seconds of transmit fails before session is killed
 
+#define REACTOR_MAX_QUEUED_FRAMES 100 // maximum data frames queued by reactor before oldest discarded
+#define REACTOR_MAX_EVENTS        64  // maximum events handled per reactor wait
+#define REACTOR_FRAME_PAYLOAD     2048 // payload size of the data frames the reactor reads into
+#define BATCH_SLOT_SIZE           2112 // size of each datagram slot in receive/transmit batches
+
 const unsigned SecondsFrom1900to1970 = (70*365+17)*24*60*60U;
 
 #ifndef _WIN32_WCE
@@ -441,6 +453,10 @@ OpalMediaStatistics::OpalMediaStatistics()
     // Video
   , m_totalFrames(0)
   , m_keyFrames(0)
+  , m_updateRequests(0)
+  , m_updatesCoalesced(0)
+  , m_updatesDeferred(0)
+  , m_forcedKeyFrames(0)
 {
 }
 
@@ -496,6 +512,7 @@ RTP_Session::RTP_Session(const Params & params)
   userData = params.userData;
   autoDeleteUserData = params.autoDelete;
 
+  m_jitterBufferThreadless = false;
   ignoreOutOfOrderPackets = true;
   ignorePayloadTypeChanges = true;
   syncSourceOut = PRandom::Number();
@@ -525,6 +542,12 @@ RTP_Session::RTP_Session(const Params & params)
 
   lastSentTimestamp = 0;  // should be calculated, but we'll settle for initialising it
 
+  m_relayStarted = false;
+  m_relaySyncSourceIn = 0;
+  m_relaySequenceOffset = 0;
+  m_relayLastTimestamp = 0;
+  m_relayTimestampStep = 0;
+
   m_encodingHandler = NULL;
   SetEncoding(params.encoding);
 }
@@ -696,7 +719,11 @@ void RTP_Session::SetJitterBufferSize(unsigned minJitterDelay,
       m_jitterBuffer->SetDelay(minJitterDelay, maxJitterDelay);
     else
       m_jitterBuffer = new RTP_JitterBuffer(*this, minJitterDelay, maxJitterDelay, timeUnits, stackSize);
-    m_jitterBuffer->Resume();
+    if (m_jitterBufferThreadless) {
+      PTRACE(4, "RTP\tSession " << sessionID << ", jitter buffer is threadless");
+    }
+    else
+      m_jitterBuffer->Resume();
   }
 }
 
@@ -1472,6 +1499,46 @@ PBoolean RTP_Session::WriteOOBData(RTP_DataFrame &, bool)
   return true;
 }
 
+
+PBoolean RTP_Session::RelayData(RTP_DataFrame & frame)
+{
+  bool sameSource;
+
+  {
+    PWaitAndSignal mutex(dataMutex);
+
+    DWORD ssrc = frame.GetSyncSource();
+    sameSource = m_relayStarted && ssrc == m_relaySyncSourceIn;
+    if (!sameSource) {
+      PTRACE(3, "RTP\tSession " << sessionID << ", relaying data from SSRC=" << hex << ssrc << dec);
+      m_relaySequenceOffset = (WORD)(lastSentSequenceNumber + 1 - frame.GetSequenceNumber());
+      if (packetsSent > 0) {
+        // Carry on a frame after the last timestamp sent, marking the discontinuity
+        timeStampOffs = m_relayLastTimestamp + m_relayTimestampStep - frame.GetTimestamp();
+        frame.SetMarker(true);
+      }
+      m_relaySyncSourceIn = ssrc;
+      m_relayStarted = true;
+    }
+
+    // OnSendData() increments this before use
+    lastSentSequenceNumber = (WORD)(frame.GetSequenceNumber() + m_relaySequenceOffset - 1);
+  }
+
+  if (!WriteData(frame))
+    return false;
+
+  PWaitAndSignal mutex(dataMutex);
+
+  // Remember the frame duration, as the last advance of the timestamp from the one source
+  DWORD step = frame.GetTimestamp() - m_relayLastTimestamp;
+  if (sameSource && step > 0 && step < 0x80000000)
+    m_relayTimestampStep = step;
+
+  m_relayLastTimestamp = frame.GetTimestamp();
+  return true;
+}
+
 void RTP_Session::AddFilter(const PNotifier & filter)
 {
   // ensures that a filter is added only once
@@ -1504,6 +1571,131 @@ static void SetMinBufferSize(PUDPSocket & sock, int buftype)
 }
 
 
+#ifdef P_LINUX
+
+static void SockAddrToAddress(const sockaddr_storage & sa, PIPSocket::Address & addr, WORD & port)
+{
+#if P_HAS_IPV6
+  if (sa.ss_family == AF_INET6) {
+    const sockaddr_in6 & sin6 = (const sockaddr_in6 &)sa;
+    addr = sin6.sin6_addr;
+    port = ntohs(sin6.sin6_port);
+    return;
+  }
+#endif
+
+  const sockaddr_in & sin = (const sockaddr_in &)sa;
+  addr = sin.sin_addr;
+  port = ntohs(sin.sin_port);
+}
+
+
+static socklen_t AddressToSockAddr(const PIPSocket::Address & addr, WORD port, sockaddr_storage & sa)
+{
+  memset(&sa, 0, sizeof(sa));
+
+#if P_HAS_IPV6
+  if (addr.GetVersion() == 6) {
+    sockaddr_in6 & sin6 = (sockaddr_in6 &)sa;
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr   = addr;
+    sin6.sin6_port   = htons(port);
+    return sizeof(sin6);
+  }
+#endif
+
+  sockaddr_in & sin = (sockaddr_in &)sa;
+  sin.sin_family = AF_INET;
+  sin.sin_addr   = addr;
+  sin.sin_port   = htons(port);
+  return sizeof(sin);
+}
+
+
+/* Holds datagrams pulled off the data socket with a single recvmmsg() call,
+   handing them out one at a time to ReadDataOrControlPDU().
+ */
+class RTP_UDP::ReceiveBatch
+{
+  public:
+    ReceiveBatch(unsigned size)
+      : m_size(size)
+      , m_count(0)
+      , m_next(0)
+      , m_buffer(size*BATCH_SLOT_SIZE)
+      , m_messages(size)
+      , m_vectors(size)
+      , m_addresses(size)
+    {
+    }
+
+    unsigned GetSize() const { return m_size; }
+    bool HasPending() const { return m_next < m_count; }
+    void Clear() { m_next = m_count = 0; }
+
+    bool Read(int fd, BYTE * framePtr, PINDEX frameSize, PIPSocket::Address & addr, WORD & port, PINDEX & length, int & error)
+    {
+      length = 0;
+
+      if (m_next >= m_count) {
+        memset(&m_messages[0], 0, m_size*sizeof(struct mmsghdr));
+        for (unsigned i = 0; i < m_size; ++i) {
+          m_vectors[i].iov_base = &m_buffer[i*BATCH_SLOT_SIZE];
+          m_vectors[i].iov_len = BATCH_SLOT_SIZE;
+          m_messages[i].msg_hdr.msg_name = &m_addresses[i];
+          m_messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+          m_messages[i].msg_hdr.msg_iov = &m_vectors[i];
+          m_messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(fd, &m_messages[0], m_size, MSG_DONTWAIT, NULL);
+        if (count <= 0) {
+          error = count < 0 ? errno : EAGAIN;
+          Clear();
+          return false;
+        }
+
+        m_count = count;
+        m_next = 0;
+      }
+
+      unsigned index = m_next++;
+      length = m_messages[index].msg_len;
+      SockAddrToAddress(m_addresses[index], addr, port);
+
+      if ((m_messages[index].msg_hdr.msg_flags & MSG_TRUNC) != 0 || length > frameSize) {
+        error = EMSGSIZE;
+        return false;
+      }
+
+      memcpy(framePtr, &m_buffer[index*BATCH_SLOT_SIZE], length);
+      return true;
+    }
+
+  protected:
+    unsigned                      m_size;
+    unsigned                      m_count;
+    unsigned                      m_next;
+    std::vector<BYTE>             m_buffer;
+    std::vector<struct mmsghdr>   m_messages;
+    std::vector<struct iovec>     m_vectors;
+    std::vector<sockaddr_storage> m_addresses;
+};
+
+#else // P_LINUX
+
+class RTP_UDP::ReceiveBatch
+{
+  public:
+    ReceiveBatch(unsigned) { }
+    unsigned GetSize() const { return 1; }
+    bool HasPending() const { return false; }
+    void Clear() { }
+};
+
+#endif // P_LINUX
+
+
 RTP_UDP::RTP_UDP(const Params & params)
   : RTP_Session(params),
     remoteAddress(0),
@@ -1520,6 +1712,14 @@ RTP_UDP::RTP_UDP(const Params & params)
   appliedQOS        = false;
   localHasNAT       = false;
   badTransmitCounter = 0;
+  m_reactor         = NULL;
+  m_reactorIndex    = P_MAX_INDEX;
+  m_reactorAborted  = false;
+  m_receiveBatch    = NULL;
+  m_lastDataReadCount    = 0;
+  m_lastControlReadCount = 0;
+  m_relaySession    = NULL;
+  m_relayPayloadType = RTP_DataFrame::IllegalPayloadType;
 }
 
 
@@ -1533,8 +1733,46 @@ RTP_UDP::~RTP_UDP()
   // over them and exits the reading thread.
   SetJitterBufferSize(0, 0);
 
+  // Likewise, make sure the reactor is no longer looking at the sockets
+  if (m_reactor != NULL)
+    m_reactor->RemoveSession(*this);
+
   delete dataSocket;
   delete controlSocket;
+  delete m_receiveBatch;
+}
+
+
+void RTP_UDP::SetReceiveBatchSize(unsigned packets)
+{
+  PWaitAndSignal mutex(dataMutex);
+
+  if (packets == GetReceiveBatchSize())
+    return;
+
+  delete m_receiveBatch;
+  m_receiveBatch = NULL;
+
+#ifdef P_LINUX
+  if (packets > 1) {
+    m_receiveBatch = new ReceiveBatch(packets);
+    PTRACE(4, "RTP_UDP\tSession " << sessionID << ", receiving up to " << packets << " packets per system call");
+  }
+#else
+  PTRACE_IF(2, packets > 1, "RTP_UDP\tSession " << sessionID << ", receive batching not supported on this platform");
+#endif
+}
+
+
+unsigned RTP_UDP::GetReceiveBatchSize() const
+{
+  return m_receiveBatch != NULL ? m_receiveBatch->GetSize() : 1;
+}
+
+
+bool RTP_UDP::HasBatchedDataPDU() const
+{
+  return m_receiveBatch != NULL && m_receiveBatch->HasPending();
 }
 
 
@@ -1580,6 +1818,9 @@ PBoolean RTP_UDP::Open(PIPSocket::Address _localAddress,
   localDataPort    = (WORD)(portBase&0xfffe);
   localControlPort = (WORD)(localDataPort + 1);
 
+  if (m_reactor != NULL)
+    m_reactor->RemoveSession(*this);
+
   delete dataSocket;
   delete controlSocket;
   dataSocket = NULL;
@@ -1670,6 +1911,11 @@ PBoolean RTP_UDP::Open(PIPSocket::Address _localAddress,
   shutdownRead = false;
   shutdownWrite = false;
 
+  if (m_reactor != NULL && !m_reactor->AddSession(*this)) {
+    PTRACE(2, "RTP_UDP\tSession " << sessionID << ", reactor unavailable, using blocking read.");
+    m_reactor = NULL;
+  }
+
   if (canonicalName.Find('@') == P_MAX_INDEX)
     canonicalName += '@' + GetLocalHostName();
 
@@ -1685,8 +1931,12 @@ void RTP_UDP::Reopen(PBoolean reading)
 {
   PWaitAndSignal mutex(dataMutex);
 
-  if (reading)
+  if (reading) {
     shutdownRead = false;
+    m_reactorMutex.Wait();
+    m_reactorAborted = false;
+    m_reactorMutex.Signal();
+  }
   else
     shutdownWrite = false;
 
@@ -1704,7 +1954,9 @@ void RTP_UDP::Close(PBoolean reading)
       PTRACE(3, "RTP_UDP\tSession " << sessionID << ", Shutting down read.");
       syncSourceIn = 0;
       shutdownRead = true;
-      if (dataSocket != NULL && controlSocket != NULL) {
+      if (m_reactor != NULL)
+        SignalReactorData();
+      else if (dataSocket != NULL && controlSocket != NULL) {
         PIPSocket::Address addr;
         controlSocket->GetLocalAddress(addr);
         if (addr.IsAny())
@@ -1787,6 +2039,9 @@ PBoolean RTP_UDP::ReadData(RTP_DataFrame & frame, PBoolean loop)
 
 PBoolean RTP_UDP::Internal_ReadData(RTP_DataFrame & frame, PBoolean loop)
 {
+  if (m_reactor != NULL)
+    return ReactorReadData(frame, loop);
+
   do {
     int selectStatus = WaitForPDU(*dataSocket, *controlSocket, reportTimer);
 
@@ -1815,6 +2070,8 @@ PBoolean RTP_UDP::Internal_ReadData(RTP_DataFrame & frame, PBoolean loop)
             if (!shutdownRead) {
               switch (OnReceiveData(frame)) {
                 case e_ProcessPacket :
+                  if (RelayReceivedData(frame))
+                    break;
                   return true;
                 case e_IgnorePacket :
                   break;
@@ -1856,8 +2113,350 @@ PBoolean RTP_UDP::Internal_ReadData(RTP_DataFrame & frame, PBoolean loop)
   return true;
 }
 
+PBoolean RTP_UDP::ReadBufferedData(RTP_DataFrame & frame)
+{
+  JitterBufferPtr jitter = m_jitterBuffer; // Increase reference count
+  if (jitter == NULL || !m_jitterBufferThreadless)
+    return RTP_Session::ReadBufferedData(frame);
+
+  if (m_reactor == NULL) {
+    if (!PollReceivedData(*jitter))
+      return false;
+  }
+  else {
+    PWaitAndSignal mutex(m_reactorMutex);
+    if (m_reactorAborted || shutdownRead)
+      return false;
+  }
+
+  return jitter->ReadData(frame);
+}
+
+
+bool RTP_UDP::PollReceivedData(RTP_JitterBuffer & jitter)
+{
+  for (;;) {
+    int selectStatus = WaitForPDU(*dataSocket, *controlSocket, 0);
+
+    {
+      PWaitAndSignal mutex(dataMutex);
+      if (shutdownRead) {
+        PTRACE(3, "RTP_UDP\tSession " << sessionID << ", Read shutdown.");
+        return false;
+      }
+    }
+
+    switch (selectStatus) {
+      case -2 :
+        if (ReadControlPDU() == e_AbortTransport)
+          return false;
+        break;
+
+      case -3 :
+        if (ReadControlPDU() == e_AbortTransport)
+          return false;
+        // Then do -1 case
+
+      case -1 :
+      {
+        RTP_DataFrame frame(2048);
+        switch (ReadDataPDU(frame)) {
+          case e_ProcessPacket :
+            switch (OnReceiveData(frame)) {
+              case e_ProcessPacket :
+                jitter.WriteData(frame);
+                break;
+              case e_IgnorePacket :
+                break;
+              case e_AbortTransport :
+                return false;
+            }
+            break;
+          case e_IgnorePacket :
+            break;
+          case e_AbortTransport :
+            return false;
+        }
+        break;
+      }
+
+      case 0 :
+      {
+        // Nothing more waiting, give RTCP reports a chance to go out
+        RTP_DataFrame frame(0);
+        return OnReadTimeout(frame) != e_AbortTransport;
+      }
+
+      case PSocket::Interrupted:
+        PTRACE(2, "RTP_UDP\tSession " << sessionID << ", Interrupted.");
+        return false;
+
+      default :
+        PTRACE(1, "RTP_UDP\tSession " << sessionID << ", Select error: "
+                << PChannel::GetErrorText((PChannel::Errors)selectStatus));
+        return false;
+    }
+  }
+}
+
+
+PBoolean RTP_UDP::ReactorReadData(RTP_DataFrame & frame, PBoolean loop)
+{
+  do {
+    {
+      PWaitAndSignal mutex(m_reactorMutex);
+
+      if (shutdownRead) {
+        PTRACE(3, "RTP_UDP\tSession " << sessionID << ", Read shutdown.");
+        return false;
+      }
+
+      if (m_reactorAborted)
+        return false;
+
+      if (first && isAudio) {
+        PTRACE_IF(2, !m_reactorFrames.empty(), "RTP_UDP\tSession " << sessionID
+                  << ", flushed " << m_reactorFrames.size() << " RTP data packets on startup");
+        m_reactorFrames.clear();
+        first = false;
+      }
+
+      if (!m_reactorFrames.empty()) {
+        RTP_DataFrame & queued = m_reactorFrames.front();
+        PINDEX size = queued.GetHeaderSize() + queued.GetPayloadSize();
+        if (frame.IsUnique() && frame.GetSize() >= size) {
+          // Copy into the callers buffer so ours can be reused by the reactor
+          memcpy(frame.GetPointer(), (const BYTE *)queued, size);
+          frame.SetPayloadSize(queued.GetPayloadSize());
+          RecycleReactorFrame(queued);
+        }
+        else
+          frame = queued;
+        m_reactorFrames.pop_front();
+        return true;
+      }
+    }
+
+    if (!m_reactorFramesAvailable.Wait(reportTimer)) {
+      switch (OnReadTimeout(frame)) {
+        case e_ProcessPacket :
+          if (!shutdownRead)
+            return true;
+        case e_IgnorePacket :
+          break;
+        case e_AbortTransport :
+          return false;
+      }
+    }
+  } while (loop);
+
+  frame.SetSize(0);
+  return true;
+}
+
+
+void RTP_UDP::OnReactorReadable(bool fromDataChannel)
+{
+  if (!fromDataChannel) {
+    if (ReadControlPDU() == e_AbortTransport) {
+      PTRACE(3, "RTP_UDP\tSession " << sessionID << ", reactor control read aborted transport.");
+      m_reactorMutex.Wait();
+      m_reactorAborted = true;
+      m_reactorMutex.Signal();
+      SignalReactorData();
+    }
+    return;
+  }
+
+  // With receive batching a single readiness event may have pulled several
+  // datagrams off the socket, and epoll will not fire again for those.
+  do {
+    RTP_DataFrame frame(GetReactorFrame());
+
+    SendReceiveStatus status = ReadDataPDU(frame);
+    if (status == e_ProcessPacket && !shutdownRead)
+      status = OnReceiveData(frame);
+
+    switch (status) {
+      case e_ProcessPacket :
+        if (RelayReceivedData(frame)) {
+          PWaitAndSignal mutex(m_reactorMutex);
+          RecycleReactorFrame(frame);
+          continue;
+        }
+        if (m_jitterBufferThreadless) {
+          // Straight into the jitter buffer, no need to queue for ReadData()
+          JitterBufferPtr jitter = m_jitterBuffer; // Increase reference count
+          if (jitter != NULL) {
+            jitter->WriteData(frame);
+            continue;
+          }
+        }
+        break;
+      case e_IgnorePacket :
+        continue;
+      case e_AbortTransport :
+        PTRACE(3, "RTP_UDP\tSession " << sessionID << ", reactor data read aborted transport.");
+        m_reactorMutex.Wait();
+        m_reactorAborted = true;
+        m_reactorMutex.Signal();
+        SignalReactorData();
+        return;
+    }
+
+    m_reactorMutex.Wait();
+    if (shutdownRead) {
+      m_reactorMutex.Signal();
+      return;
+    }
+    if (m_reactorFrames.size() >= REACTOR_MAX_QUEUED_FRAMES) {
+      PTRACE(4, "RTP_UDP\tSession " << sessionID << ", reactor queue full, discarding oldest frame");
+      RecycleReactorFrame(m_reactorFrames.front());
+      m_reactorFrames.pop_front();
+    }
+    m_reactorFrames.push_back(frame);
+    m_reactorMutex.Signal();
+
+    SignalReactorData();
+  } while (HasBatchedDataPDU());
+}
+
+
+RTP_DataFrame RTP_UDP::GetReactorFrame()
+{
+  {
+    PWaitAndSignal mutex(m_reactorMutex);
+    if (!m_reactorFreeFrames.empty()) {
+      RTP_DataFrame frame = m_reactorFreeFrames.back();
+      m_reactorFreeFrames.pop_back();
+
+      // Something may have shrunk it to the last packet, so grow it back to a full read
+      if (frame.GetSize() < RTP_DataFrame::MinHeaderSize+REACTOR_FRAME_PAYLOAD)
+        frame.SetSize(RTP_DataFrame::MinHeaderSize+REACTOR_FRAME_PAYLOAD);
+      return frame;
+    }
+  }
+
+  return RTP_DataFrame(REACTOR_FRAME_PAYLOAD);
+}
+
+
+void RTP_UDP::RecycleReactorFrame(const RTP_DataFrame & frame)
+{
+  // Must have m_reactorMutex, frames still referenced elsewhere are dropped
+  if (frame.IsUnique() && m_reactorFreeFrames.size() < REACTOR_MAX_QUEUED_FRAMES)
+    m_reactorFreeFrames.push_back(frame);
+}
+
+
+void RTP_UDP::SignalReactorData()
+{
+  m_reactorFramesAvailable.Signal();
+
+  PWaitAndSignal mutex(m_dataReadyMutex);
+  if (!m_dataReadyNotifier.IsNULL())
+    m_dataReadyNotifier(*this, 0);
+}
+
+
+bool RTP_UDP::SetDataReadyNotifier(const PNotifier & notifier)
+{
+  if (m_reactor == NULL && !notifier.IsNULL())
+    return false;
+
+  if (!notifier.IsNULL()) {
+    // Do the start up flush now, so ReadData() does not then block on an empty queue
+    PWaitAndSignal mutex(m_reactorMutex);
+    if (first && isAudio) {
+      PTRACE_IF(2, !m_reactorFrames.empty(), "RTP_UDP\tSession " << sessionID
+                << ", flushed " << m_reactorFrames.size() << " RTP data packets on startup");
+      m_reactorFrames.clear();
+      first = false;
+    }
+  }
+
+  PWaitAndSignal mutex(m_dataReadyMutex);
+  m_dataReadyNotifier = notifier;
+  return true;
+}
+
+
+bool RTP_UDP::IsDataReady()
+{
+  if (m_reactor == NULL)
+    return false;
+
+  PWaitAndSignal mutex(m_reactorMutex);
+  return !m_reactorFrames.empty() || m_reactorAborted || shutdownRead;
+}
+
+
+bool RTP_UDP::SetRelaySession(RTP_Session * session, RTP_DataFrame::PayloadTypes payloadType)
+{
+  PWaitAndSignal mutex(m_relayMutex);
+
+  if (session != NULL) {
+    PTRACE(3, "RTP_UDP\tSession " << sessionID << ", relaying data to session "
+           << session->GetSessionID() << (m_reactor != NULL ? " from reactor" : ""));
+  }
+  else {
+    PTRACE_IF(3, m_relaySession != NULL, "RTP_UDP\tSession " << sessionID << ", stopped relaying data");
+  }
+
+  m_relaySession = session;
+  m_relayPayloadType = payloadType;
+  return m_reactor != NULL;
+}
+
+
+bool RTP_UDP::RelayReceivedData(RTP_DataFrame & frame)
+{
+  PWaitAndSignal mutex(m_relayMutex);
+
+  if (m_relaySession == NULL)
+    return false;
+
+  if (m_relayPayloadType != RTP_DataFrame::IllegalPayloadType)
+    frame.SetPayloadType(m_relayPayloadType);
+
+  // Sending trims the frame to the packet, restore it as it is read into again
+  PINDEX receiveSize = frame.GetSize();
+
+  if (!m_relaySession->RelayData(frame)) {
+    PTRACE(4, "RTP_UDP\tSession " << sessionID << ", relay to session "
+           << m_relaySession->GetSessionID() << " failed");
+  }
+
+  frame.SetSize(receiveSize);
+  return true;
+}
+
+
+void RTP_UDP::SetReactor(RTP_Reactor * reactor)
+{
+  PWaitAndSignal mutex(dataMutex);
+
+  if (reactor == m_reactor)
+    return;
+
+  if (m_reactor != NULL)
+    m_reactor->RemoveSession(*this);
+
+  m_reactor = reactor;
+
+  if (m_reactor != NULL && dataSocket != NULL && controlSocket != NULL && !m_reactor->AddSession(*this)) {
+    PTRACE(2, "RTP_UDP\tSession " << sessionID << ", reactor unavailable, using blocking read.");
+    m_reactor = NULL;
+  }
+}
+
+
 int RTP_UDP::WaitForPDU(PUDPSocket & dataSocket, PUDPSocket & controlSocket, const PTimeInterval & timeout)
 {
+  // Datagrams already read by the last batched receive will not make the socket readable
+  if (HasBatchedDataPDU())
+    return -1;
+
   return EncodingLock(*this)->WaitForPDU(dataSocket, controlSocket, timeout);
 }
 
@@ -1872,6 +2471,9 @@ int RTP_UDP::Internal_WaitForPDU(PUDPSocket & dataSocket, PUDPSocket & controlSo
     while (dataSocket.Read(buffer, sizeof(buffer)))
       ++count;
 
+    if (m_receiveBatch != NULL)
+      m_receiveBatch->Clear();
+
     PTRACE_IF(2, count > 0, "RTP_UDP\tSession " << sessionID << ", flushed " << count << " RTP data packets on startup");
 
     dataSocket.SetReadTimeout(oldTimeout);
@@ -1891,8 +2493,22 @@ RTP_Session::SendReceiveStatus RTP_UDP::ReadDataOrControlPDU(BYTE * framePtr,
   PUDPSocket & socket = *(fromDataChannel ? dataSocket : controlSocket);
   PIPSocket::Address addr;
   WORD port;
+  PINDEX & lastReadCount = fromDataChannel ? m_lastDataReadCount : m_lastControlReadCount;
+
+  bool ok;
+  int errorNumber;
+#ifdef P_LINUX
+  if (fromDataChannel && m_receiveBatch != NULL)
+    ok = m_receiveBatch->Read(socket.GetHandle(), framePtr, frameSize, addr, port, lastReadCount, errorNumber);
+  else
+#endif
+  {
+    ok = socket.ReadFrom(framePtr, frameSize, addr, port);
+    lastReadCount = socket.GetLastReadCount();
+    errorNumber = socket.GetErrorNumber();
+  }
 
-  if (socket.ReadFrom(framePtr, frameSize, addr, port)) {
+  if (ok) {
     // If remote address never set from higher levels, then try and figure
     // it out from the first packet received.
     if (!remoteAddress.IsValid()) {
@@ -1930,7 +2546,7 @@ RTP_Session::SendReceiveStatus RTP_UDP::ReadDataOrControlPDU(BYTE * framePtr,
     return RTP_Session::e_ProcessPacket;
   }
 
-  switch (socket.GetErrorNumber()) {
+  switch (errorNumber) {
     case ECONNRESET :
     case ECONNREFUSED :
       PTRACE(2, "RTP_UDP\tSession " << sessionID << ", " << channelName << " port on remote not ready.");
@@ -1955,8 +2571,8 @@ RTP_Session::SendReceiveStatus RTP_UDP::ReadDataOrControlPDU(BYTE * framePtr,
 
     default:
       PTRACE(1, "RTP_UDP\tSession " << sessionID << ", " << channelName
-             << " read error (" << socket.GetErrorNumber(PChannel::LastReadError) << "): "
-             << socket.GetErrorText(PChannel::LastReadError));
+             << " read error (" << errorNumber << "): "
+             << PChannel::GetErrorText(PChannel::Miscellaneous, errorNumber));
       return RTP_Session::e_AbortTransport;
   }
 }
@@ -1974,7 +2590,7 @@ RTP_Session::SendReceiveStatus RTP_UDP::Internal_ReadDataPDU(RTP_DataFrame & fra
     return status;
 
   // Check received PDU is big enough
-  PINDEX pduSize = dataSocket->GetLastReadCount();
+  PINDEX pduSize = GetLastReadCount(true);
   if (pduSize < RTP_DataFrame::MinHeaderSize || pduSize < frame.GetHeaderSize()) {
     PTRACE(2, "RTP_UDP\tSession " << sessionID
            << ", Received data packet too small: " << pduSize << " bytes");
@@ -2011,7 +2627,7 @@ RTP_Session::SendReceiveStatus RTP_UDP::ReadControlPDU()
   if (status != e_ProcessPacket)
     return status;
 
-  PINDEX pduSize = controlSocket->GetLastReadCount();
+  PINDEX pduSize = GetLastReadCount(false);
   if (pduSize < 4 || pduSize < 4+frame.GetPayloadSize()) {
     PTRACE(2, "RTP_UDP\tSession " << sessionID
            << ", Received control packet too small: " << pduSize << " bytes");
@@ -2104,6 +2720,10 @@ bool RTP_UDP::WriteDataOrControlPDU(const BYTE * framePtr, PINDEX frameSize, boo
   PUDPSocket & socket = *(toDataChannel ? dataSocket : controlSocket);
   WORD port = toDataChannel ? remoteDataPort : remoteControlPort;
 
+  if (toDataChannel && m_reactor != NULL && m_reactor->IsTransmitBatching() &&
+      m_reactor->QueueTransmit(*this, socket, framePtr, frameSize, remoteAddress, port))
+    return true;
+
   while (!socket.WriteTo(framePtr, frameSize, remoteAddress, port)) {
     switch (socket.GetErrorNumber()) {
       case ECONNRESET :
@@ -2286,4 +2906,583 @@ OpalSecurityMode * SecureRTP_UDP::GetSecurityParms() const
   return securityParms; 
 }
 
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef P_LINUX
+
+class RTP_Reactor::WorkerThread : public PThread
+{
+    PCLASSINFO(WorkerThread, PThread);
+  public:
+    WorkerThread(unsigned index);
+    ~WorkerThread();
+
+    virtual void Main();
+
+    bool Add(RTP_UDP & session);
+    void Remove(RTP_UDP & session);
+    void Shutdown();
+    PINDEX GetSessionCount() const;
+
+    void SetTransmitBatching(unsigned maxPackets, const PTimeInterval & maxLatency);
+    bool QueueTransmit(int fd, const BYTE * framePtr, PINDEX frameSize, const PIPSocket::Address & address, WORD port);
+
+  protected:
+    bool AddSocket(RTP_UDP & session, PUDPSocket & socket, bool isData);
+    void RemoveSocket(int fd);
+    void Wake();
+    bool IsShuttingDown() const;
+    int  GetTransmitTimeout();
+    void FlushTransmit();
+
+    struct Registration {
+      RTP_UDP       * session;
+      PUDPSocket    * socket;
+      PTimeInterval   readTimeout;  // Restored when the socket leaves the reactor
+      bool            isData;
+    };
+    typedef std::map<int, Registration> RegistrationMap;
+
+    int                       m_epollFd;
+    int                       m_wakeFds[2];
+    bool                      m_shutdown;     // Protected by m_mutex
+    RegistrationMap           m_registrations;
+    RTP_UDP                 * m_dispatching;
+    std::vector<PSyncPoint *> m_dispatchWaiters;
+    mutable PMutex            m_mutex;
+
+    struct Datagram {
+      int              fd;
+      sockaddr_storage address;
+      socklen_t        addressLength;
+      PINDEX           size;
+      BYTE             data[BATCH_SLOT_SIZE];
+    };
+    std::vector<Datagram>       m_transmitQueue;
+    std::vector<unsigned>       m_transmitOrder;
+    std::vector<struct mmsghdr> m_transmitMessages;
+    std::vector<struct iovec>   m_transmitVectors;
+    unsigned                    m_transmitCount;
+    unsigned                    m_transmitBatchSize;
+    PTimeInterval               m_transmitLatency;
+    PTimeInterval               m_transmitFirstTick;
+    PMutex                      m_transmitMutex;
+};
+
+
+RTP_Reactor::WorkerThread::WorkerThread(unsigned index)
+  : PThread(65536, NoAutoDeleteThread, HighPriority, psprintf("RTP Reactor:%u", index))
+  , m_epollFd(epoll_create(1024))
+  , m_shutdown(false)
+  , m_dispatching(NULL)
+  , m_transmitCount(0)
+  , m_transmitBatchSize(1)
+{
+  if (::pipe(m_wakeFds) == 0) {
+    fcntl(m_wakeFds[0], F_SETFL, fcntl(m_wakeFds[0], F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = m_wakeFds[0];
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFds[0], &event);
+  }
+  else
+    m_wakeFds[0] = m_wakeFds[1] = -1;
+
+  PTRACE_IF(1, m_epollFd < 0 || m_wakeFds[0] < 0, "RTP\tCould not create reactor thread " << index << " handles");
+}
+
+
+RTP_Reactor::WorkerThread::~WorkerThread()
+{
+  if (m_epollFd >= 0)
+    ::close(m_epollFd);
+  if (m_wakeFds[0] >= 0) {
+    ::close(m_wakeFds[0]);
+    ::close(m_wakeFds[1]);
+  }
+}
+
+
+void RTP_Reactor::WorkerThread::Main()
+{
+  PTRACE(4, "RTP\tReactor thread started");
+
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  while (!IsShuttingDown()) {
+    int count = epoll_wait(m_epollFd, events, PARRAYSIZE(events), GetTransmitTimeout());
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      PTRACE(1, "RTP\tReactor wait failed, errno=" << errno);
+      break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      int fd = events[i].data.fd;
+
+      if (fd == m_wakeFds[0]) {
+        char buffer[16];
+        while (::read(fd, buffer, sizeof(buffer)) > 0)
+          ;
+        continue;
+      }
+
+      m_mutex.Wait();
+      RegistrationMap::iterator it = m_registrations.find(fd);
+      if (it == m_registrations.end()) {
+        // Removed since the wait returned
+        m_mutex.Signal();
+        continue;
+      }
+      Registration registration = it->second;
+      m_dispatching = registration.session;
+      m_mutex.Signal();
+
+      registration.session->OnReactorReadable(registration.isData);
+
+      // Release anyone in Remove() waiting for this read to finish
+      m_mutex.Wait();
+      m_dispatching = NULL;
+      for (std::vector<PSyncPoint *>::iterator it = m_dispatchWaiters.begin(); it != m_dispatchWaiters.end(); ++it)
+        (*it)->Signal();
+      m_dispatchWaiters.clear();
+      m_mutex.Signal();
+    }
+  }
+
+  m_transmitMutex.Wait();
+  FlushTransmit();
+  m_transmitMutex.Signal();
+
+  PTRACE(4, "RTP\tReactor thread ended");
+}
+
+
+void RTP_Reactor::WorkerThread::Wake()
+{
+  if (m_wakeFds[1] >= 0) {
+    static const char wake = 0;
+    PAssert(::write(m_wakeFds[1], &wake, 1) == 1, POperatingSystemError);
+  }
+}
+
+
+bool RTP_Reactor::WorkerThread::IsShuttingDown() const
+{
+  PWaitAndSignal mutex(m_mutex);
+  return m_shutdown;
+}
+
+
+int RTP_Reactor::WorkerThread::GetTransmitTimeout()
+{
+  PWaitAndSignal mutex(m_transmitMutex);
+
+  if (m_transmitCount == 0)
+    return -1;
+
+  PTimeInterval remaining = m_transmitLatency - (PTimer::Tick() - m_transmitFirstTick);
+  if (remaining > 0)
+    return (int)remaining.GetMilliSeconds() + 1;
+
+  FlushTransmit();
+  return -1;
+}
+
+
+void RTP_Reactor::WorkerThread::SetTransmitBatching(unsigned maxPackets, const PTimeInterval & maxLatency)
+{
+  PWaitAndSignal mutex(m_transmitMutex);
+
+  FlushTransmit();
+
+  m_transmitBatchSize = maxPackets;
+  m_transmitLatency = maxLatency;
+  if (maxPackets > 1) {
+    m_transmitQueue.resize(maxPackets);
+    m_transmitOrder.resize(maxPackets);
+    m_transmitMessages.resize(maxPackets);
+    m_transmitVectors.resize(maxPackets);
+  }
+  else {
+    m_transmitQueue.clear();
+    m_transmitOrder.clear();
+    m_transmitMessages.clear();
+    m_transmitVectors.clear();
+  }
+}
+
+
+bool RTP_Reactor::WorkerThread::QueueTransmit(int fd,
+                                              const BYTE * framePtr,
+                                              PINDEX frameSize,
+                                              const PIPSocket::Address & address,
+                                              WORD port)
+{
+  if (fd < 0 || frameSize > BATCH_SLOT_SIZE)
+    return false;
+
+  m_transmitMutex.Wait();
+
+  if (m_transmitBatchSize <= 1) {
+    m_transmitMutex.Signal();
+    return false;
+  }
+
+  bool wasEmpty = m_transmitCount == 0;
+  if (wasEmpty)
+    m_transmitFirstTick = PTimer::Tick();
+
+  Datagram & datagram = m_transmitQueue[m_transmitCount++];
+  datagram.fd = fd;
+  datagram.addressLength = AddressToSockAddr(address, port, datagram.address);
+  datagram.size = frameSize;
+  memcpy(datagram.data, framePtr, frameSize);
+
+  // A full batch goes out immediately, from the writers thread
+  if (m_transmitCount >= m_transmitBatchSize)
+    FlushTransmit();
+
+  bool wake = wasEmpty && m_transmitCount > 0;
+  m_transmitMutex.Signal();
+
+  // Get the reactor to start the latency timer for this batch
+  if (wake)
+    Wake();
+
+  return true;
+}
+
+
+void RTP_Reactor::WorkerThread::FlushTransmit()
+{
+  // Must have m_transmitMutex
+  if (m_transmitCount == 0)
+    return;
+
+  // Group datagrams by socket, keeping per socket order, for one sendmmsg() each
+  for (unsigned i = 0; i < m_transmitCount; ++i) {
+    unsigned j = i;
+    while (j > 0 && m_transmitQueue[m_transmitOrder[j-1]].fd > m_transmitQueue[i].fd) {
+      m_transmitOrder[j] = m_transmitOrder[j-1];
+      --j;
+    }
+    m_transmitOrder[j] = i;
+  }
+
+  memset(&m_transmitMessages[0], 0, m_transmitCount*sizeof(struct mmsghdr));
+  for (unsigned i = 0; i < m_transmitCount; ++i) {
+    Datagram & datagram = m_transmitQueue[m_transmitOrder[i]];
+    m_transmitVectors[i].iov_base = datagram.data;
+    m_transmitVectors[i].iov_len = datagram.size;
+    m_transmitMessages[i].msg_hdr.msg_name = &datagram.address;
+    m_transmitMessages[i].msg_hdr.msg_namelen = datagram.addressLength;
+    m_transmitMessages[i].msg_hdr.msg_iov = &m_transmitVectors[i];
+    m_transmitMessages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  unsigned first = 0;
+  while (first < m_transmitCount) {
+    int fd = m_transmitQueue[m_transmitOrder[first]].fd;
+    unsigned last = first+1;
+    while (last < m_transmitCount && m_transmitQueue[m_transmitOrder[last]].fd == fd)
+      ++last;
+
+    while (first < last) {
+      int sent = sendmmsg(fd, &m_transmitMessages[first], last - first, MSG_DONTWAIT);
+      if (sent > 0)
+        first += sent;
+      else if (sent < 0 && errno == EINTR)
+        continue;
+      else {
+        PTRACE(2, "RTP\tReactor batched write on socket " << fd << " failed, errno=" << errno
+               << ", discarded " << (last - first) << " packets");
+        first = last;
+      }
+    }
+  }
+
+  m_transmitCount = 0;
+}
+
+
+bool RTP_Reactor::WorkerThread::AddSocket(RTP_UDP & session, PUDPSocket & socket, bool isData)
+{
+  int fd = socket.GetHandle();
+  if (fd < 0)
+    return false;
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    PTRACE(1, "RTP\tReactor could not add socket " << fd << ", errno=" << errno);
+    return false;
+  }
+
+  Registration & registration = m_registrations[fd];
+  registration.session = &session;
+  registration.socket = &socket;
+  registration.readTimeout = socket.GetReadTimeout();
+  registration.isData = isData;
+
+  // Never block the reactor thread, even on a spurious wake up
+  socket.SetReadTimeout(0);
+  return true;
+}
+
+
+void RTP_Reactor::WorkerThread::RemoveSocket(int fd)
+{
+  // Must have m_mutex
+  RegistrationMap::iterator it = m_registrations.find(fd);
+  if (it == m_registrations.end())
+    return;
+
+  epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL);
+
+  // Back to blocking reads, if the session goes on without the reactor
+  it->second.socket->SetReadTimeout(it->second.readTimeout);
+
+  m_registrations.erase(it);
+}
+
+
+bool RTP_Reactor::WorkerThread::Add(RTP_UDP & session)
+{
+  if (m_epollFd < 0 || m_wakeFds[0] < 0 || session.dataSocket == NULL || session.controlSocket == NULL)
+    return false;
+
+  PWaitAndSignal mutex(m_mutex);
+
+  if (!AddSocket(session, *session.dataSocket, true))
+    return false;
+
+  if (!AddSocket(session, *session.controlSocket, false)) {
+    RemoveSocket(session.dataSocket->GetHandle());
+    return false;
+  }
+
+  return true;
+}
+
+
+void RTP_Reactor::WorkerThread::Remove(RTP_UDP & session)
+{
+  // Get anything queued for the session out before its sockets go away
+  m_transmitMutex.Wait();
+  FlushTransmit();
+  m_transmitMutex.Signal();
+
+  m_mutex.Wait();
+
+  for (RegistrationMap::iterator it = m_registrations.begin(); it != m_registrations.end(); ) {
+    int fd = it->first;
+    bool remove = it->second.session == &session;
+    ++it;
+    if (remove)
+      RemoveSocket(fd);
+  }
+
+  // Wait for any read in progress on the session, unless we are it
+  if (m_dispatching == &session && PThread::Current() != this) {
+    PSyncPoint dispatched;
+    m_dispatchWaiters.push_back(&dispatched);
+    m_mutex.Signal();
+    dispatched.Wait();
+    return;
+  }
+
+  m_mutex.Signal();
+}
+
+
+void RTP_Reactor::WorkerThread::Shutdown()
+{
+  m_mutex.Wait();
+  m_shutdown = true;
+  m_mutex.Signal();
+  Wake();
+  WaitForTermination();
+}
+
+
+PINDEX RTP_Reactor::WorkerThread::GetSessionCount() const
+{
+  PWaitAndSignal mutex(m_mutex);
+  return m_registrations.size()/2;
+}
+
+
+RTP_Reactor::RTP_Reactor(unsigned threadCount)
+  : m_transmitBatchSize(1)
+  , m_transmitLatency(1)
+{
+  if (threadCount == 0)
+    threadCount = OpalManager::GetProcessorCount();
+
+  for (unsigned i = 0; i < threadCount; ++i) {
+    WorkerThread * thread = new WorkerThread(i);
+    m_threads.push_back(thread);
+    thread->Resume();
+  }
+
+  PTRACE(3, "RTP\tReactor started with " << threadCount << " threads");
+}
+
+
+RTP_Reactor::~RTP_Reactor()
+{
+  for (std::vector<WorkerThread *>::iterator it = m_threads.begin(); it != m_threads.end(); ++it) {
+    (*it)->Shutdown();
+    delete *it;
+  }
+
+  PTRACE(3, "RTP\tReactor stopped");
+}
+
+
+bool RTP_Reactor::IsAvailable()
+{
+  return true;
+}
+
+
+bool RTP_Reactor::AddSession(RTP_UDP & session)
+{
+  PWaitAndSignal mutex(m_threadsMutex);
+
+  if (m_threads.empty())
+    return false;
+
+  PINDEX best = 0;
+  PINDEX bestCount = m_threads[0]->GetSessionCount();
+  for (PINDEX i = 1; i < (PINDEX)m_threads.size(); ++i) {
+    PINDEX count = m_threads[i]->GetSessionCount();
+    if (count < bestCount) {
+      best = i;
+      bestCount = count;
+    }
+  }
+
+  if (!m_threads[best]->Add(session))
+    return false;
+
+  session.m_reactorIndex = best;
+  PTRACE(4, "RTP\tReactor thread " << best << " servicing session " << session.GetSessionID());
+  return true;
+}
+
+
+void RTP_Reactor::RemoveSession(RTP_UDP & session)
+{
+  PINDEX index = session.m_reactorIndex;
+  if (index < (PINDEX)m_threads.size())
+    m_threads[index]->Remove(session);
+  session.m_reactorIndex = P_MAX_INDEX;
+}
+
+
+PINDEX RTP_Reactor::GetSessionCount() const
+{
+  PINDEX count = 0;
+  for (std::vector<WorkerThread *>::const_iterator it = m_threads.begin(); it != m_threads.end(); ++it)
+    count += (*it)->GetSessionCount();
+  return count;
+}
+
+
+void RTP_Reactor::SetTransmitBatching(unsigned maxPackets, const PTimeInterval & maxLatency)
+{
+  PWaitAndSignal mutex(m_threadsMutex);
+
+  if (maxPackets < 1)
+    maxPackets = 1;
+
+  for (std::vector<WorkerThread *>::iterator it = m_threads.begin(); it != m_threads.end(); ++it)
+    (*it)->SetTransmitBatching(maxPackets, maxLatency);
+
+  m_transmitBatchSize = maxPackets;
+  m_transmitLatency = maxLatency;
+
+  PTRACE(3, "RTP\tReactor transmit batching "
+         << (maxPackets > 1 ? psprintf("up to %u packets", maxPackets) : PString("disabled"))
+         << ", latency " << maxLatency);
+}
+
+
+bool RTP_Reactor::QueueTransmit(RTP_UDP & session,
+                                PUDPSocket & socket,
+                                const BYTE * framePtr,
+                                PINDEX frameSize,
+                                const PIPSocket::Address & address,
+                                WORD port)
+{
+  PINDEX index = session.m_reactorIndex;
+  if (index >= (PINDEX)m_threads.size())
+    return false;
+
+  return m_threads[index]->QueueTransmit(socket.GetHandle(), framePtr, frameSize, address, port);
+}
+
+
+#else // P_LINUX
+
+class RTP_Reactor::WorkerThread
+{
+};
+
+
+RTP_Reactor::RTP_Reactor(unsigned)
+  : m_transmitBatchSize(1)
+  , m_transmitLatency(1)
+{
+  PTRACE(2, "RTP\tReactor not supported on this platform");
+}
+
+
+RTP_Reactor::~RTP_Reactor()
+{
+}
+
+
+bool RTP_Reactor::IsAvailable()
+{
+  return false;
+}
+
+
+bool RTP_Reactor::AddSession(RTP_UDP &)
+{
+  return false;
+}
+
+
+void RTP_Reactor::RemoveSession(RTP_UDP &)
+{
+}
+
+
+PINDEX RTP_Reactor::GetSessionCount() const
+{
+  return 0;
+}
+
+
+void RTP_Reactor::SetTransmitBatching(unsigned, const PTimeInterval &)
+{
+}
+
+
+bool RTP_Reactor::QueueTransmit(RTP_UDP &, PUDPSocket &, const BYTE *, PINDEX, const PIPSocket::Address &, WORD)
+{
+  return false;
+}
+
+#endif // P_LINUX
+
+
 /////////////////////////////////////////////////////////////////////////////
@@ -104,6 +104,12 @@ SIPHandler::SIPHandler(SIPEndPoint & ep,
   , state(Unavailable)
   , retryTimeoutMin(retryMin)
   , retryTimeoutMax(retryMax)
+  , m_byCallIdEntry(NULL)
+  , m_byUserNameAndRealmEntry(NULL)
+  , m_byRealmEntry(NULL)
+  , m_byUrlEntry(NULL)
+  , m_byUrlAndPackageEntry(NULL)
+  , m_byDomainEntry(NULL)
 {
   transactions.DisallowDeleteObjects();
 
@@ -470,6 +476,7 @@ void SIPHandler::OnReceivedAuthenticationRequired(SIPTransaction & transaction,
   m_realm    = newAuth->GetAuthRealm();
   m_username = username;
   m_password = password;
+  endpoint.GetHandlersList().Update(this);
 
   // And end connect mode on the transport
   CollapseFork(transaction);
@@ -1678,41 +1685,74 @@ PStringList SIPHandlersList::GetAddresses(bool includeOffline, SIP_PDU::Methods
 }
 
 
+static std::string MakeUserNameAndRealmKey(const PString & userName, const PString & realm)
+{
+  std::string key((const char *)userName);
+  key += '\n';
+  key += (const char *)realm;
+  return key;
+}
+
+
+static std::string MakeUrlKey(SIP_PDU::Methods method, const PString & url)
+{
+  std::string key(1, (char)('A' + method));
+  key += (const char *)url;
+  return key;
+}
+
+
+static std::string MakeUrlAndPackageKey(SIP_PDU::Methods method, const PString & url, const PString & eventPackage)
+{
+  std::string key(MakeUrlKey(method, url));
+  key += '\n';
+  key += (const char *)eventPackage;
+  return key;
+}
+
+
 /**
   * called when a handler is added
   */
 
-void SIPHandlersList::Append(SIPHandler * obj)
+void SIPHandlersList::Append(SIPHandler * handler)
 {
-  if (obj == NULL)
+  if (handler == NULL)
     return;
 
-  PWaitAndSignal m(m_extraMutex);
+  PWriteWaitAndSignal m(m_indexMutex);
 
-  PSafePtr<SIPHandler> handler = m_handlersList.Append(obj, PSafeReference);
+  m_handlersList.Append(handler, PSafeReference);
 
-  // add entry to call to handler map
-  m_handlersByCallId.insert(StringToHandlerMap::value_type(handler->GetCallID(), handler));
+  handler->m_byCallIdEntry = m_handlersByCallId.Insert((const char *)handler->GetCallID(), handler);
 
-  // add entry to username/realm map
-  if (!handler->GetUsername().IsEmpty()) {
-    PString key(handler->GetUsername() + '\n' + handler->GetRealm());
-    handler->m_userNameAndRealmKey = (const char *)key;
-    m_handlersByUserNameAndRealm.insert(StringToHandlerMap::value_type(handler->m_userNameAndRealmKey, handler));
-  }
+  InsertAuthentication(handler);
+
+  SIP_PDU::Methods method = handler->GetMethod();
+  const SIPURL & aor = handler->GetAddressOfRecord();
+  PString url(aor.AsString());
+  handler->m_byUrlEntry = m_handlersByUrl.Insert(MakeUrlKey(method, url), handler);
+  handler->m_byUrlAndPackageEntry = m_handlersByUrlAndPackage.Insert(MakeUrlAndPackageKey(method, url, handler->GetEventPackage()), handler);
+  handler->m_byDomainEntry = m_handlersByDomain.Insert(MakeUrlKey(method, aor.GetHostName()), handler);
+}
+
+
+/**
+  * Called when the user name or realm of a handler changes
+  */
+void SIPHandlersList::Update(SIPHandler * handler)
+{
+  if (handler == NULL)
+    return;
 
-  // add entry to url map
-  PString url(handler->GetAddressOfRecord().AsString());
-  PString key;
-  key.sprintf("%i\n%s", handler->GetMethod(), (const char *)url);
-  handler->m_urlKey = (const char *)key;
-  m_handlersByUrl.insert(StringToHandlerMap::value_type(handler->m_urlKey, handler));
+  PWriteWaitAndSignal m(m_indexMutex);
 
-  // add entry to url and package map
-  PString pkg(handler->GetEventPackage());
-  key.sprintf("%i\n%s\n%s", handler->GetMethod(), (const char *)url, (const char *)pkg);
-  handler->m_urlAndPackageKey = (const char *)key;
-  m_handlersByUrlAndPackage.insert(StringToHandlerMap::value_type(handler->m_urlAndPackageKey, handler));
+  // Not in the list, or already removed
+  if (handler->m_byCallIdEntry == NULL)
+    return;
+
+  EraseAuthentication(handler);
+  InsertAuthentication(handler);
 }
 
 
@@ -1724,27 +1764,110 @@ void SIPHandlersList::Remove(SIPHandler * handler)
   if (handler == NULL)
     return;
 
-  PWaitAndSignal m(m_extraMutex);
+  {
+    PWriteWaitAndSignal m(m_indexMutex);
+
+    if (handler->m_byCallIdEntry != NULL) {
+      m_handlersByCallId.Erase(handler->m_byCallIdEntry);
+      handler->m_byCallIdEntry = NULL;
+    }
+
+    EraseAuthentication(handler);
 
-  m_handlersByCallId.erase(handler->GetCallID());
-  m_handlersByUserNameAndRealm.erase(handler->m_userNameAndRealmKey);
+    if (handler->m_byUrlEntry != NULL) {
+      m_handlersByUrl.Erase(handler->m_byUrlEntry);
+      handler->m_byUrlEntry = NULL;
+    }
+
+    if (handler->m_byUrlAndPackageEntry != NULL) {
+      m_handlersByUrlAndPackage.Erase(handler->m_byUrlAndPackageEntry);
+      handler->m_byUrlAndPackageEntry = NULL;
+    }
+
+    if (handler->m_byDomainEntry != NULL) {
+      m_handlersByDomain.Erase(handler->m_byDomainEntry);
+      handler->m_byDomainEntry = NULL;
+    }
+  }
 
   m_handlersList.Remove(handler);
 }
 
 
+void SIPHandlersList::InsertAuthentication(SIPHandler * handler)
+{
+  const PString & userName = handler->GetUsername();
+  const PString & realm = handler->GetRealm();
+
+  if (!userName.IsEmpty())
+    handler->m_byUserNameAndRealmEntry = m_handlersByUserNameAndRealm.Insert(MakeUserNameAndRealmKey(userName, realm), handler);
+
+  handler->m_byRealmEntry = m_handlersByRealm.Insert((const char *)realm, handler);
+}
+
+
+void SIPHandlersList::EraseAuthentication(SIPHandler * handler)
+{
+  if (handler->m_byUserNameAndRealmEntry != NULL) {
+    m_handlersByUserNameAndRealm.Erase(handler->m_byUserNameAndRealmEntry);
+    handler->m_byUserNameAndRealmEntry = NULL;
+  }
+
+  if (handler->m_byRealmEntry != NULL) {
+    m_handlersByRealm.Erase(handler->m_byRealmEntry);
+    handler->m_byRealmEntry = NULL;
+  }
+}
+
+
+/* Get a reference to the first handler with the key, must be called with
+   m_indexMutex held for reading. Handlers are only deleted after removal
+   from the list, which takes the mutex for writing, so any handler still in
+   an index can have a reference taken to it here. Locking it is left until
+   the mutex is released, so a lookup never waits on a handler while holding
+   up changes to the list.
+
+   For the same reason the state is deliberately read without locking the
+   handler. It is a single word, so at worst a handler that is just being
+   unsubscribed is returned. Callers must cope with that anyway, as the
+   state can change as soon as they have the handler.
+ */
+PSafePtr<SIPHandler> SIPHandlersList::FindFirst(const SIPHandlerIndex & index, const std::string & key, bool skipUnsubscribed)
+{
+  for (SIPHandlerIndex::Entry * entry = index.Find(key); entry != NULL; entry = index.FindNext(entry)) {
+    if (skipUnsubscribed && entry->m_handler->GetState() == SIPHandler::Unsubscribed)
+      continue;
+
+    PSafePtr<SIPHandler> handler(entry->m_handler, PSafeReference);
+    if (handler != NULL)
+      return handler;
+  }
+
+  return NULL;
+}
+
+
+static PSafePtr<SIPHandler> SetHandlerMode(PSafePtr<SIPHandler> handler, PSafetyMode mode)
+{
+  if (handler != NULL && handler.SetSafetyMode(mode))
+    return handler;
+  return NULL;
+}
+
+
 /**
  * Find the SIPHandler object with the specified callID
  */
 PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByCallID(const PString & callID, PSafetyMode mode)
 {
-  PWaitAndSignal m(m_extraMutex);
-
-  StringToHandlerMap::iterator r = m_handlersByCallId.find(std::string((const char *)callID));
-  if (r == m_handlersByCallId.end())
-    return NULL;
+  std::string key((const char *)callID);
 
-  return PSafePtr<SIPHandler>(r->second, mode);
+  PSafePtr<SIPHandler> handler;
+  {
+    PReadWaitAndSignal m(m_indexMutex);
+    handler = FindFirst(m_handlersByCallId, key);
+  }
+  return SetHandlerMode(handler, mode);
 }
 
 
@@ -1753,62 +1876,28 @@ PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByCallID(const PString & cal
  */
 PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByAuthRealm (const PString & authRealm, const PString & userName, PSafetyMode mode)
 {
-  PWaitAndSignal m(m_extraMutex);
+  PSafePtr<SIPHandler> handler;
 
-  // if username is specified, look for exact matches
-  if (!userName.IsEmpty()) {
+  {
+    PReadWaitAndSignal m(m_indexMutex);
 
-    // look for a match to exact user name and realm
-    PString key(userName + '\n' + authRealm);
-    StringToHandlerMap::iterator r = m_handlersByUserNameAndRealm.find((const char *)key);
-    if (r != m_handlersByUserNameAndRealm.end()) {
-      PSafePtr<SIPHandler> handler = r->second;
-      handler.SetSafetyMode(mode);
-      return handler;
-    }
+    // if username is specified, look for exact matches
+    if (!userName.IsEmpty()) {
 
-    // look for a match to exact user name and empty realm
-    key = PString(userName + '\n');
-    r = m_handlersByUserNameAndRealm.find((const char *)key);
-    if (r != m_handlersByUserNameAndRealm.end()) {
-      PSafePtr<SIPHandler> handler = r->second;
-      handler.SetSafetyMode(mode);
-      return handler;
-    }
+      // look for a match to exact user name and realm
+      handler = FindFirst(m_handlersByUserNameAndRealm, MakeUserNameAndRealmKey(userName, authRealm));
 
-#if 0
-    // look for a match to exact username and realm as hostname
-    PIPSocket::Address addr;
-    if (PIPSocket::GetHostAddress(authRealm, addr)) {
-      key = PString(userName + '\n' + addr.AsString());
-      r = m_handlersByUserNameAndRealmAddress.find(std::string(key));
-      if (r != m_handlersByUserNameAndRealmAddress.end()) {
-        PSafePtr<SIPHandler> handler = r->second;
-        handler.SetSafetyMode(mode);
-        return handler;
-      }
+      // look for a match to exact user name and empty realm
+      if (handler == NULL)
+        handler = FindFirst(m_handlersByUserNameAndRealm, MakeUserNameAndRealmKey(userName, PString()));
     }
-#endif
-  }
 
-  // look for a match to exact realm
-  for (PSafePtr<SIPHandler> handler(m_handlersList, PSafeReference); handler != NULL; ++handler) {
-    if (handler->GetRealm() == authRealm && handler.SetSafetyMode(mode))
-      return handler;
+    // look for a match to exact realm
+    if (handler == NULL)
+      handler = FindFirst(m_handlersByRealm, (const char *)authRealm);
   }
 
-#if 0
-  // look for a match to exact realm as hostname
-  for (PSafePtr<SIPHandler> handler(m_handlersList, PSafeReference); handler != NULL; ++handler) {
-    PIPSocket::Address addr;
-    if (PIPSocket::GetHostAddress(handler->GetRealm(), addr) &&
-        handlerRealmAddress == authRealmAddress &&
-        handler.SetSafetyMode(mode))
-      return handler;
-  }
-#endif
-
-  return NULL;
+  return SetHandlerMode(handler, mode);
 }
 
 
@@ -1821,31 +1910,27 @@ PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByAuthRealm (const PString &
  */
 PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByUrl(const PString & aor, SIP_PDU::Methods method, PSafetyMode mode)
 {
-  PString key;
-  key.sprintf("%i\n%s", method, (const char *)aor);
+  std::string key(MakeUrlKey(method, aor));
 
-  PWaitAndSignal m(m_extraMutex);
-
-  StringToHandlerMap::iterator r = m_handlersByUrl.find(std::string((const char *)key));
-  if (r == m_handlersByUrl.end())
-    return NULL;
-
-  return PSafePtr<SIPHandler>(r->second, mode);
+  PSafePtr<SIPHandler> handler;
+  {
+    PReadWaitAndSignal m(m_indexMutex);
+    handler = FindFirst(m_handlersByUrl, key);
+  }
+  return SetHandlerMode(handler, mode);
 }
 
 
 PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByUrl(const PString & aor, SIP_PDU::Methods method, const PString & eventPackage, PSafetyMode mode)
 {
-  PString key;
-  key.sprintf("%i\n%s\n%s", method, (const char *)aor, (const char *)eventPackage);
-
-  PWaitAndSignal m(m_extraMutex);
+  std::string key(MakeUrlAndPackageKey(method, aor, eventPackage));
 
-  StringToHandlerMap::iterator r = m_handlersByUrlAndPackage.find(std::string((const char *)key));
-  if (r == m_handlersByUrlAndPackage.end())
-    return NULL;
-
-  return PSafePtr<SIPHandler>(r->second, mode);
+  PSafePtr<SIPHandler> handler;
+  {
+    PReadWaitAndSignal m(m_indexMutex);
+    handler = FindFirst(m_handlersByUrlAndPackage, key);
+  }
+  return SetHandlerMode(handler, mode);
 }
 
 
@@ -1856,16 +1941,134 @@ PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByUrl(const PString & aor, S
  */
 PSafePtr<SIPHandler> SIPHandlersList::FindSIPHandlerByDomain(const PString & name, SIP_PDU::Methods meth, PSafetyMode mode)
 {
-  for (PSafePtr<SIPHandler> handler(m_handlersList, PSafeReference); handler != NULL; ++handler) {
-    if ( handler->GetMethod() == meth &&
-         handler->GetState() != SIPHandler::Unsubscribed &&
-        (handler->GetAddressOfRecord().GetHostName() == name ||
-         handler->GetAddressOfRecord().GetHostAddress().IsEquivalent(name)) &&
-         handler.SetSafetyMode(mode))
-      return handler;
+  std::string key(MakeUrlKey(meth, name));
+
+  PSafePtr<SIPHandler> handler;
+  {
+    PReadWaitAndSignal m(m_indexMutex);
+    handler = FindFirst(m_handlersByDomain, key, true);
+  }
+  return SetHandlerMode(handler, mode);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+SIPHandlerIndex::SIPHandlerIndex()
+  : m_buckets(16)
+  , m_count(0)
+{
+}
+
+
+SIPHandlerIndex::~SIPHandlerIndex()
+{
+  for (size_t i = 0; i < m_buckets.size(); ++i) {
+    Entry * entry = m_buckets[i];
+    while (entry != NULL) {
+      Entry * next = entry->m_next;
+      delete entry;
+      entry = next;
+    }
+  }
+}
+
+
+unsigned SIPHandlerIndex::Hash(const std::string & key)
+{
+  // FNV-1a
+  unsigned hash = 2166136261U;
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+    hash ^= (unsigned char)*it;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+
+SIPHandlerIndex::Entry * SIPHandlerIndex::Insert(const std::string & key, SIPHandler * handler)
+{
+  if (m_count >= m_buckets.size())
+    Rehash(m_buckets.size()*2);
+
+  Entry * entry = new Entry;
+  entry->m_key = key;
+  entry->m_hash = Hash(key);
+  entry->m_handler = handler;
+
+  Entry * & head = m_buckets[entry->m_hash & (m_buckets.size()-1)];
+  entry->m_prev = NULL;
+  entry->m_next = head;
+  if (head != NULL)
+    head->m_prev = entry;
+  head = entry;
+
+  ++m_count;
+  return entry;
+}
+
+
+void SIPHandlerIndex::Erase(Entry * entry)
+{
+  if (entry->m_next != NULL)
+    entry->m_next->m_prev = entry->m_prev;
+
+  if (entry->m_prev != NULL)
+    entry->m_prev->m_next = entry->m_next;
+  else
+    m_buckets[entry->m_hash & (m_buckets.size()-1)] = entry->m_next;
+
+  delete entry;
+  --m_count;
+}
+
+
+SIPHandlerIndex::Entry * SIPHandlerIndex::Find(const std::string & key) const
+{
+  unsigned hash = Hash(key);
+  for (Entry * entry = m_buckets[hash & (m_buckets.size()-1)]; entry != NULL; entry = entry->m_next) {
+    if (entry->m_hash == hash && entry->m_key == key)
+      return entry;
   }
   return NULL;
 }
 
 
+SIPHandlerIndex::Entry * SIPHandlerIndex::FindNext(const Entry * previous) const
+{
+  for (Entry * entry = previous->m_next; entry != NULL; entry = entry->m_next) {
+    if (entry->m_hash == previous->m_hash && entry->m_key == previous->m_key)
+      return entry;
+  }
+  return NULL;
+}
+
+
+void SIPHandlerIndex::Rehash(size_t buckets)
+{
+  // Size is kept a power of two so the bucket is a mask of the hash
+  std::vector<Entry *> newBuckets(buckets);
+  std::vector<Entry *> tails(buckets);
+
+  // Add to the end of each new bucket, so entries with the same key stay in order
+  for (size_t i = 0; i < m_buckets.size(); ++i) {
+    Entry * entry = m_buckets[i];
+    while (entry != NULL) {
+      Entry * next = entry->m_next;
+      size_t bucket = entry->m_hash & (buckets-1);
+      entry->m_prev = tails[bucket];
+      entry->m_next = NULL;
+      if (tails[bucket] != NULL)
+        tails[bucket]->m_next = entry;
+      else
+        newBuckets[bucket] = entry;
+      tails[bucket] = entry;
+      entry = next;
+    }
+  }
+
+  m_buckets.swap(newBuckets);
+}
+
+
 #endif // OPAL_SIP
@@ -233,6 +233,8 @@ SIPConnection::SIPConnection(OpalCall & call,
   , needReINVITE(false)
   , m_appearanceCode(ep.GetDefaultAppearanceCode())
   , authentication(NULL)
+  , ackTimer(ep.GetTimerWheel(), *this)
+  , ackRetry(ep.GetTimerWheel(), *this)
   , ackReceived(false)
   , releaseMethod(ReleaseWithNothing)
 #if OPAL_HAS_IM
@@ -279,6 +281,9 @@ SIPConnection::SIPConnection(OpalCall & call,
     proxy = endpoint.GetProxy();
 
   m_dialog.UpdateRouteSet(proxy); // Default routeSet if there is a proxy
+
+  // Keep endpoint index of dialogs up to date as tags are set
+  m_dialog.SetIndex(&endpoint.GetDialogIndex(), GetToken());
   
   forkedInvitations.DisallowDeleteObjects();
 
@@ -409,6 +414,8 @@ void SIPConnection::OnReleased()
 
   SetPhase(ReleasedPhase);
 
+  m_dialog.SetIndex(NULL);
+
   OpalRTPConnection::OnReleased();
 }
 
@@ -2491,7 +2498,7 @@ PBoolean SIPConnection::SendInviteResponse(SIP_PDU::StatusCodes code, const char
 }
 
 
-void SIPConnection::OnInviteResponseRetry(PTimer &, INT)
+void SIPConnection::OnInviteResponseRetry(SIPTimer &, INT)
 {
   PSafeLockReadWrite safeLock(*this);
   if (safeLock.IsLocked() && !ackReceived && originalInvite != NULL) {
@@ -2501,7 +2508,7 @@ void SIPConnection::OnInviteResponseRetry(PTimer &, INT)
 }
 
 
-void SIPConnection::OnAckTimeout(PTimer &, INT)
+void SIPConnection::OnAckTimeout(SIPTimer &, INT)
 {
   PSafeLockReadWrite safeLock(*this);
   if (safeLock.IsLocked() && !ackReceived) {
@@ -66,12 +66,13 @@ SIPEndPoint::SIPEndPoint(OpalManager & mgr)
   , notifierTimeToLive(0, 0, 0, 1)   // 1 hour
   , natBindingTimeout(0, 0, 1)       // 1 minute
   , m_shuttingDown(false)
-  , m_defaultAppearanceCode(-1)
 
 #ifdef _MSC_VER
 #pragma warning(disable:4355)
 #endif
 
+  , m_timerWheel(*this)
+  , m_defaultAppearanceCode(-1)
   , m_highPriorityMonitor(*this, HighPriority)
   , m_lowPriorityMonitor(*this, LowPriority)
 
@@ -144,8 +145,14 @@ void SIPEndPoint::ShutDown()
     transactions.RemoveAt(transaction->GetTransactionID());
   }
 
+  // No transactions left, so no more timers to run
+  m_timerWheel.ShutDown();
+
   // Now shut down listeners and aggregators
   OpalEndPoint::ShutDown();
+
+  // Nothing can add work now, so stop the threads doing it
+  threadPool.Shutdown();
 }
 
 
@@ -521,7 +528,8 @@ PBoolean SIPEndPoint::OnReceivedPDU(OpalTransport & transport, SIP_PDU * pdu)
       break;
 
     case SIP_PDU::NumMethods :
-      AddWork(new SIPEndPoint::SIP_PDU_Work(*this, token, pdu));
+      // Responses for a REGISTER, OPTIONS etc without a connection can be done in any order
+      AddWork(new SIPEndPoint::SIP_PDU_Work(*this, token, pdu, hasFromConnection || hasToConnection));
       return true;
   }
 
@@ -746,22 +754,26 @@ PSafePtr<SIPConnection> SIPEndPoint::GetSIPConnectionWithLock(const PString & to
     return NULL;
   }
 
-  connection = PSafePtrCast<OpalConnection, SIPConnection>(connectionsActive.GetAt(0, PSafeReference));
-  while (connection != NULL) {
-    const SIPDialogContext & context = connection->GetDialog();
-    if (context.GetCallID() == callid) {
-      if (context.GetLocalTag() == to && context.GetRemoteTag() == from) {
-        if (connection.SetSafetyMode(mode))
-          return connection;
-        break;
-      }
+  PString dialogToken = m_dialogIndex.Find(callid, to, from);
+  if (!dialogToken.IsEmpty()) {
+    connection = PSafePtrCast<OpalConnection, SIPConnection>(GetConnectionWithLock(dialogToken, mode));
+    if (connection != NULL)
+      return connection;
+  }
 
-      PTRACE(4, "SIP\tReplaces header matches callid, but not to/from tags: "
-                "to=" << context.GetLocalTag() << ", from=" << context.GetRemoteTag());
+#if PTRACING
+  if (PTrace::CanTrace(4)) {
+    PStringList tokens = m_dialogIndex.FindByCallID(callid);
+    for (PINDEX i = 0; i < tokens.GetSize(); ++i) {
+      connection = PSafePtrCast<OpalConnection, SIPConnection>(GetConnectionWithLock(tokens[i], PSafeReference));
+      if (connection != NULL) {
+        const SIPDialogContext & context = connection->GetDialog();
+        PTRACE(4, "SIP\tReplaces header matches callid, but not to/from tags: "
+                  "to=" << context.GetLocalTag() << ", from=" << context.GetRemoteTag());
+      }
     }
-
-    ++connection;
   }
+#endif
 
   if (errorCode != NULL)
     *errorCode = SIP_PDU::Failure_TransactionDoesNotExist;
@@ -1081,6 +1093,7 @@ bool SIPEndPoint::Register(const SIPRegister::Params & params, PString & aor)
   // then update it with the new information
   if (handler != NULL) {
     PSafePtrCast<SIPHandler, SIPRegisterHandler>(handler)->UpdateParameters(params);
+    activeSIPHandlers.Update(handler);
   }
   else {
     // Otherwise create a new request with this method type
@@ -1154,8 +1167,10 @@ bool SIPEndPoint::Subscribe(const SIPSubscribe::Params & params, PString & aor)
   
   // If there is already a request with this URL and method, 
   // then update it with the new information
-  if (handler != NULL && handler->GetState() != SIPHandler::Unsubscribed)
+  if (handler != NULL && handler->GetState() != SIPHandler::Unsubscribed) {
     handler->UpdateParameters(params);
+    activeSIPHandlers.Update(handler);
+  }
   else {
     // Otherwise create a new request with this method type
     handler = new SIPSubscribeHandler(*this, params);
@@ -1521,36 +1536,341 @@ void SIPEndPoint::OnRTPStatistics(const SIPConnection & connection,
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-SIPEndPoint::WorkThreadPool::WorkerThreadBase * SIPEndPoint::WorkThreadPool::CreateWorkerThread()
-{ 
-  return new SIP_Work_Thread(*this); 
+/* The work queues need an atomic exchange of pointers, which PAtomicInteger
+   does not provide, so use the compiler or OS primitives directly. */
+#if defined(_WIN32)
+
+static inline SIPEndPoint::SIP_WorkQueue::Node * ExchangeNode(SIPEndPoint::SIP_WorkQueue::Node * volatile * ptr,
+                                                              SIPEndPoint::SIP_WorkQueue::Node * node)
+{
+  return (SIPEndPoint::SIP_WorkQueue::Node *)InterlockedExchangePointer((PVOID volatile *)ptr, node);
+}
+
+static inline bool CompareExchange(volatile long * ptr, long expected, long value)
+{
+  return InterlockedCompareExchange(ptr, value, expected) == expected;
 }
 
+#define SIP_WORK_BARRIER() MemoryBarrier()
 
-SIPEndPoint::SIP_Work_Thread::SIP_Work_Thread(WorkThreadPool & pool_)
-  : WorkThreadPool::WorkerThread(pool_)
+#elif defined(__GNUC__)
+
+static inline SIPEndPoint::SIP_WorkQueue::Node * ExchangeNode(SIPEndPoint::SIP_WorkQueue::Node * volatile * ptr,
+                                                              SIPEndPoint::SIP_WorkQueue::Node * node)
 {
-  SetPriority(HighPriority);
+  // This builtin is only an acquire barrier, so make it a full one
+  __sync_synchronize();
+  return __sync_lock_test_and_set(ptr, node);
 }
 
+static inline bool CompareExchange(volatile long * ptr, long expected, long value)
+{
+  return __sync_bool_compare_and_swap(ptr, expected, value);
+}
 
-unsigned SIPEndPoint::SIP_Work_Thread::GetWorkSize() const 
-{ 
-  return m_pduQueue.size(); 
+#define SIP_WORK_BARRIER() __sync_synchronize()
+
+#else
+
+static PMutex & GetExchangeMutex()
+{
+  static PMutex mutex;
+  return mutex;
+}
+
+static inline SIPEndPoint::SIP_WorkQueue::Node * ExchangeNode(SIPEndPoint::SIP_WorkQueue::Node * volatile * ptr,
+                                                              SIPEndPoint::SIP_WorkQueue::Node * node)
+{
+  PWaitAndSignal mutex(GetExchangeMutex());
+  SIPEndPoint::SIP_WorkQueue::Node * previous = *ptr;
+  *ptr = node;
+  return previous;
+}
+
+static inline bool CompareExchange(volatile long * ptr, long expected, long value)
+{
+  PWaitAndSignal mutex(GetExchangeMutex());
+  if (*ptr != expected)
+    return false;
+  *ptr = value;
+  return true;
+}
+
+#define SIP_WORK_BARRIER() { PWaitAndSignal mutex(GetExchangeMutex()); }
+
+#endif
+
+
+static unsigned HashCallID(const PString & callID)
+{
+  // FNV-1a, PString::HashFunction() only has a small range
+  unsigned hash = 2166136261U;
+  for (const char * ptr = callID; *ptr != '\0'; ++ptr)
+    hash = (hash ^ (unsigned char)*ptr)*16777619U;
+  return hash;
+}
+
+
+SIPEndPoint::SIP_WorkQueue::SIP_WorkQueue()
+  : m_head(&m_stub)
+  , m_tail(&m_stub)
+  , m_depth(0)
+  , m_claimed(0)
+{
+}
+
+
+void SIPEndPoint::SIP_WorkQueue::Link(Node * node)
+{
+  node->m_nextWork = NULL;
+  Node * previous = ExchangeNode(&m_head, node);
+
+  /* Between the exchange and this, the consumer sees the queue as empty
+     from the previous node, so it must never block on the producer. */
+  previous->m_nextWork = node;
 }
 
 
-void SIPEndPoint::SIP_Work_Thread::AddWork(SIP_Work * work)
+void SIPEndPoint::SIP_WorkQueue::Push(Node * node)
 {
-  PWaitAndSignal m(m_workerMutex);
-  m_pduQueue.push(work);
-  if (m_pduQueue.size() == 1)
-    m_sync.Signal();
+  ++m_depth;
+  Link(node);
+}
+
+
+SIPEndPoint::SIP_WorkQueue::Node * SIPEndPoint::SIP_WorkQueue::Pop()
+{
+  Node * tail = m_tail;
+  Node * next = tail->m_nextWork;
+  SIP_WORK_BARRIER();
+
+  if (tail == &m_stub) {
+    if (next == NULL)
+      return NULL;
+    m_tail = next;
+    tail = next;
+    next = next->m_nextWork;
+    SIP_WORK_BARRIER();
+  }
+
+  if (next == NULL) {
+    // Last node, or a producer is part way through Push()
+    if (tail != m_head)
+      return NULL;
+
+    // Put the stub back behind the last node so it can be removed
+    Link(&m_stub);
+    next = tail->m_nextWork;
+    SIP_WORK_BARRIER();
+    if (next == NULL)
+      return NULL;
+  }
+
+  m_tail = next;
+  --m_depth;
+  return tail;
 }
 
 
-void SIPEndPoint::SIP_Work_Thread::RemoveWork(SIP_Work *)
+bool SIPEndPoint::SIP_WorkQueue::Claim()
 {
+  return CompareExchange(&m_claimed, 0, 1);
+}
+
+
+void SIPEndPoint::SIP_WorkQueue::Release()
+{
+  SIP_WORK_BARRIER();
+  m_claimed = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+SIPEndPoint::WorkThreadPool::WorkThreadPool(unsigned threads)
+  : m_nextChoice(0)
+  , m_adding(0)
+  , m_shutdown(false)
+{
+  if (threads == 0)
+    threads = OpalManager::GetProcessorCount();
+
+  for (unsigned i = 0; i < threads; ++i) {
+    SIP_Work_Thread * worker = new SIP_Work_Thread(*this, i);
+    m_workers.push_back(worker);
+    worker->Resume();
+  }
+
+  PTRACE(4, "SIP\tStarted " << threads << " work threads");
+}
+
+
+SIPEndPoint::WorkThreadPool::~WorkThreadPool()
+{
+  Shutdown();
+}
+
+
+void SIPEndPoint::WorkThreadPool::Shutdown()
+{
+  if (m_shutdown)
+    return;
+
+  // From here AddWork() discards work, rather than touch a worker
+  m_shutdown = true;
+
+  std::vector<SIP_Work_Thread *>::iterator it;
+  for (it = m_workers.begin(); it != m_workers.end(); ++it)
+    (*it)->Shutdown();
+
+  // All must stop before any is deleted, as running ones can steal from, or add work to, the others
+  for (it = m_workers.begin(); it != m_workers.end(); ++it)
+    (*it)->WaitForTermination();
+
+  // Let any AddWork() that got past the check before it was set finish its push
+  while (m_adding > 0)
+    PThread::Yield();
+
+  for (it = m_workers.begin(); it != m_workers.end(); ++it) {
+    // Nothing is adding work now, so no need to claim the queue
+    SIP_WorkQueue::Node * node;
+    while ((node = (*it)->m_dialogQueue.Pop()) != NULL)
+      delete (SIP_Work *)node;
+    while ((node = (*it)->m_otherQueue.Pop()) != NULL)
+      delete (SIP_Work *)node;
+
+    delete *it;
+  }
+
+  m_workers.clear();
+}
+
+
+void SIPEndPoint::WorkThreadPool::AddWork(SIP_Work * work, const PString & key)
+{
+  if (key.IsEmpty()) {
+    AddWork(work);
+    return;
+  }
+
+  ++m_adding;
+  if (m_shutdown)
+    delete work;
+  else
+    m_workers[HashCallID(key)%m_workers.size()]->AddWork(work, true);
+  --m_adding;
+}
+
+
+void SIPEndPoint::WorkThreadPool::AddWork(SIP_Work * work)
+{
+  ++m_adding;
+  if (m_shutdown)
+    delete work;
+  else
+    AddOtherWork(work);
+  --m_adding;
+}
+
+
+void SIPEndPoint::WorkThreadPool::AddOtherWork(SIP_Work * work)
+{
+
+  // Least busy of two threads, which is nearly as good as the least busy of all
+  unsigned choice = (unsigned)(long)++m_nextChoice;
+  SIP_Work_Thread * first = m_workers[choice%m_workers.size()];
+  SIP_Work_Thread * second = m_workers[(choice*7+1)%m_workers.size()];
+  SIP_Work_Thread * chosen = second->m_pending < first->m_pending ? second : first;
+  chosen->AddWork(work, false);
+
+  // If it has to wait behind other work, let an idle thread take it
+  if (chosen->m_pending > 1)
+    WakeIdle(*chosen);
+}
+
+
+void SIPEndPoint::WorkThreadPool::WakeIdle(SIP_Work_Thread & busy)
+{
+  unsigned count = (unsigned)m_workers.size();
+  for (unsigned i = 1; i < count; ++i) {
+    SIP_Work_Thread & worker = *m_workers[(busy.m_index+i)%count];
+    if (worker.m_idle) {
+      worker.m_idle = false;
+      worker.m_sync.Signal();
+      return;
+    }
+  }
+}
+
+
+SIPEndPoint::SIP_Work * SIPEndPoint::WorkThreadPool::Steal(SIP_Work_Thread & thief)
+{
+  unsigned count = (unsigned)m_workers.size();
+  for (unsigned i = 1; i < count; ++i) {
+    SIP_Work_Thread & victim = *m_workers[(thief.m_index+i)%count];
+    if (victim.m_otherQueue.GetDepth() > 0) {
+      SIP_Work * work = victim.TakeOther();
+      if (work != NULL) {
+        ++thief.m_stolen;
+
+        // Pass on any more there is to take
+        if (victim.m_otherQueue.GetDepth() > 0)
+          WakeIdle(victim);
+        return work;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+void SIPEndPoint::WorkThreadPool::GetStatistics(std::vector<ShardStatistics> & statistics) const
+{
+  statistics.resize(m_workers.size());
+  for (size_t i = 0; i < m_workers.size(); ++i) {
+    statistics[i].m_dialogDepth = m_workers[i]->m_dialogQueue.GetDepth();
+    statistics[i].m_otherDepth = m_workers[i]->m_otherQueue.GetDepth();
+    statistics[i].m_processed = (unsigned)(long)m_workers[i]->m_processed;
+    statistics[i].m_stolen = (unsigned)(long)m_workers[i]->m_stolen;
+  }
+}
+
+
+SIPEndPoint::SIP_Work_Thread::SIP_Work_Thread(WorkThreadPool & pool, unsigned index)
+  : PThread(5000, NoAutoDeleteThread, HighPriority, psprintf("SIP Work %u", index))
+  , m_pool(pool)
+  , m_index(index)
+  , m_pending(0)
+  , m_processed(0)
+  , m_stolen(0)
+  , m_idle(false)
+  , m_shutdown(false)
+{
+}
+
+
+void SIPEndPoint::SIP_Work_Thread::AddWork(SIP_Work * work, bool inDialog)
+{
+  (inDialog ? m_dialogQueue : m_otherQueue).Push(work);
+  ++m_pending;
+
+  // Always, as the thread only ever waits when it cannot see any work
+  m_sync.Signal();
+}
+
+
+SIPEndPoint::SIP_Work * SIPEndPoint::SIP_Work_Thread::TakeOther()
+{
+  if (!m_otherQueue.Claim())
+    return NULL;
+
+  SIP_Work * work = (SIP_Work *)m_otherQueue.Pop();
+  m_otherQueue.Release();
+
+  if (work != NULL)
+    --m_pending;
+  return work;
 }
 
 
@@ -1564,27 +1884,31 @@ void SIPEndPoint::SIP_Work_Thread::Shutdown()
 void SIPEndPoint::SIP_Work_Thread::Main()
 {
   while (!m_shutdown) {
+    // Own work first, dialog work can only be done by this thread
+    SIP_Work * work = (SIP_Work *)m_dialogQueue.Pop();
+    if (work != NULL)
+      --m_pending;
+    else {
+      work = TakeOther();
+      if (work == NULL)
+        work = m_pool.Steal(*this);
+    }
 
-    // wait for work to become available
-    m_workerMutex.Wait();
-    if (m_pduQueue.size() == 0) {
-      m_workerMutex.Signal();
+    if (work == NULL) {
+      /* Wait for work to be added to our queues, which includes the last of
+         a Push() that was part way through, or for another thread to have
+         work to steal. */
+      m_idle = true;
       m_sync.Wait();
+      m_idle = false;
       continue;
     }
 
-    // get the work
-    SIP_Work * work = m_pduQueue.front();
-    m_pduQueue.pop();
-    m_workerMutex.Signal();
-
     // process the work
     PTRACE(4, "SIP\tStarted processing PDU");
     work->Process();
     PTRACE(4, "SIP\tFinished processing PDU");
-
-    // indicate work is now free
-    m_pool.RemoveWork(work, false);
+    ++m_processed;
 
     // delete the work
     delete work;
@@ -1605,14 +1929,17 @@ SIPEndPoint::SIP_Work::~SIP_Work()
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-SIPEndPoint::SIP_PDU_Work::SIP_PDU_Work(SIPEndPoint & ep, const PString & token, SIP_PDU * pdu)
-  : SIP_Work(ep, pdu), m_token(token)
+SIPEndPoint::SIP_PDU_Work::SIP_PDU_Work(SIPEndPoint & ep, const PString & token, SIP_PDU * pdu, bool inDialog)
+  : SIP_Work(ep, pdu), m_token(token), m_inDialog(inDialog)
 { }
 
 
 void SIPEndPoint::SIP_PDU_Work::Add(SIPEndPoint::WorkThreadPool & pool)
 {
-  pool.AddWork(this, m_token);
+  if (m_inDialog)
+    pool.AddWork(this, m_pdu->GetMIME().GetCallID());
+  else
+    pool.AddWork(this);
 }
 
 
@@ -1652,7 +1979,7 @@ SIPEndPoint::SIPResponseWork::SIPResponseWork(SIPEndPoint & ep, const PString &
 
 void SIPEndPoint::SIPResponseWork::Add(SIPEndPoint::WorkThreadPool & pool)
 {
-  pool.AddWork(this);
+  pool.AddWork(this, m_pdu->GetMIME().GetCallID());
 }
 
 void SIPEndPoint::SIPResponseWork::Process()
@@ -1664,6 +1991,24 @@ void SIPEndPoint::SIPResponseWork::Process()
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
+SIPEndPoint::SIP_Timer_Work::SIP_Timer_Work(SIPEndPoint & ep, SIPTimerWheel::ExpiredList & expired)
+  : SIP_Work(ep, NULL)
+{
+  m_expired.swap(expired);
+}
+
+void SIPEndPoint::SIP_Timer_Work::Add(SIPEndPoint::WorkThreadPool & pool)
+{
+  pool.AddWork(this);
+}
+
+void SIPEndPoint::SIP_Timer_Work::Process()
+{
+  m_endpoint.GetTimerWheel().Fire(m_expired);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
 SIPEndPoint::InterfaceMonitor::InterfaceMonitor(SIPEndPoint & ep, PINDEX priority)
   : PInterfaceMonitorClient(priority) 
   , m_endpoint(ep)
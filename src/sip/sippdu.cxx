@@ -566,6 +566,179 @@ void SIPMIMEInfo::ReadFrom(istream & strm)
 }
 
 
+static inline bool IsLinearWhiteSpace(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
+
+// Find the end of a line, returning the start of the next, handles CRLF or bare LF
+static const char * FindEndOfLine(const char * line, const char * end, const char * & next)
+{
+  const char * eol = (const char *)memchr(line, '\n', end - line);
+  if (eol == NULL)
+    return next = NULL;
+
+  next = eol+1;
+  if (eol > line && eol[-1] == '\r')
+    --eol;
+  return eol;
+}
+
+
+static void TrimSpan(const char * & start, const char * & finish)
+{
+  while (start < finish && IsLinearWhiteSpace(*start))
+    ++start;
+  while (finish > start && IsLinearWhiteSpace(finish[-1]))
+    --finish;
+}
+
+
+// Field names found in most PDUs, including the full names of all the compact forms
+static const char * const KnownFieldNames[] = {
+  "Via", "From", "To", "Call-ID", "CSeq", "Contact", "Max-Forwards",
+  "Content-Length", "Content-Type", "Content-Encoding", "Content-Disposition",
+  "Subject", "Refer-To", "Referred-By", "Supported", "Require", "Event",
+  "Allow", "Allow-Events", "Accept", "Expires", "Min-Expires", "User-Agent",
+  "Server", "Route", "Record-Route", "Authorization", "WWW-Authenticate",
+  "Proxy-Authenticate", "Proxy-Authorization", "Session-Expires",
+  "Subscription-State", "Date", "Warning", "P-Asserted-Identity", "Privacy"
+};
+
+/* Parsed fields share these strings, rather than allocating a new name for
+   every field. Built during static initialisation, before any thread can
+   use them. */
+static class SIPKnownFieldNameTable
+{
+  public:
+    SIPKnownFieldNameTable()
+    {
+      for (PINDEX i = 0; i < PARRAYSIZE(KnownFieldNames); ++i)
+        m_names[i] = KnownFieldNames[i];
+    }
+
+    bool Find(const char * name, PINDEX length, PCaselessString & found) const
+    {
+      for (PINDEX i = 0; i < PARRAYSIZE(KnownFieldNames); ++i) {
+        if (m_names[i].GetLength() == length && strncasecmp(name, KnownFieldNames[i], length) == 0) {
+          found = m_names[i];
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    PCaselessString m_names[PARRAYSIZE(KnownFieldNames)];
+} const KnownFieldNameTable;
+
+
+bool SIPMIMEInfo::Parse(const char * & data, const char * end)
+{
+  RemoveAll();
+
+  /* The field is added when the next one starts, as it may be continued on
+     following lines. Nearly all fields are not, so the value is only copied
+     into a string when it is. */
+  PCaselessString name;
+  const char * valueStart = NULL;
+  const char * valueEnd = NULL;
+  PString foldedValue;
+  bool folded = false;
+
+  const char * line = data;
+  while (line < end) {
+    const char * next;
+    const char * eol = FindEndOfLine(line, end, next);
+    if (eol == NULL) {
+      // Last line has no end of line, the buffer ends the header fields
+      eol = end;
+      if (eol > line && eol[-1] == '\r')
+        --eol;
+      next = end;
+    }
+
+    if (IsLinearWhiteSpace(*line) && eol > line) {
+      if (name.IsEmpty())
+        return false;
+
+      const char * start = line;
+      TrimSpan(start, eol);
+      if (!folded) {
+        foldedValue = PString(valueStart, valueEnd - valueStart);
+        folded = true;
+      }
+      if (start < eol)
+        foldedValue += ' ' + PString(start, eol - start);
+    }
+    else {
+      if (!name.IsEmpty())
+        AddField(name, folded ? foldedValue : PString(valueStart, valueEnd - valueStart));
+
+      if (eol == line) {
+        // Blank line, the rest is the body
+        data = next;
+        return true;
+      }
+
+      const char * colon = (const char *)memchr(line, ':', eol - line);
+      if (colon == NULL) {
+        PTRACE(2, "SIP\tNo colon in header field \"" << PString(line, eol - line) << '"');
+        return false;
+      }
+
+      const char * nameStart = line;
+      const char * nameEnd = colon;
+      TrimSpan(nameStart, nameEnd);
+      if (nameStart == nameEnd) {
+        PTRACE(2, "SIP\tEmpty header field name");
+        return false;
+      }
+
+      bool known = false;
+      if (nameEnd - nameStart == 1) {
+        char compact = (char)tolower((unsigned char)*nameStart);
+        for (PINDEX i = 0; i < PARRAYSIZE(CompactForms); ++i) {
+          if (compact == CompactForms[i].compact) {
+            const char * full = CompactForms[i].full;
+            known = KnownFieldNameTable.Find(full, strlen(full), name);
+            break;
+          }
+        }
+      }
+      if (!known && !KnownFieldNameTable.Find(nameStart, nameEnd - nameStart, name))
+        name = PString(nameStart, nameEnd - nameStart);
+
+      valueStart = colon+1;
+      valueEnd = eol;
+      TrimSpan(valueStart, valueEnd);
+      folded = false;
+    }
+
+    line = next;
+  }
+
+  // No blank line, the header fields ran to the end of the buffer and there is no body
+  if (!name.IsEmpty())
+    AddField(name, folded ? foldedValue : PString(valueStart, valueEnd - valueStart));
+
+  data = end;
+  return true;
+}
+
+
+void SIPMIMEInfo::AddField(const PCaselessString & name, const PString & value)
+{
+  // Repeated fields are kept as one value with a line for each, as PMIMEInfo does
+  PString * existing = GetAt(name);
+  if (existing == NULL)
+    SetAt(name, value);
+  else
+    SetAt(name, *existing + '\n' + value);
+}
+
+
 PINDEX SIPMIMEInfo::GetContentLength() const
 {
   PString len = GetString("Content-Length");
@@ -2075,120 +2248,126 @@ PBoolean SIP_PDU::Read(OpalTransport & transport)
     return PFalse;
   }
 
-  PStringStream datagram;
-  PBYTEArray pdu;
-
-  istream * stream;
-  if (transport.IsReliable())
-    stream = &transport;
-  else {
-    stream = &datagram;
-
+  if (!transport.IsReliable()) {
+    // Datagrams are parsed in place, without copying into a stream
+    PBYTEArray pdu;
     if (!transport.ReadPDU(pdu))
       return false;
 
-    datagram = PString((char *)pdu.GetPointer(), pdu.GetSize());
-  }
-
-  // get the message from transport/datagram into cmd and parse MIME
-  PString cmd;
-  *stream >> cmd;
+    const char * data = (const char *)(const BYTE *)pdu;
+    PINDEX length = pdu.GetSize();
+    PINDEX i = 0;
+    while (i < length && isspace((unsigned char)data[i]))
+      ++i;
 
-  if (!stream->good() || cmd.IsEmpty()) {
-    if (stream == &datagram) {
+    if (i >= length) {
       transport.setstate(ios::failbit);
       PTRACE(1, "SIP\tInvalid datagram from " << transport.GetLastReceivedAddress()
                 << " - " << pdu.GetSize() << " bytes.\n" << hex << setprecision(2) << pdu << dec);
+      return false;
     }
-    return PFalse;
-  }
 
-  if (cmd.Left(4) *= "SIP/") {
-    // parse Response version, code & reason (ie: "SIP/2.0 200 OK")
-    PINDEX space = cmd.Find(' ');
-    if (space == P_MAX_INDEX) {
-      PTRACE(2, "SIP\tBad Status-Line \"" << cmd << "\" received on " << transport);
-      return PFalse;
+    // A failure leaves the transport good, so BadRequest response is sent by caller
+    if (!Parse(data, length)) {
+      PTRACE(2, "SIP\tInvalid PDU received on " << transport);
+      return false;
     }
-
-    versionMajor = cmd.Mid(4).AsUnsigned();
-    versionMinor = cmd(cmd.Find('.')+1, space).AsUnsigned();
-    statusCode = (StatusCodes)cmd.Mid(++space).AsUnsigned();
-    info    = cmd.Mid(cmd.Find(' ', space));
-    uri     = PString();
   }
   else {
-    // parse the method, URI and version
-    PStringArray cmds = cmd.Tokenise( ' ', PFalse);
-    if (cmds.GetSize() < 3) {
-      PTRACE(2, "SIP\tBad Request-Line \"" << cmd << "\" received on " << transport);
+    // get the message from transport into cmd and parse MIME
+    PString cmd;
+    transport >> cmd;
+
+    if (!transport.good() || cmd.IsEmpty())
       return PFalse;
-    }
 
-    int i = 0;
-    while (!(cmds[0] *= MethodNames[i])) {
-      i++;
-      if (i >= NumMethods) {
-        PTRACE(2, "SIP\tUnknown method name " << cmds[0] << " received on " << transport);
+    if (cmd.Left(4) *= "SIP/") {
+      // parse Response version, code & reason (ie: "SIP/2.0 200 OK")
+      PINDEX space = cmd.Find(' ');
+      if (space == P_MAX_INDEX) {
+        PTRACE(2, "SIP\tBad Status-Line \"" << cmd << "\" received on " << transport);
         return PFalse;
       }
+
+      versionMajor = cmd.Mid(4).AsUnsigned();
+      versionMinor = cmd(cmd.Find('.')+1, space).AsUnsigned();
+      statusCode = (StatusCodes)cmd.Mid(++space).AsUnsigned();
+      info    = cmd.Mid(cmd.Find(' ', space));
+      uri     = PString();
     }
-    method = (Methods)i;
+    else {
+      // parse the method, URI and version
+      PStringArray cmds = cmd.Tokenise( ' ', PFalse);
+      if (cmds.GetSize() < 3) {
+        PTRACE(2, "SIP\tBad Request-Line \"" << cmd << "\" received on " << transport);
+        return PFalse;
+      }
 
-    uri = cmds[1];
-    versionMajor = cmds[2].Mid(4).AsUnsigned();
-    versionMinor = cmds[2].Mid(cmds[2].Find('.')+1).AsUnsigned();
-    info = PString();
-  }
+      int i = 0;
+      while (!(cmds[0] *= MethodNames[i])) {
+        i++;
+        if (i >= NumMethods) {
+          PTRACE(2, "SIP\tUnknown method name " << cmds[0] << " received on " << transport);
+          return PFalse;
+        }
+      }
+      method = (Methods)i;
 
-  if (versionMajor < 2) {
-    PTRACE(2, "SIP\tInvalid version (" << versionMajor << ") received on " << transport);
-    return PFalse;
-  }
+      uri = cmds[1];
+      versionMajor = cmds[2].Mid(4).AsUnsigned();
+      versionMinor = cmds[2].Mid(cmds[2].Find('.')+1).AsUnsigned();
+      info = PString();
+    }
 
-  // Getthe MIME fields
-  *stream >> mime;
-  if (!stream->good() || mime.IsEmpty()) {
-    PTRACE(2, "SIP\tInvalid MIME received on " << transport);
-    transport.clear(); // Clear flags so BadRequest response is sent by caller
-    return PFalse;
-  }
+    if (versionMajor < 2) {
+      PTRACE(2, "SIP\tInvalid version (" << versionMajor << ") received on " << transport);
+      return PFalse;
+    }
+
+    // Getthe MIME fields
+    transport >> mime;
+    if (!transport.good() || mime.IsEmpty()) {
+      PTRACE(2, "SIP\tInvalid MIME received on " << transport);
+      transport.clear(); // Clear flags so BadRequest response is sent by caller
+      return PFalse;
+    }
 
 
-  // get the SDP content body
-  // if a content length is specified, read that length
-  // if no content length is specified (which is not the same as zero length)
-  // then read until end of datagram or stream
-  PINDEX contentLength = mime.GetContentLength();
-  bool contentLengthPresent = mime.IsContentLengthPresent();
+    // get the SDP content body
+    // if a content length is specified, read that length
+    // if no content length is specified (which is not the same as zero length)
+    // then read until end of stream
+    PINDEX contentLength = mime.GetContentLength();
+    bool contentLengthPresent = mime.IsContentLengthPresent();
 
-  if (!contentLengthPresent) {
-    PTRACE(2, "SIP\tNo Content-Length present from " << transport << ", reading till end of datagram/stream.");
-  }
-  else if (contentLength < 0) {
-    PTRACE(2, "SIP\tImpossible negative Content-Length from " << transport << ", reading till end of datagram/stream.");
-    contentLengthPresent = false;
-  }
-  else if (contentLength > (transport.IsReliable() ? 1000000 : datagram.GetLength())) {
-    PTRACE(2, "SIP\tImplausibly long Content-Length " << contentLength << " received from " << transport << ", reading to end of datagram/stream.");
-    contentLengthPresent = false;
-  }
+    if (!contentLengthPresent) {
+      PTRACE(2, "SIP\tNo Content-Length present from " << transport << ", reading till end of stream.");
+    }
+    else if (contentLength < 0) {
+      PTRACE(2, "SIP\tImpossible negative Content-Length from " << transport << ", reading till end of stream.");
+      contentLengthPresent = false;
+    }
+    else if (contentLength > 1000000) {
+      PTRACE(2, "SIP\tImplausibly long Content-Length " << contentLength << " received from " << transport << ", reading to end of stream.");
+      contentLengthPresent = false;
+    }
 
-  if (contentLengthPresent) {
-    if (contentLength > 0)
-      stream->read(entityBody.GetPointer(contentLength+1), contentLength);
-  }
-  else {
-    contentLength = 0;
-    int c;
-    while ((c = stream->get()) != EOF) {
-      entityBody.SetMinSize((++contentLength/1000+1)*1000);
-      entityBody += (char)c;
+    if (contentLengthPresent) {
+      if (contentLength > 0)
+        transport.read(entityBody.GetPointer(contentLength+1), contentLength);
+    }
+    else {
+      contentLength = 0;
+      int c;
+      while ((c = transport.get()) != EOF) {
+        entityBody.SetMinSize((++contentLength/1000+1)*1000);
+        entityBody += (char)c;
+      }
     }
-  }
 
-  ////////////////
-  entityBody[contentLength] = '\0';
+    ////////////////
+    entityBody[contentLength] = '\0';
+  }
 
 #if PTRACING
   if (PTrace::CanTrace(3)) {
@@ -2208,8 +2387,14 @@ PBoolean SIP_PDU::Read(OpalTransport & transport)
           << ",local=" << transport.GetLocalAddress()
           << ",if=" << transport.GetLastReceivedInterface();
 
-    if (PTrace::CanTrace(4))
-      trace << '\n' << cmd << '\n' << mime << entityBody;
+    if (PTrace::CanTrace(4)) {
+      trace << '\n';
+      if (method != NumMethods)
+        trace << MethodNames[method] << ' ' << uri << " SIP/" << versionMajor << '.' << versionMinor;
+      else
+        trace << "SIP/" << versionMajor << '.' << versionMinor << ' ' << (unsigned)statusCode << info;
+      trace << '\n' << mime << entityBody;
+    }
 
     trace << PTrace::End;
   }
@@ -2219,6 +2404,133 @@ PBoolean SIP_PDU::Read(OpalTransport & transport)
 }
 
 
+// Parse a run of decimal digits, the caller guarantees a non-digit before end of buffer
+static unsigned ParseUnsigned(const char * & ptr, const char * end)
+{
+  unsigned value = 0;
+  while (ptr < end && isdigit((unsigned char)*ptr))
+    value = value*10 + (*ptr++ - '0');
+  return value;
+}
+
+
+bool SIP_PDU::Parse(const char * data, PINDEX length)
+{
+  const char * end = data + length;
+
+  // RFC3261 section 7.5, empty lines before the start line are ignored
+  while (data < end && (*data == '\r' || *data == '\n'))
+    ++data;
+
+  const char * next;
+  const char * eol = FindEndOfLine(data, end, next);
+  if (eol == NULL || eol == data) {
+    PTRACE(2, "SIP\tNo start line in PDU");
+    return false;
+  }
+
+  const char * ptr = data;
+  if (eol - data > 4 && strncasecmp(data, "SIP/", 4) == 0) {
+    // parse Response version, code & reason (ie: "SIP/2.0 200 OK")
+    ptr += 4;
+    versionMajor = ParseUnsigned(ptr, eol);
+    if (ptr < eol && *ptr == '.')
+      ++ptr;
+    versionMinor = ParseUnsigned(ptr, eol);
+
+    if (ptr >= eol || *ptr != ' ') {
+      PTRACE(2, "SIP\tBad Status-Line \"" << PString(data, eol - data) << '"');
+      return false;
+    }
+
+    while (ptr < eol && *ptr == ' ')
+      ++ptr;
+    statusCode = (StatusCodes)ParseUnsigned(ptr, eol);
+
+    // The reason phrase keeps its leading space, as Read() from a stream does
+    const char * reason = (const char *)memchr(ptr, ' ', eol - ptr);
+    info = reason != NULL ? PString(reason, eol - reason) : PString();
+    uri = PString();
+  }
+  else {
+    // parse the method, URI and version
+    const char * tokens[3];
+    PINDEX lengths[3];
+    PINDEX count = 0;
+    while (count < 3) {
+      while (ptr < eol && *ptr == ' ')
+        ++ptr;
+      if (ptr >= eol)
+        break;
+      tokens[count] = ptr;
+      while (ptr < eol && *ptr != ' ')
+        ++ptr;
+      lengths[count] = ptr - tokens[count];
+      ++count;
+    }
+
+    if (count < 3) {
+      PTRACE(2, "SIP\tBad Request-Line \"" << PString(data, eol - data) << '"');
+      return false;
+    }
+
+    PINDEX i = 0;
+    while (i < NumMethods && !((PINDEX)strlen(MethodNames[i]) == lengths[0] &&
+                               strncasecmp(tokens[0], MethodNames[i], lengths[0]) == 0))
+      ++i;
+    if (i >= NumMethods) {
+      PTRACE(2, "SIP\tUnknown method name " << PString(tokens[0], lengths[0]));
+      return false;
+    }
+    method = (Methods)i;
+
+    uri = PString(tokens[1], lengths[1]);
+
+    const char * version = tokens[2] + 4;
+    const char * versionEnd = tokens[2] + lengths[2];
+    versionMajor = version < versionEnd ? ParseUnsigned(version, versionEnd) : 0;
+    if (version < versionEnd && *version == '.')
+      ++version;
+    versionMinor = ParseUnsigned(version, versionEnd);
+    info = PString();
+  }
+
+  if (versionMajor < 2) {
+    PTRACE(2, "SIP\tInvalid version (" << versionMajor << ')');
+    return false;
+  }
+
+  // Get the MIME fields
+  data = next;
+  if (!mime.Parse(data, end) || mime.IsEmpty()) {
+    PTRACE(2, "SIP\tInvalid MIME in PDU");
+    return false;
+  }
+
+  /* Get the content body, the rest of the datagram if there is no, or an
+     invalid, Content-Length. */
+  PINDEX available = end - data;
+  PINDEX contentLength = mime.GetContentLength();
+  if (!mime.IsContentLengthPresent()) {
+    PTRACE(2, "SIP\tNo Content-Length present, reading till end of datagram.");
+    contentLength = available;
+  }
+  else if (contentLength < 0) {
+    PTRACE(2, "SIP\tImpossible negative Content-Length, reading till end of datagram.");
+    contentLength = available;
+  }
+  else if (contentLength > available) {
+    PTRACE(2, "SIP\tImplausibly long Content-Length " << contentLength << ", reading to end of datagram.");
+    contentLength = available;
+  }
+
+  // This is the only copy of the body, GetSDP() decodes it from here
+  entityBody = PString(data, contentLength);
+
+  return true;
+}
+
+
 PBoolean SIP_PDU::Write(OpalTransport & transport, const OpalTransportAddress & remoteAddress, const PString & localInterface)
 {
   PWaitAndSignal mutex(transport.GetWriteMutex());
@@ -2358,6 +2670,120 @@ void SIP_PDU::SetSDP(SDPSessionDescription * sdp)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////
+
+SIPDialogIndex::SIPDialogIndex()
+{
+}
+
+
+static PString MakeDialogKey(const PString & callId, const PString & localTag, const PString & remoteTag)
+{
+  // Line feeds cannot be in a header field, so the key is unambiguous
+  return callId + '\n' + localTag + '\n' + remoteTag;
+}
+
+
+void SIPDialogIndex::SetAt(const PString & token, const PString & callId, const PString & localTag, const PString & remoteTag)
+{
+  PString key = MakeDialogKey(callId, localTag, remoteTag);
+
+  PWaitAndSignal mutex(m_mutex);
+
+  PString * oldKey = m_dialogByToken.GetAt(token);
+  if (oldKey != NULL && *oldKey == key)
+    return;
+
+  InternalRemove(token);
+
+  m_dialogByToken.SetAt(token, key);
+  m_tokenByDialog.SetAt(key, token);
+
+  PStringList * tokens = m_tokensByCallID.GetAt(callId);
+  if (tokens == NULL)
+    m_tokensByCallID.SetAt(callId, tokens = new PStringList);
+  tokens->AppendString(token);
+
+  PTRACE(4, "SIP\tIndexed dialog for " << token << ": call-id=" << callId
+         << ", local-tag=" << localTag << ", remote-tag=" << remoteTag);
+}
+
+
+void SIPDialogIndex::RemoveAt(const PString & token)
+{
+  PWaitAndSignal mutex(m_mutex);
+  InternalRemove(token);
+}
+
+
+void SIPDialogIndex::InternalRemove(const PString & token)
+{
+  PString * key = m_dialogByToken.GetAt(token);
+  if (key == NULL)
+    return;
+
+  PString callId = key->Left(key->Find('\n'));
+
+  // Another connection may have since been indexed under the same dialog
+  PString * mapped = m_tokenByDialog.GetAt(*key);
+  if (mapped != NULL && *mapped == token)
+    m_tokenByDialog.RemoveAt(*key);
+
+  PStringList * tokens = m_tokensByCallID.GetAt(callId);
+  if (tokens != NULL) {
+    PINDEX pos = tokens->GetStringsIndex(token);
+    if (pos != P_MAX_INDEX)
+      tokens->RemoveAt(pos);
+    if (tokens->IsEmpty())
+      m_tokensByCallID.RemoveAt(callId);
+  }
+
+  m_dialogByToken.RemoveAt(token);
+}
+
+
+PString SIPDialogIndex::Find(const PString & callId, const PString & localTag, const PString & remoteTag) const
+{
+  PString key = MakeDialogKey(callId, localTag, remoteTag);
+
+  PWaitAndSignal mutex(m_mutex);
+
+  const PString * token = m_tokenByDialog.GetAt(key);
+  if (token == NULL)
+    return PString::Empty();
+
+  PString found = *token;
+  found.MakeUnique();
+  return found;
+}
+
+
+PStringList SIPDialogIndex::FindByCallID(const PString & callId) const
+{
+  PStringList found;
+
+  PWaitAndSignal mutex(m_mutex);
+
+  const PStringList * tokens = m_tokensByCallID.GetAt(callId);
+  if (tokens != NULL) {
+    for (PINDEX i = 0; i < tokens->GetSize(); ++i) {
+      PString token = (*tokens)[i];
+      token.MakeUnique();
+      found.AppendString(token);
+    }
+  }
+
+  return found;
+}
+
+
+PINDEX SIPDialogIndex::GetSize() const
+{
+  PWaitAndSignal mutex(m_mutex);
+  return m_dialogByToken.GetSize();
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////
 
 SIPDialogContext::SIPDialogContext()
@@ -2368,6 +2794,12 @@ SIPDialogContext::SIPDialogContext()
 }
 
 
+SIPDialogContext::~SIPDialogContext()
+{
+  SetIndex(NULL);
+}
+
+
 static void SetWithTag(const SIPURL & url, SIPURL & uri, PString & tag, bool generate)
 {
   uri = url;
@@ -2405,24 +2837,66 @@ static bool SetWithTag(const PString & str, SIPURL & uri, PString & tag, bool ge
 void SIPDialogContext::SetLocalURI(const SIPURL & url)
 {
   SetWithTag(url, m_localURI, m_localTag, true);
+  UpdateIndex();
 }
 
 
 bool SIPDialogContext::SetLocalURI(const PString & uri)
 {
-  return SetWithTag(uri, m_localURI, m_localTag, true);
+  if (!SetWithTag(uri, m_localURI, m_localTag, true))
+    return false;
+
+  UpdateIndex();
+  return true;
 }
 
 
 void SIPDialogContext::SetRemoteURI(const SIPURL & url)
 {
   SetWithTag(url, m_remoteURI, m_remoteTag, false);
+  UpdateIndex();
 }
 
 
 bool SIPDialogContext::SetRemoteURI(const PString & uri)
 {
-  return SetWithTag(uri, m_remoteURI, m_remoteTag, false);
+  if (!SetWithTag(uri, m_remoteURI, m_remoteTag, false))
+    return false;
+
+  UpdateIndex();
+  return true;
+}
+
+
+void SIPDialogContext::SetIndex(SIPDialogIndex * index, const PString & token)
+{
+  if (m_indexBinding.m_index != NULL)
+    m_indexBinding.m_index->RemoveAt(m_indexBinding.m_token);
+
+  m_indexBinding.m_index = index;
+  m_indexBinding.m_token = token;
+  m_indexBinding.m_callId = m_callId;
+  m_indexBinding.m_localTag = m_localTag;
+  m_indexBinding.m_remoteTag = m_remoteTag;
+
+  if (index != NULL)
+    index->SetAt(token, m_callId, m_localTag, m_remoteTag);
+}
+
+
+void SIPDialogContext::UpdateIndex()
+{
+  // Only go to the index, and its mutex, if something actually changed
+  if (m_indexBinding.m_index == NULL ||
+        (m_indexBinding.m_callId == m_callId &&
+         m_indexBinding.m_localTag == m_localTag &&
+         m_indexBinding.m_remoteTag == m_remoteTag))
+    return;
+
+  m_indexBinding.m_callId = m_callId;
+  m_indexBinding.m_localTag = m_localTag;
+  m_indexBinding.m_remoteTag = m_remoteTag;
+  m_indexBinding.m_index->SetAt(m_indexBinding.m_token, m_callId, m_localTag, m_remoteTag);
 }
 
 
@@ -2497,6 +2971,14 @@ SIPTransaction::SIPTransaction(SIPEndPoint & ep,
                                const PTimeInterval & maxRetryTime)
   : endpoint(ep)
   , transport(trans)
+#ifdef _MSC_VER
+#pragma warning(disable:4355)
+#endif
+  , retryTimer(ep.GetTimerWheel(), *this)
+  , completionTimer(ep.GetTimerWheel(), *this)
+#ifdef _MSC_VER
+#pragma warning(default:4355)
+#endif
 {
   Construct(minRetryTime, maxRetryTime);
   PTRACE(4, "SIP\tTransaction " << mime.GetCSeq() << " created.");
@@ -2508,7 +2990,15 @@ SIPTransaction::SIPTransaction(SIPConnection & conn,
                                Methods meth)
   : SIP_PDU(meth, conn, trans),
     endpoint(conn.GetEndPoint()),
-    transport(trans)
+    transport(trans),
+#ifdef _MSC_VER
+#pragma warning(disable:4355)
+#endif
+    retryTimer(conn.GetEndPoint().GetTimerWheel(), *this),
+    completionTimer(conn.GetEndPoint().GetTimerWheel(), *this)
+#ifdef _MSC_VER
+#pragma warning(default:4355)
+#endif
 {
   connection = &conn;
   Construct();
@@ -2762,7 +3252,7 @@ PBoolean SIPTransaction::OnCompleted(SIP_PDU & /*response*/)
 }
 
 
-void SIPTransaction::OnRetry(PTimer &, INT)
+void SIPTransaction::OnRetry(SIPTimer &, INT)
 {
   PSafeLockReadWrite lock(*this);
 
@@ -2798,7 +3288,7 @@ void SIPTransaction::OnRetry(PTimer &, INT)
 }
 
 
-void SIPTransaction::OnTimeout(PTimer &, INT)
+void SIPTransaction::OnTimeout(SIPTimer &, INT)
 {
   PSafeLockReadWrite lock(*this);
 
@@ -0,0 +1,427 @@
+/*
+ * siptimer.cxx
+ *
+ * Session Initiation Protocol transaction timers.
+ *
+ * Open Phone Abstraction Library (OPAL)
+ *
+ * Copyright (c) 2000 Equivalence Pty. Ltd.
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.0 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * The Original Code is Open Phone Abstraction Library.
+ *
+ * The Initial Developer of the Original Code is Equivalence Pty. Ltd.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * $Revision$
+ * $Author$
+ * $Date$
+ */
+
+#include <ptlib.h>
+#include <opal/buildopts.h>
+
+#if OPAL_SIP
+
+#ifdef __GNUC__
+#pragma implementation "siptimer.h"
+#endif
+
+#include <sip/siptimer.h>
+
+#include <sip/sipep.h>
+
+
+#define new PNEW
+
+
+////////////////////////////////////////////////////////////////////////////////////
+
+SIPTimer::SIPTimer(SIPTimerWheel & wheel, PSafeObject & owner)
+  : m_wheel(wheel)
+  , m_owner(owner)
+  , m_head(NULL)
+  , m_prev(NULL)
+  , m_next(NULL)
+  , m_expiry(0)
+  , m_expiryTime(0)
+  , m_generation(0)
+{
+}
+
+
+SIPTimer::~SIPTimer()
+{
+  m_wheel.Stop(*this);
+}
+
+
+void SIPTimer::PrintOn(ostream & strm) const
+{
+  strm << m_resetTime;
+}
+
+
+SIPTimer & SIPTimer::operator=(const PTimeInterval & interval)
+{
+  m_wheel.Start(*this, interval);
+  return *this;
+}
+
+
+void SIPTimer::SetInterval(PInt64 milliseconds, long seconds, long minutes, long hours, int days)
+{
+  m_wheel.Start(*this, PTimeInterval(milliseconds, seconds, minutes, hours, days));
+}
+
+
+void SIPTimer::Stop(bool)
+{
+  m_wheel.Stop(*this);
+}
+
+
+bool SIPTimer::IsRunning() const
+{
+  return m_wheel.IsRunning(*this);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////
+
+SIPTimerWheel::Statistics::Statistics()
+  : m_active(0)
+  , m_started(0)
+  , m_stopped(0)
+  , m_fired(0)
+  , m_stale(0)
+  , m_batches(0)
+{
+}
+
+
+#ifdef _MSC_VER
+#pragma warning(disable:4355)
+#endif
+
+SIPTimerWheel::SIPTimerWheel(SIPEndPoint & endpoint, unsigned tickMilliseconds)
+  : m_endpoint(endpoint)
+  , m_tickMilliseconds(tickMilliseconds > 0 ? tickMilliseconds : (unsigned)DefaultTickMilliseconds)
+  , m_baseTime(PTimer::Tick())
+  , m_currentTick(0)
+  , m_shuttingDown(false)
+{
+  memset(m_firstLevel, 0, sizeof(m_firstLevel));
+  memset(m_levels, 0, sizeof(m_levels));
+
+  m_thread = PThread::Create(PCREATE_NOTIFIER(TickMain), 0,
+                             PThread::NoAutoDeleteThread,
+                             PThread::HighestPriority,
+                             "SIP Timers");
+}
+
+#ifdef _MSC_VER
+#pragma warning(default:4355)
+#endif
+
+
+SIPTimerWheel::~SIPTimerWheel()
+{
+  ShutDown();
+}
+
+
+void SIPTimerWheel::ShutDown()
+{
+  m_mutex.Wait();
+  PThread * thread = m_thread;
+  m_thread = NULL;
+  m_shuttingDown = true;
+  m_mutex.Signal();
+
+  if (thread == NULL)
+    return;
+
+  m_shutdownSync.Signal();
+  thread->WaitForTermination();
+  delete thread;
+
+  PTRACE(4, "SIP\tTimer wheel stopped:"
+            " active=" << m_statistics.m_active <<
+            " started=" << m_statistics.m_started <<
+            " stopped=" << m_statistics.m_stopped <<
+            " fired=" << m_statistics.m_fired <<
+            " stale=" << m_statistics.m_stale <<
+            " max-late=" << m_statistics.m_maxLateness);
+}
+
+
+void SIPTimerWheel::GetStatistics(Statistics & statistics) const
+{
+  PWaitAndSignal mutex(m_mutex);
+  statistics = m_statistics;
+}
+
+
+PUInt64 SIPTimerWheel::GetElapsedTicks(PInt64 & elapsed) const
+{
+  elapsed = (PTimer::Tick() - m_baseTime).GetMilliSeconds();
+  return elapsed/m_tickMilliseconds;
+}
+
+
+void SIPTimerWheel::Start(SIPTimer & timer, const PTimeInterval & interval)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  if (timer.m_head != NULL)
+    Unlink(timer);
+  ++timer.m_generation;
+  timer.m_resetTime = interval;
+
+  // As for PTimer, a zero interval leaves the timer stopped
+  if (interval <= 0)
+    return;
+
+  PInt64 elapsed;
+  GetElapsedTicks(elapsed);
+
+  /* Round up, so a timer is never early. If the tick thread has fallen
+     behind, the timer still goes in a slot it has yet to reach. */
+  timer.m_expiryTime = elapsed + interval.GetMilliSeconds();
+  timer.m_expiry = (timer.m_expiryTime + m_tickMilliseconds - 1)/m_tickMilliseconds;
+  if (timer.m_expiry < m_currentTick)
+    timer.m_expiry = m_currentTick;
+
+  Insert(timer);
+
+  ++m_statistics.m_started;
+}
+
+
+void SIPTimerWheel::Stop(SIPTimer & timer)
+{
+  PWaitAndSignal mutex(m_mutex);
+
+  ++timer.m_generation;
+
+  if (timer.m_head != NULL) {
+    Unlink(timer);
+    ++m_statistics.m_stopped;
+  }
+}
+
+
+bool SIPTimerWheel::IsRunning(const SIPTimer & timer) const
+{
+  PWaitAndSignal mutex(m_mutex);
+  return timer.m_head != NULL;
+}
+
+
+void SIPTimerWheel::Insert(SIPTimer & timer)
+{
+  PUInt64 delta = timer.m_expiry - m_currentTick;
+
+  SIPTimer ** head;
+  if (delta < FirstLevelSlots)
+    head = &m_firstLevel[timer.m_expiry & (FirstLevelSlots-1)];
+  else {
+    unsigned level = 0;
+    unsigned shift = FirstLevelBits;
+    while (level < NumLevels-2 && delta >= ((PUInt64)1 << (shift+LevelBits))) {
+      ++level;
+      shift += LevelBits;
+    }
+
+    // Beyond the top level, which is about a week with the default tick
+    if (delta >= ((PUInt64)1 << (shift+LevelBits))) {
+      delta = ((PUInt64)1 << (shift+LevelBits)) - 1;
+      timer.m_expiry = m_currentTick + delta;
+    }
+
+    head = &m_levels[level][(timer.m_expiry >> shift) & (LevelSlots-1)];
+  }
+
+  timer.m_head = head;
+  timer.m_prev = NULL;
+  timer.m_next = *head;
+  if (*head != NULL)
+    (*head)->m_prev = &timer;
+  *head = &timer;
+
+  ++m_statistics.m_active;
+}
+
+
+void SIPTimerWheel::Unlink(SIPTimer & timer)
+{
+  if (timer.m_next != NULL)
+    timer.m_next->m_prev = timer.m_prev;
+
+  if (timer.m_prev != NULL)
+    timer.m_prev->m_next = timer.m_next;
+  else
+    *timer.m_head = timer.m_next;
+
+  timer.m_head = NULL;
+  timer.m_prev = timer.m_next = NULL;
+
+  --m_statistics.m_active;
+}
+
+
+unsigned SIPTimerWheel::Cascade(unsigned level)
+{
+  unsigned shift = FirstLevelBits + level*LevelBits;
+  unsigned index = (unsigned)(m_currentTick >> shift) & (LevelSlots-1);
+
+  // Move everything in the slot down, now it is within range of a lower level
+  SIPTimer * timer = m_levels[level][index];
+  m_levels[level][index] = NULL;
+  while (timer != NULL) {
+    SIPTimer * next = timer->m_next;
+    --m_statistics.m_active;
+    Insert(*timer);
+    timer = next;
+  }
+
+  return index;
+}
+
+
+void SIPTimerWheel::Advance(ExpiredList & expired)
+{
+  unsigned index = (unsigned)(m_currentTick & (FirstLevelSlots-1));
+
+  // At each turn of a level, bring down the next slot of the level above
+  if (index == 0) {
+    for (unsigned level = 0; level < NumLevels-1; ++level) {
+      if (Cascade(level) != 0)
+        break;
+    }
+  }
+
+  SIPTimer * timer = m_firstLevel[index];
+  m_firstLevel[index] = NULL;
+  while (timer != NULL) {
+    SIPTimer * next = timer->m_next;
+    timer->m_head = NULL;
+    timer->m_prev = timer->m_next = NULL;
+    --m_statistics.m_active;
+
+    Expired entry;
+    entry.m_owner = PSafePtr<PSafeObject>(&timer->m_owner, PSafeReference);
+    entry.m_timer = timer;
+    entry.m_generation = timer->m_generation;
+    entry.m_expiryTime = timer->m_expiryTime;
+
+    // Owner is on its way out, so nothing to call
+    if (entry.m_owner != NULL)
+      expired.push_back(entry);
+    else
+      ++m_statistics.m_stale;
+
+    timer = next;
+  }
+
+  ++m_currentTick;
+}
+
+
+void SIPTimerWheel::Dispatch(ExpiredList & expired)
+{
+  ExpiredList::iterator it = expired.begin();
+  while (it != expired.end()) {
+    ExpiredList::iterator end = expired.end() - it > BatchSize ? it + BatchSize : expired.end();
+    ExpiredList batch(it, end);
+    m_endpoint.AddWork(new SIPEndPoint::SIP_Timer_Work(m_endpoint, batch));
+    it = end;
+
+    PWaitAndSignal mutex(m_mutex);
+    ++m_statistics.m_batches;
+  }
+
+  expired.clear();
+}
+
+
+void SIPTimerWheel::Fire(ExpiredList & expired)
+{
+  for (ExpiredList::iterator it = expired.begin(); it != expired.end(); ++it) {
+    PNotifier notifier;
+
+    {
+      PWaitAndSignal mutex(m_mutex);
+
+      // Restarted or stopped since it expired
+      if (it->m_generation != it->m_timer->m_generation) {
+        ++m_statistics.m_stale;
+        continue;
+      }
+
+      PInt64 elapsed;
+      GetElapsedTicks(elapsed);
+      PTimeInterval lateness = elapsed > it->m_expiryTime ? elapsed - it->m_expiryTime : 0;
+      m_statistics.m_totalLateness += lateness;
+      if (m_statistics.m_maxLateness < lateness)
+        m_statistics.m_maxLateness = lateness;
+
+      ++m_statistics.m_fired;
+      notifier = it->m_timer->m_notifier;
+    }
+
+    if (!notifier.IsNULL())
+      notifier(*it->m_timer, 0);
+  }
+
+  expired.clear();
+}
+
+
+void SIPTimerWheel::TickMain(PThread &, INT)
+{
+  PTRACE(4, "SIP\tTimer wheel started, tick " << m_tickMilliseconds << "ms");
+
+  ExpiredList expired;
+
+  for (;;) {
+    PInt64 elapsed;
+    PUInt64 now = GetElapsedTicks(elapsed);
+
+    m_mutex.Wait();
+    if (m_shuttingDown) {
+      m_mutex.Signal();
+      break;
+    }
+
+    // Catch up on any ticks missed, if the thread was held up
+    while (m_currentTick <= now)
+      Advance(expired);
+    m_mutex.Signal();
+
+    if (!expired.empty())
+      Dispatch(expired);
+
+    if (m_shutdownSync.Wait(PTimeInterval((PInt64)(now+1)*m_tickMilliseconds - elapsed)))
+      break;
+  }
+
+  PTRACE(4, "SIP\tTimer wheel thread ended");
+}
+
+
+#endif // OPAL_SIP
+
+
+// End of File ///////////////////////////////////////////////////////////////
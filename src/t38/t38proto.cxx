@@ -221,7 +221,7 @@ class T38PseudoRTP_Handler : public RTP_Encoding
       if (status != RTP_Session::e_ProcessPacket)
         return status;
 
-      PINDEX pduSize = rtpUDP->GetDataSocket().GetLastReadCount();
+      PINDEX pduSize = rtpUDP->GetLastReadCount(true);
       
       PTRACE(4, "T38_RTP\tRead UDPTL of size " << pduSize);
 